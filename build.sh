@@ -9,6 +9,39 @@ ib raspi-phone-tools/raspi-phone-tools --force --out_root out
 echo 'building raspi-phone-tools/util-test'
 ib raspi-phone-tools/util-test  --force --out_root out
 
+echo 'building raspi-phone-tools/phone-test'
+ib raspi-phone-tools/phone-test  --force --out_root out
+
+echo 'building raspi-phone-tools/histogram-test'
+ib raspi-phone-tools/histogram-test  --force --out_root out
+
+echo 'building raspi-phone-tools/signal-history-test'
+ib raspi-phone-tools/signal-history-test  --force --out_root out
+
+echo 'building raspi-phone-tools/executor-test'
+ib raspi-phone-tools/executor-test  --force --out_root out
+echo 'building raspi-phone-tools/task-pool-test'
+ib raspi-phone-tools/task-pool-test  --force --out_root out
+
+echo 'building raspi-phone-tools/spsc-ring-test'
+ib raspi-phone-tools/spsc-ring-test  --force --out_root out
+echo 'building raspi-phone-tools/mpsc-queue-test'
+ib raspi-phone-tools/mpsc-queue-test  --force --out_root out
+
+echo 'building raspi-phone-tools/event-filter-test'
+ib raspi-phone-tools/event-filter-test  --force --out_root out
+
+echo 'building raspi-phone-tools/timing-wheel-test'
+ib raspi-phone-tools/timing-wheel-test  --force --out_root out
+echo 'building raspi-phone-tools/journal-test'
+ib raspi-phone-tools/journal-test  --force --out_root out
+
+echo 'building raspi-phone-tools/phone-bench'
+ib raspi-phone-tools/phone-bench  --force --out_root out
+
+echo 'building raspi-phone-tools/phone-cli'
+ib raspi-phone-tools/phone-cli  --force --out_root out
+
 echo 'building phone-controller'
 cd phone-controller
 ./scripts/build.sh
@@ -0,0 +1,173 @@
+#include <raspi-phone-tools/at.h>
+
+#include <cctype>
+#include <cstdlib>
+
+namespace phone {
+  namespace at {
+    bool starts_with(const std::string &str, const std::string &prefix) {
+      return str.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    bool is_call_progress(const std::string &line) {
+      return starts_with(line, "CONNECT") ||
+          line == "NO CARRIER" ||
+          line == "BUSY" ||
+          line == "NO ANSWER" ||
+          line == "NO DIALTONE";
+    }
+
+    bool is_final(const std::string &line) {
+      return line == "OK" ||
+          line == "ERROR" ||
+          starts_with(line, "+CME ERROR:") ||
+          starts_with(line, "+CMS ERROR:") ||
+          is_call_progress(line);
+    }
+
+    bool is_error(const std::string &line) {
+      return is_final(line) && line != "OK" && !starts_with(line, "CONNECT");
+    }
+
+    bool is_unsolicited(const std::string &line) {
+      static const char *const names[] = {
+        "RING", "+CRING", "+CLIP", "+CCWA", "+CMTI", "+CMT", "+CDS", "+CDSI",
+        "+CBM", "+CREG", "+CGREG", "+CEREG", "+CUSD", "+CIEV", "+CSQN",
+        "+CLCC", "+COLP", "^ORIG", "^CONF", "^CONN", "^CEND", "MO RING",
+        "MO CONNECTED"
+      };
+      auto name = line_name(line);
+      for (const char *known: names) {
+        if (name == known) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    int error_code(const std::string &line) {
+      if (!starts_with(line, "+CME ERROR:") && !starts_with(line, "+CMS ERROR:")) {
+        return -1;
+      }
+      return to_int(line.substr(11));
+    }
+
+    std::string response_prefix(const std::string &command) {
+      size_t start = starts_with(command, "AT") || starts_with(command, "at") ? 2 : 0;
+      if (start >= command.size() || (command[start] != '+' && command[start] != '^')) {
+        return std::string {};
+      }
+      size_t end = command.find_first_of("=?;", start);
+      return command.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    }
+
+    std::vector<std::string> response_prefixes(const std::string &line) {
+      std::vector<std::string> result;
+      size_t start = 0;
+      bool quoted = false;
+      for (size_t i = 0; i <= line.size(); ++i) {
+        if (i < line.size() && line[i] == '"') {
+          quoted = !quoted;
+        }
+        if (i == line.size() || (line[i] == ';' && !quoted)) {
+          auto prefix = response_prefix(line.substr(start, i - start));
+          if (!prefix.empty()) {
+            result.push_back(std::move(prefix));
+          }
+          start = i + 1;
+        }
+      }  // for
+      return result;
+    }
+
+    std::string command_name(const std::string &command) {
+      auto prefix = response_prefix(command);
+      if (!prefix.empty()) {
+        size_t end = 2 + prefix.size();
+        if (command.compare(end, 2, "=?") == 0) {
+          return prefix + "=?";
+        }
+        if (command.compare(end, 1, "?") == 0) {
+          return prefix + "?";
+        }
+        return prefix;
+      }
+      size_t start = starts_with(command, "AT") || starts_with(command, "at") ? 2 : 0;
+      if (start >= command.size()) {
+        return "AT";
+      }
+      if (command[start] == '&' && start + 1 < command.size()) {
+        return command.substr(start, 2);
+      }
+      return std::string(1, static_cast<char>(std::toupper(command[start])));
+    }
+
+    std::string line_name(const std::string &line) {
+      return line.substr(0, line.find(':'));
+    }
+
+    std::vector<std::string> split_params(const std::string &line) {
+      std::vector<std::string> result;
+      size_t colon = line.find(':');
+      size_t csr = (colon == std::string::npos) ? 0 : colon + 1;
+      while (csr < line.size() && line[csr] == ' ') {
+        ++csr;
+      }
+      if (csr >= line.size()) {
+        return result;
+      }
+      std::string field;
+      bool quoted = false, was_quoted = false;
+      int depth = 0;
+      for (; csr < line.size(); ++csr) {
+        char c = line[csr];
+        if (quoted) {
+          if (c == '"') {
+            quoted = false;
+          } else {
+            field += c;
+          }
+        } else if (c == '"' && depth == 0) {
+          quoted = was_quoted = true;
+        } else if (c == ',' && depth == 0) {
+          result.push_back(std::move(field));
+          field.clear();
+          was_quoted = false;
+        } else {
+          if (c == '(') {
+            ++depth;
+          } else if (c == ')' && depth > 0) {
+            --depth;
+          }
+          // Quotes inside parentheses are kept so the group can be split again.
+          if (c != ' ' || was_quoted || depth > 0) {
+            field += c;
+          }
+        }
+      }  // for
+      result.push_back(std::move(field));
+      return result;
+    }
+
+    std::string quote(const std::string &str) {
+      std::string result = "\"";
+      for (char c: str) {
+        if (c != '"') {
+          result += c;
+        }
+      }
+      result += '"';
+      return result;
+    }
+
+    int to_int(const std::string &field, int otherwise) {
+      const char *start = field.c_str();
+      while (*start == ' ') {
+        ++start;
+      }
+      char *end = nullptr;
+      long value = std::strtol(start, &end, 10);
+      return (end == start) ? otherwise : static_cast<int>(value);
+    }
+  }
+}
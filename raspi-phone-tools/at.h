@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace phone {
+  namespace at {
+    // Return true iff. 'str' begins with 'prefix'.
+    bool starts_with(const std::string &str, const std::string &prefix);
+
+    // Return true iff. the line is a final result code, one which ends the
+    // response to a command: OK, ERROR, +CME ERROR, +CMS ERROR, and the
+    // call-progress codes (CONNECT, NO CARRIER, BUSY, NO ANSWER, NO DIALTONE).
+    bool is_final(const std::string &line);
+
+    // Return true iff. the line is a final result code which reports
+    // failure.  Anything final that isn't OK or CONNECT counts.
+    bool is_error(const std::string &line);
+
+    // Return true iff. the line is one of the call-progress codes, which are
+    // only final when they answer a dial (ATD) or answer (ATA) command.
+    bool is_call_progress(const std::string &line);
+
+    // Return true iff. the line is one the modem sends on its own, without
+    // being asked: RING, +CLIP, +CMTI, +CREG, +CUSD, and the like.  Some of
+    // these (+CREG, for instance) also answer a query, so when a command is
+    // pending, check its response prefix first.
+    bool is_unsolicited(const std::string &line);
+
+    // If the line is a +CME ERROR or +CMS ERROR with a numeric code, return
+    // the code; otherwise, return -1.
+    int error_code(const std::string &line);
+
+    // Return the prefix which the information lines answering 'command' start
+    // with.  For example, "AT+CPBR=1,10" is answered by "+CPBR:" lines, so
+    // this returns "+CPBR".  Basic commands (ATD, ATE0, ...) return empty.
+    std::string response_prefix(const std::string &command);
+
+    // As response_prefix(), but for every command on a line, so that
+    // "AT+CMEE?;+CLIP?" gives "+CMEE" and "+CLIP".
+    std::vector<std::string> response_prefixes(const std::string &line);
+
+    // Return a short name for the kind of command, used to key statistics:
+    // the extended command's name with "?" or "=?" if it is a read or test
+    // ("+CPBR", "+CREG?", "+CPBR=?"), or the letter of a basic command
+    // ("D", "H", "E").  Only the first command on a line counts.
+    std::string command_name(const std::string &command);
+
+    // Return the name of the result in the line, up to but not including the
+    // colon.  For example, "+CLIP: \"123\",129" gives "+CLIP".  A line with
+    // no colon is returned whole.
+    std::string line_name(const std::string &line);
+
+    // Split the parameters of an information line into fields.  Everything
+    // up to the first colon is skipped.  Fields are separated by commas,
+    // except within double quotes or parentheses.  Quoted fields come back
+    // without their quotes; parenthesized fields come back verbatim.
+    std::vector<std::string> split_params(const std::string &line);
+
+    // Wrap the string in double quotes for use as a command parameter.
+    // V.250 has no escape for the quote character itself, so any double
+    // quotes in the string are dropped.
+    std::string quote(const std::string &str);
+
+    // Parse a decimal field, returning 'otherwise' if it is empty or not a
+    // number.
+    int to_int(const std::string &field, int otherwise = -1);
+  }
+}
@@ -0,0 +1,436 @@
+#include <raspi-phone-tools/call-monitor.h>
+#include <raspi-phone-tools/at.h>
+
+#include <algorithm>
+
+namespace phone {
+  namespace {
+    using state_t = call_t::state_t;
+
+    int64_t to_ms(call_t::time_point_t at) {
+      if (at == call_t::time_point_t {}) {
+        return 0;
+      }
+      return std::chrono::duration_cast<std::chrono::milliseconds>(at.time_since_epoch()).count();
+    }
+
+    call_changed_t describe(const call_t &call) {
+      call_changed_t event;
+      event.id = call.id;
+      event.state = to_string(call.state);
+      event.direction = call.direction == call_t::direction_t::incoming ? "incoming" : "outgoing";
+      event.number = call.number;
+      event.type = call.type;
+      event.started = to_ms(call.started);
+      event.answered = to_ms(call.answered);
+      event.ended = to_ms(call.ended);
+      event.duration_ms = (call.answered != call_t::time_point_t {} && call.ended != call_t::time_point_t {})
+          ? event.ended - event.answered : 0;
+      return event;
+    }
+
+    // Map the <stat> field of +CLCC onto our states.
+    state_t from_clcc(int stat) {
+      switch (stat) {
+        case 0: return state_t::active;
+        case 1: return state_t::held;
+        case 2: return state_t::dialing;
+        case 3: return state_t::alerting;
+        case 4: return state_t::ringing;
+        case 5: return state_t::waiting;
+        default: return state_t::idle;
+      }
+    }
+
+    bool is_live(const call_t &call) {
+      return call.state != state_t::ended && call.state != state_t::idle;
+    }
+
+    call_t make_call(call_t::direction_t direction, state_t state) {
+      call_t call;
+      call.id = 0;
+      call.direction = direction;
+      call.state = state;
+      call.type = 129;
+      call.rings = 0;
+      call.started = std::chrono::system_clock::now();
+      call.rejected = false;
+      return call;
+    }
+  }
+
+  const char *to_string(call_t::state_t state) {
+    switch (state) {
+      case state_t::idle: return "idle";
+      case state_t::dialing: return "dialing";
+      case state_t::alerting: return "alerting";
+      case state_t::ringing: return "ringing";
+      case state_t::waiting: return "waiting";
+      case state_t::active: return "active";
+      case state_t::held: return "held";
+      case state_t::ended: return "ended";
+    }
+    return "unknown";
+  }
+
+  constexpr int call_monitor_t::default_ring_timeout_ms;
+
+  call_monitor_t::call_monitor_t(
+      phone_t &phone, int ring_timeout_ms, const dtmf_queue_t::options_t &dtmf_options)
+      : phone(phone),
+        ring_timeout_ms(ring_timeout_ms),
+        ring_generation(0),
+        probes(0),
+        dtmf(phone, dtmf_options) {
+    phone.on_urc([this](const std::string &line) { handle(line); });
+    phone.on_dial([this](const std::string &number, const phone_t::result_t *result) {
+      dialed(number, result);
+    });
+  }
+
+  call_t::state_t call_monitor_t::get_state() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto *call = find({ state_t::active });
+    if (!call) {
+      call = find({ state_t::ringing, state_t::dialing, state_t::alerting });
+    }
+    if (!call && !calls.empty()) {
+      call = &calls.front();
+    }
+    return call ? call->state : state_t::idle;
+  }
+
+  std::vector<call_t> call_monitor_t::get_calls() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return calls;
+  }
+
+  call_t *call_monitor_t::find(std::initializer_list<call_t::state_t> states) {
+    for (auto &call: calls) {
+      if (std::find(states.begin(), states.end(), call.state) != states.end()) {
+        return &call;
+      }
+    }
+    return nullptr;
+  }
+
+  call_t *call_monitor_t::find_dialed() {
+    for (auto call = calls.rbegin(); call != calls.rend(); ++call) {
+      if (call->direction == call_t::direction_t::outgoing &&
+          (call->state == state_t::dialing || call->state == state_t::alerting)) {
+        return &*call;
+      }
+    }
+    return nullptr;
+  }
+
+  void call_monitor_t::prune() {
+    calls.erase(std::remove_if(calls.begin(), calls.end(), [](const call_t &call) {
+      return !is_live(call);
+    }), calls.end());
+    if (calls.empty()) {
+      dtmf.clear();
+    }
+  }
+
+  void call_monitor_t::transition(call_t &call, call_t::state_t state, events_t &events) {
+    if (call.state == state) {
+      return;
+    }
+    auto now = std::chrono::system_clock::now();
+    if (state == state_t::active && call.answered == call_t::time_point_t {}) {
+      call.answered = now;
+    }
+    if (state == state_t::ended) {
+      call.ended = now;
+    }
+    call.state = state;
+    pending_event_t event {};
+    event.changed = describe(call);
+    if (state == state_t::ended &&
+        call.direction == call_t::direction_t::incoming &&
+        call.answered == call_t::time_point_t {} &&
+        !call.rejected) {
+      event.missed = true;
+      event.missed_call.number = call.number;
+      event.missed_call.type = call.type;
+      event.missed_call.rings = call.rings;
+      event.missed_call.started = event.changed.started;
+      event.missed_call.ended = event.changed.ended;
+    }
+    events.push_back(event);
+  }
+
+  void call_monitor_t::flush(events_t &events) {
+    for (const auto &event: events) {
+      phone.emit(event.changed);
+      if (event.missed) {
+        phone.emit(event.missed_call);
+      }
+    }
+    events.clear();
+  }
+
+  void call_monitor_t::handle(const std::string &line) {
+    events_t events;
+    bool probe_needed = false;
+    bool ring = false;
+    unsigned generation = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto name = at::line_name(line);
+      if (name == "RING" || name == "+CRING") {
+        auto *call = find({ state_t::ringing });
+        if (!call) {
+          calls.push_back(make_call(call_t::direction_t::incoming, state_t::idle));
+          call = &calls.back();
+          transition(*call, state_t::ringing, events);
+        }
+        ++call->rings;
+        // No caller ID by the second ring means +CLIP isn't coming; ask.
+        probe_needed = call->rings == 2 && call->number.empty();
+        ring = true;
+        generation = ++ring_generation;
+      } else if (name == "+CLIP") {
+        auto params = at::split_params(line);
+        auto *call = find({ state_t::ringing });
+        if (!call) {
+          // Some modems send caller ID ahead of the first RING.
+          calls.push_back(make_call(call_t::direction_t::incoming, state_t::idle));
+          call = &calls.back();
+          transition(*call, state_t::ringing, events);
+          ring = true;
+          generation = ++ring_generation;
+        }
+        if (!params.empty() && call->number.empty() && !params[0].empty()) {
+          call->number = params[0];
+          call->type = params.size() > 1 ? at::to_int(params[1], 129) : 129;
+          events.push_back(pending_event_t { describe(*call), false, missed_call_t {} });
+        }
+      } else if (name == "+CCWA") {
+        auto params = at::split_params(line);
+        calls.push_back(make_call(call_t::direction_t::incoming, state_t::idle));
+        auto &call = calls.back();
+        if (!params.empty()) {
+          call.number = params[0];
+          call.type = params.size() > 1 ? at::to_int(params[1], 129) : 129;
+        }
+        transition(call, state_t::waiting, events);
+      } else if (name == "^CONF" || name == "MO RING") {
+        auto *call = find_dialed();
+        if (call && call->state == state_t::dialing) {
+          transition(*call, state_t::alerting, events);
+        }
+      } else if (name == "^CONN" || name == "+COLP" || name == "MO CONNECTED") {
+        if (auto *call = find_dialed()) {
+          transition(*call, state_t::active, events);
+        }
+      } else if (line == "NO CARRIER" || line == "BUSY" || line == "NO ANSWER") {
+        auto live = std::count_if(calls.begin(), calls.end(), is_live);
+        if (live == 1) {
+          transition(*std::find_if(calls.begin(), calls.end(), is_live), state_t::ended, events);
+          prune();
+        } else if (live > 1) {
+          // We can't tell which of them went; ask.
+          probe_needed = true;
+        }
+      }
+    }
+    flush(events);
+    if (probe_needed) {
+      phone.defer([this]() { probe(); });
+    }
+    if (ring) {
+      phone.defer([this, generation]() { check_ringing(generation); }, ring_timeout_ms);
+    }
+  }
+
+  void call_monitor_t::check_ringing(unsigned generation) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (generation != ring_generation || !find({ state_t::ringing })) {
+        return;
+      }
+    }
+    probe();
+  }
+
+  void call_monitor_t::dialed(const std::string &number, const phone_t::result_t *result) {
+    events_t events;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!result) {
+        calls.push_back(make_call(call_t::direction_t::outgoing, state_t::idle));
+        calls.back().number = number;
+        calls.back().type = (!number.empty() && number[0] == '+') ? 145 : 129;
+        transition(calls.back(), state_t::dialing, events);
+      } else if (!result->ok()) {
+        // A BUSY or NO CARRIER which answers ATD itself is its final result,
+        // not a line we see in handle().
+        if (auto *call = find_dialed()) {
+          transition(*call, state_t::ended, events);
+          prune();
+        }
+      }
+    }
+    flush(events);
+  }
+
+  bool call_monitor_t::answer() {
+    bool waiting;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      waiting = find({ state_t::waiting }) && find({ state_t::active });
+    }
+    auto result = phone.command(waiting ? "AT+CHLD=2" : "ATA");
+    if (!result.ok()) {
+      return false;
+    }
+    events_t events;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (waiting) {
+        auto *active = find({ state_t::active });
+        auto *next = find({ state_t::waiting });
+        if (active) {
+          transition(*active, state_t::held, events);
+        }
+        if (next) {
+          transition(*next, state_t::active, events);
+        }
+      } else if (auto *call = find({ state_t::ringing })) {
+        transition(*call, state_t::active, events);
+      }
+    }
+    flush(events);
+    return true;
+  }
+
+  bool call_monitor_t::hangup() {
+    if (!phone.command("ATH").ok()) {
+      return false;
+    }
+    events_t events;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto &call: calls) {
+        if (is_live(call)) {
+          call.rejected = call.answered == call_t::time_point_t {};
+          transition(call, state_t::ended, events);
+        }
+      }
+      prune();
+    }
+    flush(events);
+    return true;
+  }
+
+  void call_monitor_t::send_dtmf(const std::string &tones) {
+    dtmf.push(tones);
+  }
+
+  dtmf_queue_t &call_monitor_t::get_dtmf() {
+    return dtmf;
+  }
+
+  bool call_monitor_t::swap() {
+    if (!phone.command("AT+CHLD=2").ok()) {
+      return false;
+    }
+    events_t events;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto *active = find({ state_t::active });
+      auto *held = find({ state_t::held, state_t::waiting });
+      if (held) {
+        transition(*held, state_t::active, events);
+      }
+      if (active) {
+        transition(*active, state_t::held, events);
+      }
+    }
+    flush(events);
+    return true;
+  }
+
+  void call_monitor_t::probe() {
+    ++probes;
+
+    // +CLCC: <id>,<dir>,<stat>,<mode>,<mpty>[,<number>,<type>]
+    struct reported_t {
+      int id;
+      call_t::direction_t direction;
+      state_t state;
+      std::string number;
+      int type;
+    };
+    std::vector<reported_t> reported;
+    auto result = phone.command("AT+CLCC", [&reported](const std::string &line) {
+      if (!at::starts_with(line, "+CLCC:")) {
+        return;
+      }
+      auto params = at::split_params(line);
+      if (params.size() < 3) {
+        return;
+      }
+      reported.push_back(reported_t {
+        at::to_int(params[0]),
+        at::to_int(params[1]) == 1 ? call_t::direction_t::incoming : call_t::direction_t::outgoing,
+        from_clcc(at::to_int(params[2])),
+        params.size() > 5 ? params[5] : std::string {},
+        params.size() > 6 ? at::to_int(params[6], 129) : 129
+      });
+    });
+    if (!result.ok()) {
+      return;
+    }
+
+    events_t events;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::vector<bool> seen(calls.size(), false);
+      for (const auto &report: reported) {
+        // Match by index first, then by number, then any unindexed call
+        // going the same way.
+        size_t match = calls.size();
+        for (size_t i = 0; i < calls.size() && match == calls.size(); ++i) {
+          if (!seen[i] && calls[i].id == report.id) {
+            match = i;
+          }
+        }
+        for (size_t i = 0; i < calls.size() && match == calls.size(); ++i) {
+          if (!seen[i] && calls[i].id == 0 && calls[i].direction == report.direction &&
+              (report.number.empty() || calls[i].number.empty() || calls[i].number == report.number)) {
+            match = i;
+          }
+        }
+        if (match == calls.size()) {
+          calls.push_back(make_call(report.direction, state_t::idle));
+          seen.push_back(false);
+        }
+        auto &call = calls[match];
+        seen[match] = true;
+        call.id = report.id;
+        if (call.number.empty() && !report.number.empty()) {
+          call.number = report.number;
+          call.type = report.type;
+          if (call.state == report.state) {
+            events.push_back(pending_event_t { describe(call), false, missed_call_t {} });
+          }
+        }
+        transition(call, report.state, events);
+      }  // for
+      for (size_t i = 0; i < seen.size(); ++i) {
+        if (!seen[i] && is_live(calls[i])) {
+          transition(calls[i], state_t::ended, events);
+        }
+      }
+      prune();
+    }
+    flush(events);
+  }
+
+  size_t call_monitor_t::get_probes() const {
+    return probes;
+  }
+}
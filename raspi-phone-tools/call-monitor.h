@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <raspi-phone-tools/dtmf-queue.h>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // A voice call as followed by call_monitor_t.
+  struct call_t {
+    // The stages of a call.  An incoming call goes idle -> ringing -> active
+    // (-> held -> active ...) -> ended; one which arrives while another is
+    // in progress starts out waiting instead of ringing.  Outgoing calls go
+    // through dialing and alerting.
+    enum class state_t {
+      idle,
+      dialing,
+      alerting,
+      ringing,
+      waiting,
+      active,
+      held,
+      ended
+    };
+
+    enum class direction_t {
+      incoming,
+      outgoing
+    };
+
+    using time_point_t = std::chrono::system_clock::time_point;
+
+    // The call's index as +CLCC reports it, or 0 until we have asked.
+    int id;
+
+    direction_t direction;
+    state_t state;
+
+    // The caller ID, if the network gave one, and its type of address.
+    std::string number;
+    int type;
+
+    // How many times RING has been seen for it.
+    int rings;
+
+    // When it started ringing (or was dialed), was answered, and ended.
+    // Zero if it hasn't yet.
+    time_point_t started;
+    time_point_t answered;
+    time_point_t ended;
+
+    // True if we hung it up without ever answering, so it isn't missed.
+    bool rejected;
+  };
+
+  // The name of the state, as used in event payloads.
+  const char *to_string(call_t::state_t state);
+
+  // Follows calls through their states using the lines the modem sends on
+  // its own: RING and +CRING, +CLIP (caller ID), +CCWA (call waiting), the
+  // progress of an outgoing call (MO RING or ^CONF, then MO CONNECTED, ^CONN
+  // or +COLP), and NO CARRIER, BUSY or NO ANSWER at the end.  Calls placed
+  // with phone_t::dial() are picked up as ATD goes out, and end there if the
+  // modem turns ATD down.  Nothing is polled.  Only when the lines leave the
+  // state in doubt, such as a NO CARRIER while two calls are up or a call
+  // that stops ringing without hanging up, does the monitor ask the modem
+  // with a single AT+CLCC.
+  //
+  // Each change of state is emitted as a call event.  An incoming call which
+  // ends without being answered is also emitted as a missedcall event.  Both
+  // carry the caller ID and timestamps in milliseconds since the epoch.
+  //
+  // The monitor must outlive the phone's listening thread.
+  class call_monitor_t final {
+    public:
+      // If RING stops for this long and no hang-up is reported, ask the
+      // modem whether the call is still there.
+      static constexpr int default_ring_timeout_ms = 8000;
+
+      explicit call_monitor_t(
+          phone_t &phone, int ring_timeout_ms = default_ring_timeout_ms,
+          const dtmf_queue_t::options_t &dtmf_options = dtmf_queue_t::options_t());
+
+      // The state of the call in the foreground: the active one if there is
+      // one, else the one ringing, else the first of the rest; idle if there
+      // are no calls.
+      call_t::state_t get_state();
+
+      // A copy of every call in progress.
+      std::vector<call_t> get_calls();
+
+      // Answer the ringing call, or, if one is active, put that on hold and
+      // take the waiting one.  Return true iff. the modem agreed.
+      bool answer();
+
+      // Hang up every call.  Return true iff. the modem agreed.
+      bool hangup();
+
+      // Queue DTMF tones (and ',' pauses) to play into the active call; see
+      // dtmf_queue_t.  Returns at once.  Whatever is still queued when the
+      // last call ends is dropped.
+      void send_dtmf(const std::string &tones);
+
+      dtmf_queue_t &get_dtmf();
+
+      // Swap the active and held calls.  Return true iff. the modem agreed.
+      bool swap();
+
+      // Ask the modem for its list of calls with AT+CLCC and bring ours into
+      // line with it.  This issues a command, so it must not be called from
+      // a line or unsolicited-line handler.
+      void probe();
+
+      // How many times probe() has run.
+      size_t get_probes() const;
+
+    private:
+      // An event to emit once the lock is released: a call's change of
+      // state and, if that change means it was missed, that too.
+      struct pending_event_t {
+        call_changed_t changed;
+        bool missed;
+        missed_call_t missed_call;
+      };
+
+      using events_t = std::vector<pending_event_t>;
+
+      // Handle a line the modem sent on its own.
+      void handle(const std::string &line);
+
+      // Handle a call placed with phone_t::dial(): start it dialing as ATD
+      // goes out (a null result), and end it if the modem refused ATD.
+      void dialed(const std::string &number, const phone_t::result_t *result);
+
+      // Move the call into the new state, queuing the event(s) to emit.
+      void transition(call_t &call, call_t::state_t state, events_t &events);
+
+      // Emit the queued events.  Called without the lock held, so
+      // listeners are free to call back into the monitor.
+      void flush(events_t &events);
+
+      // Find the first call in one of the given states, or null.
+      call_t *find(std::initializer_list<call_t::state_t> states);
+
+      // The most recent outgoing call still dialing or alerting, or null.
+      call_t *find_dialed();
+
+      // Drop calls which have ended, and if that leaves none, any DTMF
+      // still queued.
+      void prune();
+
+      // Check on the ringing call, if RING hasn't been seen since
+      // 'generation'.
+      void check_ringing(unsigned generation);
+
+      phone_t &phone;
+      const int ring_timeout_ms;
+      std::mutex mutex;
+      std::vector<call_t> calls;
+      unsigned ring_generation;
+      std::atomic<size_t> probes;
+      dtmf_queue_t dtmf;
+  };
+}
@@ -0,0 +1,259 @@
+#include <raspi-phone-tools/charset.h>
+
+#include <stdexcept>
+
+namespace phone {
+  namespace charset {
+    namespace {
+      int hex_value(char c) {
+        if (c >= '0' && c <= '9') {
+          return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+          return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+          return c - 'A' + 10;
+        }
+        throw std::invalid_argument("bad hex digit");
+      }
+
+      void append_unit(std::string &out, unsigned unit) {
+        static const char digits[] = "0123456789ABCDEF";
+        for (int shift = 12; shift >= 0; shift -= 4) {
+          out += digits[(unit >> shift) & 0xF];
+        }
+      }
+
+      // The GSM 03.38 default alphabet, by septet.  0x1B escapes to the
+      // extension table; on its own it reads as a space.
+      const unsigned short gsm7_basic[128] = {
+        0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+        0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+        0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+        0x03A3, 0x0398, 0x039E, 0x0020, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+        0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+        0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+        0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+        0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+        0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+        0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+        0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+        0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+        0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+        0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+        0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+        0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0
+      };
+
+      // The extension table: the septet after an escape, and what it means.
+      const unsigned short gsm7_extended[][2] = {
+        { 0x0A, 0x000C }, { 0x14, 0x005E }, { 0x28, 0x007B }, { 0x29, 0x007D },
+        { 0x2F, 0x005C }, { 0x3C, 0x005B }, { 0x3D, 0x007E }, { 0x3E, 0x005D },
+        { 0x40, 0x007C }, { 0x65, 0x20AC }
+      };
+
+      const char gsm7_escape = 0x1B;
+
+      // Decode hex digits into bytes.
+      std::string unhex(const std::string &hex) {
+        if (hex.size() % 2) {
+          throw std::invalid_argument("hex string length is odd");
+        }
+        std::string result;
+        result.reserve(hex.size() / 2);
+        for (size_t i = 0; i < hex.size(); i += 2) {
+          result += static_cast<char>((hex_value(hex[i]) << 4) | hex_value(hex[i + 1]));
+        }
+        return result;
+      }
+
+      // Decode the code point starting at utf8[i] and move 'i' past it.
+      unsigned next_code_point(const std::string &utf8, size_t &i) {
+        auto lead = static_cast<unsigned char>(utf8[i]);
+        unsigned code_point;
+        size_t extra;
+        if (lead < 0x80) {
+          code_point = lead;
+          extra = 0;
+        } else if ((lead & 0xE0) == 0xC0) {
+          code_point = lead & 0x1F;
+          extra = 1;
+        } else if ((lead & 0xF0) == 0xE0) {
+          code_point = lead & 0x0F;
+          extra = 2;
+        } else if ((lead & 0xF8) == 0xF0) {
+          code_point = lead & 0x07;
+          extra = 3;
+        } else {
+          throw std::invalid_argument("bad UTF-8 lead byte");
+        }
+        if (i + extra >= utf8.size() && extra) {
+          throw std::invalid_argument("truncated UTF-8 sequence");
+        }
+        for (size_t j = 1; j <= extra; ++j) {
+          auto cont = static_cast<unsigned char>(utf8[i + j]);
+          if ((cont & 0xC0) != 0x80) {
+            throw std::invalid_argument("bad UTF-8 continuation byte");
+          }
+          code_point = (code_point << 6) | (cont & 0x3F);
+        }
+        i += extra + 1;
+        return code_point;
+      }
+    }
+
+    void append_utf8(std::string &out, unsigned code_point) {
+      if (code_point < 0x80) {
+        out += static_cast<char>(code_point);
+      } else if (code_point < 0x800) {
+        out += static_cast<char>(0xC0 | (code_point >> 6));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+      } else if (code_point < 0x10000) {
+        out += static_cast<char>(0xE0 | (code_point >> 12));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+      } else {
+        out += static_cast<char>(0xF0 | (code_point >> 18));
+        out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+      }
+    }
+
+    std::string ucs2_hex_to_utf8(const std::string &hex) {
+      if (hex.size() % 4) {
+        throw std::invalid_argument("UCS2 string length is not a multiple of 4");
+      }
+      std::string result;
+      result.reserve(hex.size() / 2);
+      unsigned high = 0;
+      for (size_t i = 0; i < hex.size(); i += 4) {
+        unsigned unit = 0;
+        for (size_t j = 0; j < 4; ++j) {
+          unit = (unit << 4) | static_cast<unsigned>(hex_value(hex[i + j]));
+        }
+        if (unit >= 0xD800 && unit < 0xDC00) {
+          high = unit;
+          continue;
+        }
+        if (unit >= 0xDC00 && unit < 0xE000 && high) {
+          unit = 0x10000 + ((high - 0xD800) << 10) + (unit - 0xDC00);
+        }
+        high = 0;
+        append_utf8(result, unit);
+      }  // for
+      return result;
+    }
+
+    std::string utf8_to_ucs2_hex(const std::string &utf8) {
+      std::string result;
+      result.reserve(utf8.size() * 4);
+      for (size_t i = 0; i < utf8.size();) {
+        auto code_point = next_code_point(utf8, i);
+        if (code_point >= 0x10000) {
+          code_point -= 0x10000;
+          append_unit(result, 0xD800 + (code_point >> 10));
+          append_unit(result, 0xDC00 + (code_point & 0x3FF));
+        } else {
+          append_unit(result, code_point);
+        }
+      }  // for
+      return result;
+    }
+
+    std::string gsm7_to_utf8(const std::string &septets) {
+      std::string result;
+      result.reserve(septets.size());
+      for (size_t i = 0; i < septets.size(); ++i) {
+        auto septet = static_cast<unsigned>(septets[i]) & 0x7F;
+        if (septet == static_cast<unsigned>(gsm7_escape) && i + 1 < septets.size()) {
+          auto next = static_cast<unsigned>(septets[++i]) & 0x7F;
+          unsigned code_point = gsm7_basic[next];
+          for (const auto &entry: gsm7_extended) {
+            if (entry[0] == next) {
+              code_point = entry[1];
+              break;
+            }
+          }
+          append_utf8(result, code_point);
+        } else {
+          append_utf8(result, gsm7_basic[septet]);
+        }
+      }  // for
+      return result;
+    }
+
+    std::string utf8_to_gsm7(const std::string &utf8) {
+      std::string result;
+      result.reserve(utf8.size());
+      for (size_t i = 0; i < utf8.size();) {
+        auto code_point = next_code_point(utf8, i);
+        int found = -1;
+        for (unsigned septet = 0; septet < 128 && found < 0; ++septet) {
+          if (gsm7_basic[septet] == code_point && septet != static_cast<unsigned>(gsm7_escape)) {
+            found = static_cast<int>(septet);
+          }
+        }
+        if (found >= 0) {
+          result += static_cast<char>(found);
+          continue;
+        }
+        for (const auto &entry: gsm7_extended) {
+          if (entry[1] == code_point) {
+            result += gsm7_escape;
+            found = entry[0];
+            break;
+          }
+        }
+        result += static_cast<char>(found >= 0 ? found : 0x3F);
+      }  // for
+      return result;
+    }
+
+    std::string gsm7_packed_hex_to_utf8(const std::string &hex) {
+      auto bytes = unhex(hex);
+      size_t count = bytes.size() * 8 / 7;
+      std::string septets;
+      septets.reserve(count);
+      for (size_t i = 0; i < count; ++i) {
+        size_t bit = i * 7;
+        unsigned value = static_cast<unsigned char>(bytes[bit / 8]) >> (bit % 8);
+        if (bit % 8 > 1) {
+          value |= static_cast<unsigned>(static_cast<unsigned char>(bytes[bit / 8 + 1])) << (8 - bit % 8);
+        }
+        septets += static_cast<char>(value & 0x7F);
+      }
+      // Seven spare bits at the end are padding, which USSD fills with a
+      // carriage return.
+      if (count % 8 == 0 && count && (septets.back() == '\r' || septets.back() == 0)) {
+        septets.pop_back();
+      }
+      return gsm7_to_utf8(septets);
+    }
+
+    std::string utf8_to_gsm7_packed_hex(const std::string &utf8) {
+      static const char digits[] = "0123456789ABCDEF";
+      auto septets = utf8_to_gsm7(utf8);
+      if (septets.size() % 8 == 7) {
+        septets += '\r';
+      }
+      std::string bytes((septets.size() * 7 + 7) / 8, '\0');
+      for (size_t i = 0; i < septets.size(); ++i) {
+        size_t bit = i * 7;
+        unsigned value = static_cast<unsigned>(septets[i]) & 0x7F;
+        bytes[bit / 8] = static_cast<char>(bytes[bit / 8] | (value << (bit % 8)));
+        if (bit % 8 > 1) {
+          bytes[bit / 8 + 1] = static_cast<char>(bytes[bit / 8 + 1] | (value >> (8 - bit % 8)));
+        }
+      }
+      std::string result;
+      result.reserve(bytes.size() * 2);
+      for (char c: bytes) {
+        result += digits[(static_cast<unsigned char>(c) >> 4) & 0xF];
+        result += digits[static_cast<unsigned char>(c) & 0xF];
+      }
+      return result;
+    }
+  }
+}
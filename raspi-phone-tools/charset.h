@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+
+namespace phone {
+  namespace charset {
+    // Decode a string sent by the modem in the "UCS2" character set (hex
+    // digits, four per UTF-16 code unit, big-endian) into UTF-8.  Surrogate
+    // pairs are combined.  Throws std::invalid_argument if the input isn't
+    // well-formed hex.
+    std::string ucs2_hex_to_utf8(const std::string &hex);
+
+    // Encode a UTF-8 string into the modem's "UCS2" character set.  Code
+    // points outside the basic multilingual plane become surrogate pairs.
+    // Throws std::invalid_argument if the input isn't well-formed UTF-8.
+    std::string utf8_to_ucs2_hex(const std::string &utf8);
+
+    // Decode septets of the GSM 7-bit default alphabet, one to a byte,
+    // into UTF-8, including the characters of the extension table.
+    std::string gsm7_to_utf8(const std::string &septets);
+
+    // Encode UTF-8 into septets of the GSM 7-bit default alphabet, one to a
+    // byte.  Characters the alphabet lacks become '?'.  Throws
+    // std::invalid_argument if the input isn't well-formed UTF-8.
+    std::string utf8_to_gsm7(const std::string &utf8);
+
+    // Decode GSM 7-bit text packed eight septets to seven octets and sent
+    // as hex digits, as some modems report USSD, into UTF-8.  Throws
+    // std::invalid_argument if the input isn't well-formed hex.
+    std::string gsm7_packed_hex_to_utf8(const std::string &hex);
+
+    // Encode UTF-8 as packed GSM 7-bit text in hex digits, padding a spare
+    // septet with a carriage return as USSD requires.
+    std::string utf8_to_gsm7_packed_hex(const std::string &utf8);
+
+    // Append the code point to 'out' as UTF-8.
+    void append_utf8(std::string &out, unsigned code_point);
+  }
+}
@@ -0,0 +1,273 @@
+#include <raspi-phone-tools/delivery-tracker.h>
+#include <raspi-phone-tools/at.h>
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+namespace phone {
+  constexpr size_t delivery_tracker_t::default_capacity;
+  constexpr long delivery_tracker_t::default_expire_ms;
+  constexpr int delivery_tracker_t::send_timeout_ms;
+
+  // Microseconds on the steady clock.
+  static int64_t to_us(phone_t::time_point_t at) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(at.time_since_epoch()).count();
+  }
+
+  // The smallest power of two at least twice 'capacity', so the table is
+  // never more than half full of live entries.
+  static size_t slot_count_for(size_t capacity) {
+    size_t result = 16;
+    while (result < capacity * 2) {
+      result *= 2;
+    }
+    return result;
+  }
+
+  delivery_tracker_t::delivery_tracker_t(phone_t &phone, size_t capacity, long expire_ms)
+      : phone(phone),
+        capacity(capacity ? capacity : 1),
+        expire_ms(expire_ms),
+        slots(slot_count_for(this->capacity), slot_t {}),
+        live(0),
+        dead(0),
+        last_sweep_us(to_us(std::chrono::steady_clock::now())),
+        stats(),
+        latency(phone.get_latencies().get("sms:delivery")) {
+    phone.on_urc([this](const std::string &line) {
+      report(line);
+    });
+  }
+
+  int delivery_tracker_t::send(const std::string &number, const std::string &text) {
+    // Track the message as soon as its reference arrives, on the reading
+    // thread, so a quick report can't beat us to the table.
+    int mr = -1;
+    auto result = phone.command_with_body(
+        "AT+CMGS=" + at::quote(number), text,
+        [this, &number, &mr](const std::string &line) {
+          if (at::line_name(line) != "+CMGS") {
+            return;
+          }
+          auto params = at::split_params(line);
+          mr = params.empty() ? -1 : at::to_int(params[0]);
+          if (mr >= 0) {
+            track(number, mr);
+          }
+        },
+        send_timeout_ms);
+    if (!result.ok() || mr < 0) {
+      throw std::runtime_error(
+          "cannot send message: " + (result.final.empty() ? std::string { "timeout" } : result.final));
+    }
+    return mr;
+  }
+
+  void delivery_tracker_t::track(const std::string &number, int mr, phone_t::time_point_t sent) {
+    slot_t entry;
+    entry.recipient = hash_number(number);
+    entry.sent_us = to_us(sent);
+    entry.mr = static_cast<uint8_t>(mr & 0xff);
+    entry.state = slot_state_t::live;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ++stats.sent;
+    auto now_us = to_us(std::chrono::steady_clock::now());
+    if (now_us - last_sweep_us >= expire_ms * 1000 / 16) {
+      sweep(now_us);
+    }
+    auto *same = find(entry.recipient, entry.mr);
+    if (same) {
+      // The reference has come round again; the old message's report is
+      // never coming, or if it does, we can't tell it from the new one's.
+      same->sent_us = entry.sent_us;
+      ++stats.replaced;
+      return;
+    }
+    make_room(now_us);
+    place(entry);
+  }
+
+  bool delivery_tracker_t::report(const std::string &line) {
+    status_report_t parsed;
+    if (!parse(line, parsed)) {
+      return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    uint64_t waited_us;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto *slot = find(parsed.recipient.empty() ? 0 : hash_number(parsed.recipient), parsed.mr);
+      if (!slot) {
+        ++stats.unmatched;
+        return false;
+      }
+      if (parsed.trying()) {
+        ++stats.trying;
+        return true;
+      }
+      waited_us = static_cast<uint64_t>(std::max<int64_t>(0, to_us(now) - slot->sent_us));
+      ++(parsed.delivered() ? stats.delivered : stats.failed);
+      kill(*slot);
+    }
+    latency.record(waited_us);
+    delivery_t event;
+    event.number = parsed.recipient;
+    event.mr = parsed.mr;
+    event.status = parsed.status;
+    event.delivered = parsed.delivered();
+    event.latency_ms = static_cast<int64_t>(waited_us / 1000);
+    phone.emit(event);
+    return true;
+  }
+
+  size_t delivery_tracker_t::expire(phone_t::time_point_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return sweep(to_us(now));
+  }
+
+  size_t delivery_tracker_t::sweep(int64_t now_us) {
+    last_sweep_us = now_us;
+    size_t result = 0;
+    for (auto &slot: slots) {
+      if (slot.state == slot_state_t::live && now_us - slot.sent_us >= expire_ms * 1000) {
+        kill(slot);
+        ++result;
+      }
+    }
+    stats.expired += result;
+    return result;
+  }
+
+  delivery_tracker_t::stats_t delivery_tracker_t::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto result = stats;
+    result.outstanding = live;
+    return result;
+  }
+
+  const histogram_t &delivery_tracker_t::get_latency() const {
+    return latency;
+  }
+
+  bool delivery_tracker_t::parse(const std::string &line, status_report_t &report) {
+    // +CDS: <fo>,<mr>,[<ra>],[<tora>],<scts>,<dt>,<st>; in PDU mode, it's
+    // a length, with the PDU on the next line.
+    if (at::line_name(line) != "+CDS") {
+      return false;
+    }
+    auto params = at::split_params(line);
+    if (params.size() < 7) {
+      return false;
+    }
+    report.mr = at::to_int(params[1]);
+    report.recipient = params[2];
+    report.scts = params[4];
+    report.dt = params[5];
+    report.status = at::to_int(params[6]);
+    return report.mr >= 0 && report.mr < 256 && report.status >= 0;
+  }
+
+  uint64_t delivery_tracker_t::hash_number(const std::string &number) {
+    // FNV-1a over the last nine digits.  A number without digits (an
+    // alphanumeric sender, say) is hashed whole.
+    static const size_t significant = 9;
+    std::string digits;
+    for (char c: number) {
+      if (std::isdigit(static_cast<unsigned char>(c))) {
+        digits += c;
+      }
+    }
+    if (digits.empty()) {
+      digits = number;
+    } else if (digits.size() > significant) {
+      digits.erase(0, digits.size() - significant);
+    }
+    uint64_t result = 14695981039346656037ull;
+    for (char c: digits) {
+      result ^= static_cast<unsigned char>(c);
+      result *= 1099511628211ull;
+    }
+    // Zero means "any recipient" to find().
+    return result ? result : 1;
+  }
+
+  size_t delivery_tracker_t::home_of(uint64_t recipient, int mr) const {
+    auto key = (recipient ^ static_cast<uint64_t>(mr)) * 0x9e3779b97f4a7c15ull;
+    return static_cast<size_t>(key >> 32) & (slots.size() - 1);
+  }
+
+  delivery_tracker_t::slot_t *delivery_tracker_t::find(uint64_t recipient, int mr) {
+    if (!recipient) {
+      // The report didn't say who it was for, which is rare enough that
+      // a scan will do: take the oldest message with the reference.
+      slot_t *oldest = nullptr;
+      for (auto &slot: slots) {
+        if (slot.state == slot_state_t::live && slot.mr == mr &&
+            (!oldest || slot.sent_us < oldest->sent_us)) {
+          oldest = &slot;
+        }
+      }
+      return oldest;
+    }
+    auto mask = slots.size() - 1;
+    for (size_t i = home_of(recipient, mr);; i = (i + 1) & mask) {
+      auto &slot = slots[i];
+      if (slot.state == slot_state_t::empty) {
+        return nullptr;
+      }
+      if (slot.state == slot_state_t::live && slot.recipient == recipient && slot.mr == mr) {
+        return &slot;
+      }
+    }  // for
+  }
+
+  void delivery_tracker_t::make_room(int64_t now_us) {
+    if (live >= capacity) {
+      sweep(now_us);
+    }
+    if (live >= capacity) {
+      slot_t *oldest = nullptr;
+      for (auto &slot: slots) {
+        if (slot.state == slot_state_t::live && (!oldest || slot.sent_us < oldest->sent_us)) {
+          oldest = &slot;
+        }
+      }
+      kill(*oldest);
+      ++stats.expired;
+    }
+    if (live + dead + 1 > slots.size() / 4 * 3) {
+      std::vector<slot_t> old(slots.size(), slot_t {});
+      old.swap(slots);
+      live = 0;
+      dead = 0;
+      for (const auto &slot: old) {
+        if (slot.state == slot_state_t::live) {
+          place(slot);
+        }
+      }
+    }
+  }
+
+  void delivery_tracker_t::place(const slot_t &entry) {
+    auto mask = slots.size() - 1;
+    for (size_t i = home_of(entry.recipient, entry.mr);; i = (i + 1) & mask) {
+      auto &slot = slots[i];
+      if (slot.state != slot_state_t::live) {
+        if (slot.state == slot_state_t::dead) {
+          --dead;
+        }
+        slot = entry;
+        ++live;
+        return;
+      }
+    }  // for
+  }
+
+  void delivery_tracker_t::kill(slot_t &slot) {
+    slot.state = slot_state_t::dead;
+    --live;
+    ++dead;
+  }
+}
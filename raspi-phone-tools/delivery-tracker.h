@@ -0,0 +1,163 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <raspi-phone-tools/histogram.h>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // A status report (+CDS) as the modem sends it in text mode.
+  struct status_report_t {
+    // The reference of the message it reports on, 0-255.
+    int mr;
+
+    // The recipient, if the report names one.
+    std::string recipient;
+
+    // When the service centre took the message, and when it reached the
+    // recipient (or failed to), as the network reports them.
+    std::string scts;
+    std::string dt;
+
+    // TP-Status: below 32 the message was delivered, 32 to 63 the service
+    // centre is still trying, and anything higher failed for good.
+    int status;
+
+    bool delivered() const { return status < 32; }
+    bool trying() const { return status >= 32 && status < 64; }
+  };
+
+  // Tracks the messages we have sent until their status reports come in.
+  //
+  // Outstanding messages live in an open-addressing table of fixed size,
+  // keyed by recipient and message reference, so a report is matched with
+  // a single probe sequence and no allocation.  Recipients are compared on
+  // their last nine digits, since networks report them in whichever of
+  // national or international form they please, and stored only as a hash.
+  //
+  // The modem hands out message references from 0 to 255 and then starts
+  // again, so a reference can come round for the same recipient while the
+  // first message is still outstanding; the new message replaces the old,
+  // which we count as lost.  Entries with no report after 'expire_ms' are
+  // dropped.  When a report comes in, the time since the message was sent
+  // is recorded and a delivery event is emitted.
+  //
+  // Status reports must be asked for (AT+CSMP with a first octet of 49, as
+  // in the standard init profile) and routed straight to us (AT+CNMI with
+  // <ds> of 1).  Only text mode (AT+CMGF=1) reports are understood.
+  class delivery_tracker_t final {
+    public:
+      // How many messages may be outstanding at once, by default.
+      static constexpr size_t default_capacity = 1024;
+
+      // How long to wait for a report, by default: the 24 hour validity
+      // period the standard init profile asks for.
+      static constexpr long default_expire_ms = 24L * 60 * 60 * 1000;
+
+      // How long AT+CMGS may take.
+      static constexpr int send_timeout_ms = 60000;
+
+      struct stats_t {
+        // Messages waiting for a final report.
+        size_t outstanding;
+
+        uint64_t sent;
+        uint64_t delivered;
+        uint64_t failed;
+
+        // Reports saying the service centre is still trying.
+        uint64_t trying;
+
+        // Messages which got no report in time, or whose reference came
+        // round again before theirs did.
+        uint64_t expired;
+        uint64_t replaced;
+
+        // Reports which matched no outstanding message.
+        uint64_t unmatched;
+      };
+
+      // Watch 'phone' for status reports.  The tracker must outlive the
+      // phone's listening thread.
+      explicit delivery_tracker_t(
+          phone_t &phone, size_t capacity = default_capacity,
+          long expire_ms = default_expire_ms);
+
+      // Send a text message with AT+CMGS and track it.  Return its
+      // reference, or throw if the modem refused it.
+      int send(const std::string &number, const std::string &text);
+
+      // Track a message sent by other means.
+      void track(
+          const std::string &number, int mr,
+          phone_t::time_point_t sent = std::chrono::steady_clock::now());
+
+      // Match a status report line against the outstanding messages, and
+      // return true iff. it matched one.  Lines other than +CDS are ignored.
+      bool report(const std::string &line);
+
+      // Drop the messages which have waited longer than 'expire_ms', and
+      // return how many there were.  This happens by itself as messages are
+      // tracked, too.
+      size_t expire(phone_t::time_point_t now = std::chrono::steady_clock::now());
+
+      stats_t get_stats() const;
+
+      // The time from sending a message to its final report, which is also
+      // kept in the phone's latency table as "sms:delivery".
+      const histogram_t &get_latency() const;
+
+      // Parse a +CDS line; return false if it isn't one.
+      static bool parse(const std::string &line, status_report_t &report);
+
+      // The hash we key recipients by.
+      static uint64_t hash_number(const std::string &number);
+
+    private:
+      enum class slot_state_t : uint8_t { empty, live, dead };
+
+      struct slot_t {
+        uint64_t recipient;
+        int64_t sent_us;
+        uint8_t mr;
+        slot_state_t state;
+      };
+
+      // The slot the key's probe sequence starts at.
+      size_t home_of(uint64_t recipient, int mr) const;
+
+      // The live slot for the key, or null.  If 'mr' alone is to be
+      // matched, 'recipient' is zero.
+      slot_t *find(uint64_t recipient, int mr);
+
+      // Make room for one more entry: if the table is full, sweep out what
+      // has expired, and failing that, the oldest entry; then, if dead
+      // slots are making probes long, rehash.
+      void make_room(int64_t now_us);
+
+      // Drop what has expired; expire() without the lock.
+      size_t sweep(int64_t now_us);
+
+      // Put the entry in the first free slot of its probe sequence.
+      void place(const slot_t &entry);
+
+      // Take the entry out of the table.
+      void kill(slot_t &slot);
+
+      phone_t &phone;
+      const size_t capacity;
+      const long expire_ms;
+      mutable std::mutex mutex;
+      std::vector<slot_t> slots;
+      size_t live;
+      size_t dead;
+      int64_t last_sweep_us;
+      stats_t stats;
+
+      // "sms:delivery" in the phone's latency table.
+      histogram_t &latency;
+  };
+}
@@ -0,0 +1,172 @@
+#include <raspi-phone-tools/dtmf-queue.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace phone {
+  static bool is_pause(char c) {
+    return c == ',' || c == 'p' || c == 'P';
+  }
+
+  static bool is_tone(char c) {
+    return (c >= '0' && c <= '9') || c == '*' || c == '#' || (c >= 'A' && c <= 'D');
+  }
+
+  dtmf_queue_t::options_t::options_t()
+      : tone_ms(100),
+        gap_ms(0),
+        pause_ms(2000),
+        max_tones(1),
+        max_line(256) {}
+
+  dtmf_queue_t::dtmf_queue_t(phone_t &phone, const options_t &options)
+      : phone(phone),
+        options(options),
+        draining(false),
+        duration_sent(false),
+        stats(stats_t { 0, 0, 0, 0 }) {}
+
+  void dtmf_queue_t::push(const std::string &tones) {
+    for (char c: tones) {
+      if (!is_tone(c) && !is_pause(c)) {
+        throw std::invalid_argument("not a DTMF tone: " + std::string(1, c));
+      }
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    for (char c: tones) {
+      items.push_back(item_t { c, now });
+    }
+    if (!draining && !items.empty()) {
+      draining = true;
+      phone.defer([this]() { drain(); });
+    }
+  }
+
+  void dtmf_queue_t::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.dropped += items.size();
+    items.clear();
+  }
+
+  bool dtmf_queue_t::wait_idle(int timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return idle_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() {
+      return !draining;
+    });
+  }
+
+  void dtmf_queue_t::set_options(const options_t &new_options) {
+    std::lock_guard<std::mutex> lock(mutex);
+    duration_sent = duration_sent && new_options.tone_ms == options.tone_ms;
+    options = new_options;
+  }
+
+  size_t dtmf_queue_t::get_pending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+  }
+
+  dtmf_queue_t::stats_t dtmf_queue_t::get_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+  std::vector<std::pair<std::string, size_t>> dtmf_queue_t::pack(
+      const std::string &tones, const std::string &duration, const options_t &options) {
+    std::vector<std::pair<std::string, size_t>> result;
+    std::string line;
+    size_t played = 0;
+    auto add = [&](const std::string &cmd, size_t count) {
+      if (!line.empty() && line.size() + 1 + cmd.size() > options.max_line) {
+        result.emplace_back(line, played);
+        line.clear();
+        played = 0;
+      }
+      line += line.empty() ? "AT" : ";";
+      line += cmd;
+      played += count;
+    };
+    if (!duration.empty()) {
+      add("+VTD=" + duration, 0);
+    }
+    auto per_command = std::max<size_t>(1, options.max_tones);
+    for (size_t csr = 0; csr < tones.size(); csr += per_command) {
+      auto chunk = tones.substr(csr, per_command);
+      add(per_command == 1 ? "+VTS=" + chunk : "+VTS=\"" + chunk + "\"", chunk.size());
+    }
+    if (played) {
+      result.emplace_back(line, played);
+    }
+    return result;
+  }
+
+  void dtmf_queue_t::drain() {
+    std::string run;
+    std::vector<std::chrono::steady_clock::time_point> queued;
+    std::string duration;
+    options_t now_options;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      now_options = options;
+      size_t pauses = 0;
+      while (!items.empty() && is_pause(items.front().tone)) {
+        items.pop_front();
+        ++pauses;
+      }
+      if (pauses) {
+        stats.pauses += pauses;
+        phone.defer([this]() { drain(); }, static_cast<int>(pauses) * now_options.pause_ms);
+        return;
+      }
+      if (items.empty()) {
+        draining = false;
+        idle_cv.notify_all();
+        return;
+      }
+      // With a gap of our own to keep, tones go one at a time.
+      size_t limit = now_options.gap_ms > 0 ? 1 : items.size();
+      while (!items.empty() && !is_pause(items.front().tone) && run.size() < limit) {
+        run += items.front().tone;
+        queued.push_back(items.front().queued);
+        items.pop_front();
+      }
+      if (!duration_sent) {
+        duration = std::to_string(std::max(1, (now_options.tone_ms + 50) / 100));
+        duration_sent = true;
+      }
+    }
+
+    auto &latency = phone.get_latencies().get("dtmf");
+    size_t sent = 0;
+    for (const auto &cmd: pack(run, duration, now_options)) {
+      // The modem answers once it has played the tones.
+      auto timeout_ms = phone_t::default_timeout_ms +
+          static_cast<int>(cmd.second) * 2 * now_options.tone_ms;
+      auto result = phone.command(cmd.first, phone_t::line_callback_t {}, timeout_ms);
+      if (!result.ok()) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stats.dropped += run.size() - sent + items.size();
+          items.clear();
+          duration_sent = false;
+          draining = false;
+          idle_cv.notify_all();
+        }
+        phone.emit(phone_error_t {
+          "DTMF refused: " + (result.final.empty() ? std::string { "timeout" } : result.final)
+        });
+        return;
+      }
+      for (size_t i = sent; i < sent + cmd.second; ++i) {
+        latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            result.finished - queued[i]).count()));
+      }
+      sent += cmd.second;
+      std::lock_guard<std::mutex> lock(mutex);
+      stats.tones += cmd.second;
+      ++stats.commands;
+    }  // for
+    phone.defer([this]() { drain(); }, now_options.gap_ms);
+  }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // Plays DTMF tones into the call in progress, for working IVR menus.
+  //
+  // Tones are queued as strings of 0-9, *, # and A-D, with ',' (or 'p')
+  // for a pause, and go out on the phone's worker thread.  Each run of
+  // tones between pauses is packed into as few command lines as the modem
+  // takes: AT+VTS commands joined by semicolons, each carrying one tone, or
+  // up to 'max_tones' as a string for modems which accept that form.  The
+  // modem holds the OK until it has played them, so a run costs one round
+  // trip instead of one per tone.
+  //
+  // The tone duration goes to the modem with AT+VTD, ahead of the first
+  // tones.  The gap between tones is the modem's own unless 'gap_ms' asks
+  // for more, in which case each tone goes in a command of its own with
+  // the gap waited out between them.
+  //
+  // The time from queuing each tone to the modem having played it is
+  // recorded in the phone's latency table as "dtmf".  If the modem refuses
+  // a command, the rest of the queue is dropped and an error event emitted.
+  class dtmf_queue_t final {
+    public:
+      struct options_t {
+        options_t();
+
+        // How long each tone sounds, to the nearest tenth of a second.
+        int tone_ms;
+
+        // Silence to leave between tones on top of the modem's own.
+        int gap_ms;
+
+        // How long a pause lasts.
+        int pause_ms;
+
+        // The most tones the modem takes in one AT+VTS string; 1 for
+        // modems which only take the single-tone form.
+        size_t max_tones;
+
+        // The longest command line the modem will take.
+        size_t max_line;
+      };
+
+      struct stats_t {
+        size_t tones;
+        size_t pauses;
+        size_t commands;
+        size_t dropped;
+      };
+
+      // The queue must outlive the phone's worker thread.
+      explicit dtmf_queue_t(phone_t &phone, const options_t &options = options_t());
+
+      // Queue the tones and return at once.  Throws std::invalid_argument,
+      // queuing nothing, if there is anything else in the string.
+      void push(const std::string &tones);
+
+      // Drop whatever hasn't been sent yet, as when the call ends.
+      void clear();
+
+      // Wait up to 'timeout_ms' for the queue to empty; return true iff. it
+      // did.
+      bool wait_idle(int timeout_ms);
+
+      // Use these options from the next command on.
+      void set_options(const options_t &options);
+
+      // The number of tones and pauses waiting.
+      size_t get_pending();
+
+      stats_t get_stats();
+
+      // Build the command lines for a run of tones, with "+VTD=<n>" in
+      // front of the first if 'duration' isn't empty.  Each line comes with
+      // the number of tones it plays.
+      static std::vector<std::pair<std::string, size_t>> pack(
+          const std::string &tones, const std::string &duration, const options_t &options);
+
+    private:
+      struct item_t {
+        char tone;
+        std::chrono::steady_clock::time_point queued;
+      };
+
+      // Send what is at the front of the queue; runs as deferred work.
+      void drain();
+
+      phone_t &phone;
+      std::mutex mutex;
+      std::condition_variable idle_cv;
+      options_t options;
+      std::deque<item_t> items;
+
+      // True while a drain() is scheduled or running.
+      bool draining;
+
+      // True once the modem has been told the tone duration.
+      bool duration_sent;
+
+      stats_t stats;
+  };
+}
@@ -0,0 +1,102 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/event-filter.h>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+  // True iff. the pattern is turned away as malformed.
+  bool rejects(const std::string &pattern) {
+    try {
+      phone::pattern_t compiled(pattern);
+    } catch (const std::invalid_argument &) {
+      return true;
+    }
+    return false;
+  }
+}
+
+FIXTURE(pattern_matches) {
+  phone::pattern_t digits("^\\+?[0-9]+$");
+  EXPECT_TRUE(digits.matches("+15551234"));
+  EXPECT_TRUE(digits.matches("911"));
+  EXPECT_FALSE(digits.matches("+1-555"));
+  EXPECT_FALSE(digits.matches(""));
+  phone::pattern_t anywhere("urg.nt");
+  EXPECT_TRUE(anywhere.matches("this is URGENT, no, urgent"));
+  EXPECT_FALSE(anywhere.matches("URGENT"));
+  phone::pattern_t greedy("^a*ab?c$");
+  EXPECT_TRUE(greedy.matches("aaac"));
+  EXPECT_TRUE(greedy.matches("abc"));
+  EXPECT_FALSE(greedy.matches("bc"));
+  phone::pattern_t not_comma("^[^,]+,[]x]$");
+  EXPECT_TRUE(not_comma.matches("SM,]"));
+  EXPECT_FALSE(not_comma.matches(",x"));
+  EXPECT_TRUE(phone::pattern_t("a\\$").matches("xa$"));
+  EXPECT_TRUE(rejects("*a"));
+  EXPECT_TRUE(rejects("[a-"));
+  EXPECT_TRUE(rejects("a\\"));
+  EXPECT_FALSE(rejects("[*]+"));
+}
+
+FIXTURE(pattern_never_backtracks) {
+  // Backtracking, this would try every way of sharing the a's out among
+  // the stars before giving up.
+  std::string many_stars;
+  for (int i = 0; i < 20; ++i) {
+    many_stars += "a*";
+  }
+  phone::pattern_t pattern(many_stars + "b");
+  std::string text(4096, 'a');
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(pattern.matches(text));
+  EXPECT_TRUE(pattern.matches(text + "b"));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  EXPECT_TRUE(phone::pattern_t("^a+b?a+$").matches("aa"));
+  EXPECT_FALSE(phone::pattern_t("^a+b?a+$").matches("a"));
+
+  // 'x+' counts as two atoms.
+  EXPECT_FALSE(rejects(std::string(phone::pattern_t::max_atoms, 'a')));
+  EXPECT_TRUE(rejects(std::string(phone::pattern_t::max_atoms + 1, 'a')));
+  EXPECT_TRUE(rejects(std::string(phone::pattern_t::max_atoms - 1, 'a') + "b+"));
+}
+
+FIXTURE(filter_set_matches_in_one_pass) {
+  std::vector<phone::filter_t> filters(6);
+  filters[0].equals("number", "+15551234");
+  filters[1].prefix("number", "+1555").in_set("state", { "ringing", "waiting" });
+  filters[2].not_in_set("number", { "+15551234", "+15559999" });
+  filters[3].matches("number", "^\\+44").equals("index", "3");
+  filters[4].prefix("number", "+1555");
+  std::vector<const phone::filter_t *> pointers;
+  for (const auto &filter: filters) {
+    pointers.push_back(&filter);
+  }
+  phone::filter_set_t set(pointers);
+  EXPECT_EQ(set.size(), 6u);
+  // The prefix shared by two filters is one condition.
+  EXPECT_EQ(set.get_condition_count(), 6u);
+
+  std::vector<uint32_t> passed;
+  set.match(json_t::object_t {
+    { "number", std::string { "+15551234" } }, { "state", std::string { "ringing" } }
+  }, passed);
+  EXPECT_TRUE(passed == std::vector<uint32_t>({ 0, 1, 4, 5 }));
+
+  set.match(json_t::object_t {
+    { "number", std::string { "+15550000" } }, { "state", std::string { "active" } }
+  }, passed);
+  EXPECT_TRUE(passed == std::vector<uint32_t>({ 2, 4, 5 }));
+
+  // Numbers compare as their text; a missing field passes only not_in_set.
+  set.match(json_t::object_t {{ "number", std::string { "+447700900" } }, { "index", 3 }}, passed);
+  EXPECT_TRUE(passed == std::vector<uint32_t>({ 2, 3, 5 }));
+  set.match(json_t::object_t {}, passed);
+  EXPECT_TRUE(passed == std::vector<uint32_t>({ 2, 5 }));
+
+  phone::filter_set_t none;
+  none.match(json_t::object_t {}, passed);
+  EXPECT_TRUE(passed.empty());
+}
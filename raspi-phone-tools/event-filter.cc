@@ -0,0 +1,327 @@
+#include <raspi-phone-tools/event-filter.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+namespace phone {
+  namespace {
+    // A count no filter reaches, marking one which can't pass.
+    const uint32_t vetoed = static_cast<uint32_t>(-1);
+
+    // The value as text to compare, per filter_t; false if it has none.
+    bool to_text(const json_t &value, std::string &scratch, const std::string *&text) {
+      if (auto *string = value.try_as<json_t::string_t>()) {
+        text = string;
+        return true;
+      }
+      if (auto *number = value.try_as<json_t::number_t>()) {
+        char buf[32];
+        if (std::floor(*number) == *number && std::fabs(*number) < 1e15) {
+          std::snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(*number));
+        } else {
+          std::snprintf(buf, sizeof(buf), "%.17g", *number);
+        }
+        scratch = buf;
+        text = &scratch;
+        return true;
+      }
+      if (auto *boolean = value.try_as<json_t::boolean_t>()) {
+        scratch = *boolean ? "true" : "false";
+        text = &scratch;
+        return true;
+      }
+      return false;
+    }
+  }
+
+  constexpr size_t pattern_t::max_atoms;
+
+  pattern_t::pattern_t(const std::string &pattern)
+      : anchored_start(false),
+        anchored_end(false) {
+    size_t i = 0, end = pattern.size();
+    if (i < end && pattern[i] == '^') {
+      anchored_start = true;
+      ++i;
+    }
+    if (end > i && pattern[end - 1] == '$' && (end - 1 == i || pattern[end - 2] != '\\')) {
+      anchored_end = true;
+      --end;
+    }
+    while (i < end) {
+      atom_t atom;
+      atom.skippable = false;
+      atom.many = false;
+      auto c = static_cast<unsigned char>(pattern[i++]);
+      if (c == '.') {
+        atom.chars.set();
+      } else if (c == '\\') {
+        if (i >= end) {
+          throw std::invalid_argument("pattern ends in an escape");
+        }
+        atom.chars.set(static_cast<unsigned char>(pattern[i++]));
+      } else if (c == '[') {
+        bool negate = i < end && pattern[i] == '^';
+        if (negate) {
+          ++i;
+        }
+        // A ']' first is a member, not the end.
+        for (bool first = true; i < end && (first || pattern[i] != ']'); first = false) {
+          auto lo = static_cast<unsigned char>(pattern[i++]);
+          if (lo == '\\' && i < end) {
+            lo = static_cast<unsigned char>(pattern[i++]);
+          }
+          auto hi = lo;
+          if (i + 1 < end && pattern[i] == '-' && pattern[i + 1] != ']') {
+            hi = static_cast<unsigned char>(pattern[i + 1]);
+            i += 2;
+            if (hi < lo) {
+              throw std::invalid_argument("backwards range in pattern: " + pattern);
+            }
+          }
+          for (unsigned member = lo; member <= hi; ++member) {
+            atom.chars.set(member);
+          }
+        }
+        if (i >= end) {
+          throw std::invalid_argument("unclosed class in pattern: " + pattern);
+        }
+        ++i;
+        if (negate) {
+          atom.chars.flip();
+        }
+      } else if (c == '*' || c == '+' || c == '?') {
+        throw std::invalid_argument("nothing to repeat in pattern: " + pattern);
+      } else {
+        atom.chars.set(c);
+      }
+      if (i < end && (pattern[i] == '*' || pattern[i] == '+' || pattern[i] == '?')) {
+        // 'x+' is 'x' then 'x*'.
+        if (pattern[i] == '+') {
+          atoms.push_back(atom);
+        }
+        atom.skippable = true;
+        atom.many = pattern[i] != '?';
+        ++i;
+      }
+      atoms.push_back(atom);
+    }
+    if (atoms.size() > max_atoms) {
+      throw std::invalid_argument("pattern too long: " + pattern);
+    }
+  }
+
+  pattern_t::places_t pattern_t::skip_ahead(places_t places) const {
+    // Skipping only ever goes forward, so one pass does.
+    for (size_t at = 0; at < atoms.size(); ++at) {
+      if ((places >> at & 1) && atoms[at].skippable) {
+        places |= places_t(1) << (at + 1);
+      }
+    }
+    return places;
+  }
+
+  bool pattern_t::matches(const std::string &text) const {
+    const places_t start = skip_ahead(1), done = places_t(1) << atoms.size();
+    auto places = start;
+    for (size_t pos = 0; ; ++pos) {
+      if ((places & done) && (!anchored_end || pos == text.size())) {
+        return true;
+      }
+      if (pos == text.size() || (!places && anchored_start)) {
+        return false;
+      }
+      auto c = static_cast<unsigned char>(text[pos]);
+      places_t next = 0;
+      for (size_t at = 0; at < atoms.size(); ++at) {
+        if ((places >> at & 1) && atoms[at].chars[c]) {
+          next |= places_t(1) << (atoms[at].many ? at : at + 1);
+        }
+      }
+      places = skip_ahead(next);
+      if (!anchored_start) {
+        // Unanchored, a match may start at any character.
+        places |= start;
+      }
+    }
+  }
+
+  filter_t &filter_t::equals(const std::string &field, const std::string &value) {
+    conditions.push_back(condition_t { field, op_t::equals, { value } });
+    return *this;
+  }
+
+  filter_t &filter_t::prefix(const std::string &field, const std::string &value) {
+    conditions.push_back(condition_t { field, op_t::prefix, { value } });
+    return *this;
+  }
+
+  filter_t &filter_t::in_set(const std::string &field, const std::vector<std::string> &values) {
+    conditions.push_back(condition_t { field, op_t::in_set, values });
+    return *this;
+  }
+
+  filter_t &filter_t::not_in_set(const std::string &field, const std::vector<std::string> &values) {
+    conditions.push_back(condition_t { field, op_t::not_in_set, values });
+    return *this;
+  }
+
+  filter_t &filter_t::matches(const std::string &field, const std::string &pattern) {
+    // Compiled here too, so a bad pattern is caught where it's written.
+    pattern_t check(pattern);
+    conditions.push_back(condition_t { field, op_t::matches, { pattern } });
+    return *this;
+  }
+
+  filter_set_t::filter_set_t()
+      : filter_count(0) {}
+
+  filter_set_t::filter_set_t(const std::vector<const filter_t *> &filters)
+      : filter_count(filters.size()),
+        required(filters.size(), 0) {
+    std::map<std::string, uint32_t> known;
+    std::map<std::string, size_t> field_indexes;
+    for (size_t filter = 0; filter < filters.size(); ++filter) {
+      for (const auto &condition: filters[filter]->get_conditions()) {
+        // Conditions which are the same are the same condition.
+        std::string key(1, static_cast<char>('0' + static_cast<int>(condition.op)));
+        key += condition.field;
+        for (const auto &value: condition.values) {
+          key += '\0';
+          key += value;
+        }
+        bool negative = condition.op == filter_t::op_t::not_in_set;
+        auto found = known.find(key);
+        if (found != known.end()) {
+          // Said twice in one filter, it's still only one condition.
+          auto &shared = owners[found->second];
+          if (shared.back() != filter) {
+            shared.push_back(static_cast<uint32_t>(filter));
+            required[filter] += negative ? 0 : 1;
+          }
+          continue;
+        }
+        auto id = static_cast<uint32_t>(negated.size());
+        known[key] = id;
+        negated.push_back(negative);
+        owners.push_back(std::vector<uint32_t> { static_cast<uint32_t>(filter) });
+        required[filter] += negative ? 0 : 1;
+
+        auto index = field_indexes.find(condition.field);
+        if (index == field_indexes.end()) {
+          index = field_indexes.emplace(condition.field, fields.size()).first;
+          fields.push_back(field_t {});
+          fields.back().name = condition.field;
+        }
+        auto &field = fields[index->second];
+        switch (condition.op) {
+          case filter_t::op_t::equals:
+          case filter_t::op_t::in_set:
+          case filter_t::op_t::not_in_set:
+            for (const auto &value: condition.values) {
+              auto &ids = field.values[value];
+              if (ids.empty() || ids.back() != id) {
+                ids.push_back(id);
+              }
+            }
+            break;
+          case filter_t::op_t::prefix: {
+            if (field.trie.empty()) {
+              field.trie.push_back(trie_node_t {});
+            }
+            uint32_t node = 0;
+            for (char c: condition.values[0]) {
+              auto next = field.trie[node].next.find(c);
+              if (next == field.trie[node].next.end()) {
+                auto child = static_cast<uint32_t>(field.trie.size());
+                field.trie[node].next[c] = child;
+                field.trie.push_back(trie_node_t {});
+                node = child;
+              } else {
+                node = next->second;
+              }
+            }
+            field.trie[node].conditions.push_back(id);
+            break;
+          }
+          case filter_t::op_t::matches:
+            field.patterns.emplace_back(pattern_t(condition.values[0]), id);
+            break;
+        }
+      }
+    }
+    for (size_t filter = 0; filter < filters.size(); ++filter) {
+      if (required[filter] == 0) {
+        unconditional.push_back(static_cast<uint32_t>(filter));
+      }
+    }
+  }
+
+  void filter_set_t::match(const json_t::object_t &event, std::vector<uint32_t> &passed) const {
+    passed = unconditional;
+    std::vector<uint32_t> hits(filter_count, 0);
+    std::vector<uint32_t> vetoes;
+    // Each condition fires at most once: it belongs to one field, and is
+    // filed once under each of its values.
+    auto fire = [this, &passed, &hits, &vetoes](uint32_t id) {
+      if (negated[id]) {
+        vetoes.push_back(id);
+        return;
+      }
+      for (auto filter: owners[id]) {
+        if (++hits[filter] == required[filter]) {
+          passed.push_back(filter);
+        }
+      }
+    };
+    std::string scratch;
+    for (const auto &field: fields) {
+      auto found = event.find(field.name);
+      const std::string *text = nullptr;
+      if (found == event.end() || !to_text(found->second, scratch, text)) {
+        continue;
+      }
+      auto value = field.values.find(*text);
+      if (value != field.values.end()) {
+        for (auto id: value->second) {
+          fire(id);
+        }
+      }
+      if (!field.trie.empty()) {
+        uint32_t node = 0;
+        for (size_t i = 0; ; ++i) {
+          for (auto id: field.trie[node].conditions) {
+            fire(id);
+          }
+          if (i == text->size()) {
+            break;
+          }
+          auto next = field.trie[node].next.find((*text)[i]);
+          if (next == field.trie[node].next.end()) {
+            break;
+          }
+          node = next->second;
+        }
+      }
+      for (const auto &pattern: field.patterns) {
+        if (pattern.first.matches(*text)) {
+          fire(pattern.second);
+        }
+      }
+    }
+    if (!vetoes.empty()) {
+      // Reuse the counts to mark the vetoed.
+      for (auto id: vetoes) {
+        for (auto filter: owners[id]) {
+          hits[filter] = vetoed;
+        }
+      }
+      passed.erase(std::remove_if(passed.begin(), passed.end(), [&hits](uint32_t filter) {
+        return hits[filter] == vetoed;
+      }), passed.end());
+    }
+    std::sort(passed.begin(), passed.end());
+  }
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <json/json.h>
+
+namespace phone {
+  // A pattern in a small subset of regular expressions: literal characters,
+  // '.', classes such as [0-9] and [^,], the quantifiers '*', '+' and '?',
+  // '\' to escape, and the anchors '^' and '$'.  No groups or alternation.
+  // Matching goes through the text once, keeping every place in the
+  // pattern it could have got to, so it takes time in proportion to the
+  // text and the pattern, however many quantifiers there are.  Unanchored,
+  // it matches anywhere.
+  class pattern_t final {
+    public:
+      // The most atoms (characters, classes or '.', with any quantifier) a
+      // pattern may have; 'x+' counts as two.
+      static constexpr size_t max_atoms = 63;
+
+      // Throws std::invalid_argument if the pattern is malformed or too
+      // long.
+      explicit pattern_t(const std::string &pattern);
+
+      bool matches(const std::string &text) const;
+
+    private:
+      struct atom_t {
+        // The characters the atom matches.
+        std::bitset<256> chars;
+
+        // True iff. it may match nothing, and may match more than once.
+        bool skippable;
+        bool many;
+      };
+
+      // A set of places in the pattern, by the index of the atom to match
+      // next; the bit past the last atom means all have matched.
+      using places_t = uint64_t;
+
+      // The places, and those reached from them by skipping atoms.
+      places_t skip_ahead(places_t places) const;
+
+      std::vector<atom_t> atoms;
+      bool anchored_start;
+      bool anchored_end;
+  };
+
+  // Which events a listener wants, as conditions on fields of the event's
+  // JSON, all of which must hold.  A field is compared as text: strings as
+  // they are, whole numbers without a decimal point, and booleans as "true"
+  // or "false".  A missing field satisfies only not_in_set().  No
+  // conditions at all means every event.
+  //
+  //   filter_t().prefix("number", "+1555").in_set("state", { "ringing", "waiting" })
+  class filter_t final {
+    public:
+      enum class op_t {
+        equals,
+        prefix,
+        in_set,
+        not_in_set,
+        matches
+      };
+
+      struct condition_t {
+        std::string field;
+        op_t op;
+        std::vector<std::string> values;
+      };
+
+      filter_t &equals(const std::string &field, const std::string &value);
+      filter_t &prefix(const std::string &field, const std::string &value);
+      filter_t &in_set(const std::string &field, const std::vector<std::string> &values);
+      filter_t &not_in_set(const std::string &field, const std::vector<std::string> &values);
+
+      // Throws std::invalid_argument if the pattern is malformed.
+      filter_t &matches(const std::string &field, const std::string &pattern);
+
+      bool empty() const { return conditions.empty(); }
+      const std::vector<condition_t> &get_conditions() const { return conditions; }
+
+    private:
+      std::vector<condition_t> conditions;
+  };
+
+  // Any number of filters compiled together, so an event is checked
+  // against all of them in one pass over the fields they look at, rather
+  // than one filter at a time.  Conditions shared between filters are
+  // checked once.  Per field, exact values are found with one hash lookup,
+  // prefixes with one walk down a trie, and only patterns are tried one by
+  // one.  Each condition which holds counts towards the filters it's part
+  // of, and a filter passes once all of its have, so conditions which don't
+  // hold cost nothing.  Immutable once built, so it may be shared between
+  // threads.
+  class filter_set_t final {
+    public:
+      // No filters.
+      filter_set_t();
+
+      // The filters are numbered by their place in the vector.
+      explicit filter_set_t(const std::vector<const filter_t *> &filters);
+
+      // Set 'passed' to the numbers of the filters the event passes, in
+      // order.
+      void match(const json_t::object_t &event, std::vector<uint32_t> &passed) const;
+
+      size_t size() const { return filter_count; }
+
+      // The number of distinct conditions, after sharing.
+      size_t get_condition_count() const { return negated.size(); }
+
+    private:
+      struct trie_node_t {
+        std::map<char, uint32_t> next;
+
+        // Conditions whose prefix ends here.
+        std::vector<uint32_t> conditions;
+      };
+
+      // The tests for one field.
+      struct field_t {
+        std::string name;
+        std::unordered_map<std::string, std::vector<uint32_t>> values;
+        std::vector<trie_node_t> trie;
+        std::vector<std::pair<pattern_t, uint32_t>> patterns;
+      };
+
+      size_t filter_count;
+      std::vector<field_t> fields;
+
+      // By condition: true iff. it holds when its test doesn't fire, as
+      // for not_in_set(); and the filters it belongs to.
+      std::vector<bool> negated;
+      std::vector<std::vector<uint32_t>> owners;
+
+      // By filter, how many of its conditions must fire; and the filters
+      // for which that's none, which pass unless a not_in_set() fires.
+      std::vector<uint32_t> required;
+      std::vector<uint32_t> unconditional;
+  };
+}
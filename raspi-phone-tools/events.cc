@@ -0,0 +1,168 @@
+#include <raspi-phone-tools/events.h>
+
+namespace phone {
+  namespace {
+    // The field as a string, or empty if it's missing or isn't one.
+    std::string get_string(const json_t::object_t &data, const char *key) {
+      auto found = data.find(key);
+      if (found == data.end()) {
+        return std::string {};
+      }
+      auto *value = found->second.try_as<json_t::string_t>();
+      return value ? *value : std::string {};
+    }
+
+    // The field as a number, or 'otherwise' if it's missing or isn't one.
+    double get_number(const json_t::object_t &data, const char *key, double otherwise = 0) {
+      auto found = data.find(key);
+      if (found == data.end()) {
+        return otherwise;
+      }
+      auto *value = found->second.try_as<json_t::number_t>();
+      return value ? *value : otherwise;
+    }
+
+    bool get_bool(const json_t::object_t &data, const char *key) {
+      auto found = data.find(key);
+      if (found == data.end()) {
+        return false;
+      }
+      auto *value = found->second.try_as<json_t::boolean_t>();
+      return value && *value;
+    }
+  }
+
+  json_t::object_t line_received_t::to_json() const {
+    return json_t::object_t {{ "line", line.str() }};
+  }
+
+  line_received_t line_received_t::from_json(const json_t::object_t &data) {
+    line_received_t event;
+    event.line = get_string(data, "line");
+    return event;
+  }
+
+  json_t::object_t phone_error_t::to_json() const {
+    return json_t::object_t {{ "what", what.str() }};
+  }
+
+  phone_error_t phone_error_t::from_json(const json_t::object_t &data) {
+    phone_error_t event;
+    event.what = get_string(data, "what");
+    return event;
+  }
+
+  json_t::object_t sms_received_t::to_json() const {
+    return json_t::object_t {
+      { "storage", storage.str() },
+      { "index", index }
+    };
+  }
+
+  sms_received_t sms_received_t::from_json(const json_t::object_t &data) {
+    sms_received_t event;
+    event.storage = get_string(data, "storage");
+    event.index = static_cast<int>(get_number(data, "index", -1));
+    return event;
+  }
+
+  json_t::object_t call_changed_t::to_json() const {
+    return json_t::object_t {
+      { "id", id },
+      { "state", state.str() },
+      { "direction", direction.str() },
+      { "number", number.str() },
+      { "type", type },
+      { "started", static_cast<double>(started) },
+      { "answered", static_cast<double>(answered) },
+      { "ended", static_cast<double>(ended) },
+      { "duration_ms", static_cast<double>(duration_ms) }
+    };
+  }
+
+  call_changed_t call_changed_t::from_json(const json_t::object_t &data) {
+    call_changed_t event;
+    event.id = static_cast<int>(get_number(data, "id"));
+    event.state = get_string(data, "state");
+    event.direction = get_string(data, "direction");
+    event.number = get_string(data, "number");
+    event.type = static_cast<int>(get_number(data, "type", 129));
+    event.started = static_cast<int64_t>(get_number(data, "started"));
+    event.answered = static_cast<int64_t>(get_number(data, "answered"));
+    event.ended = static_cast<int64_t>(get_number(data, "ended"));
+    event.duration_ms = static_cast<int64_t>(get_number(data, "duration_ms"));
+    return event;
+  }
+
+  json_t::object_t missed_call_t::to_json() const {
+    return json_t::object_t {
+      { "number", number.str() },
+      { "type", type },
+      { "rings", rings },
+      { "started", static_cast<double>(started) },
+      { "ended", static_cast<double>(ended) }
+    };
+  }
+
+  missed_call_t missed_call_t::from_json(const json_t::object_t &data) {
+    missed_call_t event;
+    event.number = get_string(data, "number");
+    event.type = static_cast<int>(get_number(data, "type", 129));
+    event.rings = static_cast<int>(get_number(data, "rings"));
+    event.started = static_cast<int64_t>(get_number(data, "started"));
+    event.ended = static_cast<int64_t>(get_number(data, "ended"));
+    return event;
+  }
+
+  json_t::object_t delivery_t::to_json() const {
+    return json_t::object_t {
+      { "number", number.str() },
+      { "mr", mr },
+      { "status", status },
+      { "delivered", delivered },
+      { "latency_ms", static_cast<double>(latency_ms) }
+    };
+  }
+
+  delivery_t delivery_t::from_json(const json_t::object_t &data) {
+    delivery_t event;
+    event.number = get_string(data, "number");
+    event.mr = static_cast<int>(get_number(data, "mr", -1));
+    event.status = static_cast<int>(get_number(data, "status", -1));
+    event.delivered = get_bool(data, "delivered");
+    event.latency_ms = static_cast<int64_t>(get_number(data, "latency_ms"));
+    return event;
+  }
+
+  json_t::object_t registration_changed_t::to_json() const {
+    return json_t::object_t {
+      { "registration", registration },
+      { "lac", lac },
+      { "cell_id", cell_id },
+      { "act", act }
+    };
+  }
+
+  registration_changed_t registration_changed_t::from_json(const json_t::object_t &data) {
+    registration_changed_t event;
+    event.registration = static_cast<int>(get_number(data, "registration", -1));
+    event.lac = static_cast<int>(get_number(data, "lac", -1));
+    event.cell_id = static_cast<int>(get_number(data, "cell_id", -1));
+    event.act = static_cast<int>(get_number(data, "act", -1));
+    return event;
+  }
+
+  json_t::object_t signal_changed_t::to_json() const {
+    return json_t::object_t {
+      { "rssi", rssi },
+      { "ber", ber }
+    };
+  }
+
+  signal_changed_t signal_changed_t::from_json(const json_t::object_t &data) {
+    signal_changed_t event;
+    event.rssi = static_cast<int>(get_number(data, "rssi", 99));
+    event.ber = static_cast<int>(get_number(data, "ber", 99));
+    return event;
+  }
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <json/json.h>
+
+namespace phone {
+  // A string of up to 'capacity' bytes, kept inline, so an event holding
+  // some can be built, copied and queued for a listener without touching
+  // the heap.  Longer strings are cut short, and say so.
+  template <size_t capacity>
+  class inline_string_t final {
+    public:
+      static constexpr size_t max_size = capacity;
+
+      inline_string_t() noexcept
+          : length(0),
+            cut(false) {
+        text[0] = '\0';
+      }
+
+      inline_string_t(const std::string &that) noexcept {
+        assign(that.data(), that.size());
+      }
+
+      inline_string_t(const char *that) noexcept {
+        assign(that, std::strlen(that));
+      }
+
+      inline_string_t &operator=(const std::string &that) noexcept {
+        assign(that.data(), that.size());
+        return *this;
+      }
+
+      inline_string_t &operator=(const char *that) noexcept {
+        assign(that, std::strlen(that));
+        return *this;
+      }
+
+      // Copy in the bytes, as many as fit, and return true iff. they all
+      // did.
+      bool assign(const char *data, size_t size) noexcept {
+        cut = size > capacity;
+        length = cut ? capacity : size;
+        std::memcpy(text, data, length);
+        text[length] = '\0';
+        return !cut;
+      }
+
+      const char *c_str() const noexcept { return text; }
+      size_t size() const noexcept { return length; }
+      bool empty() const noexcept { return length == 0; }
+
+      // True iff. the string was cut short to fit.
+      bool truncated() const noexcept { return cut; }
+
+      std::string str() const { return std::string(text, length); }
+
+      bool operator==(const char *that) const noexcept {
+        return std::strlen(that) == length && std::memcmp(text, that, length) == 0;
+      }
+
+      bool operator!=(const char *that) const noexcept {
+        return !(*this == that);
+      }
+
+    private:
+      char text[capacity + 1];
+      size_t length;
+      bool cut;
+  };
+
+  template <size_t capacity>
+  constexpr size_t inline_string_t<capacity>::max_size;
+
+  // The events phone_t emits, as plain structs.  Each is what a typed
+  // listener gets, and to_json() gives the payload a JSON listener gets,
+  // built only if there is one.  from_json() goes the other way, for events
+  // emitted as JSON to typed listeners.  Times are milliseconds since the
+  // epoch, 0 if they haven't happened.
+
+  // A line the modem sent on its own (reply).
+  struct line_received_t {
+    inline_string_t<512> line;
+
+    json_t::object_t to_json() const;
+    static line_received_t from_json(const json_t::object_t &data);
+  };
+
+  // Something went wrong (error).
+  struct phone_error_t {
+    inline_string_t<256> what;
+
+    json_t::object_t to_json() const;
+    static phone_error_t from_json(const json_t::object_t &data);
+  };
+
+  // A new message was stored, from +CMTI (sms).
+  struct sms_received_t {
+    inline_string_t<8> storage;
+    int index;
+
+    json_t::object_t to_json() const;
+    static sms_received_t from_json(const json_t::object_t &data);
+  };
+
+  // A voice call changed state (call).  An incoming call is one whose
+  // direction is "incoming" and whose state is "ringing" or "waiting".
+  struct call_changed_t {
+    int id;
+    inline_string_t<16> state;
+    inline_string_t<16> direction;
+    inline_string_t<32> number;
+    int type;
+    int64_t started;
+    int64_t answered;
+    int64_t ended;
+    int64_t duration_ms;
+
+    json_t::object_t to_json() const;
+    static call_changed_t from_json(const json_t::object_t &data);
+  };
+
+  // An incoming call ended without being answered (missedcall).
+  struct missed_call_t {
+    inline_string_t<32> number;
+    int type;
+    int rings;
+    int64_t started;
+    int64_t ended;
+
+    json_t::object_t to_json() const;
+    static missed_call_t from_json(const json_t::object_t &data);
+  };
+
+  // The network reported on a message we sent (delivery).
+  struct delivery_t {
+    inline_string_t<32> number;
+    int mr;
+    int status;
+    bool delivered;
+    int64_t latency_ms;
+
+    json_t::object_t to_json() const;
+    static delivery_t from_json(const json_t::object_t &data);
+  };
+
+  // The registration or serving cell changed, per +CREG (registration).
+  struct registration_changed_t {
+    int registration;
+    int lac;
+    int cell_id;
+    int act;
+
+    json_t::object_t to_json() const;
+    static registration_changed_t from_json(const json_t::object_t &data);
+  };
+
+  // The signal quality changed, per +CSQ (signal).  99 means not known.
+  struct signal_changed_t {
+    int rssi;
+    int ber;
+
+    json_t::object_t to_json() const;
+    static signal_changed_t from_json(const json_t::object_t &data);
+  };
+
+  // Which event each struct is emitted as; specialized in phone.h.
+  template <typename event_struct_t>
+  struct event_traits_t;
+}
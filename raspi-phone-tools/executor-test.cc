@@ -0,0 +1,183 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/executor.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+FIXTURE(executor_keeps_lane_order) {
+  phone::executor_t executor(4);
+  std::vector<phone::executor_t::lane_ptr_t> lanes;
+  std::vector<std::vector<int>> seen(8);
+  for (size_t i = 0; i < seen.size(); ++i) {
+    lanes.push_back(executor.make_lane());
+  }
+  for (int n = 0; n < 200; ++n) {
+    for (size_t i = 0; i < lanes.size(); ++i) {
+      EXPECT_TRUE(executor.post(lanes[i], [&seen, i, n]() { seen[i].push_back(n); }));
+    }
+  }
+  executor.drain();
+  for (size_t i = 0; i < seen.size(); ++i) {
+    EXPECT_EQ(seen[i].size(), 200u);
+    bool ordered = true;
+    for (size_t n = 0; n < seen[i].size(); ++n) {
+      ordered = ordered && seen[i][n] == static_cast<int>(n);
+    }
+    EXPECT_TRUE(ordered);
+  }
+  auto stats = executor.get_stats(lanes[0]);
+  EXPECT_EQ(stats.runs, 200u);
+  EXPECT_EQ(stats.depth, 0u);
+  EXPECT_EQ(stats.dropped, 0u);
+}
+
+FIXTURE(executor_counts_whatever_is_thrown) {
+  phone::executor_t executor(1);
+  auto lane = executor.make_lane();
+  executor.post(lane, []() { throw std::runtime_error("listener"); });
+  executor.post(lane, []() { throw 42; });
+  executor.post(lane, []() {});
+  executor.drain();
+  auto stats = executor.get_stats(lane);
+  EXPECT_EQ(stats.runs, 3u);
+  EXPECT_EQ(stats.failures, 2u);
+}
+
+FIXTURE(executor_overflow) {
+  phone::executor_t executor(2);
+  std::mutex gate;
+  std::unique_lock<std::mutex> held(gate);
+  std::atomic<bool> entered { false };
+  auto stall = [&gate, &entered]() {
+    entered = true;
+    std::lock_guard<std::mutex> lock(gate);
+  };
+  std::vector<int> seen[2];
+
+  // Each lane runs 'stall' while three more posts arrive for two places.
+  phone::executor_t::lane_options_t options;
+  options.capacity = 2;
+  options.overflow = phone::executor_t::overflow_t::drop;
+  auto dropping = executor.make_lane(options);
+  options.overflow = phone::executor_t::overflow_t::coalesce;
+  auto coalescing = executor.make_lane(options);
+
+  phone::executor_t::lane_ptr_t lanes[2] = { dropping, coalescing };
+  for (size_t i = 0; i < 2; ++i) {
+    entered = false;
+    executor.post(lanes[i], stall);
+    while (!entered) {
+      std::this_thread::yield();
+    }
+    for (int n = 1; n <= 3; ++n) {
+      executor.post(lanes[i], [&seen, i, n]() { seen[i].push_back(n); });
+    }
+  }
+  held.unlock();
+  executor.drain();
+  EXPECT_EQ(seen[0].size(), 2u);
+  EXPECT_EQ(seen[0][0], 1);
+  EXPECT_EQ(seen[0][1], 2);
+  EXPECT_EQ(seen[1].size(), 2u);
+  EXPECT_EQ(seen[1][0], 1);
+  EXPECT_EQ(seen[1][1], 3);
+  EXPECT_EQ(executor.get_stats(dropping).dropped, 1u);
+  EXPECT_EQ(executor.get_stats(coalescing).coalesced, 1u);
+  EXPECT_EQ(executor.get_stats(coalescing).max_depth, 2u);
+
+  // A blocking lane holds the poster until there's room.
+  options.capacity = 1;
+  options.overflow = phone::executor_t::overflow_t::block;
+  auto blocking = executor.make_lane(options);
+  std::atomic<int> ran { 0 };
+  for (int n = 0; n < 20; ++n) {
+    EXPECT_TRUE(executor.post(blocking, [&ran]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ++ran;
+    }));
+  }
+  executor.drain();
+  EXPECT_EQ(ran.load(), 20);
+  EXPECT_GT(executor.get_stats(blocking).blocked, 0u);
+}
+
+FIXTURE(executor_close_drops_waiting_work) {
+  phone::executor_t executor(1);
+  std::mutex gate;
+  std::unique_lock<std::mutex> held(gate);
+  std::atomic<bool> entered { false };
+  std::atomic<int> ran { 0 };
+  auto lane = executor.make_lane();
+  executor.post(lane, [&gate, &entered]() {
+    entered = true;
+    std::lock_guard<std::mutex> lock(gate);
+  });
+  while (!entered) {
+    std::this_thread::yield();
+  }
+  executor.post(lane, [&ran]() { ++ran; });
+  std::thread closer([&executor, &lane]() { executor.close(lane); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  held.unlock();
+  closer.join();
+  EXPECT_FALSE(executor.post(lane, [&ran]() { ++ran; }));
+  executor.drain();
+  EXPECT_EQ(ran.load(), 0);
+  EXPECT_EQ(executor.get_stats(lane).dropped, 1u);
+  EXPECT_EQ(executor.get_stats(lane).runs, 1u);
+}
+
+FIXTURE(executor_rate_limit) {
+  phone::executor_t executor(2);
+  phone::executor_t::lane_options_t options;
+  options.max_per_s = 50;
+  options.burst = 2;
+  auto limited = executor.make_lane(options);
+  auto free = executor.make_lane();
+  std::atomic<int> limited_ran { 0 }, free_ran { 0 };
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < 6; ++n) {
+    executor.post(limited, [&limited_ran]() { ++limited_ran; });
+    executor.post(free, [&free_ran]() { ++free_ran; });
+  }
+  // Two go at once, then one each 20ms; the other lane doesn't wait.
+  while (free_ran < 6) {
+    std::this_thread::yield();
+  }
+  EXPECT_LT(limited_ran.load(), 6);
+  executor.drain();
+  EXPECT_EQ(limited_ran.load(), 6);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(75));
+  EXPECT_GT(executor.get_stats(limited).deferred, 0u);
+  EXPECT_EQ(executor.get_stats(free).deferred, 0u);
+}
+
+FIXTURE(executor_rate_limit_beside_a_slow_lane) {
+  // A slow lane doesn't hold up a limited lane's next turn while there's a
+  // thread free to take it.
+  phone::executor_t executor(2);
+  phone::executor_t::lane_options_t options;
+  options.max_per_s = 20;
+  options.burst = 1;
+  auto limited = executor.make_lane(options);
+  auto slow = executor.make_lane();
+  std::atomic<int> limited_ran { 0 };
+  executor.post(limited, [&limited_ran]() { ++limited_ran; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  // The next is put off about 40ms, and the slow job comes in meanwhile.
+  auto start = std::chrono::steady_clock::now();
+  executor.post(limited, [&limited_ran]() { ++limited_ran; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  executor.post(slow, []() { std::this_thread::sleep_for(std::chrono::milliseconds(400)); });
+  while (limited_ran < 2 && std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(limited_ran.load(), 2);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(300));
+  EXPECT_EQ(executor.get_stats(limited).deferred, 1u);
+  executor.drain();
+}
@@ -0,0 +1,238 @@
+#include <raspi-phone-tools/executor.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+
+namespace phone {
+  // The executor whose thread this is, if any.
+  static thread_local const executor_t *current_executor = nullptr;
+
+  struct executor_t::lane_t {
+    explicit lane_t(const lane_options_t &options)
+        : options(options),
+          queued(false),
+          running(false),
+          waiting(false),
+          closed(false),
+          tokens(static_cast<double>(std::max<size_t>(1, options.burst))),
+          refilled(std::chrono::steady_clock::now()),
+          stats(lane_stats_t { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }) {
+      this->options.capacity = std::max<size_t>(1, options.capacity);
+      this->options.burst = std::max<size_t>(1, options.burst);
+    }
+
+    lane_options_t options;
+    fifo_t<job_t> jobs;
+
+    // True while the lane is in the ready queue, while one of the threads
+    // is running its work, and while it's waiting for its rate limit,
+    // respectively.  Never more than one, so the lane's work runs one item
+    // at a time.
+    bool queued;
+    bool running;
+    bool waiting;
+
+    bool closed;
+
+    // The rate limit's bucket: how many runs the lane may make now, and
+    // when that was worked out.
+    double tokens;
+    std::chrono::steady_clock::time_point refilled;
+
+    lane_stats_t stats;
+  };
+
+  constexpr size_t executor_t::job_t::inline_bytes;
+
+  executor_t::lane_options_t::lane_options_t()
+      : capacity(256),
+        overflow(overflow_t::block),
+        max_per_s(0),
+        burst(1) {}
+
+  executor_t::executor_t(size_t threads)
+      : busy(0),
+        stopping(false) {
+    for (size_t i = 0; i < std::max<size_t>(1, threads); ++i) {
+      this->threads.push_back(std::thread([this]() { work(); }));
+    }
+  }
+
+  executor_t::~executor_t() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      ready_cv.notify_all();
+      room_cv.notify_all();
+    }
+    for (auto &thread: threads) {
+      thread.join();
+    }
+  }
+
+  executor_t::lane_ptr_t executor_t::make_lane(const lane_options_t &options) {
+    return std::make_shared<lane_t>(options);
+  }
+
+  bool executor_t::post(const lane_ptr_t &lane, job_t work) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (lane->closed || stopping) {
+      return false;
+    }
+    if (lane->jobs.size() >= lane->options.capacity) {
+      switch (lane->options.overflow) {
+        case overflow_t::coalesce:
+          lane->jobs.back() = std::move(work);
+          ++lane->stats.coalesced;
+          return true;
+        case overflow_t::block:
+          if (!on_worker()) {
+            ++lane->stats.blocked;
+            room_cv.wait(lock, [this, &lane]() {
+              return lane->jobs.size() < lane->options.capacity || lane->closed || stopping;
+            });
+            if (lane->closed || stopping) {
+              return false;
+            }
+            break;
+          }
+          // fallthrough
+        case overflow_t::drop:
+          ++lane->stats.dropped;
+          return false;
+      }
+    }
+    lane->jobs.push_back(std::move(work));
+    lane->stats.max_depth = std::max(lane->stats.max_depth, lane->jobs.size());
+    if (!lane->queued && !lane->running && !lane->waiting) {
+      lane->queued = true;
+      ready.push_back(lane);
+      ready_cv.notify_one();
+    }
+    return true;
+  }
+
+  void executor_t::close(const lane_ptr_t &lane) {
+    std::unique_lock<std::mutex> lock(mutex);
+    lane->closed = true;
+    lane->stats.dropped += lane->jobs.size();
+    lane->jobs.clear();
+    room_cv.notify_all();
+    if (!on_worker()) {
+      idle_cv.wait(lock, [&lane]() { return !lane->running; });
+    }
+  }
+
+  void executor_t::drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_cv.wait(lock, [this]() { return ready.empty() && deferred.empty() && busy == 0; });
+  }
+
+  executor_t::lane_stats_t executor_t::get_stats(const lane_ptr_t &lane) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto stats = lane->stats;
+    stats.depth = lane->jobs.size();
+    return stats;
+  }
+
+  bool executor_t::on_worker() const {
+    return current_executor == this;
+  }
+
+  void executor_t::work() {
+    current_executor = this;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      // Whatever is waiting runs before the threads stop.
+      wake_deferred(std::chrono::steady_clock::now());
+      if (ready.empty()) {
+        if (stopping && deferred.empty()) {
+          return;
+        }
+        if (deferred.empty()) {
+          ready_cv.wait(lock);
+        } else {
+          ready_cv.wait_until(lock, deferred.begin()->first);
+        }
+        continue;
+      }
+      auto lane = ready.pop_front();
+      lane->queued = false;
+      if (lane->jobs.empty()) {
+        idle_cv.notify_all();
+        continue;
+      }
+      if (!take_token(lane, std::chrono::steady_clock::now())) {
+        continue;
+      }
+      auto job = lane->jobs.pop_front();
+      lane->running = true;
+      ++busy;
+      room_cv.notify_all();
+      lock.unlock();
+
+      auto start = std::chrono::steady_clock::now();
+      bool failed = false;
+      try {
+        job();
+      } catch (...) {
+        failed = true;
+      }
+      auto elapsed_us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count());
+      job.reset();
+
+      lock.lock();
+      --busy;
+      lane->running = false;
+      ++lane->stats.runs;
+      lane->stats.failures += failed ? 1 : 0;
+      lane->stats.total_us += elapsed_us;
+      lane->stats.max_us = std::max(lane->stats.max_us, elapsed_us);
+      // Back of the line, so a busy lane can't starve the others.
+      if (!lane->jobs.empty() && !lane->closed) {
+        lane->queued = true;
+        ready.push_back(lane);
+        ready_cv.notify_one();
+      }
+      idle_cv.notify_all();
+    }
+  }
+
+  bool executor_t::take_token(const lane_ptr_t &lane, std::chrono::steady_clock::time_point now) {
+    auto rate = lane->options.max_per_s;
+    if (rate <= 0 || stopping) {
+      return true;
+    }
+    auto elapsed_s = std::chrono::duration<double>(now - lane->refilled).count();
+    lane->tokens = std::min(static_cast<double>(lane->options.burst), lane->tokens + elapsed_s * rate);
+    lane->refilled = now;
+    if (lane->tokens >= 1) {
+      lane->tokens -= 1;
+      return true;
+    }
+    auto due = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>((1 - lane->tokens) / rate));
+    lane->waiting = true;
+    ++lane->stats.deferred;
+    auto at = deferred.emplace(due, lane);
+    // Threads already idle wait with no deadline, or a later one; have
+    // them all wait for this, so it's not left to this thread, which may
+    // go off to run something long.
+    if (at == deferred.begin()) {
+      ready_cv.notify_all();
+    }
+    return false;
+  }
+
+  void executor_t::wake_deferred(std::chrono::steady_clock::time_point now) {
+    while (!deferred.empty() && (stopping || deferred.begin()->first <= now)) {
+      auto lane = std::move(deferred.begin()->second);
+      deferred.erase(deferred.begin());
+      lane->waiting = false;
+      lane->queued = true;
+      ready.push_back(lane);
+    }
+  }
+}
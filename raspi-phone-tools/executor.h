@@ -0,0 +1,307 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace phone {
+  // A fixed pool of threads running work posted to lanes.  Work in one lane
+  // runs in the order it was posted, one item at a time; different lanes
+  // run side by side, so a slow lane holds up only itself.
+  //
+  // Each lane's queue is bounded.  What happens when it's full is up to the
+  // lane: the new work is dropped, the poster blocks until there's room,
+  // or the new work replaces the newest work waiting, which suits work
+  // that only cares about the latest state.  A lane may also be capped to
+  // so many runs a second, with its work waiting its turn meanwhile.
+  class executor_t final {
+    public:
+      enum class overflow_t {
+        drop,
+        block,
+        coalesce
+      };
+
+      struct lane_options_t {
+        lane_options_t();
+
+        // The most work which may wait in the lane; at least 1.
+        size_t capacity;
+
+        overflow_t overflow;
+
+        // The most runs a second, on average, or 0 for no limit; and how
+        // many may run back to back before the limit bites.
+        double max_per_s;
+        size_t burst;
+      };
+
+      struct lane_stats_t {
+        // Work waiting now, and the most there has been.
+        size_t depth;
+        size_t max_depth;
+
+        // Work run, and of that, how much threw.
+        uint64_t runs;
+        uint64_t failures;
+
+        // Work turned away or merged because the lane was full, and posts
+        // which had to wait for room.
+        uint64_t dropped;
+        uint64_t coalesced;
+        uint64_t blocked;
+
+        // Times the lane had to wait for its rate limit.
+        uint64_t deferred;
+
+        // How long the work took, in microseconds.
+        uint64_t total_us;
+        uint64_t max_us;
+      };
+
+      // A piece of work for a lane.  Work which fits, such as a listener's
+      // job carrying an event struct from events.h, is kept inline, so
+      // posting it doesn't touch the heap; anything bigger is moved to the
+      // heap, as std::function would.
+      class job_t final {
+        public:
+          // Big enough for the largest event struct, with a callback beside
+          // it.
+          static constexpr size_t inline_bytes = 576;
+
+          // True iff. work of the given type is kept inline.
+          template <typename work_t>
+          struct fits_inline : std::integral_constant<bool,
+              sizeof(work_t) <= inline_bytes &&
+              alignof(work_t) <= alignof(std::max_align_t) &&
+              std::is_nothrow_move_constructible<work_t>::value> {};
+
+          job_t() noexcept
+              : ops(nullptr) {}
+
+          template <
+              typename work_t,
+              typename = typename std::enable_if<
+                  !std::is_same<typename std::decay<work_t>::type, job_t>::value>::type>
+          job_t(work_t &&work) {
+            using stored_t = typename std::decay<work_t>::type;
+            place(std::forward<work_t>(work), fits_inline<stored_t> {});
+          }
+
+          job_t(job_t &&that) noexcept
+              : ops(that.ops) {
+            if (ops) {
+              ops->move(that.buffer, buffer);
+              that.ops = nullptr;
+            }
+          }
+
+          job_t &operator=(job_t &&that) noexcept {
+            if (this != &that) {
+              reset();
+              if (that.ops) {
+                that.ops->move(that.buffer, buffer);
+                ops = that.ops;
+                that.ops = nullptr;
+              }
+            }
+            return *this;
+          }
+
+          job_t(const job_t &) = delete;
+          job_t &operator=(const job_t &) = delete;
+
+          ~job_t() {
+            reset();
+          }
+
+          void operator()() {
+            ops->run(buffer);
+          }
+
+          explicit operator bool() const noexcept {
+            return ops != nullptr;
+          }
+
+          // Destroy the work, if any, leaving the job empty.
+          void reset() noexcept {
+            if (ops) {
+              ops->destroy(buffer);
+              ops = nullptr;
+            }
+          }
+
+        private:
+          struct ops_t {
+            void (*run)(void *buffer);
+
+            // Move the work from one buffer to another, leaving nothing to
+            // destroy in the first.
+            void (*move)(void *from, void *to);
+
+            void (*destroy)(void *buffer);
+          };
+
+          template <typename work_t>
+          void place(work_t &&work, std::true_type) {
+            using stored_t = typename std::decay<work_t>::type;
+            static const ops_t inline_ops {
+              [](void *buffer) { (*static_cast<stored_t *>(buffer))(); },
+              [](void *from, void *to) noexcept {
+                new (to) stored_t(std::move(*static_cast<stored_t *>(from)));
+                static_cast<stored_t *>(from)->~stored_t();
+              },
+              [](void *buffer) noexcept { static_cast<stored_t *>(buffer)->~stored_t(); }
+            };
+            new (buffer) stored_t(std::forward<work_t>(work));
+            ops = &inline_ops;
+          }
+
+          template <typename work_t>
+          void place(work_t &&work, std::false_type) {
+            using stored_t = typename std::decay<work_t>::type;
+            static const ops_t heap_ops {
+              [](void *buffer) { (**static_cast<stored_t **>(buffer))(); },
+              [](void *from, void *to) noexcept {
+                *static_cast<stored_t **>(to) = *static_cast<stored_t **>(from);
+              },
+              [](void *buffer) noexcept { delete *static_cast<stored_t **>(buffer); }
+            };
+            *reinterpret_cast<stored_t **>(buffer) = new stored_t(std::forward<work_t>(work));
+            ops = &heap_ops;
+          }
+
+          alignas(std::max_align_t) unsigned char buffer[inline_bytes];
+          const ops_t *ops;
+      };
+
+      struct lane_t;
+      using lane_ptr_t = std::shared_ptr<lane_t>;
+
+      // Start the threads.
+      explicit executor_t(size_t threads);
+
+      // Run whatever is still waiting, rate limits or no, then stop the
+      // threads.
+      ~executor_t();
+
+      lane_ptr_t make_lane(const lane_options_t &options = lane_options_t());
+
+      // Queue work on the lane, and return false if it was turned away.  A
+      // blocking lane doesn't block a post from one of the executor's own
+      // threads, which might be the one it's waiting for; the work is
+      // dropped instead.
+      bool post(const lane_ptr_t &lane, job_t work);
+
+      // Drop the lane's waiting work and turn away any more.  Unless called
+      // from one of the executor's threads, waits for work already running
+      // in the lane to finish.
+      void close(const lane_ptr_t &lane);
+
+      // Wait until no work is waiting or running, rate limits permitting.
+      // Must not be called from one of the executor's threads.
+      void drain();
+
+      lane_stats_t get_stats(const lane_ptr_t &lane);
+
+      // True iff. the calling thread is one of this executor's.
+      bool on_worker() const;
+
+    private:
+      // A first-in, first-out queue kept in one buffer, which grows to the
+      // most it has held and no further, so once it has, pushing and
+      // popping don't touch the heap.  Not safe to share between threads.
+      template <typename item_t>
+      class fifo_t final {
+        public:
+          fifo_t()
+              : head(0),
+                count(0) {}
+
+          bool empty() const { return count == 0; }
+          size_t size() const { return count; }
+
+          item_t &front() { return slots[head]; }
+          item_t &back() { return slots[(head + count - 1) % slots.size()]; }
+
+          void push_back(item_t item) {
+            if (count == slots.size()) {
+              grow();
+            }
+            slots[(head + count) % slots.size()] = std::move(item);
+            ++count;
+          }
+
+          item_t pop_front() {
+            auto item = std::move(slots[head]);
+            slots[head] = item_t {};
+            head = (head + 1) % slots.size();
+            --count;
+            return item;
+          }
+
+          // Destroy what's queued, but keep the room.
+          void clear() {
+            while (count) {
+              pop_front();
+            }
+          }
+
+        private:
+          void grow() {
+            std::vector<item_t> bigger(std::max<size_t>(8, slots.size() * 2));
+            for (size_t i = 0; i < count; ++i) {
+              bigger[i] = std::move(slots[(head + i) % slots.size()]);
+            }
+            slots = std::move(bigger);
+            head = 0;
+          }
+
+          std::vector<item_t> slots;
+          size_t head;
+          size_t count;
+      };
+
+      // The body of each thread.
+      void work();
+
+      // Take one of the lane's rate tokens, or if it has none, set it aside
+      // until it will and return false.
+      bool take_token(const lane_ptr_t &lane, std::chrono::steady_clock::time_point now);
+
+      // Make the lanes set aside by take_token() ready, if their time has
+      // come or we're stopping.
+      void wake_deferred(std::chrono::steady_clock::time_point now);
+
+      std::mutex mutex;
+
+      // Signalled when a lane is ready to run, when there's room in a lane
+      // and when work finishes, respectively.
+      std::condition_variable ready_cv;
+      std::condition_variable room_cv;
+      std::condition_variable idle_cv;
+
+      // Lanes with work waiting and no thread running them, in the order
+      // they became ready.
+      fifo_t<lane_ptr_t> ready;
+
+      // Lanes waiting for their rate limit, by when they may run.
+      std::multimap<std::chrono::steady_clock::time_point, lane_ptr_t> deferred;
+
+      // Threads running work.
+      size_t busy;
+
+      bool stopping;
+      std::vector<std::thread> threads;
+  };
+}
@@ -0,0 +1,78 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/histogram.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+FIXTURE(histogram_buckets_are_contiguous) {
+  for (uint64_t value = 0; value < 100000; ++value) {
+    auto index = phone::histogram_t::index_of(value);
+    EXPECT_LE(value, phone::histogram_t::highest_in(index));
+    if (index > 0) {
+      EXPECT_GT(value, phone::histogram_t::highest_in(index - 1));
+    }
+  }
+  EXPECT_EQ(phone::histogram_t::index_of(uint64_t { 1 } << 40), phone::histogram_t::bucket_count - 1);
+}
+
+FIXTURE(histogram_percentiles) {
+  std::unique_ptr<phone::histogram_t> histogram(new phone::histogram_t);
+  for (uint64_t value = 1; value <= 10000; ++value) {
+    histogram->record(value);
+  }
+  EXPECT_EQ(histogram->get_count(), 10000u);
+  EXPECT_EQ(histogram->get_max(), 10000u);
+  EXPECT_EQ(histogram->get_mean(), 5000.5);
+  // Within the 3% the buckets promise.
+  EXPECT_GE(histogram->get_percentile(0.5), 5000u);
+  EXPECT_LE(histogram->get_percentile(0.5), 5150u);
+  EXPECT_GE(histogram->get_percentile(0.99), 9900u);
+  EXPECT_LE(histogram->get_percentile(0.99), 10000u);
+  EXPECT_EQ(histogram->get_percentile(1.0), 10000u);
+  EXPECT_EQ(histogram->get_percentile(0.0001), 1u);
+}
+
+FIXTURE(histogram_merges_across_threads) {
+  const int thread_count = 4, per_thread = 100000;
+  std::vector<std::unique_ptr<phone::histogram_t>> locals;
+  std::unique_ptr<phone::histogram_t> shared(new phone::histogram_t);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; ++t) {
+    locals.emplace_back(new phone::histogram_t);
+  }
+  for (int t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&locals, &shared, t]() {
+      for (int i = 0; i < per_thread; ++i) {
+        locals[t]->record(static_cast<uint64_t>(t * 1000 + i % 1000));
+        shared->record(static_cast<uint64_t>(t * 1000 + i % 1000));
+      }
+    });
+  }
+  for (auto &thread: threads) {
+    thread.join();
+  }
+  std::unique_ptr<phone::histogram_t> merged(new phone::histogram_t);
+  for (const auto &local: locals) {
+    merged->merge(*local);
+  }
+  EXPECT_EQ(merged->get_count(), shared->get_count());
+  EXPECT_EQ(merged->get_max(), shared->get_max());
+  EXPECT_EQ(merged->get_percentile(0.9), shared->get_percentile(0.9));
+}
+
+FIXTURE(histogram_table_names) {
+  std::unique_ptr<phone::histogram_table_t> table(new phone::histogram_table_t);
+  table->record("+CPBR", 100);
+  table->record("+CPBR", 300);
+  table->record("D", 5000);
+  EXPECT_EQ(&table->get("+CPBR"), &table->get("+CPBR"));
+  EXPECT_NE(&table->get("+CPBR"), &table->get("D"));
+  auto report = table->report();
+  EXPECT_EQ(report.size(), 2u);
+  EXPECT_EQ(report["+CPBR"]["count"], 2);
+  EXPECT_EQ(report["D"]["max_us"], 5000);
+  for (size_t i = 0; i < phone::histogram_table_t::slot_count + 10; ++i) {
+    table->record("name" + std::to_string(i), 1);
+  }
+  EXPECT_TRUE(table->report().count("other") == 1);
+}
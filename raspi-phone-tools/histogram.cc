@@ -0,0 +1,191 @@
+#include <raspi-phone-tools/histogram.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace phone {
+  constexpr unsigned histogram_t::sub_bits;
+  constexpr unsigned histogram_t::sub_count;
+  constexpr unsigned histogram_t::max_bits;
+  constexpr size_t histogram_t::bucket_count;
+  constexpr size_t histogram_table_t::slot_count;
+  constexpr size_t histogram_table_t::max_name;
+
+  namespace {
+    unsigned msb(uint64_t value) {
+      return 63 - static_cast<unsigned>(__builtin_clzll(value));
+    }
+
+    uint64_t fnv1a(const std::string &name, size_t limit) {
+      uint64_t hash = 14695981039346656037ull;
+      for (size_t i = 0; i < name.size() && i < limit; ++i) {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 1099511628211ull;
+      }
+      // Zero marks a free slot.
+      return hash ? hash : 1;
+    }
+  }
+
+  histogram_t::histogram_t() noexcept {
+    reset();
+  }
+
+  size_t histogram_t::index_of(uint64_t value) noexcept {
+    if (value < 2 * sub_count) {
+      return static_cast<size_t>(value);
+    }
+    unsigned shift = msb(value) - sub_bits;
+    if (shift + sub_bits >= max_bits) {
+      return bucket_count - 1;
+    }
+    return (shift + 1) * sub_count + static_cast<size_t>((value >> shift) - sub_count);
+  }
+
+  uint64_t histogram_t::highest_in(size_t index) noexcept {
+    if (index < 2 * sub_count) {
+      return index;
+    }
+    size_t shift = index / sub_count - 1;
+    uint64_t base = (index % sub_count + sub_count) << shift;
+    return base + ((uint64_t { 1 } << shift) - 1);
+  }
+
+  void histogram_t::record(uint64_t value_us) noexcept {
+    counts[index_of(value_us)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value_us, std::memory_order_relaxed);
+    auto seen = max.load(std::memory_order_relaxed);
+    while (value_us > seen &&
+        !max.compare_exchange_weak(seen, value_us, std::memory_order_relaxed)) {}
+  }
+
+  void histogram_t::merge(const histogram_t &that) noexcept {
+    for (size_t i = 0; i < bucket_count; ++i) {
+      auto n = that.counts[i].load(std::memory_order_relaxed);
+      if (n) {
+        counts[i].fetch_add(n, std::memory_order_relaxed);
+      }
+    }
+    count.fetch_add(that.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    sum.fetch_add(that.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    auto theirs = that.max.load(std::memory_order_relaxed);
+    auto seen = max.load(std::memory_order_relaxed);
+    while (theirs > seen &&
+        !max.compare_exchange_weak(seen, theirs, std::memory_order_relaxed)) {}
+  }
+
+  void histogram_t::reset() noexcept {
+    for (auto &bucket: counts) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t histogram_t::get_count() const noexcept {
+    return count.load(std::memory_order_relaxed);
+  }
+
+  double histogram_t::get_mean() const noexcept {
+    auto n = get_count();
+    return n ? static_cast<double>(sum.load(std::memory_order_relaxed)) / static_cast<double>(n) : 0;
+  }
+
+  uint64_t histogram_t::get_max() const noexcept {
+    return max.load(std::memory_order_relaxed);
+  }
+
+  uint64_t histogram_t::get_percentile(double fraction) const noexcept {
+    // Total the buckets rather than trusting 'count', which a concurrent
+    // record() may have bumped ahead of its bucket.
+    uint64_t total = 0;
+    for (const auto &bucket: counts) {
+      total += bucket.load(std::memory_order_relaxed);
+    }
+    if (!total) {
+      return 0;
+    }
+    fraction = std::min(1.0, std::max(0.0, fraction));
+    auto wanted = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(total))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+      seen += counts[i].load(std::memory_order_relaxed);
+      if (seen >= wanted) {
+        return std::min(highest_in(i), get_max());
+      }
+    }
+    return get_max();
+  }
+
+  json_t::object_t histogram_t::report() const {
+    return json_t::object_t {
+      { "count", static_cast<double>(get_count()) },
+      { "mean_us", get_mean() },
+      { "max_us", static_cast<double>(get_max()) },
+      { "p50_us", static_cast<double>(get_percentile(0.5)) },
+      { "p90_us", static_cast<double>(get_percentile(0.9)) },
+      { "p99_us", static_cast<double>(get_percentile(0.99)) },
+      { "p999_us", static_cast<double>(get_percentile(0.999)) }
+    };
+  }
+
+  histogram_table_t::histogram_table_t() noexcept {
+    for (auto &slot: slots) {
+      slot.key.store(0, std::memory_order_relaxed);
+      slot.ready.store(false, std::memory_order_relaxed);
+      slot.name[0] = '\0';
+    }
+  }
+
+  histogram_t &histogram_table_t::get(const std::string &name) noexcept {
+    auto key = fnv1a(name, max_name);
+    for (size_t probe = 0; probe < slot_count; ++probe) {
+      auto &slot = slots[(key + probe) % slot_count];
+      auto seen = slot.key.load(std::memory_order_acquire);
+      if (seen == key) {
+        return slot.histogram;
+      }
+      if (seen == 0) {
+        if (slot.key.compare_exchange_strong(seen, key, std::memory_order_acq_rel)) {
+          auto len = std::min(name.size(), max_name);
+          std::memcpy(slot.name, name.data(), len);
+          slot.name[len] = '\0';
+          slot.ready.store(true, std::memory_order_release);
+          return slot.histogram;
+        }
+        // Someone else claimed it first.  It may have been for our name.
+        if (seen == key) {
+          return slot.histogram;
+        }
+      }
+    }  // for
+    return other;
+  }
+
+  void histogram_table_t::record(const std::string &name, uint64_t value_us) noexcept {
+    get(name).record(value_us);
+  }
+
+  json_t::object_t histogram_table_t::report() const {
+    json_t::object_t result;
+    for (const auto &slot: slots) {
+      if (slot.ready.load(std::memory_order_acquire) && slot.histogram.get_count()) {
+        result[slot.name] = slot.histogram.report();
+      }
+    }
+    if (other.get_count()) {
+      result["other"] = other.report();
+    }
+    return result;
+  }
+
+  void histogram_table_t::reset() noexcept {
+    for (auto &slot: slots) {
+      slot.histogram.reset();
+    }
+    other.reset();
+  }
+}
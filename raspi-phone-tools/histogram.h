@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <json/json.h>
+
+namespace phone {
+  // A fixed-size, lock-free histogram of latencies in microseconds, laid out
+  // in the manner of HdrHistogram: values below 64 get a bucket each, and
+  // each power of two above that is split into 32 linear sub-buckets, so any
+  // value is reported to within about 3%.  Values up to 2^32 us (a little
+  // over an hour) are kept; anything longer lands in the top bucket.
+  //
+  // record() is a handful of relaxed atomic adds, cheap enough to leave on
+  // everywhere.  Readers see a consistent-enough picture without stopping
+  // writers.  Histograms merge by adding counts, so per-thread histograms
+  // can be summed for a report.
+  class histogram_t final {
+    public:
+      // Sub-buckets per power of two, as a power of two.
+      static constexpr unsigned sub_bits = 5;
+      static constexpr unsigned sub_count = 1u << sub_bits;
+
+      // The largest value kept exactly, as a power of two.
+      static constexpr unsigned max_bits = 32;
+
+      // The number of buckets needed to cover 0 to 2^max_bits.
+      static constexpr size_t bucket_count = (max_bits - sub_bits + 1) * sub_count;
+
+      histogram_t() noexcept;
+
+      // Count one value.
+      void record(uint64_t value_us) noexcept;
+
+      // Add that histogram's counts into this one.
+      void merge(const histogram_t &that) noexcept;
+
+      // Forget everything.
+      void reset() noexcept;
+
+      // The number of values recorded.
+      uint64_t get_count() const noexcept;
+
+      // The mean of the values recorded, or 0 if none were.
+      double get_mean() const noexcept;
+
+      // The largest value recorded.
+      uint64_t get_max() const noexcept;
+
+      // The value at or below which the given fraction (0 to 1) of values
+      // fall, to the precision of the buckets.  Returns 0 if empty.
+      uint64_t get_percentile(double fraction) const noexcept;
+
+      // The count, mean, max and the 50th, 90th, 99th and 99.9th
+      // percentiles, in microseconds.
+      json_t::object_t report() const;
+
+      // The bucket a value falls in, and the highest value in a bucket.
+      static size_t index_of(uint64_t value) noexcept;
+      static uint64_t highest_in(size_t index) noexcept;
+
+    private:
+      std::atomic<uint64_t> counts[bucket_count];
+      std::atomic<uint64_t> count;
+      std::atomic<uint64_t> sum;
+      std::atomic<uint64_t> max;
+  };
+
+  // A fixed table of named histograms which never locks, allocates or moves
+  // once constructed.  Names are claimed on first use; once the table is
+  // full, further names share the "other" histogram.  Names longer than
+  // max_name are truncated.
+  class histogram_table_t final {
+    public:
+      static constexpr size_t slot_count = 48;
+      static constexpr size_t max_name = 23;
+
+      histogram_table_t() noexcept;
+
+      // The histogram for the name, claiming a slot for it if it's new.
+      histogram_t &get(const std::string &name) noexcept;
+
+      // Record a value against the name.
+      void record(const std::string &name, uint64_t value_us) noexcept;
+
+      // Each named histogram's report, by name.  Histograms which have
+      // recorded nothing are left out.
+      json_t::object_t report() const;
+
+      // Forget every value, keeping the names.
+      void reset() noexcept;
+
+    private:
+      struct slot_t {
+        // The name's hash, or 0 while the slot is free.
+        std::atomic<uint64_t> key;
+
+        // Set once 'name' has been written.
+        std::atomic<bool> ready;
+
+        char name[max_name + 1];
+        histogram_t histogram;
+      };
+
+      slot_t slots[slot_count];
+      histogram_t other;
+  };
+}
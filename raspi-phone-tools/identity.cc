@@ -0,0 +1,213 @@
+#include <raspi-phone-tools/identity.h>
+#include <raspi-phone-tools/at.h>
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+namespace phone {
+  namespace {
+    bool all_digits(const std::string &str) {
+      if (str.empty()) {
+        return false;
+      }
+      for (char c: str) {
+        if (!std::isdigit(static_cast<unsigned char>(c))) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // ICCIDs are 19 or 20 digits, sometimes padded with a trailing F.
+    bool looks_like_iccid(std::string str) {
+      if (!str.empty() && (str.back() == 'F' || str.back() == 'f')) {
+        str.pop_back();
+      }
+      return (str.size() == 19 || str.size() == 20) && all_digits(str);
+    }
+
+    std::string strip_name(const std::string &line) {
+      auto colon = line.find(':');
+      if (colon == std::string::npos || (line[0] != '+' && line.compare(0, 9, "Revision:") != 0)) {
+        return line;
+      }
+      auto start = line.find_first_not_of(' ', colon + 1);
+      auto value = (start == std::string::npos) ? std::string {} : line.substr(start);
+      if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+        value = value.substr(1, value.size() - 2);
+      }
+      return value;
+    }
+  }
+
+  const char *const identity_cache_t::default_path = "/var/cache/phone/identity.json";
+
+  identity_cache_t::identity_cache_t(phone_t &phone, const std::string &path)
+      : phone(phone), path(path), stats(stats_t { false, 0, 0, std::string {} }) {}
+
+  std::string identity_cache_t::query(const std::string &cmd) {
+    std::string first;
+    bool seen = false;
+    auto result = phone.command(cmd, [&first, &seen](const std::string &line) {
+      if (!seen) {
+        first = strip_name(line);
+        seen = true;
+      }
+    });
+    ++stats.commands;
+    return result.ok() ? first : std::string {};
+  }
+
+  modem_identity_t identity_cache_t::load() {
+    auto start = std::chrono::steady_clock::now();
+    stats = stats_t { false, 0, 0, std::string {} };
+    modem_identity_t identity;
+
+    // The one query: both serial numbers on one line.
+    auto result = phone.command("AT+CGSN;+CCID", [&identity](const std::string &line) {
+      auto value = strip_name(line);
+      if (at::starts_with(line, "+CCID:") || at::starts_with(line, "+ICCID:") ||
+          (identity.iccid.empty() && looks_like_iccid(value))) {
+        identity.iccid = value;
+      } else if (identity.imei.empty() && all_digits(value)) {
+        identity.imei = value;
+      }
+    });
+    ++stats.commands;
+    if (!result.ok()) {
+      // This modem spells it differently.  Ask one at a time.
+      identity.imei = query("AT+CGSN");
+      identity.iccid = query("AT+ICCID");
+    }
+    if (identity.imei.empty()) {
+      throw std::runtime_error("modem did not give its IMEI: " + result.final);
+    }
+
+    // Without an ICCID, the SIM could be any SIM, so the file is no use.
+    auto cacheable = !identity.iccid.empty();
+    auto key = identity.imei + "/" + identity.iccid;
+    auto entries = cacheable ? read_file() : json_t::object_t {};
+    auto found = entries.find(key);
+    if (found != entries.end()) {
+      try {
+        auto cached = from_json(found->second);
+        cached.imei = identity.imei;
+        cached.iccid = identity.iccid;
+        stats.hit = true;
+        stats.ready_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        phone.get_latencies().record("identity:hit", static_cast<uint64_t>(stats.ready_us));
+        return cached;
+      } catch (const std::exception &) {
+        // A damaged entry; fall through and ask.
+      }
+    }
+
+    identity.imsi = query("AT+CIMI");
+    identity.manufacturer = query("AT+CGMI");
+    identity.model = query("AT+CGMM");
+    identity.revision = query("AT+CGMR");
+    phone.command("AT+GCAP", [&identity](const std::string &line) {
+      if (!at::starts_with(line, "+GCAP:")) {
+        return;
+      }
+      for (auto &capability: at::split_params(line)) {
+        identity.capabilities.push_back(std::move(capability));
+      }
+    });
+    ++stats.commands;
+
+    if (cacheable) {
+      // We have the identity either way; a cache we can't write only costs
+      // the next start some commands.
+      entries[key] = to_json(identity);
+      try {
+        write_file(entries);
+      } catch (const std::exception &ex) {
+        stats.write_error = ex.what();
+      }
+    }
+    stats.ready_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    phone.get_latencies().record("identity:miss", static_cast<uint64_t>(stats.ready_us));
+    return identity;
+  }
+
+  void identity_cache_t::invalidate(const modem_identity_t &identity) {
+    auto entries = read_file();
+    if (entries.erase(identity.imei + "/" + identity.iccid)) {
+      write_file(entries);
+    }
+  }
+
+  const identity_cache_t::stats_t &identity_cache_t::get_stats() const {
+    return stats;
+  }
+
+  json_t::object_t identity_cache_t::to_json(const modem_identity_t &identity) {
+    json_t::array_t capabilities;
+    for (const auto &capability: identity.capabilities) {
+      capabilities.push_back(capability);
+    }
+    return json_t::object_t {
+      { "imei", identity.imei },
+      { "iccid", identity.iccid },
+      { "imsi", identity.imsi },
+      { "manufacturer", identity.manufacturer },
+      { "model", identity.model },
+      { "revision", identity.revision },
+      { "capabilities", std::move(capabilities) }
+    };
+  }
+
+  modem_identity_t identity_cache_t::from_json(const json_t &json) {
+    modem_identity_t identity;
+    identity.imei = json["imei"].as<json_t::string_t>();
+    identity.iccid = json["iccid"].as<json_t::string_t>();
+    identity.imsi = json["imsi"].as<json_t::string_t>();
+    identity.manufacturer = json["manufacturer"].as<json_t::string_t>();
+    identity.model = json["model"].as<json_t::string_t>();
+    identity.revision = json["revision"].as<json_t::string_t>();
+    for (const auto &capability: json["capabilities"].as<json_t::array_t>()) {
+      identity.capabilities.push_back(capability.as<json_t::string_t>());
+    }
+    return identity;
+  }
+
+  json_t::object_t identity_cache_t::read_file() const {
+    if (!util::exists(path)) {
+      return json_t::object_t {};
+    }
+    try {
+      auto file = util::open(path);
+      struct stat st;
+      util::throw_if_lt0(fstat(file, &st));
+      std::string text(static_cast<size_t>(st.st_size), '\0');
+      util::read_exactly(file, &text[0], text.size());
+      auto json = json_t::decode(text);
+      return json.as<json_t::object_t>();
+    } catch (const std::exception &) {
+      return json_t::object_t {};
+    }
+  }
+
+  void identity_cache_t::write_file(const json_t::object_t &entries) const {
+    auto text = json_t(entries).encode();
+    auto slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0 &&
+        ::mkdir(path.substr(0, slash).c_str(), 0755) < 0 && errno != EEXIST) {
+      util::throw_system_error();
+    }
+    auto temp = path + ".tmp";
+    {
+      auto file = util::open(
+          temp, util::access_t::write_only,
+          util::if_not_exists_t(0644), util::if_exists_t::truncate);
+      util::write_exactly(file, text.data(), text.size());
+      util::throw_if_lt0(fsync(file));
+    }
+    util::throw_if_lt0(rename(temp.c_str(), path.c_str()));
+  }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // The facts about a modem and its SIM which never change while the two
+  // stay together.
+  struct modem_identity_t {
+    // The modem's serial number (IMEI), from AT+CGSN.
+    std::string imei;
+
+    // The SIM's serial number, from AT+CCID (or AT+ICCID).
+    std::string iccid;
+
+    // The subscriber identity on the SIM, from AT+CIMI.
+    std::string imsi;
+
+    // From AT+CGMI, AT+CGMM and AT+CGMR.
+    std::string manufacturer;
+    std::string model;
+    std::string revision;
+
+    // From AT+GCAP, such as "+CGSM" and "+FCLASS".
+    std::vector<std::string> capabilities;
+  };
+
+  // Keeps modem identities in a small JSON file, keyed by IMEI and ICCID,
+  // so that start-up doesn't have to ask the modem for facts it already
+  // gave us.  load() asks for just the IMEI and ICCID, on one command line,
+  // and if the file has an entry for that pair, uses it; otherwise it asks
+  // for the rest and adds an entry.  A swapped SIM or modem is a new pair
+  // and so is never mistaken for the old one; a SIM whose ICCID can't be
+  // read can't be told from another, so is never looked up or added.  The
+  // file is a convenience: if it can't be written, load() says so in its
+  // stats and carries on.
+  class identity_cache_t final {
+    public:
+      // Where the cache lives unless told otherwise.
+      static const char *const default_path;
+
+      // What the last load() did.
+      struct stats_t {
+        // True iff. the identity came from the file.
+        bool hit;
+
+        // The number of command lines sent.
+        size_t commands;
+
+        // From the start of load() until the identity was ready.
+        long ready_us;
+
+        // Why the file couldn't be written, if it couldn't.
+        std::string write_error;
+      };
+
+      identity_cache_t(phone_t &phone, const std::string &path = default_path);
+
+      // Identify the modem and SIM, using the file where possible.  Throws
+      // std::runtime_error if the modem won't give its IMEI.
+      modem_identity_t load();
+
+      // Forget the file's entry for this pair, so the next load() asks
+      // again.
+      void invalidate(const modem_identity_t &identity);
+
+      const stats_t &get_stats() const;
+
+      // The identity as a JSON object, and back.
+      static json_t::object_t to_json(const modem_identity_t &identity);
+      static modem_identity_t from_json(const json_t &json);
+
+    private:
+      // Send a command and return its first information line with any
+      // "+NAME:" prefix taken off, or empty if it failed.
+      std::string query(const std::string &cmd);
+
+      // Read the whole file as a JSON object, or an empty one if there is
+      // no file or it is damaged.
+      json_t::object_t read_file() const;
+
+      // Replace the file, atomically, with the given object, making its
+      // directory if need be.
+      void write_file(const json_t::object_t &entries) const;
+
+      phone_t &phone;
+      const std::string path;
+      stats_t stats;
+  };
+}
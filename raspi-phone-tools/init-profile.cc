@@ -0,0 +1,165 @@
+#include <raspi-phone-tools/init-profile.h>
+#include <raspi-phone-tools/at.h>
+
+#include <chrono>
+
+namespace phone {
+  constexpr size_t init_profile_t::default_max_line;
+
+  init_profile_t::init_profile_t(size_t max_line)
+      : max_line(max_line),
+        want_echo(false),
+        echo_seen(false),
+        stats(stats_t { 0, 0, 0, 0, std::vector<std::string> {}, 0 }) {}
+
+  init_profile_t init_profile_t::standard() {
+    init_profile_t profile;
+    profile
+        .echo(false)
+        .add("+CMEE=1")
+        .add("+CMGF=1")
+        .add("+CSMP=49,167,0,0")
+        .add("+CNMI=2,1,0,1,0")
+        .add("+CLIP=1")
+        .add("+CCWA=1")
+        .add("+COLP=1")
+        .add("+CREG=2")
+        .add("+CUSD=1");
+    return profile;
+  }
+
+  init_profile_t &init_profile_t::echo(bool on) {
+    want_echo = on;
+    return *this;
+  }
+
+  init_profile_t &init_profile_t::add(const std::string &command) {
+    setting_t setting;
+    setting.command = command;
+    auto eq = command.find('=');
+    setting.name = command.substr(0, eq);
+    if (eq != std::string::npos) {
+      setting.fields = at::split_params(":" + command.substr(eq + 1));
+    }
+    setting.in_effect = false;
+    settings.push_back(std::move(setting));
+    return *this;
+  }
+
+  void init_profile_t::read(phone_t &phone, size_t first, size_t last) {
+    if (first >= last) {
+      return;
+    }
+    std::string line = "AT";
+    for (size_t i = first; i < last; ++i) {
+      line += (i == first ? "" : ";") + settings[i].name + "?";
+    }
+    auto result = phone.command(line, [this, first, last](const std::string &answer) {
+      auto name = at::line_name(answer);
+      for (size_t i = first; i < last; ++i) {
+        auto &setting = settings[i];
+        if (setting.name != name || setting.in_effect) {
+          continue;
+        }
+        auto fields = at::split_params(answer);
+        bool same = fields.size() >= setting.fields.size();
+        for (size_t f = 0; same && f < setting.fields.size(); ++f) {
+          same = fields[f] == setting.fields[f];
+        }
+        setting.in_effect = same;
+        break;
+      }
+    });
+    ++stats.read_lines;
+    if (result.echoed) {
+      echo_seen = true;
+    }
+    if (!result.ok() && last - first > 1) {
+      size_t middle = first + (last - first) / 2;
+      read(phone, first, middle);
+      read(phone, middle, last);
+    }
+  }
+
+  void init_profile_t::write(
+      phone_t &phone, const std::string &basic, const std::vector<size_t> &which) {
+    std::string line = "AT" + basic;
+    for (size_t n = 0; n < which.size(); ++n) {
+      line += (n == 0 ? "" : ";") + settings[which[n]].command;
+    }
+    ++stats.write_lines;
+    if (phone.command(line).ok()) {
+      stats.changed += which.size() + (basic.empty() ? 0 : 1);
+      return;
+    }
+    if (which.size() + (basic.empty() ? 0 : 1) == 1) {
+      stats.failed.push_back(basic.empty() ? settings[which[0]].command : basic);
+      return;
+    }
+    if (!basic.empty()) {
+      write(phone, basic, std::vector<size_t> {});
+    }
+    for (auto i: which) {
+      write(phone, std::string {}, std::vector<size_t> { i });
+    }
+  }
+
+  const init_profile_t::stats_t &init_profile_t::apply(phone_t &phone) {
+    auto start = std::chrono::steady_clock::now();
+    stats = stats_t { 0, 0, 0, 0, std::vector<std::string> {}, 0 };
+    echo_seen = false;
+    for (auto &setting: settings) {
+      setting.in_effect = false;
+    }
+
+    // Read everything back, a line's worth at a time.
+    size_t first = 0, length = 2;
+    for (size_t i = 0; i < settings.size(); ++i) {
+      auto cost = settings[i].name.size() + 2;
+      if (i > first && length + cost > max_line) {
+        read(phone, first, i);
+        first = i;
+        length = 2;
+      }
+      length += cost;
+    }
+    read(phone, first, settings.size());
+
+    // Send what differs, a line's worth at a time.
+    std::string basic;
+    if (echo_seen != want_echo) {
+      basic = want_echo ? "E1" : "E0";
+    } else {
+      ++stats.unchanged;
+    }
+    std::vector<size_t> which;
+    size_t length_so_far = 2 + basic.size();
+    for (size_t i = 0; i < settings.size(); ++i) {
+      if (settings[i].in_effect) {
+        ++stats.unchanged;
+        continue;
+      }
+      auto cost = settings[i].command.size() + 1;
+      if ((!which.empty() || !basic.empty()) && length_so_far + cost > max_line) {
+        write(phone, basic, which);
+        basic.clear();
+        which.clear();
+        length_so_far = 2;
+      }
+      which.push_back(i);
+      length_so_far += cost;
+    }
+    if (!which.empty() || !basic.empty()) {
+      write(phone, basic, which);
+    }
+
+    stats.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    phone.get_latencies().record("init", static_cast<uint64_t>(stats.elapsed_us));
+    return stats;
+  }
+
+  const init_profile_t::stats_t &init_profile_t::get_stats() const {
+    return stats;
+  }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // A declarative description of how the modem should be configured, which
+  // is applied by reading what is already in effect and sending only what
+  // differs.
+  //
+  // Settings are given as the extended command which sets them, such as
+  // "+CNMI=2,1,0,1,0".  The profile reads each back with its read form
+  // ("+CNMI?") and compares the answer's leading fields with the ones being
+  // set, so "+CREG=2" is satisfied by "+CREG: 2,1".  Reads are packed onto
+  // as few command lines as fit; so are the commands that need sending.
+  // Echo is checked for free, by whether the modem echoes the read line.
+  //
+  // A modem which kept its settings through a USB re-enumeration therefore
+  // costs one round trip to bring back.
+  class init_profile_t final {
+    public:
+      // What the last apply() did.
+      struct stats_t {
+        // Command lines sent to read settings, and to change them.
+        size_t read_lines;
+        size_t write_lines;
+
+        // Settings found already in effect, and changed.
+        size_t unchanged;
+        size_t changed;
+
+        // Settings the modem refused.
+        std::vector<std::string> failed;
+
+        long elapsed_us;
+      };
+
+      // The longest command line most modems will take.
+      static constexpr size_t default_max_line = 256;
+
+      explicit init_profile_t(size_t max_line = default_max_line);
+
+      // The settings this tree relies on: echo off, numeric errors, text
+      // SMS with status reports delivered as +CDS, caller ID, call waiting,
+      // connected-line reporting, registration with cell location, and
+      // USSD results as +CUSD.
+      static init_profile_t standard();
+
+      // Want echo on or off.  Off unless said otherwise.
+      init_profile_t &echo(bool on);
+
+      // Want the setting made by the extended command, e.g. "+CMEE=1".
+      init_profile_t &add(const std::string &setting);
+
+      // Bring the modem in line with the profile.  Settings the modem
+      // refuses are listed in the stats rather than thrown.
+      const stats_t &apply(phone_t &phone);
+
+      const stats_t &get_stats() const;
+
+    private:
+      struct setting_t {
+        // "+CNMI=2,1,0,1,0", "+CNMI", and the fields after the '='.
+        std::string command;
+        std::string name;
+        std::vector<std::string> fields;
+
+        // True once a read shows it in effect.
+        bool in_effect;
+      };
+
+      // Read back the settings from 'first' to 'last' (exclusive) on one
+      // line, marking those in effect.  If the line fails, split it in two
+      // and try each half, so one unreadable setting doesn't spoil the rest.
+      void read(phone_t &phone, size_t first, size_t last);
+
+      // Send one line of settings.  If it fails, send them one by one to
+      // find out which the modem refused.
+      void write(phone_t &phone, const std::string &basic, const std::vector<size_t> &which);
+
+      size_t max_line;
+      bool want_echo;
+      std::vector<setting_t> settings;
+      bool echo_seen;
+      stats_t stats;
+  };
+}
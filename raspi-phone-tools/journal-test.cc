@@ -0,0 +1,221 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/journal.h>
+#include <raspi-phone-tools/util.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <dirent.h>
+
+namespace {
+  // A fresh directory for a journal, removed with whatever's in it at the
+  // end.
+  class temp_dir_t final {
+    public:
+      temp_dir_t() {
+        char path[] = "/tmp/journal-test-XXXXXX";
+        this->path = mkdtemp(path);
+      }
+
+      ~temp_dir_t() {
+        for (const auto &name: list()) {
+          util::unlink(util::join_path({ path, name }));
+        }
+        rmdir(path.c_str());
+      }
+
+      std::vector<std::string> list() const {
+        std::vector<std::string> names;
+        auto *dir = opendir(path.c_str());
+        while (auto *entry = readdir(dir)) {
+          if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+          }
+        }
+        closedir(dir);
+        return names;
+      }
+
+      std::string path;
+  };
+
+  json_t::object_t make_fields(int i) {
+    return json_t::object_t {
+      { "number", "+1555" + std::to_string(i) },
+      { "index", i },
+      { "delivered", i % 2 == 0 },
+      { "nested", json_t::array_t { 1, std::string { "two" } } }
+    };
+  }
+}
+
+FIXTURE(journal_appends_and_replays) {
+  temp_dir_t dir;
+  phone::journal_t::options_t options;
+  options.segment_bytes = 4096;
+  options.index_every = 4;
+  {
+    phone::journal_t journal(dir.path, options);
+    EXPECT_EQ(journal.get_next_seq(), 1u);
+    for (int i = 0; i < 200; ++i) {
+      EXPECT_EQ(journal.append(i % 8, 1000 + i, make_fields(i)), static_cast<uint64_t>(i + 1));
+    }
+    EXPECT_GT(journal.get_stats().segments, 3u);
+    EXPECT_GT(dir.list().size(), 3u);
+
+    std::vector<uint64_t> seqs;
+    bool decoded = true;
+    journal.replay(57, [&seqs, &decoded](const phone::journal_t::record_t &record) {
+      auto i = static_cast<int>(record.seq - 1);
+      decoded = decoded && record.event == i % 8 && record.time_ms == 1000 + i &&
+          record.decode() == make_fields(i);
+      seqs.push_back(record.seq);
+      return true;
+    });
+    EXPECT_TRUE(decoded);
+    EXPECT_EQ(seqs.size(), 144u);
+    EXPECT_EQ(seqs.front(), 57u);
+    EXPECT_EQ(seqs.back(), 200u);
+
+    uint64_t first = 0;
+    auto seen = journal.replay_since(1150, [&first](const phone::journal_t::record_t &record) {
+      first = record.seq;
+      return false;
+    });
+    EXPECT_EQ(seen, 1u);
+    EXPECT_EQ(first, 151u);
+  }
+
+  // Reopened, it carries on where it left off.
+  phone::journal_t journal(dir.path, options);
+  EXPECT_EQ(journal.get_next_seq(), 201u);
+  EXPECT_EQ(journal.get_stats().discarded, 0u);
+  EXPECT_EQ(journal.append(0, 2000, make_fields(0)), 201u);
+  EXPECT_EQ(journal.replay(1, [](const phone::journal_t::record_t &) { return true; }), 201u);
+}
+
+FIXTURE(journal_drops_damage) {
+  temp_dir_t dir;
+  phone::journal_t::options_t options;
+  options.segment_bytes = 1 << 16;
+  {
+    phone::journal_t journal(dir.path, options);
+    for (int i = 0; i < 10; ++i) {
+      journal.append(1, i, make_fields(i));
+    }
+  }
+  // Flip a byte in the eighth record's fields, stepping over the segment
+  // header and seven records to find it.
+  auto path = util::join_path({ dir.path, dir.list()[0] });
+  {
+    auto file = util::open(path, util::access_t::read_write);
+    std::vector<char> bytes(options.segment_bytes);
+    util::read_exactly(file, bytes.data(), bytes.size());
+    size_t offset = 32;
+    for (int i = 0; i < 7; ++i) {
+      uint32_t length;
+      std::memcpy(&length, &bytes[offset], sizeof(length));
+      offset += (length + 7) / 8 * 8;
+    }
+    bytes[offset + 40] ^= 1;
+    util::throw_if_lt0(lseek(file, 0, SEEK_SET));
+    util::write_exactly(file, bytes.data(), bytes.size());
+  }
+  phone::journal_t journal(dir.path, options);
+  EXPECT_EQ(journal.get_stats().discarded, 1u);
+  EXPECT_EQ(journal.get_next_seq(), 8u);
+  EXPECT_EQ(journal.append(1, 99, make_fields(99)), 8u);
+  std::vector<int64_t> times;
+  journal.replay(1, [&times](const phone::journal_t::record_t &record) {
+    times.push_back(record.time_ms);
+    return true;
+  });
+  EXPECT_EQ(times.size(), 8u);
+  EXPECT_EQ(times.back(), 99);
+  EXPECT_EQ(phone::journal_t::crc32("123456789", 9), 0xCBF43926u);
+}
+
+FIXTURE(journal_keeps_max_segments) {
+  temp_dir_t dir;
+  phone::journal_t::options_t options;
+  options.segment_bytes = 4096;
+  options.max_segments = 2;
+  phone::journal_t journal(dir.path, options);
+  for (int i = 0; i < 200; ++i) {
+    journal.append(0, i, make_fields(i));
+  }
+  EXPECT_EQ(dir.list().size(), 2u);
+  auto first = journal.get_first_seq();
+  EXPECT_GT(first, 1u);
+  uint64_t replayed_first = 0;
+  journal.replay(1, [&replayed_first](const phone::journal_t::record_t &record) {
+    replayed_first = record.seq;
+    return false;
+  });
+  EXPECT_EQ(replayed_first, first);
+}
+
+FIXTURE(journal_keeps_empty_events) {
+  // An event with no fields is a record like any other, not the end.
+  temp_dir_t dir;
+  phone::journal_t::options_t options;
+  options.segment_bytes = 4096;
+  {
+    phone::journal_t journal(dir.path, options);
+    journal.append(1, 10, json_t::object_t { { "a", 1 } });
+    journal.append(2, 20, json_t::object_t {});
+    journal.append(3, 30, json_t::object_t { { "b", 2 } });
+    EXPECT_EQ(journal.replay(1, [](const phone::journal_t::record_t &) { return true; }), 3u);
+  }
+  phone::journal_t journal(dir.path, options);
+  EXPECT_EQ(journal.get_next_seq(), 4u);
+  EXPECT_EQ(journal.get_stats().discarded, 0u);
+  std::vector<int> events;
+  bool decoded = true;
+  journal.replay(1, [&events, &decoded](const phone::journal_t::record_t &record) {
+    events.push_back(record.event);
+    decoded = decoded && (record.event != 2 || (record.size == 0 && record.decode().empty()));
+    return true;
+  });
+  EXPECT_EQ(events.size(), 3u);
+  EXPECT_TRUE(decoded);
+  EXPECT_EQ(journal.append(4, 40, json_t::object_t {}), 4u);
+}
+
+FIXTURE(journal_reopens_with_another_segment_size) {
+  temp_dir_t dir;
+  phone::journal_t::options_t small, large;
+  small.segment_bytes = 64 << 10;
+  large.segment_bytes = 128 << 10;
+  auto count = [](phone::journal_t &journal) {
+    return journal.replay(1, [](const phone::journal_t::record_t &) { return true; });
+  };
+  {
+    phone::journal_t journal(dir.path, small);
+    for (int i = 0; i < 10; ++i) {
+      journal.append(1, i, make_fields(i));
+    }
+  }
+
+  // The old segment's records stay readable behind a new one.
+  {
+    phone::journal_t journal(dir.path, large);
+    EXPECT_EQ(journal.get_first_seq(), 1u);
+    EXPECT_EQ(journal.get_next_seq(), 11u);
+    EXPECT_EQ(count(journal), 10u);
+  }
+  EXPECT_EQ(dir.list().size(), 2u);
+
+  // That one, left empty, is replaced rather than kept alongside.
+  {
+    phone::journal_t journal(dir.path, small);
+    EXPECT_EQ(count(journal), 10u);
+    EXPECT_EQ(journal.append(1, 10, make_fields(10)), 11u);
+    EXPECT_EQ(count(journal), 11u);
+  }
+  EXPECT_EQ(dir.list().size(), 2u);
+  phone::journal_t journal(dir.path, large);
+  EXPECT_EQ(count(journal), 11u);
+  EXPECT_EQ(journal.get_stats().discarded, 0u);
+  EXPECT_EQ(journal.append(1, 11, make_fields(11)), 12u);
+}
@@ -0,0 +1,553 @@
+#include <raspi-phone-tools/journal.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <dirent.h>
+
+namespace phone {
+  namespace {
+    const char segment_magic[8] = { 'P', 'H', 'J', 'R', 'N', 'L', '0', '2' };
+    const char *const segment_suffix = ".journal";
+
+    // The segment header: magic, first sequence number, when it was made,
+    // and a CRC of those.
+    const size_t header_bytes = 32;
+
+    // The record header: length of the record, header and fields but not
+    // padding, so never 0; CRC of the rest of the record; sequence number,
+    // time and event.
+    const size_t record_header_bytes = 32;
+
+    size_t align8(size_t size) {
+      return (size + 7) & ~static_cast<size_t>(7);
+    }
+
+    template <typename value_t>
+    void put(char *at, value_t value) {
+      std::memcpy(at, &value, sizeof(value));
+    }
+
+    template <typename value_t>
+    value_t get(const char *at) {
+      value_t value;
+      std::memcpy(&value, at, sizeof(value));
+      return value;
+    }
+
+    int64_t now_ms() {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Read the record at 'offset', if there's a whole one there before
+    // 'end', and return where the next one starts, or 0 if there isn't.
+    size_t read_record(const char *base, size_t end, size_t offset, journal_t::record_t &record) {
+      if (offset + record_header_bytes > end) {
+        return 0;
+      }
+      auto length = get<uint32_t>(base + offset);
+      auto next = offset + align8(length);
+      if (length < record_header_bytes || next > end) {
+        return 0;
+      }
+      record.seq = get<uint64_t>(base + offset + 8);
+      record.time_ms = get<int64_t>(base + offset + 16);
+      record.event = get<int32_t>(base + offset + 24);
+      record.fields = base + offset + record_header_bytes;
+      record.size = length - record_header_bytes;
+      return next;
+    }
+  }
+
+  struct journal_t::segment_t {
+    segment_t()
+        : first_seq(0),
+          end(0) {}
+
+    std::string path;
+    uint64_t first_seq;
+    util::mmap_t map;
+
+    // Where its records end, once it's no longer being written.
+    size_t end;
+
+    std::vector<index_entry_t> index;
+  };
+
+  journal_t::options_t::options_t()
+      : segment_bytes(4 << 20),
+        index_every(64),
+        sync_interval_ms(100),
+        sync_bytes(64 << 10),
+        max_segments(0) {}
+
+  journal_t::journal_t(const std::string &dir, const options_t &options)
+      : dir(dir),
+        options(options),
+        next_seq(1),
+        write_offset(0),
+        synced_offset(0),
+        stats(stats_t { 0, 0, 0, 0 }),
+        stopping(false) {
+    if (::mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+      util::throw_system_error();
+    }
+
+    // The segments there, by the sequence number in their names.
+    std::vector<std::pair<uint64_t, std::string>> found;
+    auto *listing = ::opendir(dir.c_str());
+    if (!listing) {
+      util::throw_system_error();
+    }
+    while (auto *entry = ::readdir(listing)) {
+      std::string name = entry->d_name;
+      auto suffix = std::strlen(segment_suffix);
+      if (name.size() == 20 + suffix && name.compare(20, suffix, segment_suffix) == 0 &&
+          std::all_of(name.begin(), name.begin() + 20, [](char c) { return c >= '0' && c <= '9'; })) {
+        found.emplace_back(std::stoull(name.substr(0, 20)), util::join_path({ dir, name }));
+      }
+    }
+    ::closedir(listing);
+    std::sort(found.begin(), found.end());
+
+    // Take them in order for as long as they check out and follow on;
+    // anything after a break can't be trusted to.
+    bool broken = false;
+    for (const auto &entry: found) {
+      if (broken) {
+        util::unlink(entry.second);
+        continue;
+      }
+      auto segment = std::make_shared<segment_t>();
+      segment->path = entry.second;
+      segment->map = util::mmap_t(
+          util::open(segment->path, util::access_t::read_write), util::map_access_t::read_write);
+      if (segment->map.size() < header_bytes) {
+        broken = true;
+        util::unlink(entry.second);
+        continue;
+      }
+      auto *base = segment->map.data();
+      segment->first_seq = get<uint64_t>(base + 8);
+      if (std::memcmp(base, segment_magic, sizeof(segment_magic)) != 0 ||
+          get<uint32_t>(base + 28) != crc32(base, 28) ||
+          segment->first_seq != entry.first ||
+          (!segments.empty() && segment->first_seq != next_seq)) {
+        broken = true;
+        util::unlink(entry.second);
+        continue;
+      }
+      next_seq = segment->first_seq;
+      broken = !recover(*segment);
+      segments.push_back(segment);
+      ++stats.segments;
+    }
+
+    if (!segments.empty()) {
+      // Carry on from the end of the last one's records, clearing anything
+      // past them, so nothing damaged looks like a record later.
+      auto &last = *segments.back();
+      write_offset = synced_offset = last.end;
+      if (broken) {
+        std::memset(last.map.data() + last.end, 0, last.map.size() - last.end);
+        last.map.sync();
+      }
+    }
+    if (!segments.empty() && segments.back()->map.size() != options.segment_bytes) {
+      // Sized for other options.  Keep its records and start a new one
+      // after them; unless it has none, in which case the new one, having
+      // the same name, takes its place.
+      if (segments.back()->end == header_bytes) {
+        segments.pop_back();
+        --stats.segments;
+        write_offset = synced_offset = segments.empty() ? 0 : segments.back()->end;
+      }
+      start_segment(next_seq);
+    } else if (segments.empty()) {
+      start_segment(next_seq);
+    }
+    flusher = std::thread([this]() { flush_loop(); });
+  }
+
+  journal_t::~journal_t() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      flush_cv.notify_all();
+    }
+    flusher.join();
+    sync();
+  }
+
+  bool journal_t::recover(segment_t &segment) {
+    auto *base = segment.map.data();
+    auto size = segment.map.size();
+    segment.map.advise(util::map_advice_t::sequential);
+    size_t offset = header_bytes;
+    record_t record;
+    for (;;) {
+      auto next = read_record(base, size, offset, record);
+      if (next == 0) {
+        break;
+      }
+      auto crc = crc32(base + offset + 8, next - offset - 8);
+      if (record.seq != next_seq || get<uint32_t>(base + offset + 4) != crc) {
+        break;
+      }
+      if ((record.seq - segment.first_seq) % options.index_every == 0) {
+        segment.index.push_back(index_entry_t { record.seq, record.time_ms, offset });
+      }
+      ++next_seq;
+      offset = next;
+    }
+    segment.end = offset;
+    // The end is a zero length, or no room for another header; anything
+    // else is damage.
+    bool clean = offset + record_header_bytes > size || get<uint32_t>(base + offset) == 0;
+    if (!clean) {
+      ++stats.discarded;
+    }
+    return clean;
+  }
+
+  void journal_t::start_segment(uint64_t first_seq) {
+    if (!segments.empty()) {
+      auto &last = *segments.back();
+      last.end = write_offset;
+      last.map.sync();
+      ++stats.syncs;
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu", static_cast<unsigned long long>(first_seq));
+    auto segment = std::make_shared<segment_t>();
+    segment->path = util::join_path({ dir, name + std::string { segment_suffix } });
+    segment->first_seq = first_seq;
+    segment->map = util::mmap_t(
+        util::open(
+            segment->path, util::access_t::read_write,
+            util::if_not_exists_t(0644), util::if_exists_t::truncate),
+        util::map_access_t::read_write);
+    try {
+      // Full size up front, disk space and all.
+      segment->map.resize(options.segment_bytes);
+    } catch (...) {
+      util::unlink(segment->path);
+      throw;
+    }
+    auto *base = segment->map.data();
+    std::memcpy(base, segment_magic, sizeof(segment_magic));
+    put<uint64_t>(base + 8, first_seq);
+    put<int64_t>(base + 16, now_ms());
+    put<uint32_t>(base + 24, 1);
+    put<uint32_t>(base + 28, crc32(base, 28));
+
+    // So the new file's name survives a crash too.
+    auto parent = util::open(dir);
+    fsync(parent);
+
+    if (options.max_segments != 0 && segments.size() >= options.max_segments) {
+      auto drop = segments.size() + 1 - options.max_segments;
+      for (size_t i = 0; i < drop; ++i) {
+        util::unlink(segments[i]->path);
+      }
+      segments.erase(segments.begin(), segments.begin() + static_cast<std::ptrdiff_t>(drop));
+    }
+    segments.push_back(segment);
+    ++stats.segments;
+    write_offset = header_bytes;
+    synced_offset = 0;
+  }
+
+  uint64_t journal_t::append(int event, int64_t time_ms, const json_t::object_t &fields) {
+    auto body = encode(fields);
+    auto total = align8(record_header_bytes + body.size());
+    if (header_bytes + total > options.segment_bytes) {
+      throw std::length_error("event too big for a journal segment");
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (write_offset + total > options.segment_bytes) {
+      start_segment(next_seq);
+    }
+    auto &segment = *segments.back();
+    auto *at = segment.map.data() + write_offset;
+    put<uint64_t>(at + 8, next_seq);
+    put<int64_t>(at + 16, time_ms);
+    put<int32_t>(at + 24, static_cast<int32_t>(event));
+    put<uint32_t>(at + 28, 0);
+    std::memcpy(at + record_header_bytes, body.data(), body.size());
+    std::memset(at + record_header_bytes + body.size(), 0, total - record_header_bytes - body.size());
+    put<uint32_t>(at + 4, crc32(at + 8, total - 8));
+    // The length last, so a reader never sees a record half there.
+    put<uint32_t>(at, static_cast<uint32_t>(record_header_bytes + body.size()));
+
+    if ((next_seq - segment.first_seq) % options.index_every == 0) {
+      segment.index.push_back(index_entry_t { next_seq, time_ms, write_offset });
+    }
+    write_offset += total;
+    ++stats.appended;
+    if (write_offset - synced_offset >= options.sync_bytes) {
+      flush_cv.notify_one();
+    }
+    return next_seq++;
+  }
+
+  void journal_t::sync() {
+    std::unique_lock<std::mutex> lock(mutex);
+    flush(lock);
+  }
+
+  void journal_t::flush(std::unique_lock<std::mutex> &lock) {
+    if (segments.empty() || write_offset == synced_offset) {
+      return;
+    }
+    auto segment = segments.back();
+    auto from = synced_offset;
+    auto to = write_offset;
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      segment->map.sync(from, to - from);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    if (segments.back() == segment) {
+      synced_offset = std::max(synced_offset, to);
+    }
+    ++stats.syncs;
+  }
+
+  void journal_t::flush_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      flush_cv.wait_for(lock, std::chrono::milliseconds(options.sync_interval_ms), [this]() {
+        return stopping || write_offset - synced_offset >= options.sync_bytes;
+      });
+      try {
+        flush(lock);
+      } catch (const std::exception &) {
+        // Tried again next time round, and by sync().
+      }
+    }
+  }
+
+  size_t journal_t::replay(uint64_t from_seq, const visitor_t &visit) {
+    std::vector<std::pair<std::shared_ptr<segment_t>, size_t>> spans;
+    size_t offset = header_bytes;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      // The last segment starting at or before 'from_seq', and in it, the
+      // last indexed record at or before it.
+      auto first = std::upper_bound(segments.begin(), segments.end(), from_seq,
+          [](uint64_t seq, const std::shared_ptr<segment_t> &segment) { return seq < segment->first_seq; });
+      if (first != segments.begin()) {
+        --first;
+      }
+      if (first != segments.end()) {
+        const auto &index = (*first)->index;
+        auto entry = std::upper_bound(index.begin(), index.end(), from_seq,
+            [](uint64_t seq, const index_entry_t &entry) { return seq < entry.seq; });
+        if (entry != index.begin()) {
+          offset = (entry - 1)->offset;
+        }
+      }
+      for (auto segment = first; segment != segments.end(); ++segment) {
+        spans.emplace_back(*segment, *segment == segments.back() ? write_offset : (*segment)->end);
+      }
+    }
+    return walk(spans, offset, from_seq, 0, visit);
+  }
+
+  size_t journal_t::replay_since(int64_t time_ms, const visitor_t &visit) {
+    std::vector<std::pair<std::shared_ptr<segment_t>, size_t>> spans;
+    size_t offset = header_bytes;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      // As for replay(), by the times in the index, finding the last entry
+      // strictly before 'time_ms', as records of the same time may go
+      // before it.
+      auto before = [](int64_t ms, const index_entry_t &entry) { return ms <= entry.time_ms; };
+      auto first = std::upper_bound(segments.begin(), segments.end(), time_ms,
+          [&before](int64_t ms, const std::shared_ptr<segment_t> &segment) {
+            return segment->index.empty() || before(ms, segment->index.front());
+          });
+      if (first != segments.begin()) {
+        --first;
+      }
+      if (first != segments.end()) {
+        const auto &index = (*first)->index;
+        auto entry = std::upper_bound(index.begin(), index.end(), time_ms, before);
+        if (entry != index.begin()) {
+          offset = (entry - 1)->offset;
+        }
+      }
+      for (auto segment = first; segment != segments.end(); ++segment) {
+        spans.emplace_back(*segment, *segment == segments.back() ? write_offset : (*segment)->end);
+      }
+    }
+    return walk(spans, offset, 0, time_ms, visit);
+  }
+
+  size_t journal_t::walk(
+      const std::vector<std::pair<std::shared_ptr<segment_t>, size_t>> &spans, size_t offset,
+      uint64_t from_seq, int64_t from_ms, const visitor_t &visit) {
+    size_t seen = 0;
+    bool started = false;
+    record_t record;
+    for (const auto &span: spans) {
+      for (size_t next; (next = read_record(span.first->map.data(), span.second, offset, record)) != 0; offset = next) {
+        if (!started) {
+          if (record.seq < from_seq || record.time_ms < from_ms) {
+            continue;
+          }
+          started = true;
+        }
+        ++seen;
+        if (!visit(record)) {
+          return seen;
+        }
+      }
+      offset = header_bytes;
+    }
+    return seen;
+  }
+
+  uint64_t journal_t::get_first_seq() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return segments.empty() ? next_seq : segments.front()->first_seq;
+  }
+
+  uint64_t journal_t::get_next_seq() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return next_seq;
+  }
+
+  journal_t::stats_t journal_t::get_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+  json_t::object_t journal_t::record_t::decode() const {
+    return journal_t::decode(fields, size);
+  }
+
+  // Each field is a type byte, the length of its name in one byte, the
+  // name, and then by type: 'n', an 8-byte double; 's' and 'j', a 4-byte
+  // length and the string or JSON text; 't', 'f' and 'z', nothing.
+  std::string journal_t::encode(const json_t::object_t &fields) {
+    std::string out;
+    for (const auto &field: fields) {
+      if (field.first.size() > 255) {
+        throw std::length_error("field name too long for the journal: " + field.first);
+      }
+      auto start = [&out, &field](char type) {
+        out += type;
+        out += static_cast<char>(field.first.size());
+        out += field.first;
+      };
+      auto put_text = [&out](const std::string &text) {
+        char length[4];
+        put<uint32_t>(length, static_cast<uint32_t>(text.size()));
+        out.append(length, sizeof(length));
+        out += text;
+      };
+      const auto &value = field.second;
+      if (auto *number = value.try_as<json_t::number_t>()) {
+        start('n');
+        char bytes[8];
+        put<double>(bytes, *number);
+        out.append(bytes, sizeof(bytes));
+      } else if (auto *string = value.try_as<json_t::string_t>()) {
+        start('s');
+        put_text(*string);
+      } else if (auto *boolean = value.try_as<json_t::boolean_t>()) {
+        start(*boolean ? 't' : 'f');
+      } else if (value.get_kind() == json_t::null) {
+        start('z');
+      } else {
+        start('j');
+        put_text(value.encode());
+      }
+    }
+    return out;
+  }
+
+  json_t::object_t journal_t::decode(const char *data, size_t size) {
+    json_t::object_t fields;
+    size_t at = 0;
+    auto need = [&at, size](size_t bytes) {
+      if (at + bytes > size) {
+        throw std::runtime_error("journal record is cut short");
+      }
+    };
+    while (at < size) {
+      need(2);
+      auto type = data[at];
+      auto name_size = static_cast<unsigned char>(data[at + 1]);
+      at += 2;
+      need(name_size);
+      std::string name(data + at, name_size);
+      at += name_size;
+      switch (type) {
+        case 'n':
+          need(8);
+          fields[name] = get<double>(data + at);
+          at += 8;
+          break;
+        case 's':
+        case 'j': {
+          need(4);
+          auto length = get<uint32_t>(data + at);
+          at += 4;
+          need(length);
+          std::string text(data + at, length);
+          at += length;
+          if (type == 's') {
+            fields[name] = std::move(text);
+          } else {
+            fields[name] = json_t::decode(text);
+          }
+          break;
+        }
+        case 't':
+        case 'f':
+          fields[name] = type == 't';
+          break;
+        case 'z':
+          fields[name] = json_t {};
+          break;
+        default:
+          throw std::runtime_error("bad field type in journal record");
+      }
+    }
+    return fields;
+  }
+
+  uint32_t journal_t::crc32(const void *data, size_t size, uint32_t crc) {
+    static const struct table_t {
+      table_t() {
+        for (uint32_t i = 0; i < 256; ++i) {
+          uint32_t value = i;
+          for (int bit = 0; bit < 8; ++bit) {
+            value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+          }
+          entries[i] = value;
+        }
+      }
+      uint32_t entries[256];
+    } table;
+    auto *bytes = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+      crc = table.entries[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <json/json.h>
+#include <raspi-phone-tools/util.h>
+
+namespace phone {
+  // An append-only log of events on disk, so what happened while nobody
+  // was listening can be caught up on later, even across a restart.
+  //
+  // The log is a directory of fixed-size segment files, each named for the
+  // sequence number of its first record, created full size and mapped into
+  // memory, so appending is a copy rather than a system call.  Each record
+  // is a small binary header (length, CRC-32, sequence number, time, event)
+  // and the event's fields in a compact binary form, padded to 8 bytes.  The
+  // length counts the header, so is never 0, even for an event with no
+  // fields; a zero length marks the end of what's been written.
+  //
+  // Written records are flushed to disk in batches, by a thread of the
+  // journal's own, at most 'sync_interval_ms' after they're appended, or
+  // sooner once 'sync_bytes' are waiting.  On opening, the segments are
+  // checked record by record; anything after the first record that's torn
+  // or fails its CRC is discarded.
+  //
+  // Every 'index_every' records, the sequence number, time and offset go in
+  // a sparse in-memory index, so replay from a sequence number or time
+  // finds its start with a binary search and a short walk, then reads
+  // straight through the mapped segments.  Thread-safe.
+  class journal_t final {
+    public:
+      struct options_t {
+        options_t();
+
+        // The size of each segment file.
+        size_t segment_bytes;
+
+        size_t index_every;
+        int sync_interval_ms;
+        size_t sync_bytes;
+
+        // The most segments to keep; the oldest go when a new one starts.
+        // 0 keeps them all.
+        size_t max_segments;
+      };
+
+      // A record as it lies in the journal.  'fields' points into the
+      // mapped segment, so is only good during the replay callback.
+      struct record_t {
+        uint64_t seq;
+        int64_t time_ms;
+        int event;
+        const char *fields;
+        size_t size;
+
+        // The fields, decoded.
+        json_t::object_t decode() const;
+      };
+
+      // Return false to stop the replay.
+      using visitor_t = std::function<bool(const record_t &)>;
+
+      struct stats_t {
+        uint64_t appended;
+        uint64_t syncs;
+        uint64_t segments;
+
+        // Records found damaged, and so dropped, when opening.
+        uint64_t discarded;
+      };
+
+      // Open the journal in the directory, creating both if need be, and
+      // recover what's there.
+      explicit journal_t(const std::string &dir, const options_t &options = options_t());
+
+      // Flush what's been written.
+      ~journal_t();
+
+      journal_t(const journal_t &) = delete;
+      journal_t &operator=(const journal_t &) = delete;
+
+      // Write a record and return its sequence number.  Throws
+      // std::length_error if the event won't fit in a segment.
+      uint64_t append(int event, int64_t time_ms, const json_t::object_t &fields);
+
+      // Flush what's been written to disk now.
+      void sync();
+
+      // Call 'visit' with each record from the one numbered 'from_seq' on,
+      // or from the first at or after 'time_ms', in order.  Return how
+      // many it saw.  Records appended meanwhile may or may not be seen.
+      size_t replay(uint64_t from_seq, const visitor_t &visit);
+      size_t replay_since(int64_t time_ms, const visitor_t &visit);
+
+      // The sequence number of the first record kept, and the one the next
+      // record will get.
+      uint64_t get_first_seq();
+      uint64_t get_next_seq();
+
+      stats_t get_stats();
+
+      // Encode and decode the fields as records hold them.  Nested arrays
+      // and objects are kept as JSON text.
+      static std::string encode(const json_t::object_t &fields);
+      static json_t::object_t decode(const char *data, size_t size);
+
+      // The CRC-32 (IEEE) of the bytes, continuing from 'crc'.
+      static uint32_t crc32(const void *data, size_t size, uint32_t crc = 0);
+
+    private:
+      // A segment, mapped.
+      struct segment_t;
+
+      struct index_entry_t {
+        uint64_t seq;
+        int64_t time_ms;
+        size_t offset;
+      };
+
+      // Check and index the segment's records, which should start at
+      // 'next_seq', and advance it past them.  Return false if any were
+      // damaged.
+      bool recover(segment_t &segment);
+
+      // Begin a new segment whose first record is numbered 'first_seq'.
+      void start_segment(uint64_t first_seq);
+
+      // Flush the current segment's unflushed bytes.  Called with the lock
+      // held, which it lets go of while it waits for the disk.
+      void flush(std::unique_lock<std::mutex> &lock);
+
+      // The body of the flushing thread.
+      void flush_loop();
+
+      // Walk the segments, from the given offset in the first, skipping
+      // records before 'from_seq' and before 'from_ms'.
+      size_t walk(
+          const std::vector<std::pair<std::shared_ptr<segment_t>, size_t>> &spans, size_t offset,
+          uint64_t from_seq, int64_t from_ms, const visitor_t &visit);
+
+      const std::string dir;
+      const options_t options;
+
+      std::mutex mutex;
+      std::condition_variable flush_cv;
+
+      // Oldest first.  The last is the one being written.
+      std::vector<std::shared_ptr<segment_t>> segments;
+
+      uint64_t next_seq;
+
+      // Where the next record goes in the current segment, and how far it
+      // has been flushed.
+      size_t write_offset;
+      size_t synced_offset;
+
+      stats_t stats;
+      bool stopping;
+      std::thread flusher;
+  };
+}
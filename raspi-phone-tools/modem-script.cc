@@ -0,0 +1,99 @@
+#include <raspi-phone-tools/modem-script.h>
+
+#include <stdexcept>
+
+namespace phone {
+  script_t::script_t()
+      : resume_point(0),
+        phone(nullptr),
+        done(false),
+        op(op_t::none),
+        timeout_ms(0),
+        priority(phone_t::priority_t::normal),
+        result(phone_t::result_t {
+          phone_t::status_t::timeout, std::string {},
+          phone_t::time_point_t {}, phone_t::time_point_t {}, false }) {}
+
+  script_t::~script_t() = default;
+
+  void script_t::start(phone_t &phone, const std::shared_ptr<script_t> &script) {
+    if (script->phone) {
+      throw std::logic_error("script already started");
+    }
+    script->phone = &phone;
+    phone.defer([script]() { script->step(); });
+  }
+
+  void script_t::command(const std::string &cmd, int timeout_ms, phone_t::priority_t priority) {
+    op = op_t::command;
+    text = cmd;
+    this->timeout_ms = timeout_ms;
+    this->priority = priority;
+  }
+
+  void script_t::command_with_body(
+      const std::string &cmd, const std::string &body,
+      int timeout_ms, phone_t::priority_t priority) {
+    command(cmd, timeout_ms, priority);
+    op = op_t::command_with_body;
+    op_body = body;
+  }
+
+  void script_t::await_urc(const std::string &prefix, int timeout_ms) {
+    op = op_t::await_urc;
+    text = prefix;
+    this->timeout_ms = timeout_ms;
+  }
+
+  void script_t::sleep(int delay_ms) {
+    op = op_t::sleep;
+    timeout_ms = delay_ms;
+  }
+
+  void script_t::step() {
+    op = op_t::none;
+    try {
+      body();
+      launch();
+    } catch (...) {
+      done = true;
+      throw;
+    }
+  }
+
+  void script_t::launch() {
+    if (op == op_t::none) {
+      done = true;
+      return;
+    }
+    // The phone's callbacks hold the script until it resumes.
+    auto self = shared_from_this();
+    auto on_result = [self](const phone_t::result_t &result) {
+      self->result = result;
+      self->step();
+    };
+    auto on_line = [this](const std::string &line) { lines.push_back(line); };
+    switch (op) {
+      case op_t::command:
+        lines.clear();
+        phone->command_async(text, on_result, on_line, timeout_ms, priority);
+        break;
+      case op_t::command_with_body:
+        lines.clear();
+        phone->command_with_body_async(text, op_body, on_result, on_line, timeout_ms, priority);
+        op_body.clear();
+        break;
+      case op_t::await_urc:
+        phone->await_urc(text, [self](const std::string &line) {
+          self->urc = line;
+          self->step();
+        }, timeout_ms);
+        break;
+      case op_t::sleep:
+        phone->defer([self]() { self->step(); }, timeout_ms);
+        break;
+      case op_t::none:
+        break;
+    }
+  }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <raspi-phone-tools/phone.h>
+
+// Begin and end the body of a script_t.
+#define PHONE_SCRIPT_BEGIN switch (resume_point) { case 0:
+#define PHONE_SCRIPT_END }
+
+// Start one of a script_t's operations and pick up here when it completes.
+// At most one per line.
+#define PHONE_AWAIT(op) \
+  do { \
+    resume_point = __LINE__; \
+    op; \
+    return; \
+    case __LINE__:; \
+  } while (0)
+
+namespace phone {
+  // A multi-step exchange with the modem, such as sending a message
+  // (AT+CMGS, the prompt, the body, the +CMGS reference) or dialing and
+  // waiting for the far end to pick up, written as straight-line code
+  // which waits without holding a thread.
+  //
+  // A script is a stackless coroutine.  body() runs on the phone's worker
+  // thread; each PHONE_AWAIT starts an operation and returns, and when the
+  // operation completes, body() is called again and jumps back to where it
+  // left off.  So anything which must live across a wait belongs in a
+  // member, not a local, and a script costs only its own size while it
+  // waits, rather than a thread's stack.  A script ends when body() returns
+  // other than by waiting.
+  //
+  //   void body() override {
+  //     PHONE_SCRIPT_BEGIN
+  //     PHONE_AWAIT(command_with_body("AT+CMGS=\"" + number + "\"", text));
+  //     if (!get_result().ok()) {
+  //       return;
+  //     }
+  //     PHONE_AWAIT(await_urc("+CDS:", 60000));
+  //     delivered = !get_urc().empty();
+  //     PHONE_SCRIPT_END
+  //   }
+  //
+  // The operations only say what to wait for; it's started once body() has
+  // returned, so a script never runs on two threads at once.  If body()
+  // throws, the script ends and the phone emits an error event.
+  class script_t : public std::enable_shared_from_this<script_t> {
+    public:
+      virtual ~script_t();
+
+      script_t(const script_t &) = delete;
+      script_t &operator=(const script_t &) = delete;
+
+      // Run the script on the phone's worker thread, which listen() starts.
+      // The phone keeps it alive until it ends.  The phone must outlive it.
+      static void start(phone_t &phone, const std::shared_ptr<script_t> &script);
+
+      // True once the script has ended.
+      bool is_done() const { return done.load(); }
+
+    protected:
+      script_t();
+
+      // The script itself, between PHONE_SCRIPT_BEGIN and PHONE_SCRIPT_END.
+      virtual void body() = 0;
+
+      // The operations, for PHONE_AWAIT.  command() and
+      // command_with_body() leave the outcome in get_result() and the
+      // response's information lines in get_lines(); await_urc() leaves the
+      // line in get_urc(), empty if it timed out.
+      void command(
+          const std::string &cmd,
+          int timeout_ms = phone_t::default_timeout_ms,
+          phone_t::priority_t priority = phone_t::priority_t::normal);
+      void command_with_body(
+          const std::string &cmd, const std::string &body,
+          int timeout_ms = phone_t::default_timeout_ms,
+          phone_t::priority_t priority = phone_t::priority_t::normal);
+      void await_urc(const std::string &prefix, int timeout_ms = phone_t::default_timeout_ms);
+      void sleep(int delay_ms);
+
+      const phone_t::result_t &get_result() const { return result; }
+      const std::vector<std::string> &get_lines() const { return lines; }
+      const std::string &get_urc() const { return urc; }
+
+      phone_t &get_phone() const { return *phone; }
+
+      // Where body() picks up; for the macros.
+      int resume_point;
+
+    private:
+      enum class op_t {
+        none,
+        command,
+        command_with_body,
+        await_urc,
+        sleep
+      };
+
+      // Run body() up to its next wait, then start what it waits for.
+      void step();
+
+      // Start what body() asked to wait for, or end the script if nothing.
+      void launch();
+
+      phone_t *phone;
+      std::atomic<bool> done;
+
+      // What body() asked to wait for.  'text' is the command or prefix.
+      op_t op;
+      std::string text;
+      std::string op_body;
+      int timeout_ms;
+      phone_t::priority_t priority;
+
+      phone_t::result_t result;
+      std::vector<std::string> lines;
+      std::string urc;
+  };
+}
@@ -0,0 +1,201 @@
+#include <raspi-phone-tools/modem-sim.h>
+#include <raspi-phone-tools/at.h>
+
+#include <cctype>
+#include <chrono>
+#include <stdlib.h>
+
+namespace phone {
+  modem_sim_t::modem_sim_t()
+      : master(util::make_fd(posix_openpt(O_RDWR | O_NOCTTY))),
+        run(true),
+        delay_us(0),
+        echo(false) {
+    util::throw_if_lt0(grantpt(master));
+    util::throw_if_lt0(unlockpt(master));
+    slave_name = ptsname(master);
+    task = std::thread([this]() { serve(); });
+  }
+
+  modem_sim_t::~modem_sim_t() {
+    run = false;
+    task.join();
+  }
+
+  const std::string &modem_sim_t::port() const {
+    return slave_name;
+  }
+
+  void modem_sim_t::on(const std::string &prefix, handler_t handler) {
+    std::lock_guard<std::mutex> lock(mutex);
+    handlers.emplace_back(prefix, std::move(handler));
+  }
+
+  void modem_sim_t::on_body(const std::string &prefix, body_handler_t handler) {
+    std::lock_guard<std::mutex> lock(mutex);
+    body_handlers.emplace_back(prefix, std::move(handler));
+  }
+
+  void modem_sim_t::send(const std::string &line) {
+    std::string framed = "\r\n" + line + "\r\n";
+    std::lock_guard<std::mutex> lock(write_mutex);
+    util::write_exactly(master, framed.data(), framed.size());
+  }
+
+  void modem_sim_t::set_delay_us(int new_delay_us) {
+    delay_us = new_delay_us;
+  }
+
+  void modem_sim_t::set_echo(bool on) {
+    echo = on;
+  }
+
+  std::vector<std::string> modem_sim_t::received() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lines;
+  }
+
+  size_t modem_sim_t::count(const std::string &prefix) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t result = 0;
+    for (const auto &cmd: commands) {
+      if (at::starts_with(cmd, prefix)) {
+        ++result;
+      }
+    }
+    return result;
+  }
+
+  void modem_sim_t::serve() {
+    std::string buffer;
+    while (run) {
+      try {
+        if (!util::wait_readable(master, 20)) {
+          continue;
+        }
+        char buff[256];
+        auto actl = util::read_at_most(master, buff, sizeof(buff));
+        buffer.append(buff, actl);
+      } catch (const std::system_error &) {
+        // Nobody has the slave side open (EIO).  Wait for someone to.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        continue;
+      }
+      size_t end;
+      if (body_handler) {
+        // Ctrl-Z sends the body; Esc throws it away.
+        end = buffer.find_first_of("\x1a\x1b");
+        if (end == std::string::npos) {
+          continue;
+        }
+        std::string body = buffer.substr(0, end);
+        bool sent = buffer[end] == '\x1a';
+        buffer.erase(0, end + 1);
+        auto handler = std::move(body_handler);
+        body_handler = body_handler_t {};
+        send(sent ? handler(*this, body_cmd, body) : "OK");
+      }
+      while (!body_handler && (end = buffer.find('\r')) != std::string::npos) {
+        std::string line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        if (!line.empty() && line[0] == '\n') {
+          line.erase(0, 1);
+        }
+        execute(line);
+      }
+    }  // while
+  }
+
+  void modem_sim_t::execute(const std::string &line) {
+    if (line.size() < 2 || std::toupper(line[0]) != 'A' || std::toupper(line[1]) != 'T') {
+      return;
+    }
+    if (echo) {
+      std::string echoed = line + "\r\n";
+      std::lock_guard<std::mutex> lock(write_mutex);
+      util::write_exactly(master, echoed.data(), echoed.size());
+    }
+    if (delay_us) {
+      std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+    }
+    auto cmds = split(line.substr(2));
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      lines.push_back(line);
+      commands.insert(commands.end(), cmds.begin(), cmds.end());
+    }
+    std::string final = "OK";
+    for (const auto &cmd: cmds) {
+      handler_t handler;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (&cmd == &cmds.back()) {
+          for (const auto &entry: body_handlers) {
+            if (at::starts_with(cmd, entry.first)) {
+              body_cmd = cmd;
+              body_handler = entry.second;
+            }
+          }
+          if (body_handler) {
+            std::lock_guard<std::mutex> write_lock(write_mutex);
+            util::write_exactly(master, "\r\n> ", 4);
+            return;
+          }
+        }
+        size_t best = 0;
+        for (const auto &entry: handlers) {
+          if (at::starts_with(cmd, entry.first) && entry.first.size() >= best) {
+            best = entry.first.size();
+            handler = entry.second;
+          }
+        }
+      }
+      if (handler) {
+        final = handler(*this, cmd);
+        if (final != "OK") {
+          break;
+        }
+      }
+    }  // for
+    if (!final.empty()) {
+      send(final);
+    }
+  }
+
+  std::vector<std::string> modem_sim_t::split(const std::string &body) {
+    std::vector<std::string> result;
+    size_t csr = 0;
+    while (csr < body.size()) {
+      char c = body[csr];
+      if (c == ';' || c == ' ') {
+        ++csr;
+      } else if (c == '+' || c == '^') {
+        // An extended command runs to the next semicolon outside quotes.
+        size_t end = csr;
+        bool quoted = false;
+        for (; end < body.size(); ++end) {
+          if (body[end] == '"') {
+            quoted = !quoted;
+          } else if (body[end] == ';' && !quoted) {
+            break;
+          }
+        }
+        result.push_back(body.substr(csr, end - csr));
+        csr = end;
+      } else if (std::toupper(c) == 'D') {
+        // A dial string takes the rest of the line, including its semicolon.
+        result.push_back(body.substr(csr));
+        csr = body.size();
+      } else {
+        // A basic command: an optional '&', a letter, then any digits.
+        size_t end = csr + (c == '&' ? 2 : 1);
+        while (end < body.size() && std::isdigit(body[end])) {
+          ++end;
+        }
+        result.push_back(body.substr(csr, end - csr));
+        csr = end;
+      }
+    }  // while
+    return result;
+  }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <raspi-phone-tools/util.h>
+
+namespace phone {
+  // A fake modem sitting on the master side of a pseudo-terminal.  Point a
+  // phone_t at port() and it behaves like a serial modem: command lines are
+  // split into their individual commands ("ATE0+CMEE=1;+CLIP=1" is three),
+  // each is handed to the handler registered for the longest matching prefix,
+  // and the final result code goes back when the line is done.  Commands with
+  // no handler answer OK.  Used by the tests and the benchmarks.
+  class modem_sim_t final {
+    public:
+      // Handles one command, given without the leading "AT" (for example,
+      // "+CPBR=1,10").  It may send information lines with send() and
+      // returns the final result code, such as "OK" or "+CME ERROR: 22", or
+      // an empty string to send none.
+      using handler_t = std::function<std::string(modem_sim_t &, const std::string &)>;
+
+      // Handles a command which prompts for a body, such as "+CMGS=...",
+      // given the command and the body which followed the prompt, less its
+      // Ctrl-Z.  Returns the final result code.
+      using body_handler_t = std::function<std::string(
+          modem_sim_t &, const std::string &, const std::string &)>;
+
+      // Open the pseudo-terminal and start answering.
+      modem_sim_t();
+
+      // Stop answering and close the pseudo-terminal.
+      ~modem_sim_t();
+
+      // The path of the slave side, for phone_t to open.
+      const std::string &port() const;
+
+      // Register the handler for commands starting with 'prefix'.
+      void on(const std::string &prefix, handler_t handler);
+
+      // Register the handler for commands starting with 'prefix' which
+      // prompt for a body.  Such a command must end its line.
+      void on_body(const std::string &prefix, body_handler_t handler);
+
+      // Send a line to the phone, framed as the modem would: "\r\nline\r\n".
+      // Safe to call from any thread, so tests can inject unsolicited lines.
+      void send(const std::string &line);
+
+      // Wait this long before answering each command line, to stand in for
+      // the modem's processing time.
+      void set_delay_us(int delay_us);
+
+      // Echo each command line back before answering it, as a modem does
+      // until told ATE0.  Off to start with.
+      void set_echo(bool on);
+
+      // Every command line received so far, in order.
+      std::vector<std::string> received();
+
+      // The number of individual commands received so far which start with
+      // 'prefix'.
+      size_t count(const std::string &prefix);
+
+    private:
+      // The body of the answering thread.
+      void serve();
+
+      // Run each command on the line and send the final result code.
+      void execute(const std::string &line);
+
+      // Split a command line, less its "AT", into individual commands.
+      static std::vector<std::string> split(const std::string &body);
+
+      util::fd_t master;
+      std::string slave_name;
+      std::atomic<bool> run;
+      std::atomic<int> delay_us;
+      std::atomic<bool> echo;
+      std::mutex mutex;
+      std::vector<std::pair<std::string, handler_t>> handlers;
+      std::vector<std::pair<std::string, body_handler_t>> body_handlers;
+
+      // The command whose body we are reading, if any, and its handler.
+      // Touched only by the answering thread.
+      std::string body_cmd;
+      body_handler_t body_handler;
+      std::vector<std::string> lines;
+      std::vector<std::string> commands;
+      std::mutex write_mutex;
+      std::thread task;
+  };
+}
@@ -0,0 +1,82 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/mpsc-queue.h>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace {
+  struct item_t : phone::mpsc_node_t {
+    int producer;
+    int seq;
+  };
+}
+
+FIXTURE(mpsc_queue_in_order) {
+  phone::mpsc_queue_t queue;
+  EXPECT_TRUE(queue.pop() == nullptr);
+  EXPECT_FALSE(queue.busy());
+  std::vector<item_t> items(10);
+  for (int round = 0; round < 3; ++round) {
+    // Drain it part way, and all the way, so the stub goes round.
+    for (int i = 0; i < 10; ++i) {
+      items[i].seq = i;
+      queue.push(&items[i]);
+    }
+    EXPECT_TRUE(queue.busy());
+    for (int i = 0; i < 10; ++i) {
+      auto item = static_cast<item_t *>(queue.pop());
+      EXPECT_TRUE(item != nullptr);
+      EXPECT_EQ(item->seq, i);
+    }
+    EXPECT_TRUE(queue.pop() == nullptr);
+    EXPECT_FALSE(queue.busy());
+  }
+}
+
+FIXTURE(mpsc_queue_across_threads) {
+  phone::mpsc_queue_t queue;
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(queue.wait(20));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+  static const int producers = 8;
+  static const int count = 50000;
+  std::vector<item_t> items(producers * count);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&queue, &items, p]() {
+      for (int i = 0; i < count; ++i) {
+        auto &item = items[p * count + i];
+        item.producer = p;
+        item.seq = i;
+        queue.push(&item);
+        // Now and then, let the consumer fall asleep.
+        if (i % 10000 == 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+    });
+  }
+  // Each producer's items come out in the order it pushed them.
+  std::vector<int> next(producers, 0);
+  int popped = 0;
+  bool ordered = true;
+  while (popped < producers * count && queue.wait(1000)) {
+    auto item = static_cast<item_t *>(queue.pop());
+    if (!item) {
+      std::this_thread::yield();
+      continue;
+    }
+    ordered = ordered && item->seq == next[item->producer];
+    next[item->producer] = item->seq + 1;
+    ++popped;
+  }
+  for (auto &thread: threads) {
+    thread.join();
+  }
+  EXPECT_EQ(popped, producers * count);
+  EXPECT_TRUE(ordered);
+  EXPECT_FALSE(queue.busy());
+  EXPECT_GT(queue.get_wakes(), 0u);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <raspi-phone-tools/spsc-ring.h>
+
+namespace phone {
+  // The link an item needs to go in an mpsc_queue_t.  Derive from it.
+  struct mpsc_node_t {
+    std::atomic<mpsc_node_t *> next;
+  };
+
+  // An unbounded queue from any number of producer threads to exactly one
+  // consumer thread, of items the producers own, linked through the
+  // mpsc_node_t they derive from.  So pushing never allocates, and never
+  // waits: it's one atomic exchange and a store, whatever the other
+  // producers are doing.  An item must stay put until the consumer is done
+  // with it.
+  //
+  // Producers swap themselves in at the head; the consumer follows the
+  // links from the tail.  A producer caught between its exchange and its
+  // store leaves the items after it out of sight for a moment, so pop()
+  // can come back empty-handed while busy() is true; try again shortly.  A
+  // consumer with nothing to do can wait() without spinning.
+  class mpsc_queue_t final {
+    public:
+      mpsc_queue_t()
+          : head(&stub),
+            tail(&stub) {
+        stub.next.store(nullptr, std::memory_order_relaxed);
+      }
+
+      mpsc_queue_t(const mpsc_queue_t &) = delete;
+      mpsc_queue_t &operator=(const mpsc_queue_t &) = delete;
+
+      // Any thread: add the item at the back, waking the consumer if it
+      // waits.
+      void push(mpsc_node_t *node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        auto prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+        wakeup.notify();
+      }
+
+      // Consumer: take the item at the front, or null if there's none yet.
+      mpsc_node_t *pop() {
+        auto first = tail;
+        auto next = first->next.load(std::memory_order_acquire);
+        if (first == &stub) {
+          if (!next) {
+            return nullptr;
+          }
+          tail = first = next;
+          next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+          tail = next;
+          return first;
+        }
+        // 'first' is the last item, unless a push is under way.  Put the
+        // stub behind it, so it can be handed out.
+        if (first != head.load(std::memory_order_acquire)) {
+          return nullptr;
+        }
+        push_stub();
+        next = first->next.load(std::memory_order_acquire);
+        if (next) {
+          tail = next;
+          return first;
+        }
+        return nullptr;
+      }
+
+      // Consumer: true iff. something has been pushed which pop() hasn't
+      // handed out, though it may not be able to yet.
+      bool busy() const {
+        return head.load(std::memory_order_acquire) != &stub || tail != &stub;
+      }
+
+      // Consumer: wait up to 'timeout_ms' for a push, and return true iff.
+      // there's anything to pop.
+      bool wait(int timeout_ms) {
+        return wakeup.wait_until([this]() { return busy(); }, timeout_ms);
+      }
+
+      // How many times the consumer had to be woken.
+      uint64_t get_wakes() const {
+        return wakeup.get_wakes();
+      }
+
+    private:
+      void push_stub() {
+        stub.next.store(nullptr, std::memory_order_relaxed);
+        auto prev = head.exchange(&stub, std::memory_order_acq_rel);
+        prev->next.store(&stub, std::memory_order_release);
+      }
+
+      // The producers'.
+      std::atomic<mpsc_node_t *> head;
+      char pad0[cache_line_bytes];
+
+      // The consumer's.
+      mpsc_node_t *tail;
+      mpsc_node_t stub;
+      char pad1[cache_line_bytes];
+
+      wakeup_t wakeup;
+  };
+}
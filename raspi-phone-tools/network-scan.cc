@@ -0,0 +1,142 @@
+#include <raspi-phone-tools/network-scan.h>
+#include <raspi-phone-tools/at.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace phone {
+  constexpr int network_scan_t::default_timeout_ms;
+
+  long network_scan_t::snapshot_t::age_ms() const {
+    if (!valid) {
+      return -1;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - scanned_at).count();
+  }
+
+  network_scan_t::network_scan_t(
+      phone_t &phone, phone_t *channel, int timeout_ms, bool use_primary)
+      : channel(channel ? *channel : phone),
+        timeout_ms(timeout_ms),
+        can_scan(channel || use_primary) {
+    snapshot.valid = false;
+    snapshot.scanning = false;
+    snapshot.took_ms = 0;
+  }
+
+  network_scan_t::~network_scan_t() {
+    if (task.joinable()) {
+      task.join();
+    }
+  }
+
+  network_scan_t::snapshot_t network_scan_t::get() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return snapshot;
+  }
+
+  network_scan_t::snapshot_t network_scan_t::get(long max_age_ms) {
+    auto current = get();
+    if (!current.scanning && (!current.valid || current.age_ms() > max_age_ms)) {
+      if (!refresh()) {
+        return get();
+      }
+      current.scanning = true;
+    }
+    return current;
+  }
+
+  bool network_scan_t::refresh(done_t done) {
+    std::thread finished;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!can_scan) {
+        snapshot.error = "no secondary channel to scan on";
+        return false;
+      }
+      if (snapshot.scanning) {
+        return false;
+      }
+      snapshot.scanning = true;
+      finished = std::move(task);
+      task = std::thread([this, done]() { scan(done); });
+    }
+    // The last scan's thread is done with the snapshot, but may still be
+    // in its callback, so reap it without the lock held.  If it's this
+    // thread, called back from that callback, it's about to return anyway.
+    if (finished.joinable()) {
+      if (finished.get_id() == std::this_thread::get_id()) {
+        finished.detach();
+      } else {
+        finished.join();
+      }
+    }
+    return true;
+  }
+
+  void network_scan_t::scan(done_t done) {
+    // Let everything else on the box go first.  Linux applies nice values
+    // per thread; if we can't lower ours, carry on regardless.
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+
+    std::vector<operator_t> operators;
+    auto start = std::chrono::steady_clock::now();
+    phone_t::result_t result;
+    try {
+      result = channel.command("AT+COPS=?", [&operators](const std::string &line) {
+        if (at::starts_with(line, "+COPS:")) {
+          operators = parse(line);
+        }
+      }, timeout_ms, phone_t::priority_t::bulk);
+    } catch (const std::exception &ex) {
+      result.status = phone_t::status_t::error;
+      result.final = ex.what();
+    }
+    auto now = std::chrono::steady_clock::now();
+
+    snapshot_t copy;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      snapshot.scanning = false;
+      if (result.ok()) {
+        snapshot.operators = std::move(operators);
+        snapshot.valid = true;
+        snapshot.scanned_at = now;
+        snapshot.took_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+        snapshot.error.clear();
+      } else {
+        snapshot.error = result.final.empty() ? "timeout" : result.final;
+      }
+      copy = snapshot;
+    }
+    if (done) {
+      done(copy);
+    }
+  }
+
+  std::vector<operator_t> network_scan_t::parse(const std::string &line) {
+    // +COPS: (2,"Op A","OpA","31026",7),(1,"Op B","OpB","31027",2),,(0-4),(0-2)
+    // The operators come first; an empty field separates them from the
+    // lists of supported modes and formats.
+    std::vector<operator_t> result;
+    for (const auto &group: at::split_params(line)) {
+      if (group.size() < 2 || group.front() != '(') {
+        break;
+      }
+      auto fields = at::split_params(":" + group.substr(1, group.size() - 2));
+      if (fields.size() < 4) {
+        break;
+      }
+      result.push_back(operator_t {
+        at::to_int(fields[0], 0),
+        fields[1],
+        fields[2],
+        fields[3],
+        fields.size() > 4 ? at::to_int(fields[4]) : -1
+      });
+    }
+    return result;
+  }
+}
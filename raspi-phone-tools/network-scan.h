@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // One network as listed by AT+COPS=?.
+  struct operator_t {
+    // 0 unknown, 1 available, 2 current, 3 forbidden.
+    int status;
+    std::string long_name;
+    std::string short_name;
+    std::string numeric;
+
+    // The access technology, or -1 if not given.
+    int act;
+  };
+
+  // Runs AT+COPS=?, which can tie the modem up for minutes, in the
+  // background, and keeps the last answer for anyone who asks.
+  //
+  // Callers get the cached list at once, with its age, and may ask for a
+  // refresh, which runs on a thread of its own at the lowest scheduling
+  // priority.  The scan goes out at bulk priority on a secondary channel (a
+  // second port on a modem with several, or a CMUX channel), so the primary
+  // stays free.  Without one, the scan would hold the primary for minutes,
+  // with every command, even an urgent dial, queued behind it; so it only
+  // runs there if the caller says so.
+  class network_scan_t final {
+    public:
+      // How long to let AT+COPS=? run.
+      static constexpr int default_timeout_ms = 180000;
+
+      // The cached result.
+      struct snapshot_t {
+        std::vector<operator_t> operators;
+
+        // True iff. a scan has ever succeeded.
+        bool valid;
+
+        // True iff. a scan is running now.
+        bool scanning;
+
+        // When the operators were scanned, and how long that took.
+        std::chrono::steady_clock::time_point scanned_at;
+        long took_ms;
+
+        // How the last scan failed, if it did.
+        std::string error;
+
+        // Milliseconds since the operators were scanned, or -1 if never.
+        long age_ms() const;
+      };
+
+      // Called when a refresh finishes, with the new snapshot, on the scan's
+      // own thread.  It may call get() and refresh().
+      using done_t = std::function<void(const snapshot_t &)>;
+
+      // Scan through 'channel' if given.  Otherwise scan through 'phone'
+      // only if 'use_primary' is true; if it isn't, refresh() refuses.
+      explicit network_scan_t(
+          phone_t &phone, phone_t *channel = nullptr,
+          int timeout_ms = default_timeout_ms, bool use_primary = false);
+
+      // Wait for any scan in progress to finish.
+      ~network_scan_t();
+
+      // The cached result, at once.
+      snapshot_t get();
+
+      // Start a scan in the background, unless one is running already, or
+      // there's no channel to scan on, in which case the snapshot's error
+      // says so.  Return true iff. this call started one.
+      bool refresh(done_t done = done_t {});
+
+      // Refresh if the cache is older than 'max_age_ms' (or empty), and
+      // return what is cached now.
+      snapshot_t get(long max_age_ms);
+
+      // Parse the answer to AT+COPS=?.
+      static std::vector<operator_t> parse(const std::string &line);
+
+    private:
+      // The body of a background scan.
+      void scan(done_t done);
+
+      phone_t &channel;
+      const int timeout_ms;
+
+      // False if there's no secondary channel and we mayn't use the primary.
+      const bool can_scan;
+      std::mutex mutex;
+      snapshot_t snapshot;
+      std::thread task;
+  };
+}
@@ -0,0 +1,795 @@
+#include <raspi-phone-tools/phone.h>
+#include <raspi-phone-tools/charset.h>
+#include <raspi-phone-tools/histogram.h>
+#include <raspi-phone-tools/modem-script.h>
+#include <raspi-phone-tools/modem-sim.h>
+#include <raspi-phone-tools/mpsc-queue.h>
+#include <raspi-phone-tools/spsc-ring.h>
+#include <raspi-phone-tools/task-pool.h>
+#include <raspi-phone-tools/timing-wheel.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+
+// Microbenchmarks for the hot paths.  Each prints one JSON object per line,
+// so runs on the Pi and on a workstation can be diffed.
+
+namespace {
+  using event_t = phone::phone_t::event_t;
+
+  // Nanoseconds per call of 'f', over 'iterations' calls.
+  template <typename func_t>
+  double time_ns(size_t iterations, func_t f) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+      f();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+        static_cast<double>(iterations);
+  }
+
+  // A URC's worth of event data.
+  json_t::object_t make_payload() {
+    return json_t::object_t {
+      { "line", std::string { "+CMTI: \"SM\",3" } },
+      { "name", std::string { "+CMTI" } }
+    };
+  }
+
+  // Emit one event with one listener on it, while 'others' listeners wait
+  // on other events, as JSON and as a struct.  The old dispatch, which
+  // scanned every listener and handed each a copy of the data, is timed
+  // alongside for comparison.
+  void bench_dispatch(size_t iterations) {
+    static const event_t other_events[] = {
+      event_t::onchar, event_t::error, event_t::sms, event_t::call, event_t::missedcall, event_t::delivery
+    };
+    auto payload = make_payload();
+    for (size_t others: { 0, 1, 4, 16, 64, 256, 1024 }) {
+      phone::modem_sim_t sim;
+      phone::phone_t phone(sim.port().c_str());
+      std::vector<std::pair<event_t, std::function<void(json_t::object_t)>>> scanned;
+      size_t calls = 0;
+      // Run on the emitting thread, so only dispatch is timed.
+      phone::phone_t::listener_options_t options;
+      options.queued = false;
+      for (size_t i = 0; i < others; ++i) {
+        auto event = other_events[i % (sizeof(other_events) / sizeof(other_events[0]))];
+        phone.on(event, [&calls](const json_t::object_t &) { ++calls; }, options);
+        scanned.emplace_back(event, [&calls](json_t::object_t) { ++calls; });
+      }
+      auto json_listener = phone.on(event_t::reply, [&calls](const json_t::object_t &) { ++calls; }, options);
+      scanned.emplace_back(event_t::reply, [&calls](json_t::object_t) { ++calls; });
+
+      auto indexed_ns = time_ns(iterations, [&]() { phone.emit(event_t::reply, payload); });
+
+      // As emitters do it, building the map each time.
+      std::string line { "+CMTI: \"SM\",3" };
+      auto built_ns = time_ns(iterations, [&]() {
+        phone.emit(event_t::reply, json_t::object_t {{ "line", line }});
+      });
+
+      // The same, as a struct to a typed listener: no map, no allocation.
+      phone.off(json_listener);
+      phone.on<phone::line_received_t>([&calls](const phone::line_received_t &) { ++calls; }, options);
+      auto typed_ns = time_ns(iterations, [&]() { phone.emit(phone::line_received_t { line }); });
+      auto scanned_ns = time_ns(iterations, [&]() {
+        for (auto &listener: scanned) {
+          if (listener.first == event_t::reply) {
+            listener.second(payload);
+          }
+        }
+      });
+      std::cout << json_t(json_t::object_t {
+        { "bench", std::string { "dispatch" } },
+        { "other_listeners", static_cast<double>(others) },
+        { "indexed_ns", indexed_ns },
+        { "built_ns", built_ns },
+        { "typed_ns", typed_ns },
+        { "scanned_ns", scanned_ns },
+        { "calls", static_cast<double>(calls) }
+      }) << std::endl;
+    }
+  }
+
+  // Emit a call event with 'listeners' listeners each wanting calls from
+  // one number, only one of which matches: with the numbers as filters,
+  // compiled together, and with each listener checking for itself.
+  void bench_filter(size_t iterations) {
+    phone::call_changed_t call;
+    call.id = 1;
+    call.state = "ringing";
+    call.direction = "incoming";
+    call.number = "+15551234567";
+    call.type = 145;
+    call.started = call.answered = call.ended = call.duration_ms = 0;
+    for (size_t listeners: { 1, 16, 256, 1024 }) {
+      phone::modem_sim_t sim;
+      phone::phone_t filtered(sim.port().c_str()), unfiltered(sim.port().c_str());
+      size_t calls = 0, woken = 0;
+      phone::phone_t::listener_options_t options;
+      options.queued = false;
+      phone::phone_t::listener_options_t each_options = options;
+      for (size_t i = 0; i < listeners; ++i) {
+        std::string number = "+1555" + std::to_string(i * 7919 % 10000 + 100000).substr(2);
+        if (i == listeners / 2) {
+          number = call.number.str();
+        }
+        options.filter = phone::filter_t {};
+        options.filter.equals("number", number).in_set("state", { "ringing", "waiting" });
+        filtered.on<phone::call_changed_t>([&calls](const phone::call_changed_t &) { ++calls; }, options);
+        unfiltered.on<phone::call_changed_t>([&calls, &woken, number](const phone::call_changed_t &changed) {
+          ++woken;
+          if (changed.number == number.c_str() && (changed.state == "ringing" || changed.state == "waiting")) {
+            ++calls;
+          }
+        }, each_options);
+      }
+      auto filtered_ns = time_ns(iterations, [&]() { filtered.emit(call); });
+      auto filtered_calls = calls;
+      auto in_callback_ns = time_ns(iterations, [&]() { unfiltered.emit(call); });
+      std::cout << json_t(json_t::object_t {
+        { "bench", std::string { "filter" } },
+        { "listeners", static_cast<double>(listeners) },
+        { "filtered_ns", filtered_ns },
+        { "in_callback_ns", in_callback_ns },
+        { "filtered_calls", static_cast<double>(filtered_calls) },
+        { "woken_per_event", static_cast<double>(woken) / static_cast<double>(iterations) }
+      }) << std::endl;
+    }
+  }
+
+  // Nanoseconds on the steady clock.
+  int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // The handoff from the listening thread to the dispatching thread, as it
+  // is: a lock-free ring, with a wakeup only when the consumer sleeps.
+  class ring_handoff_t final {
+    public:
+      explicit ring_handoff_t(size_t capacity)
+          : ring(capacity) {}
+
+      void push(int64_t value) {
+        int64_t *slot;
+        while (!(slot = ring.claim())) {
+          std::this_thread::yield();
+        }
+        *slot = value;
+        ring.publish();
+      }
+
+      int64_t pop() {
+        while (!ring.wait(100)) {}
+        auto value = *ring.peek();
+        ring.release();
+        return value;
+      }
+
+    private:
+      phone::spsc_ring_t<int64_t> ring;
+  };
+
+  // The same, as it might have been: a deque behind a mutex, with condition
+  // variables for empty and full.
+  class mutex_handoff_t final {
+    public:
+      explicit mutex_handoff_t(size_t capacity)
+          : capacity(capacity) {}
+
+      void push(int64_t value) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return items.size() < capacity; });
+        items.push_back(value);
+        not_empty.notify_one();
+      }
+
+      int64_t pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return !items.empty(); });
+        auto value = items.front();
+        items.pop_front();
+        not_full.notify_one();
+        return value;
+      }
+
+    private:
+      const size_t capacity;
+      std::mutex mutex;
+      std::condition_variable not_empty;
+      std::condition_variable not_full;
+      std::deque<int64_t> items;
+  };
+
+  // Pass 'count' timestamps from one thread to another and print the
+  // throughput and the time each spent in transit.  With 'gap_ns', the
+  // producer waits that long between pushes, so the consumer goes to sleep
+  // in between, as it does between bursts from the modem.
+  template <typename handoff_t>
+  void run_handoff(const char *queue, size_t count, int64_t gap_ns) {
+    handoff_t handoff(256);
+    std::unique_ptr<phone::histogram_t> transit(new phone::histogram_t);
+    auto start = now_ns();
+    std::thread consumer([&handoff, &transit, count]() {
+      for (size_t i = 0; i < count; ++i) {
+        auto sent = handoff.pop();
+        transit->record(static_cast<uint64_t>(now_ns() - sent));
+      }
+    });
+    for (size_t i = 0; i < count; ++i) {
+      auto due = now_ns() + gap_ns;
+      handoff.push(now_ns());
+      while (gap_ns && now_ns() < due) {}
+    }
+    consumer.join();
+    auto elapsed_ns = now_ns() - start;
+    std::cout << json_t(json_t::object_t {
+      { "bench", std::string { "handoff" } },
+      { "queue", std::string { queue } },
+      { "gap_ns", static_cast<double>(gap_ns) },
+      { "items_per_s", static_cast<double>(count) * 1e9 / static_cast<double>(elapsed_ns) },
+      { "transit_p50_ns", static_cast<double>(transit->get_percentile(0.5)) },
+      { "transit_p99_ns", static_cast<double>(transit->get_percentile(0.99)) }
+    }) << std::endl;
+  }
+
+  // The reader-to-dispatcher handoff, flat out and at a trickle, against a
+  // mutex-based queue.
+  void bench_handoff(size_t iterations) {
+    run_handoff<ring_handoff_t>("spsc", iterations, 0);
+    run_handoff<mutex_handoff_t>("mutex", iterations, 0);
+    run_handoff<ring_handoff_t>("spsc", iterations / 100, 50000);
+    run_handoff<mutex_handoff_t>("mutex", iterations / 100, 50000);
+  }
+
+  // A write on its way to the device, as phone_t queues them.
+  struct submission_t : phone::mpsc_node_t {
+    int64_t sent;
+  };
+
+  // Submissions from many threads to the writing thread, as they go: a
+  // lock-free intrusive queue.
+  class mpsc_submit_t final {
+    public:
+      void push(submission_t *item) {
+        queue.push(item);
+      }
+
+      submission_t *pop() {
+        for (;;) {
+          if (auto node = queue.pop()) {
+            return static_cast<submission_t *>(node);
+          }
+          if (!queue.busy()) {
+            queue.wait(100);
+          }
+        }
+      }
+
+    private:
+      phone::mpsc_queue_t queue;
+  };
+
+  // The same, as it might have been: a deque behind a mutex.
+  class mutex_submit_t final {
+    public:
+      void push(submission_t *item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.push_back(item);
+        not_empty.notify_one();
+      }
+
+      submission_t *pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return !items.empty(); });
+        auto item = items.front();
+        items.pop_front();
+        return item;
+      }
+
+    private:
+      std::mutex mutex;
+      std::condition_variable not_empty;
+      std::deque<submission_t *> items;
+  };
+
+  // 'producers' threads each push their share of 'count' items to one
+  // consumer, and print the throughput, the time each push took and the
+  // time each item spent in the queue.
+  template <typename submit_t>
+  void run_submit(const char *queue, int producers, size_t count) {
+    submit_t submit;
+    auto per_producer = count / static_cast<size_t>(producers);
+    auto total = per_producer * static_cast<size_t>(producers);
+    std::vector<submission_t> items(total);
+    std::unique_ptr<phone::histogram_t> transit(new phone::histogram_t);
+    std::atomic<int64_t> push_ns(0);
+    auto start = now_ns();
+    std::thread consumer([&submit, &transit, total]() {
+      for (size_t i = 0; i < total; ++i) {
+        auto item = submit.pop();
+        transit->record(static_cast<uint64_t>(now_ns() - item->sent));
+      }
+    });
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+      auto mine = items.data() + static_cast<size_t>(p) * per_producer;
+      threads.emplace_back([&submit, mine, per_producer, &push_ns]() {
+        auto began = now_ns();
+        for (size_t i = 0; i < per_producer; ++i) {
+          mine[i].sent = now_ns();
+          submit.push(&mine[i]);
+        }
+        push_ns += now_ns() - began;
+      });
+    }
+    for (auto &thread: threads) {
+      thread.join();
+    }
+    consumer.join();
+    auto elapsed_ns = now_ns() - start;
+    std::cout << json_t(json_t::object_t {
+      { "bench", std::string { "submit" } },
+      { "queue", std::string { queue } },
+      { "producers", static_cast<double>(producers) },
+      { "items_per_s", static_cast<double>(total) * 1e9 / static_cast<double>(elapsed_ns) },
+      { "push_ns", static_cast<double>(push_ns.load()) / static_cast<double>(total) },
+      { "transit_p50_ns", static_cast<double>(transit->get_percentile(0.5)) },
+      { "transit_p99_ns", static_cast<double>(transit->get_percentile(0.99)) }
+    }) << std::endl;
+  }
+
+  // Writes submitted from 1 to 64 threads at once, against a mutex-based
+  // queue.
+  void bench_submit(size_t iterations) {
+    for (int producers = 1; producers <= 64; producers *= 2) {
+      run_submit<mpsc_submit_t>("mpsc", producers, iterations);
+      run_submit<mutex_submit_t>("mutex", producers, iterations);
+    }
+  }
+
+  // Append a delivery event's worth of fields to a journal, then replay
+  // the lot, as records only and decoded.
+  void bench_journal(size_t iterations) {
+    char dir[] = "/tmp/phone-bench-journal-XXXXXX";
+    if (!mkdtemp(dir)) {
+      util::throw_system_error();
+    }
+    {
+      phone::journal_t journal(dir);
+      json_t::object_t fields {
+        { "number", std::string { "+15551234567" } },
+        { "mr", 42 },
+        { "status", 0 },
+        { "delivered", true },
+        { "latency_ms", 1800 }
+      };
+      auto append_ns = time_ns(iterations, [&]() { journal.append(6, 1500000000000, fields); });
+      journal.sync();
+      size_t seen = 0, bytes = 0;
+      auto start = std::chrono::steady_clock::now();
+      journal.replay(1, [&seen, &bytes](const phone::journal_t::record_t &record) {
+        ++seen;
+        bytes += record.size;
+        return true;
+      });
+      auto replay_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      size_t decoded = 0;
+      start = std::chrono::steady_clock::now();
+      journal.replay(1, [&decoded](const phone::journal_t::record_t &record) {
+        decoded += record.decode().size();
+        return true;
+      });
+      auto decode_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      auto stats = journal.get_stats();
+      std::cout << json_t(json_t::object_t {
+        { "bench", std::string { "journal" } },
+        { "records", static_cast<double>(seen) },
+        { "append_ns", append_ns },
+        { "syncs", static_cast<double>(stats.syncs) },
+        { "segments", static_cast<double>(stats.segments) },
+        { "replay_records_per_s", static_cast<double>(seen) / replay_s },
+        { "replay_mb_per_s", static_cast<double>(bytes) / replay_s / 1e6 },
+        { "decoded_records_per_s", static_cast<double>(seen) / decode_s }
+      }) << std::endl;
+    }
+    auto *listing = opendir(dir);
+    while (auto *entry = readdir(listing)) {
+      if (entry->d_name[0] != '.') {
+        util::unlink(util::join_path({ dir, entry->d_name }));
+      }
+    }
+    closedir(listing);
+    rmdir(dir);
+  }
+
+  // A session as a script: check the signal, then send a message.
+  class session_script_t final : public phone::script_t {
+    public:
+      explicit session_script_t(std::atomic<size_t> &finished)
+          : finished(finished) {}
+
+    protected:
+      void body() override {
+        PHONE_SCRIPT_BEGIN
+        PHONE_AWAIT(command("AT+CSQ"));
+        PHONE_AWAIT(command_with_body("AT+CMGS=\"+15551234567\"", "hello"));
+        ++finished;
+        PHONE_SCRIPT_END
+      }
+
+    private:
+      std::atomic<size_t> &finished;
+  };
+
+  // Run 'count' sessions against the simulator at once, as scripts and as
+  // a thread each, and print how long each took and what a script costs
+  // to keep waiting.
+  void bench_scripts(size_t count) {
+    phone::modem_sim_t sim;
+    sim.on("+CSQ", [](phone::modem_sim_t &sim, const std::string &) {
+      sim.send("+CSQ: 20,0");
+      return std::string { "OK" };
+    });
+    sim.on_body("+CMGS=", [](phone::modem_sim_t &sim, const std::string &, const std::string &) {
+      sim.send("+CMGS: 7");
+      return std::string { "OK" };
+    });
+    phone::phone_t phone(sim.port().c_str());
+    phone.listen();
+
+    std::atomic<size_t> finished(0);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      phone::script_t::start(phone, std::make_shared<session_script_t>(finished));
+    }
+    while (finished.load() < count) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto scripted_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Threads are dearer, so fewer of them.
+    auto threads = count / 10;
+    start = std::chrono::steady_clock::now();
+    std::vector<std::thread> sessions;
+    for (size_t i = 0; i < threads; ++i) {
+      sessions.push_back(std::thread([&phone]() {
+        phone.command("AT+CSQ");
+        phone.command_with_body("AT+CMGS=\"+15551234567\"", "hello");
+      }));
+    }
+    for (auto &session: sessions) {
+      session.join();
+    }
+    auto threaded_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    phone.stop();
+    phone.join();
+
+    std::cout << json_t(json_t::object_t {
+      { "bench", std::string { "scripts" } },
+      { "sessions", static_cast<double>(count) },
+      { "script_bytes", static_cast<double>(sizeof(session_script_t)) },
+      { "scripted_us_per_session", scripted_s * 1e6 / static_cast<double>(count) },
+      { "threaded_sessions", static_cast<double>(threads) },
+      { "threaded_us_per_session", threaded_s * 1e6 / static_cast<double>(threads) }
+    }) << std::endl;
+  }
+
+  // Timers as deferred work was kept before the wheel: a multimap by when
+  // each falls due, each timer's iterator serving as its id.
+  class multimap_timers_t final {
+    public:
+      using time_point_t = std::chrono::steady_clock::time_point;
+      using callback_t = std::function<void()>;
+      using timer_id_t = std::multimap<time_point_t, callback_t>::iterator;
+
+      timer_id_t schedule(time_point_t due, callback_t callback) {
+        return timers.emplace(due, std::move(callback));
+      }
+
+      void cancel(timer_id_t id) {
+        timers.erase(id);
+      }
+
+      size_t advance(time_point_t now, std::vector<callback_t> &expired) {
+        size_t fired = 0;
+        while (!timers.empty() && timers.begin()->first <= now) {
+          expired.push_back(std::move(timers.begin()->second));
+          timers.erase(timers.begin());
+          ++fired;
+        }
+        return fired;
+      }
+
+      bool empty() const { return timers.empty(); }
+
+    private:
+      std::multimap<time_point_t, callback_t> timers;
+  };
+
+  // Schedule 'count' timers up to a minute out, as command timeouts and
+  // retries are, cancel all but one in ten, as most timeouts are, then run
+  // the clock through the rest in millisecond steps.
+  template <typename timers_t>
+  void run_timers(const char *kind, timers_t &timers, size_t count) {
+    using id_t = typename timers_t::timer_id_t;
+    auto origin = std::chrono::steady_clock::now();
+    std::mt19937 random(1);
+    std::vector<std::chrono::steady_clock::time_point> dues;
+    for (size_t i = 0; i < count; ++i) {
+      dues.push_back(origin + std::chrono::milliseconds(1 + random() % 60000));
+    }
+    std::vector<id_t> ids;
+    ids.reserve(count);
+    size_t fired = 0;
+    size_t i = 0;
+    auto schedule_ns = time_ns(count, [&timers, &ids, &dues, &fired, &i]() {
+      ids.push_back(timers.schedule(dues[i++], [&fired]() { ++fired; }));
+    });
+    i = 0;
+    auto cancel_ns = time_ns(count, [&timers, &ids, &i]() {
+      if (i % 10 != 0) {
+        timers.cancel(ids[i]);
+      }
+      ++i;
+    });
+    std::vector<std::function<void()>> expired;
+    auto start = std::chrono::steady_clock::now();
+    // A millisecond over, as the wheel rounds up from its own origin.
+    for (int ms = 1; ms <= 60001; ++ms) {
+      timers.advance(origin + std::chrono::milliseconds(ms), expired);
+      for (auto &callback: expired) {
+        callback();
+      }
+      expired.clear();
+    }
+    auto expire_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count()) / static_cast<double>(fired ? fired : 1);
+    std::cout << json_t(json_t::object_t {
+      { "bench", std::string { "timers" } },
+      { "timers", std::string { kind } },
+      { "count", static_cast<double>(count) },
+      { "schedule_ns", schedule_ns },
+      { "cancel_ns", cancel_ns },
+      { "expire_ns", expire_ns },
+      { "fired", static_cast<double>(fired) }
+    }) << std::endl;
+  }
+
+  // The timing wheel behind defer(), against the multimap it replaced.
+  void bench_timers(size_t iterations) {
+    {
+      phone::timing_wheel_t wheel;
+      run_timers("wheel", wheel, iterations);
+    }
+    multimap_timers_t timers;
+    run_timers("multimap", timers, iterations);
+  }
+
+  // The pool as it might have been: every task through one queue behind
+  // one mutex.
+  class global_pool_t final {
+    public:
+      explicit global_pool_t(size_t threads)
+          : pending(0),
+            stopping(false) {
+        for (size_t i = 0; i < threads; ++i) {
+          this->threads.push_back(std::thread([this]() { work(); }));
+        }
+      }
+
+      ~global_pool_t() {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stopping = true;
+          ready_cv.notify_all();
+        }
+        for (auto &thread: threads) {
+          thread.join();
+        }
+      }
+
+      void submit(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        ++pending;
+        ready_cv.notify_one();
+      }
+
+      void drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle_cv.wait(lock, [this]() { return pending == 0; });
+      }
+
+    private:
+      void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+          ready_cv.wait(lock, [this]() { return !tasks.empty() || stopping; });
+          if (tasks.empty()) {
+            return;
+          }
+          auto task = std::move(tasks.front());
+          tasks.pop_front();
+          lock.unlock();
+          task();
+          lock.lock();
+          if (--pending == 0) {
+            idle_cv.notify_all();
+          }
+        }
+      }
+
+      std::mutex mutex;
+      std::condition_variable ready_cv;
+      std::condition_variable idle_cv;
+      std::deque<std::function<void()>> tasks;
+      size_t pending;
+      bool stopping;
+      std::vector<std::thread> threads;
+  };
+
+  // Spawn a binary tree of tasks, each doing a little work, 'depth' deep.
+  template <typename pool_t>
+  void spawn_tree(pool_t &pool, int depth, std::atomic<uint64_t> &leaves) {
+    if (depth == 0) {
+      leaves.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    for (int i = 0; i < 2; ++i) {
+      pool.submit([&pool, depth, &leaves]() { spawn_tree(pool, depth - 1, leaves); });
+    }
+  }
+
+  // A contact's worth of work: its name as the SIM wants it.
+  size_t encode_contact(size_t i) {
+    return phone::charset::utf8_to_ucs2_hex("Contact " + std::to_string(i) + " Müller").size();
+  }
+
+  // Run one workload on the pool and print how long it took.
+  template <typename pool_t, typename func_t>
+  void run_pool(const char *pool_name, const char *workload, size_t tasks, pool_t &pool, func_t f) {
+    auto start = now_ns();
+    f(pool);
+    pool.drain();
+    auto elapsed_ns = now_ns() - start;
+    std::cout << json_t(json_t::object_t {
+      { "bench", std::string { "pool" } },
+      { "pool", std::string { pool_name } },
+      { "workload", std::string { workload } },
+      { "tasks", static_cast<double>(tasks) },
+      { "ms", static_cast<double>(elapsed_ns) / 1e6 },
+      { "ns_per_task", static_cast<double>(elapsed_ns) / static_cast<double>(tasks) }
+    }) << std::endl;
+  }
+
+  // The work-stealing pool against one global queue, with as many threads
+  // each: a fork-join tree of tiny tasks, a stream of tasks from outside,
+  // and importing 10k contacts in chunks.
+  void bench_pool(size_t iterations) {
+    auto threads = std::max<size_t>(2, std::thread::hardware_concurrency());
+    int depth = 1;
+    while ((size_t(2) << depth) < iterations) {
+      ++depth;
+    }
+    auto tree_tasks = (size_t(2) << depth) - 2;
+    std::atomic<uint64_t> leaves(0);
+    size_t contacts = 10000, grain = 64;
+    std::atomic<size_t> encoded(0);
+
+    phone::task_pool_t::options_t options;
+    options.threads = threads;
+    phone::task_pool_t stealing(options);
+    run_pool("stealing", "tree", tree_tasks, stealing, [depth, &leaves](phone::task_pool_t &pool) {
+      pool.submit([&pool, depth, &leaves]() { spawn_tree(pool, depth, leaves); });
+    });
+    run_pool("stealing", "outside", iterations, stealing, [iterations, &leaves](phone::task_pool_t &pool) {
+      for (size_t i = 0; i < iterations; ++i) {
+        pool.submit([&leaves]() { leaves.fetch_add(1, std::memory_order_relaxed); });
+      }
+    });
+    run_pool("stealing", "contacts", contacts / grain, stealing, [=, &encoded](phone::task_pool_t &pool) {
+      pool.parallel_for(0, contacts, grain, [&encoded](size_t low, size_t high) {
+        size_t bytes = 0;
+        for (auto i = low; i < high; ++i) {
+          bytes += encode_contact(i);
+        }
+        encoded += bytes;
+      });
+    });
+
+    global_pool_t global(threads);
+    run_pool("global", "tree", tree_tasks, global, [depth, &leaves](global_pool_t &pool) {
+      pool.submit([&pool, depth, &leaves]() { spawn_tree(pool, depth, leaves); });
+    });
+    run_pool("global", "outside", iterations, global, [iterations, &leaves](global_pool_t &pool) {
+      for (size_t i = 0; i < iterations; ++i) {
+        pool.submit([&leaves]() { leaves.fetch_add(1, std::memory_order_relaxed); });
+      }
+    });
+    run_pool("global", "contacts", contacts / grain, global, [=, &encoded](global_pool_t &pool) {
+      for (size_t low = 0; low < contacts; low += grain) {
+        auto high = std::min(contacts, low + grain);
+        pool.submit([low, high, &encoded]() {
+          size_t bytes = 0;
+          for (auto i = low; i < high; ++i) {
+            bytes += encode_contact(i);
+          }
+          encoded += bytes;
+        });
+      }
+    });
+  }
+
+  struct bench_t {
+    const char *name;
+    std::function<void(size_t)> run;
+    size_t iterations;
+  };
+
+  const std::vector<bench_t> &benches() {
+    static const std::vector<bench_t> all {
+      { "dispatch", bench_dispatch, 200000 },
+      { "journal", bench_journal, 1000000 },
+      { "filter", bench_filter, 100000 },
+      { "handoff", bench_handoff, 1000000 },
+      { "pool", bench_pool, 500000 },
+      { "scripts", bench_scripts, 10000 },
+      { "submit", bench_submit, 1000000 },
+      { "timers", bench_timers, 2000000 }
+    };
+    return all;
+  }
+
+  void print_help() {
+    std::cout << std::endl << "Usage" << std::endl << std::endl;
+    std::cout << "phone-bench [<bench>...]" << std::endl << std::endl;
+    std::cout << "Benches:";
+    for (const auto &bench: benches()) {
+      std::cout << " " << bench.name;
+    }
+    std::cout << std::endl << std::endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> wanted(argv + 1, argv + argc);
+  for (const auto &name: wanted) {
+    if (name == "-h" || name == "help") {
+      print_help();
+      return 0;
+    }
+  }
+  bool ran = false;
+  for (const auto &bench: benches()) {
+    bool selected = wanted.empty();
+    for (const auto &name: wanted) {
+      selected = selected || name == bench.name;
+    }
+    if (selected) {
+      bench.run(bench.iterations);
+      ran = true;
+    }
+  }
+  if (!ran) {
+    print_help();
+    return 1;
+  }
+  return 0;
+}
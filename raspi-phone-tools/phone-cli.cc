@@ -1,8 +1,18 @@
 #include <raspi-phone-tools/phone.h>
+#include <raspi-phone-tools/dtmf-queue.h>
+#include <raspi-phone-tools/identity.h>
+#include <raspi-phone-tools/init-profile.h>
+#include <raspi-phone-tools/phonebook.h>
+#include <chrono>
 
 void print_help() {
   std::cout << std::endl << "Usage" << std::endl << std::endl;
-  std::cout << "phone-cli <port-name>" << std::endl << std::endl;
+  std::cout << "phone-cli <port-name>" << std::endl;
+  std::cout << "phone-cli <port-name> contacts" << std::endl;
+  std::cout << "phone-cli <port-name> identity [<cache-path>]" << std::endl;
+  std::cout << "phone-cli <port-name> init" << std::endl;
+  std::cout << "phone-cli <port-name> dial <number>" << std::endl;
+  std::cout << "phone-cli <port-name> dtmf <tones>" << std::endl << std::endl;
 }
 
 int main (int argc, char *argv[]) {
@@ -11,19 +21,98 @@ int main (int argc, char *argv[]) {
     return 1;
   }
 
-  if (argc > 2) {
-    print_help();
-    return 1;
-  }
-
   std::string portname = argv[1];
 
   if (portname == "-h" || portname == "help") {
     print_help();
     return 0;
-  } else {
+  }
+
+  if (argc == 2) {
     return phone::phone_t(portname.c_str()).repl();
   }
 
-  return 0;
+  // Each subcommand checks for its own arguments, which follow it.
+  std::string subcommand = argv[2];
+  int args = argc - 3;
+
+  if (subcommand == "contacts" && args == 0) {
+    // Stream the SIM phonebook out as one JSON contact per line.
+    phone::phone_t phone(portname.c_str());
+    phone::phonebook_t book(phone);
+    phone::json_contact_sink_t sink(std::cout);
+    book.import(sink);
+    std::cout.flush();
+    return 0;
+  } else if (subcommand == "identity" && args <= 1) {
+    // Identify the modem and SIM, from the cache if we can, and report how
+    // long it took to be ready.
+    phone::phone_t phone(portname.c_str());
+    phone::identity_cache_t cache(phone, args == 1 ? argv[3] : phone::identity_cache_t::default_path);
+    auto identity = phone::identity_cache_t::to_json(cache.load());
+    identity["cached"] = cache.get_stats().hit;
+    identity["ready_us"] = static_cast<double>(cache.get_stats().ready_us);
+    if (!cache.get_stats().write_error.empty()) {
+      identity["cache_error"] = cache.get_stats().write_error;
+    }
+    std::cout << json_t(identity) << std::endl;
+    return 0;
+  } else if (subcommand == "init" && args == 0) {
+    // Bring the modem's settings in line with the standard profile, sending
+    // only what differs.
+    phone::phone_t phone(portname.c_str());
+    auto profile = phone::init_profile_t::standard();
+    const auto &stats = profile.apply(phone);
+    json_t::array_t failed;
+    for (const auto &setting: stats.failed) {
+      failed.push_back(setting);
+    }
+    std::cout << json_t(json_t::object_t {
+      { "read_lines", static_cast<double>(stats.read_lines) },
+      { "write_lines", static_cast<double>(stats.write_lines) },
+      { "unchanged", static_cast<double>(stats.unchanged) },
+      { "changed", static_cast<double>(stats.changed) },
+      { "failed", std::move(failed) },
+      { "elapsed_us", static_cast<double>(stats.elapsed_us) }
+    }) << std::endl;
+    return stats.failed.empty() ? 0 : 1;
+  } else if (subcommand == "dial" && args == 1) {
+    // Dial, wait for the call to connect or fail, and print where the time
+    // went.
+    phone::phone_t phone(portname.c_str());
+    phone.listen();
+    auto result = phone.dial(argv[3]);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+
+    while (result.ok() && std::chrono::steady_clock::now() < deadline) {
+      auto trace = phone.dial_report().back();
+      if (trace["connected_us"] != -1 || trace["ended_us"] != -1) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    std::cout << phone.dial_report().back() << std::endl;
+    return result.ok() ? 0 : 1;
+  } else if (subcommand == "dtmf" && args == 1) {
+    // Play tones into the call in progress, packed into as few commands as
+    // the modem takes, and report how long each tone took.
+    phone::phone_t phone(portname.c_str());
+    phone.listen();
+    phone::dtmf_queue_t queue(phone);
+    queue.push(argv[3]);
+    bool idle = queue.wait_idle(60000);
+    auto stats = queue.get_stats();
+    std::cout << json_t(json_t::object_t {
+      { "tones", static_cast<double>(stats.tones) },
+      { "commands", static_cast<double>(stats.commands) },
+      { "dropped", static_cast<double>(stats.dropped) },
+      { "latency", phone.get_latencies().get("dtmf").report() }
+    }) << std::endl;
+    phone.stop();
+    return idle && !stats.dropped ? 0 : 1;
+  }
+
+  print_help();
+  return 1;
 }
@@ -0,0 +1,1558 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/at.h>
+#include <raspi-phone-tools/call-monitor.h>
+#include <raspi-phone-tools/charset.h>
+#include <raspi-phone-tools/delivery-tracker.h>
+#include <raspi-phone-tools/dtmf-queue.h>
+#include <raspi-phone-tools/identity.h>
+#include <raspi-phone-tools/init-profile.h>
+#include <raspi-phone-tools/modem-script.h>
+#include <raspi-phone-tools/modem-sim.h>
+#include <raspi-phone-tools/network-scan.h>
+#include <raspi-phone-tools/phone.h>
+#include <raspi-phone-tools/phonebook.h>
+#include <raspi-phone-tools/signal-history.h>
+#include <raspi-phone-tools/ussd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+  // While set, operator new counts what it's asked for in 'allocations'.
+  std::atomic<bool> counting_allocations(false);
+  std::atomic<size_t> allocations(0);
+}
+
+void *operator new(size_t size) {
+  if (counting_allocations) {
+    ++allocations;
+  }
+  if (auto *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+  // Give the simulator a SIM phonebook with 'size' entries, every third of
+  // them empty.  Names are sent in UCS2 when 'ucs2' is set.
+  void add_phonebook(phone::modem_sim_t &sim, int size, bool ucs2) {
+    sim.on("+CSCS?", [ucs2](phone::modem_sim_t &sim, const std::string &) {
+      sim.send(ucs2 ? "+CSCS: \"UCS2\"" : "+CSCS: \"IRA\"");
+      return std::string { "OK" };
+    });
+    sim.on("+CPBR=?", [size](phone::modem_sim_t &sim, const std::string &) {
+      sim.send("+CPBR: (1-" + std::to_string(size) + "),40,18");
+      return std::string { "OK" };
+    });
+    sim.on("+CPBR=", [ucs2](phone::modem_sim_t &sim, const std::string &cmd) {
+      auto params = phone::at::split_params(cmd.substr(cmd.find('=') + 1));
+      int first = phone::at::to_int(params[0]);
+      int last = phone::at::to_int(params[1]);
+      bool any = false;
+      for (int i = first; i <= last; ++i) {
+        if (i % 3 == 0) {
+          continue;
+        }
+        std::string name = "Contact " + std::to_string(i);
+        sim.send(
+            "+CPBR: " + std::to_string(i) + ",\"+1555000" + std::to_string(i) +
+            "\",145,\"" + (ucs2 ? phone::charset::utf8_to_ucs2_hex(name) : name) + "\"");
+        any = true;
+      }
+      return std::string { any ? "OK" : "+CME ERROR: 22" };
+    });
+  }
+
+  // Wait up to a second for the predicate to hold.
+  template <typename pred_t>
+  bool eventually(pred_t pred) {
+    for (int i = 0; i < 100; ++i) {
+      if (pred()) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return pred();
+  }
+
+  // Sends a message and waits for the report that it was delivered.
+  class send_and_confirm_t final : public phone::script_t {
+    public:
+      send_and_confirm_t(const std::string &number, int wait_ms)
+          : number(number),
+            wait_ms(wait_ms),
+            mr(-1),
+            confirmed(false) {}
+
+      const std::string number;
+      const int wait_ms;
+      std::atomic<int> mr;
+      std::atomic<bool> confirmed;
+
+    protected:
+      void body() override {
+        PHONE_SCRIPT_BEGIN
+        PHONE_AWAIT(command_with_body("AT+CMGS=\"" + number + "\"", "hello " + number));
+        if (!get_result().ok() || get_lines().empty()) {
+          return;
+        }
+        mr = phone::at::to_int(phone::at::split_params(get_lines()[0])[0]);
+        PHONE_AWAIT(await_urc("+CDS: 6," + std::to_string(mr) + ",", wait_ms));
+        confirmed = !get_urc().empty();
+        PHONE_SCRIPT_END
+      }
+  };
+
+  // Collects what it is given.
+  class vector_sink_t final : public phone::contact_sink_t {
+    public:
+      void put(const phone::contact_t &contact) override {
+        contacts.push_back(contact);
+      }
+      std::vector<phone::contact_t> contacts;
+  };
+}
+
+FIXTURE(at_split_params) {
+  auto params = phone::at::split_params("+CPBR: 7,\"+1555,1\",145,\"Al (ice)\"");
+  EXPECT_EQ(params.size(), 4u);
+  EXPECT_EQ(params[0], "7");
+  EXPECT_EQ(params[1], "+1555,1");
+  EXPECT_EQ(params[2], "145");
+  EXPECT_EQ(params[3], "Al (ice)");
+  auto groups = phone::at::split_params("+COPS: (2,\"A\",\"a\",\"1\"),(1,\"B\",\"b\",\"2\"),,(0-4)");
+  EXPECT_EQ(groups.size(), 4u);
+  EXPECT_EQ(groups[0], "(2,\"A\",\"a\",\"1\")");
+  EXPECT_EQ(groups[2], "");
+}
+
+FIXTURE(at_response_prefix) {
+  EXPECT_EQ(phone::at::response_prefix("AT+CPBR=1,10"), "+CPBR");
+  EXPECT_EQ(phone::at::response_prefix("AT+CSQ"), "+CSQ");
+  EXPECT_EQ(phone::at::response_prefix("AT+CREG?"), "+CREG");
+  EXPECT_EQ(phone::at::response_prefix("ATD123;"), "");
+  EXPECT_TRUE(phone::at::is_final("+CME ERROR: 22"));
+  EXPECT_EQ(phone::at::error_code("+CME ERROR: 22"), 22);
+  EXPECT_FALSE(phone::at::is_error("OK"));
+}
+
+FIXTURE(charset_ucs2_round_trip) {
+  std::string name = "Zo\xC3\xAB \xF0\x9F\x93\x9E";
+  auto hex = phone::charset::utf8_to_ucs2_hex(name);
+  EXPECT_EQ(hex, "005A006F00EB0020D83DDCDE");
+  EXPECT_EQ(phone::charset::ucs2_hex_to_utf8(hex), name);
+}
+
+FIXTURE(charset_gsm7_packing) {
+  EXPECT_EQ(phone::charset::utf8_to_gsm7_packed_hex("*100#"), "AA180C3602");
+  EXPECT_EQ(phone::charset::gsm7_packed_hex_to_utf8("E8329BFD4697D9EC37"), "hellohello");
+  // Seven septets leave a spare one, padded with a carriage return.
+  EXPECT_EQ(phone::charset::gsm7_packed_hex_to_utf8(
+      phone::charset::utf8_to_gsm7_packed_hex("1234567")), "1234567");
+  EXPECT_EQ(phone::charset::gsm7_to_utf8(phone::charset::utf8_to_gsm7("5\xe2\x82\xac {\xc3\xa9}")),
+      "5\xe2\x82\xac {\xc3\xa9}");
+}
+
+FIXTURE(command_streams_lines) {
+  phone::modem_sim_t sim;
+  sim.on("+NOPE", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "ERROR" };
+  });
+  sim.on("+CGSN", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("490154203237518");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  std::vector<std::string> lines;
+  auto result = phone.command("AT+CGSN", [&lines](const std::string &line) {
+    lines.push_back(line);
+  });
+  EXPECT_TRUE(result.ok());
+  EXPECT_EQ(lines.size(), 1u);
+  EXPECT_EQ(lines[0], "490154203237518");
+  auto latencies = phone.latency_report();
+  EXPECT_EQ(latencies["+CGSN"]["count"], 1);
+  EXPECT_EQ(latencies["queue:normal"]["count"], 1);
+  EXPECT_EQ(phone.command("AT+NOPE").final, "ERROR");
+}
+
+FIXTURE(command_while_listening) {
+  phone::modem_sim_t sim;
+  sim.on("+CME", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "+CME ERROR: 10" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  std::vector<std::string> urcs;
+  phone.on(phone::phone_t::event_t::reply, [&urcs](const json_t::object_t &data) {
+    urcs.push_back(data.at("line").as<json_t::string_t>());
+  });
+  phone.listen();
+  sim.send("+CMTI: \"SM\",3");
+  EXPECT_TRUE(phone.command("AT").ok());
+  auto result = phone.command("AT+CME");
+  EXPECT_EQ(result.final, "+CME ERROR: 10");
+  phone.stop();
+  phone.join();
+  EXPECT_EQ(urcs.size(), 1u);
+}
+
+FIXTURE(command_after_timeout_gets_its_own_result) {
+  phone::modem_sim_t sim;
+  std::atomic<bool> slow(true);
+  sim.on("+CPBR=", [&slow](phone::modem_sim_t &sim, const std::string &cmd) {
+    auto params = phone::at::split_params(cmd.substr(cmd.find('=') + 1));
+    int first = phone::at::to_int(params[0]);
+    int last = phone::at::to_int(params[1]);
+    for (int i = first; i <= last; ++i) {
+      if (slow && i == first + 2) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+      }
+      sim.send("+CPBR: " + std::to_string(i) + ",\"555\",129,\"x\"");
+    }
+    slow = false;
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  std::vector<std::string> lines;
+  auto collect = [&lines](const std::string &line) { lines.push_back(line); };
+  auto result = phone.command("AT+CPBR=1,5", collect, 100);
+  EXPECT_TRUE(result.status == phone::phone_t::status_t::timeout);
+  EXPECT_EQ(lines.size(), 2u);
+
+  // The rest of the first reply, and its OK, come before the retry's.
+  lines.clear();
+  EXPECT_TRUE(phone.command("AT+CPBR=3,7", collect).ok());
+  EXPECT_EQ(lines.size(), 5u);
+  EXPECT_EQ(lines.front(), "+CPBR: 3,\"555\",129,\"x\"");
+  EXPECT_EQ(lines.back(), "+CPBR: 7,\"555\",129,\"x\"");
+  lines.clear();
+  EXPECT_TRUE(phone.command("AT+CPBR=8,8", collect).ok());
+  EXPECT_EQ(lines.size(), 1u);
+  phone.stop();
+  phone.join();
+}
+
+FIXTURE(command_after_one_never_answered) {
+  // Echo is off, as init profiles leave it, so only the marker sent after
+  // the timeout says where the lost command's response would have ended.
+  phone::modem_sim_t sim;
+  sim.on("+HANG", [](phone::modem_sim_t &, const std::string &) {
+    return std::string {};
+  });
+  sim.on("+CSQ", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CSQ: 20,99");
+    return std::string { "OK" };
+  });
+  sim.on("+CGSN", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("490154203237518");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  auto result = phone.command("AT+HANG", phone::phone_t::line_callback_t {}, 100);
+  EXPECT_TRUE(result.status == phone::phone_t::status_t::timeout);
+  for (int i = 0; i < 3; ++i) {
+    std::vector<std::string> lines;
+    EXPECT_TRUE(phone.command("AT+CGSN", [&lines](const std::string &line) {
+      lines.push_back(line);
+    }).ok());
+    EXPECT_EQ(lines.size(), 1u);
+  }
+  EXPECT_EQ(sim.count("+CSQ"), 1u);
+  phone.stop();
+  phone.join();
+}
+
+FIXTURE(io_options_degrade_gracefully) {
+  phone::modem_sim_t sim;
+  sim.on("+CSQ", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CSQ: 20,0");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone::phone_t::io_options_t options;
+  options.fifo_priority = 10;
+  options.cpu = 100000;
+  phone.set_io_options(options);
+  std::atomic<int> rings(0);
+  phone.on(phone::phone_t::event_t::reply, [&rings](const json_t::object_t &data) {
+    rings += data.at("line") == "RING" ? 1 : 0;
+  });
+  phone.listen();
+
+  // Lines go by way of the dispatching thread, commands' and all.
+  sim.send("RING");
+  std::vector<std::string> lines;
+  auto result = phone.command("AT+CSQ", [&lines](const std::string &line) { lines.push_back(line); });
+  EXPECT_TRUE(result.ok());
+  EXPECT_EQ(lines.size(), 1u);
+  EXPECT_TRUE(eventually([&phone, &rings]() {
+    phone.drain_listeners();
+    return rings == 1;
+  }));
+
+  // Whether we may have real-time priority depends on who runs the test;
+  // there's no CPU 100000 either way.
+  auto report = phone.io_report();
+  auto status = report["status"].as<json_t::object_t>();
+  EXPECT_EQ(status.count("fifo_priority"), 1u);
+  EXPECT_NE(status["cpu"], "ok");
+  EXPECT_EQ(status.count("lock_memory"), 0u);
+  EXPECT_TRUE(eventually([&phone]() {
+    return phone.get_latencies().get("io:wakeup-jitter").get_count() > 0;
+  }));
+  phone.stop();
+  phone.join();
+}
+
+FIXTURE(writes_from_many_threads_stay_whole) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  // Long lines, so any interleaving would show.
+  static const int writers = 8;
+  static const int lines = 25;
+  std::string filler(200, 'x');
+  std::vector<std::thread> threads;
+  for (int w = 0; w < writers; ++w) {
+    threads.emplace_back([&phone, &filler, w]() {
+      for (int i = 0; i < lines; ++i) {
+        phone.write("AT+W" + std::to_string(w) + "=" + std::to_string(i) + "," + filler + "\r");
+      }
+    });
+  }
+  for (auto &thread: threads) {
+    thread.join();
+  }
+  EXPECT_TRUE(eventually([&sim]() { return sim.count("+W") == static_cast<size_t>(writers * lines); }));
+  // Each writer's lines arrive whole, and in the order it wrote them.
+  std::vector<int> next(writers, 0);
+  bool whole = true;
+  for (const auto &line: sim.received()) {
+    auto comma = line.find(',');
+    auto equals = line.find('=');
+    if (line.compare(0, 4, "AT+W") != 0 || comma == std::string::npos || equals == std::string::npos) {
+      whole = false;
+      continue;
+    }
+    auto w = std::atoi(line.c_str() + 4);
+    auto i = std::atoi(line.c_str() + equals + 1);
+    whole = whole && w >= 0 && w < writers && i == next[w] && line.substr(comma + 1) == filler;
+    if (w >= 0 && w < writers) {
+      next[w] = i + 1;
+    }
+  }
+  EXPECT_TRUE(whole);
+  phone.stop();
+  phone.join();
+}
+
+FIXTURE(listeners_unsubscribe) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  int first = 0, second = 0, errors = 0;
+  auto id = phone.on(phone::phone_t::event_t::sms, [&first](const json_t::object_t &) { ++first; });
+  phone.on(phone::phone_t::event_t::sms, [&second](const json_t::object_t &) { ++second; });
+  phone.on(phone::phone_t::event_t::error, [&errors](const json_t::object_t &) { ++errors; });
+  phone.emit(phone::phone_t::event_t::sms, json_t::object_t {});
+  phone.drain_listeners();
+  EXPECT_TRUE(phone.off(id));
+  EXPECT_FALSE(phone.off(id));
+  phone.emit(phone::phone_t::event_t::sms, json_t::object_t {});
+  phone.drain_listeners();
+  EXPECT_EQ(first, 1);
+  EXPECT_EQ(second, 2);
+  EXPECT_EQ(errors, 0);
+}
+
+FIXTURE(queued_typed_listeners_dont_allocate) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  std::atomic<bool> hold(true);
+  std::atomic<int> missed(0), signals(0);
+  phone.on<phone::missed_call_t>([&hold, &missed](const phone::missed_call_t &call) {
+    while (hold) {
+      std::this_thread::yield();
+    }
+    missed += call.rings;
+  });
+  phone.on<phone::signal_changed_t>([&signals](const phone::signal_changed_t &) { ++signals; });
+  phone::missed_call_t call;
+  call.number = "+15551234";
+  call.type = 145;
+  call.rings = 1;
+  call.started = 1;
+  call.ended = 2;
+
+  // Let the lanes grow to the most they will hold.
+  for (int i = 0; i < 64; ++i) {
+    phone.emit(call);
+    phone.emit(phone::signal_changed_t { i, 0 });
+  }
+  hold = false;
+  phone.drain_listeners();
+  EXPECT_EQ(missed.load(), 64);
+
+  allocations = 0;
+  counting_allocations = true;
+  for (int i = 0; i < 64; ++i) {
+    phone.emit(call);
+    phone.emit(phone::signal_changed_t { i, 0 });
+  }
+  phone.drain_listeners();
+  counting_allocations = false;
+  EXPECT_EQ(allocations.load(), 0u);
+  EXPECT_EQ(missed.load(), 128);
+  EXPECT_GT(signals.load(), 0);
+}
+
+FIXTURE(typed_listeners) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone::phone_t::listener_options_t options;
+  options.queued = false;
+  std::vector<std::string> stored, lines;
+  std::vector<int> indexes;
+  phone.on<phone::sms_received_t>([&stored, &indexes](const phone::sms_received_t &sms) {
+    stored.push_back(sms.storage.str());
+    indexes.push_back(sms.index);
+  }, options);
+  phone.on<phone::line_received_t>([&lines](const phone::line_received_t &urc) {
+    lines.push_back(urc.line.str());
+  }, options);
+  json_t::object_t as_json;
+  phone.on(phone::phone_t::event_t::sms, [&as_json](const json_t::object_t &data) {
+    as_json = data;
+  }, options);
+  phone.listen();
+  sim.send("+CMTI: \"ME\",7");
+  EXPECT_TRUE(phone.command("AT").ok());
+  EXPECT_TRUE(eventually([&indexes]() { return indexes.size() == 1; }));
+  EXPECT_EQ(stored[0], "ME");
+  EXPECT_EQ(indexes[0], 7);
+  EXPECT_EQ(lines.size(), 1u);
+  EXPECT_EQ(lines[0], "+CMTI: \"ME\",7");
+  EXPECT_EQ(as_json["storage"], "ME");
+  EXPECT_EQ(as_json["index"], 7);
+
+  // An event emitted as JSON still reaches typed listeners.
+  phone.emit(phone::phone_t::event_t::sms, json_t::object_t {
+    { "storage", std::string { "SM" } }, { "index", 3 }
+  });
+  EXPECT_EQ(indexes.size(), 2u);
+  EXPECT_EQ(stored[1], "SM");
+  EXPECT_EQ(indexes[1], 3);
+
+  phone::inline_string_t<4> cut(std::string { "abcdef" });
+  EXPECT_TRUE(cut.truncated());
+  EXPECT_EQ(cut.str(), "abcd");
+}
+
+FIXTURE(filtered_listeners) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone::phone_t::listener_options_t options;
+  options.queued = false;
+  options.filter.equals("storage", "SM").in_set("index", { "1", "3" });
+  std::vector<int> wanted;
+  phone.on<phone::sms_received_t>([&wanted](const phone::sms_received_t &sms) {
+    wanted.push_back(sms.index);
+  }, options);
+  options.filter = phone::filter_t {};
+  int all = 0;
+  phone.on(phone::phone_t::event_t::sms, [&all](const json_t::object_t &) { ++all; }, options);
+  for (int i = 0; i < 5; ++i) {
+    phone.emit(phone::sms_received_t { "SM", i });
+  }
+  phone.emit(phone::sms_received_t { "ME", 1 });
+  EXPECT_EQ(wanted.size(), 2u);
+  EXPECT_EQ(wanted[0], 1);
+  EXPECT_EQ(wanted[1], 3);
+  EXPECT_EQ(all, 6);
+}
+
+FIXTURE(events_go_to_the_journal) {
+  char dir[] = "/tmp/phone-journal-XXXXXX";
+  EXPECT_TRUE(mkdtemp(dir) != nullptr);
+  {
+    phone::modem_sim_t sim;
+    phone::phone_t phone(sim.port().c_str());
+    phone::journal_t journal(dir);
+    phone.set_journal(&journal);
+    phone.listen();
+    sim.send("+CMTI: \"SM\",4");
+    EXPECT_TRUE(phone.command("AT").ok());
+    EXPECT_TRUE(eventually([&journal]() { return journal.get_next_seq() == 3; }));
+    phone.set_journal(nullptr);
+
+    std::vector<json_t::object_t> records;
+    std::vector<int> events;
+    journal.replay(1, [&records, &events](const phone::journal_t::record_t &record) {
+      events.push_back(record.event);
+      records.push_back(record.decode());
+      return true;
+    });
+    EXPECT_EQ(records.size(), 2u);
+    EXPECT_EQ(events[0], static_cast<int>(phone::phone_t::event_t::reply));
+    EXPECT_EQ(records[0]["line"], "+CMTI: \"SM\",4");
+    EXPECT_EQ(events[1], static_cast<int>(phone::phone_t::event_t::sms));
+    EXPECT_EQ(records[1]["index"], 4);
+    EXPECT_EQ(phone.get_journal_failures(), 0u);
+  }
+  // One segment, named for its first record.
+  util::unlink(util::join_path({ dir, "00000000000000000001.journal" }));
+  EXPECT_EQ(rmdir(dir), 0);
+}
+
+FIXTURE(slow_listener_doesnt_stall_reader) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  std::mutex gate;
+  std::unique_lock<std::mutex> held(gate);
+  std::atomic<bool> entered { false };
+  std::atomic<int> slow { 0 }, fast { 0 }, inline_calls { 0 };
+  phone::phone_t::listener_options_t options;
+  options.lane.capacity = 2;
+  phone.on(phone::phone_t::event_t::reply, [&gate, &entered, &slow](const json_t::object_t &) {
+    entered = true;
+    std::lock_guard<std::mutex> lock(gate);
+    ++slow;
+  }, options);
+  phone.on(phone::phone_t::event_t::reply, [&fast](const json_t::object_t &) { ++fast; });
+  options.queued = false;
+  phone.on(phone::phone_t::event_t::reply, [&inline_calls](const json_t::object_t &) { ++inline_calls; }, options);
+  phone.listen();
+  sim.send("+CMTI: \"SM\",0");
+  EXPECT_TRUE(eventually([&entered]() { return entered.load(); }));
+  for (int i = 1; i < 5; ++i) {
+    sim.send("+CMTI: \"SM\"," + std::to_string(i));
+  }
+  // The reader and the other listeners carry on while one is stuck.
+  EXPECT_TRUE(phone.command("AT").ok());
+  EXPECT_TRUE(eventually([&fast]() { return fast == 5; }));
+  EXPECT_TRUE(eventually([&inline_calls]() { return inline_calls == 5; }));
+  EXPECT_EQ(slow.load(), 0);
+  held.unlock();
+  phone.drain_listeners();
+  // One was running and two waited; the rest didn't fit.
+  EXPECT_EQ(slow.load(), 3);
+  auto report = phone.listener_report();
+  EXPECT_EQ(report.size(), 3u);
+  EXPECT_EQ(report.begin()->second["dropped"], 2);
+  EXPECT_EQ(report.begin()->second["max_depth"], 2);
+}
+
+FIXTURE(event_policies) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str(), 4);
+  std::mutex gate;
+  std::unique_lock<std::mutex> held(gate);
+  std::atomic<int> entered { 0 };
+  auto stall = [&gate, &entered]() {
+    ++entered;
+    std::lock_guard<std::mutex> lock(gate);
+  };
+  std::vector<int> rssis, counts, indexes;
+  phone.on<phone::signal_changed_t>([&stall, &rssis](const phone::signal_changed_t &signal) {
+    stall();
+    rssis.push_back(signal.rssi);
+  });
+  phone.on(phone::phone_t::event_t::onchar, [&stall, &counts](const json_t::object_t &data) {
+    stall();
+    counts.push_back(static_cast<int>(data.at("count").as<json_t::number_t>()));
+  });
+  // Never dropped, however small the lane.
+  phone::phone_t::listener_options_t options;
+  options.lane.capacity = 1;
+  phone.on<phone::sms_received_t>([&stall, &indexes](const phone::sms_received_t &sms) {
+    stall();
+    indexes.push_back(sms.index);
+  }, options);
+  phone.listen();
+  for (int i = 1; i <= 5; ++i) {
+    sim.send("+CSQ: " + std::to_string(i) + ",0");
+    sim.send("+CMTI: \"SM\"," + std::to_string(i));
+    phone.emit(phone::phone_t::event_t::onchar, json_t::object_t {});
+    if (i == 1) {
+      EXPECT_TRUE(eventually([&entered]() { return entered == 3; }));
+    }
+  }
+  EXPECT_TRUE(phone.command("AT").ok());
+  held.unlock();
+  EXPECT_TRUE(eventually([&phone, &indexes]() {
+    phone.drain_listeners();
+    return indexes.size() == 5;
+  }));
+  // The newest signal, and the rest of the burst counted as one.
+  EXPECT_EQ(rssis.size(), 2u);
+  EXPECT_EQ(rssis[1], 5);
+  EXPECT_EQ(counts.size(), 2u);
+  EXPECT_EQ(counts[0], 1);
+  EXPECT_EQ(counts[1], 4);
+  EXPECT_EQ(indexes[4], 5);
+  for (const auto &entry: phone.listener_report()) {
+    const auto &report = entry.second.as<json_t::object_t>();
+    auto event = report.at("event").as<json_t::string_t>();
+    if (event == "sms") {
+      EXPECT_EQ(report.at("policy"), "never_drop");
+      EXPECT_EQ(report.at("dropped"), 0);
+    } else {
+      EXPECT_EQ(report.at("coalesced"), 3);
+    }
+  }
+
+  // A struct can't carry a count, so a queued typed listener can't have one.
+  phone.set_policy(phone::phone_t::event_t::signal, phone::phone_t::policy_t::count);
+  bool threw = false;
+  try {
+    phone.on<phone::signal_changed_t>([](const phone::signal_changed_t &) {});
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  EXPECT_TRUE(threw);
+  phone::phone_t::listener_options_t inline_options;
+  inline_options.queued = false;
+  phone.on<phone::signal_changed_t>([](const phone::signal_changed_t &) {}, inline_options);
+  phone.on(phone::phone_t::event_t::signal, [](const json_t::object_t &) {});
+}
+
+FIXTURE(phonebook_import_streams) {
+  phone::modem_sim_t sim;
+  add_phonebook(sim, 250, true);
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  phone::phonebook_t book(phone);
+  vector_sink_t sink;
+  EXPECT_EQ(book.import(sink), 167u);
+  EXPECT_EQ(sink.contacts.size(), 167u);
+  EXPECT_EQ(sink.contacts[0].index, 1);
+  EXPECT_EQ(sink.contacts[0].name, "Contact 1");
+  EXPECT_EQ(sink.contacts[2].number, "+15550004");
+  // The chunk size grows, so 250 entries take far fewer than 25 reads.
+  EXPECT_LT(book.get_stats().commands, 12u);
+  EXPECT_EQ(book.get_stats().last_chunk, 50);
+}
+
+FIXTURE(phonebook_import_shrinks_on_error) {
+  phone::modem_sim_t sim;
+  add_phonebook(sim, 40, false);
+  // This modem can't read more than 5 entries at once.
+  sim.on("+CPBR=", [](phone::modem_sim_t &sim, const std::string &cmd) {
+    auto params = phone::at::split_params(cmd.substr(cmd.find('=') + 1));
+    int first = phone::at::to_int(params[0]);
+    int last = phone::at::to_int(params[1]);
+    for (int i = first; i <= last && i < first + 5; ++i) {
+      sim.send("+CPBR: " + std::to_string(i) + ",\"555\",129,\"N" + std::to_string(i) + "\"");
+    }
+    return std::string { last - first >= 5 ? "ERROR" : "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone::phonebook_t book(phone);
+  std::ostringstream strm;
+  phone::json_contact_sink_t sink(strm);
+  EXPECT_EQ(book.import(sink), 40u);
+  EXPECT_GT(book.get_stats().retries, 0u);
+  EXPECT_EQ(strm.str().substr(0, strm.str().find('\n')),
+      "{ \"id\": 1, \"name\": \"N1\", \"number\": \"555\", \"type\": 129 }");
+}
+
+FIXTURE(phonebook_store_batches) {
+  phone::modem_sim_t sim;
+  add_phonebook(sim, 250, false);
+  phone::phone_t phone(sim.port().c_str());
+  phone::phonebook_t book(phone);
+  std::vector<phone::contact_t> contacts;
+  for (int i = 1; i <= 100; ++i) {
+    contacts.push_back(phone::contact_t { i, "+1555000" + std::to_string(i), 0, "C" + std::to_string(i) });
+  }
+  phone::vector_contact_source_t source(contacts);
+  EXPECT_EQ(book.store(source), 100u);
+  EXPECT_EQ(sim.count("+CPBW="), 100u);
+  // Eight or so writes fit on each 256-byte line.
+  EXPECT_LT(book.get_stats().commands, 20u);
+  for (const auto &line: sim.received()) {
+    EXPECT_LE(line.size(), 256u);
+  }
+}
+
+FIXTURE(call_missed) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone::call_monitor_t monitor(phone);
+  std::vector<json_t::object_t> missed;
+  std::vector<std::string> states;
+  phone.on(phone::phone_t::event_t::missedcall, [&missed](const json_t::object_t &data) {
+    missed.push_back(data);
+  });
+  phone.on(phone::phone_t::event_t::call, [&states](const json_t::object_t &data) {
+    states.push_back(data.at("state").as<json_t::string_t>());
+  });
+  phone.listen();
+  sim.send("RING");
+  sim.send("+CLIP: \"+15551234\",145,,,,0");
+  sim.send("RING");
+  EXPECT_TRUE(eventually([&monitor]() { return monitor.get_state() == phone::call_t::state_t::ringing; }));
+  sim.send("NO CARRIER");
+  EXPECT_TRUE(eventually([&phone, &missed]() {
+    phone.drain_listeners();
+    return missed.size() == 1;
+  }));
+  EXPECT_EQ(missed[0]["number"], "+15551234");
+  EXPECT_EQ(missed[0]["rings"], 2);
+  EXPECT_GE(missed[0]["ended"].as<double>(), missed[0]["started"].as<double>());
+  EXPECT_EQ(states.front(), "ringing");
+  EXPECT_EQ(states.back(), "ended");
+  EXPECT_TRUE(monitor.get_state() == phone::call_t::state_t::idle);
+  EXPECT_EQ(monitor.get_probes(), 0u);
+}
+
+FIXTURE(call_answered_then_held) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone::call_monitor_t monitor(phone);
+  size_t missed = 0;
+  phone.on(phone::phone_t::event_t::missedcall, [&missed](const json_t::object_t &) { ++missed; });
+  phone.listen();
+  sim.send("+CLIP: \"5551234\",129");
+  EXPECT_TRUE(eventually([&monitor]() { return monitor.get_state() == phone::call_t::state_t::ringing; }));
+  EXPECT_TRUE(monitor.answer());
+  EXPECT_TRUE(monitor.get_state() == phone::call_t::state_t::active);
+  sim.send("+CCWA: \"5559999\",129,1");
+  EXPECT_TRUE(eventually([&monitor]() { return monitor.get_calls().size() == 2; }));
+  EXPECT_TRUE(monitor.answer());
+  auto calls = monitor.get_calls();
+  EXPECT_TRUE(calls[0].state == phone::call_t::state_t::held);
+  EXPECT_TRUE(calls[1].state == phone::call_t::state_t::active);
+
+  // With two calls up, NO CARRIER is ambiguous, so the monitor asks.
+  sim.on("+CLCC", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CLCC: 2,1,0,0,0,\"5559999\",129");
+    return std::string { "OK" };
+  });
+  sim.send("NO CARRIER");
+  EXPECT_TRUE(eventually([&monitor]() { return monitor.get_calls().size() == 1; }));
+  EXPECT_EQ(monitor.get_probes(), 1u);
+  EXPECT_EQ(monitor.get_calls()[0].number, "5559999");
+  EXPECT_EQ(missed, 0u);
+}
+
+FIXTURE(call_stops_ringing_silently) {
+  phone::modem_sim_t sim;
+  sim.on("+CLCC", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone::call_monitor_t monitor(phone, 50);
+  size_t missed = 0;
+  phone.on(phone::phone_t::event_t::missedcall, [&missed](const json_t::object_t &) { ++missed; });
+  phone.listen();
+  sim.send("RING");
+  EXPECT_TRUE(eventually([&missed]() { return missed == 1; }));
+  EXPECT_EQ(monitor.get_probes(), 1u);
+}
+
+FIXTURE(call_dialed) {
+  phone::modem_sim_t sim;
+  sim.on("D5550000", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "BUSY" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone::call_monitor_t monitor(phone);
+  std::vector<std::string> states;
+  std::vector<std::string> directions;
+  phone.on(phone::phone_t::event_t::call, [&states, &directions](const json_t::object_t &data) {
+    states.push_back(data.at("state").as<json_t::string_t>());
+    directions.push_back(data.at("direction").as<json_t::string_t>());
+  });
+  phone.listen();
+  EXPECT_TRUE(phone.dial("+15551234").ok());
+  EXPECT_TRUE(monitor.get_state() == phone::call_t::state_t::dialing);
+  auto calls = monitor.get_calls();
+  EXPECT_EQ(calls.size(), 1u);
+  EXPECT_EQ(calls[0].number, "+15551234");
+  EXPECT_EQ(calls[0].type, 145);
+  sim.send("MO RING");
+  EXPECT_TRUE(eventually([&monitor]() { return monitor.get_state() == phone::call_t::state_t::alerting; }));
+  sim.send("MO CONNECTED");
+  EXPECT_TRUE(eventually([&monitor]() { return monitor.get_state() == phone::call_t::state_t::active; }));
+  sim.send("NO CARRIER");
+  EXPECT_TRUE(eventually([&monitor]() { return monitor.get_state() == phone::call_t::state_t::idle; }));
+
+  // A call the modem turns down as its answer to ATD ends there.
+  EXPECT_FALSE(phone.dial("5550000").ok());
+  EXPECT_TRUE(monitor.get_state() == phone::call_t::state_t::idle);
+  EXPECT_TRUE(monitor.get_calls().empty());
+  EXPECT_TRUE(eventually([&phone, &states]() {
+    phone.drain_listeners();
+    return states.size() == 6;
+  }));
+  EXPECT_EQ(states[0], "dialing");
+  EXPECT_EQ(states[1], "alerting");
+  EXPECT_EQ(states[2], "active");
+  EXPECT_EQ(states[3], "ended");
+  EXPECT_EQ(states[4], "dialing");
+  EXPECT_EQ(states[5], "ended");
+  for (const auto &direction: directions) {
+    EXPECT_EQ(direction, "outgoing");
+  }
+  EXPECT_EQ(monitor.get_probes(), 0u);
+}
+
+FIXTURE(dial_jumps_the_queue) {
+  phone::modem_sim_t sim;
+  sim.set_delay_us(50000);
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  std::thread bulk([&phone]() {
+    phone.command("AT+BULK1", phone::phone_t::line_callback_t {}, 5000, phone::phone_t::priority_t::bulk);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  std::thread queued([&phone]() {
+    phone.command("AT+BULK2", phone::phone_t::line_callback_t {}, 5000, phone::phone_t::priority_t::bulk);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(phone.dial("5551234").ok());
+  bulk.join();
+  queued.join();
+  auto lines = sim.received();
+  EXPECT_EQ(lines.size(), 3u);
+  EXPECT_EQ(lines[0], "AT+BULK1");
+  EXPECT_EQ(lines[1], "ATD5551234;");
+  EXPECT_EQ(lines[2], "AT+BULK2");
+}
+
+FIXTURE(dial_traces_stages) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  EXPECT_TRUE(phone.dial("+15551234").ok());
+  sim.send("+CLCC: 1,0,3,0,0,\"+15551234\",145");
+  sim.send("+CLCC: 1,0,0,0,0,\"+15551234\",145");
+  EXPECT_TRUE(eventually([&phone]() {
+    return phone.dial_report()[0]["connected_us"].as<double>() >= 0;
+  }));
+  auto trace = phone.dial_report()[0];
+  EXPECT_EQ(trace["number"], "+15551234");
+  EXPECT_GE(trace["written_us"].as<double>(), 0);
+  EXPECT_GE(trace["acknowledged_us"].as<double>(), trace["written_us"].as<double>());
+  EXPECT_GE(trace["alerting_us"].as<double>(), trace["acknowledged_us"].as<double>());
+  EXPECT_GE(trace["connected_us"].as<double>(), trace["alerting_us"].as<double>());
+  EXPECT_EQ(trace["ended_us"], -1);
+}
+
+FIXTURE(dial_traces_the_call_in_progress) {
+  // The first call is alerting while a second dial waits its turn.
+  phone::modem_sim_t sim;
+  sim.on("D5550001", [](phone::modem_sim_t &sim, const std::string &) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    sim.send("+CLCC: 1,0,3,0,0,\"5550001\",129");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  std::thread first([&phone]() { phone.dial("5550001"); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_TRUE(phone.dial("5550002").ok());
+  first.join();
+  auto report = phone.dial_report();
+  EXPECT_EQ(report.size(), 2u);
+  EXPECT_EQ(report[0]["number"], "5550001");
+  EXPECT_GE(report[0]["alerting_us"].as<double>(), 0);
+  EXPECT_EQ(report[1]["alerting_us"], -1);
+
+  // So many dials queue behind a slow one that its trace is dropped.
+  sim.on("D5559999", [](phone::modem_sim_t &, const std::string &) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    return std::string { "OK" };
+  });
+  std::thread slow([&phone]() { EXPECT_TRUE(phone.dial("5559999").ok()); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  std::vector<std::thread> queued;
+  std::atomic<size_t> ok(0);
+  for (size_t i = 0; i < phone::phone_t::max_dial_traces; ++i) {
+    queued.emplace_back([&phone, &ok, i]() {
+      ok += phone.dial("55510" + std::to_string(10 + i)).ok() ? 1 : 0;
+    });
+  }
+  slow.join();
+  for (auto &thread: queued) {
+    thread.join();
+  }
+  EXPECT_EQ(ok.load(), phone::phone_t::max_dial_traces);
+  report = phone.dial_report();
+  EXPECT_EQ(report.size(), phone::phone_t::max_dial_traces);
+  bool acknowledged = true;
+  for (const auto &trace: report) {
+    acknowledged = acknowledged && !(trace["number"] == "5559999") &&
+        trace["acknowledged_us"].as<double>() >= 0;
+  }
+  EXPECT_TRUE(acknowledged);
+}
+
+FIXTURE(dial_checks_cached_registration) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  sim.send("+CREG: 1,\"1A2B\",\"01C3D4E\",7");
+  EXPECT_TRUE(eventually([&phone]() { return phone.get_state().registered(); }));
+  EXPECT_EQ(phone.get_state().lac, 0x1A2B);
+  EXPECT_EQ(phone.get_state().cell_id, 0x1C3D4E);
+  sim.send("+CREG: 3");
+  EXPECT_TRUE(eventually([&phone]() { return phone.get_state().registration == 3; }));
+  auto result = phone.dial("5551234");
+  EXPECT_FALSE(result.ok());
+  EXPECT_EQ(result.final, "not registered");
+  EXPECT_EQ(sim.count("D"), 0u);
+  EXPECT_EQ(sim.count("+CREG"), 0u);
+}
+
+FIXTURE(identity_cached_across_restarts) {
+  phone::modem_sim_t sim;
+  std::string iccid = "8944110068256270054";
+  sim.on("+CGSN", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("490154203237518");
+    return std::string { "OK" };
+  });
+  sim.on("+CCID", [&iccid](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CCID: " + iccid);
+    return std::string { "OK" };
+  });
+  sim.on("+CIMI", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("310150123456789");
+    return std::string { "OK" };
+  });
+  sim.on("+CGMM", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("SIM800");
+    return std::string { "OK" };
+  });
+  sim.on("+CGMR", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("Revision:1418B04SIM800L24");
+    return std::string { "OK" };
+  });
+  sim.on("+GCAP", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+GCAP: +CGSM,+FCLASS,+DS");
+    return std::string { "OK" };
+  });
+  auto path = util::join_path({ "/tmp", "phone-identity-test.json" }, true);
+  if (util::exists(path)) {
+    util::unlink(path);
+  }
+
+  phone::phone_t phone(sim.port().c_str());
+  phone::identity_cache_t cache(phone, path);
+  auto cold = cache.load();
+  EXPECT_FALSE(cache.get_stats().hit);
+  EXPECT_EQ(cache.get_stats().commands, 6u);
+  EXPECT_EQ(cold.imei, "490154203237518");
+  EXPECT_EQ(cold.iccid, iccid);
+  EXPECT_EQ(cold.imsi, "310150123456789");
+  EXPECT_EQ(cold.revision, "1418B04SIM800L24");
+  EXPECT_EQ(cold.capabilities.size(), 3u);
+
+  phone::identity_cache_t again(phone, path);
+  auto warm = again.load();
+  EXPECT_TRUE(again.get_stats().hit);
+  EXPECT_EQ(again.get_stats().commands, 1u);
+  EXPECT_EQ(warm.imsi, cold.imsi);
+  EXPECT_EQ(warm.model, "SIM800");
+  EXPECT_EQ(warm.capabilities[2], "+DS");
+
+  // A different SIM is a different entry.
+  iccid = "8944110068256270099";
+  auto swapped = again.load();
+  EXPECT_FALSE(again.get_stats().hit);
+  EXPECT_EQ(swapped.iccid, iccid);
+  util::unlink(path);
+}
+
+FIXTURE(identity_cache_is_best_effort) {
+  phone::modem_sim_t sim;
+  std::string iccid = "8944110068256270054";
+  sim.on("+CGSN", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("490154203237518");
+    return std::string { "OK" };
+  });
+  sim.on("+CCID", [&iccid](phone::modem_sim_t &sim, const std::string &) {
+    if (iccid.empty()) {
+      return std::string { "ERROR" };
+    }
+    sim.send("+CCID: " + iccid);
+    return std::string { "OK" };
+  });
+  sim.on("+ICCID", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "ERROR" };
+  });
+  sim.on("+CIMI", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("310150123456789");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  char dir[] = "/tmp/phone-identity-test-XXXXXX";
+  EXPECT_TRUE(mkdtemp(dir) != nullptr);
+
+  // A directory that isn't there yet is made.
+  auto path = std::string { dir } + "/cache/identity.json";
+  phone::identity_cache_t cache(phone, path);
+  EXPECT_EQ(cache.load().imsi, "310150123456789");
+  EXPECT_TRUE(cache.get_stats().write_error.empty());
+  EXPECT_TRUE(util::exists(path));
+  cache.load();
+  EXPECT_TRUE(cache.get_stats().hit);
+
+  // One that can't be made costs the cache, not the identity.
+  phone::identity_cache_t unwritable(phone, std::string { dir } + "/no/such/identity.json");
+  EXPECT_EQ(unwritable.load().imsi, "310150123456789");
+  EXPECT_FALSE(unwritable.get_stats().hit);
+  EXPECT_FALSE(unwritable.get_stats().write_error.empty());
+
+  // Without an ICCID, the file is neither trusted nor added to.
+  iccid.clear();
+  auto unknown = cache.load();
+  EXPECT_TRUE(unknown.iccid.empty());
+  EXPECT_FALSE(cache.get_stats().hit);
+  cache.load();
+  EXPECT_FALSE(cache.get_stats().hit);
+  EXPECT_EQ(sim.count("+CIMI"), 4u);
+
+  util::unlink(path);
+  rmdir((std::string { dir } + "/cache").c_str());
+  rmdir(dir);
+}
+
+namespace {
+  // Give the simulator settings it remembers, each read with "NAME?" and
+  // set with "NAME=VALUE".  Echo starts on and follows ATE.
+  void add_settings(phone::modem_sim_t &sim, std::map<std::string, std::string> &values) {
+    sim.set_echo(true);
+    sim.on("E", [](phone::modem_sim_t &sim, const std::string &cmd) {
+      sim.set_echo(cmd == "E1");
+      return std::string { "OK" };
+    });
+    for (const auto &entry: values) {
+      auto name = entry.first;
+      sim.on(name, [&values, name](phone::modem_sim_t &sim, const std::string &cmd) {
+        if (cmd == name + "?") {
+          sim.send(name + ": " + values[name]);
+        } else if (cmd.compare(0, name.size() + 1, name + "=") == 0) {
+          values[name] = cmd.substr(name.size() + 1);
+        } else {
+          return std::string { "ERROR" };
+        }
+        return std::string { "OK" };
+      });
+    }
+  }
+}
+
+FIXTURE(init_profile_sends_only_differences) {
+  phone::modem_sim_t sim;
+  std::map<std::string, std::string> values {
+    { "+CMEE", "0" }, { "+CMGF", "1" }, { "+CSMP", "17,167,0,0" },
+    { "+CNMI", "2,1,0,1,0" }, { "+CLIP", "0,1" }, { "+CCWA", "1" },
+    { "+COLP", "1,1" }, { "+CREG", "0,1" }, { "+CUSD", "1" }
+  };
+  add_settings(sim, values);
+  phone::phone_t phone(sim.port().c_str());
+  auto profile = phone::init_profile_t::standard();
+
+  auto stats = profile.apply(phone);
+  EXPECT_EQ(stats.read_lines, 1u);
+  EXPECT_EQ(stats.write_lines, 1u);
+  EXPECT_EQ(stats.changed, 5u);
+  EXPECT_EQ(stats.unchanged, 5u);
+  EXPECT_TRUE(stats.failed.empty());
+  EXPECT_EQ(sim.received().back(), "ATE0+CMEE=1;+CSMP=49,167,0,0;+CLIP=1;+CREG=2");
+  EXPECT_EQ(values["+CREG"], "2");
+
+  // Reconnecting to a modem which kept its settings costs one round trip.
+  stats = profile.apply(phone);
+  EXPECT_EQ(stats.read_lines, 1u);
+  EXPECT_EQ(stats.write_lines, 0u);
+  EXPECT_EQ(stats.unchanged, 10u);
+}
+
+FIXTURE(init_profile_survives_refusals) {
+  phone::modem_sim_t sim;
+  std::map<std::string, std::string> values {
+    { "+CMEE", "0" }, { "+CLIP", "0" }
+  };
+  add_settings(sim, values);
+  // This modem can neither read nor set +COLP.
+  sim.on("+COLP", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "ERROR" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone::init_profile_t profile;
+  profile.add("+CMEE=1").add("+COLP=1").add("+CLIP=1");
+  auto stats = profile.apply(phone);
+  EXPECT_EQ(stats.failed.size(), 1u);
+  EXPECT_EQ(stats.failed[0], "+COLP=1");
+  EXPECT_EQ(values["+CMEE"], "1");
+  EXPECT_EQ(values["+CLIP"], "1");
+}
+
+FIXTURE(network_scan_parses_operators) {
+  auto operators = phone::network_scan_t::parse(
+      "+COPS: (2,\"Op A\",\"OpA\",\"31026\",7),(3,\"Op B\",\"OpB\",\"31027\"),,(0,1,2,3,4),(0,1,2)");
+  EXPECT_EQ(operators.size(), 2u);
+  EXPECT_EQ(operators[0].status, 2);
+  EXPECT_EQ(operators[0].long_name, "Op A");
+  EXPECT_EQ(operators[0].numeric, "31026");
+  EXPECT_EQ(operators[0].act, 7);
+  EXPECT_EQ(operators[1].act, -1);
+}
+
+FIXTURE(network_scan_in_background) {
+  phone::modem_sim_t primary_sim, secondary_sim;
+  secondary_sim.on("+COPS=?", [](phone::modem_sim_t &sim, const std::string &) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    sim.send("+COPS: (2,\"Op A\",\"OpA\",\"31026\",7),(1,\"Op B\",\"OpB\",\"31027\",2),,(0-4),(0-2)");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(primary_sim.port().c_str());
+  phone::phone_t secondary(secondary_sim.port().c_str());
+  phone.listen();
+  secondary.listen();
+  phone::network_scan_t scanner(phone, &secondary);
+
+  auto before = scanner.get(60000);
+  EXPECT_FALSE(before.valid);
+  EXPECT_TRUE(before.scanning);
+  EXPECT_EQ(before.age_ms(), -1);
+  EXPECT_FALSE(scanner.refresh());
+
+  // The primary channel is free while the scan runs.
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(phone.command("AT").ok());
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+
+  EXPECT_TRUE(eventually([&scanner]() { return scanner.get().valid; }));
+  auto after = scanner.get();
+  EXPECT_FALSE(after.scanning);
+  EXPECT_EQ(after.operators.size(), 2u);
+  EXPECT_GE(after.took_ms, 300);
+  EXPECT_GE(after.age_ms(), 0);
+  EXPECT_EQ(secondary_sim.count("+COPS=?"), 1u);
+  EXPECT_EQ(primary_sim.count("+COPS"), 0u);
+
+  // A callback may look at the scanner and start the next scan.
+  std::atomic<int> calls(0);
+  phone::network_scan_t::done_t again = [&scanner, &calls, &again](
+      const phone::network_scan_t::snapshot_t &) {
+    scanner.get();
+    if (++calls == 1) {
+      scanner.refresh(again);
+    }
+  };
+  EXPECT_TRUE(scanner.refresh(again));
+  EXPECT_TRUE(eventually([&calls]() { return calls == 1; }));
+  EXPECT_TRUE(eventually([&scanner, &calls]() { return calls == 2 && !scanner.get().scanning; }));
+
+  // A refresh doesn't wait for the last callback with the lock held.
+  EXPECT_TRUE(scanner.refresh([&scanner, &calls](const phone::network_scan_t::snapshot_t &) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    scanner.get();
+    ++calls;
+  }));
+  EXPECT_TRUE(eventually([&scanner]() { return !scanner.get().scanning; }));
+  EXPECT_TRUE(scanner.refresh());
+  EXPECT_EQ(calls.load(), 3);
+  EXPECT_TRUE(eventually([&scanner]() { return !scanner.get().scanning; }));
+  EXPECT_EQ(secondary_sim.count("+COPS=?"), 5u);
+}
+
+FIXTURE(network_scan_keeps_off_the_primary) {
+  phone::modem_sim_t sim;
+  sim.on("+COPS=?", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+COPS: (2,\"Op A\",\"OpA\",\"31026\",7),,(0-4),(0-2)");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+
+  // Without a secondary channel, it won't tie up the primary unasked.
+  phone::network_scan_t refused(phone);
+  EXPECT_FALSE(refused.refresh());
+  auto snapshot = refused.get(0);
+  EXPECT_FALSE(snapshot.scanning);
+  EXPECT_FALSE(snapshot.valid);
+  EXPECT_FALSE(snapshot.error.empty());
+  EXPECT_EQ(sim.count("+COPS=?"), 0u);
+
+  phone::network_scan_t scanner(phone, nullptr, phone::network_scan_t::default_timeout_ms, true);
+  EXPECT_TRUE(scanner.refresh());
+  EXPECT_TRUE(eventually([&scanner]() { return scanner.get().valid; }));
+  EXPECT_EQ(scanner.get().operators.size(), 1u);
+  EXPECT_EQ(sim.count("+COPS=?"), 1u);
+}
+
+FIXTURE(delivery_tracker_matches_reports) {
+  phone::modem_sim_t sim;
+  int next_mr = 254;
+  std::vector<std::string> bodies;
+  sim.on_body("+CMGS=", [&next_mr, &bodies](
+      phone::modem_sim_t &sim, const std::string &, const std::string &body) {
+    bodies.push_back(body);
+    sim.send("+CMGS: " + std::to_string(next_mr));
+    next_mr = (next_mr + 1) % 256;
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  std::vector<json_t::object_t> events;
+  std::mutex events_mutex;
+  phone.on(phone::phone_t::event_t::delivery, [&events, &events_mutex](const json_t::object_t &data) {
+    std::lock_guard<std::mutex> lock(events_mutex);
+    events.push_back(data);
+  });
+  phone.listen();
+  phone::delivery_tracker_t tracker(phone);
+
+  EXPECT_EQ(tracker.send("+15551230001", "one"), 254);
+  EXPECT_EQ(tracker.send("+15551230002", "two"), 255);
+  EXPECT_EQ(tracker.send("+15551230003", "three"), 0);
+  EXPECT_EQ(bodies.size(), 3u);
+  EXPECT_EQ(bodies[2], "three");
+
+  // Reported in national form, still trying, then delivered.
+  sim.send("+CDS: 6,255,\"5551230002\",129,\"26/10/19,10:00:00+00\",\"26/10/19,10:00:05+00\",48");
+  sim.send("+CDS: 6,255,\"5551230002\",129,\"26/10/19,10:00:00+00\",\"26/10/19,10:00:09+00\",0");
+  // Failed for good, and one we never sent.
+  sim.send("+CDS: 6,254,\"+15551230001\",145,\"26/10/19,10:00:00+00\",\"26/10/19,10:00:09+00\",65");
+  sim.send("+CDS: 6,7,\"+15551230009\",145,\"26/10/19,10:00:00+00\",\"26/10/19,10:00:09+00\",0");
+  EXPECT_TRUE(eventually([&tracker]() { return tracker.get_stats().unmatched == 1; }));
+
+  auto stats = tracker.get_stats();
+  EXPECT_EQ(stats.sent, 3u);
+  EXPECT_EQ(stats.outstanding, 1u);
+  EXPECT_EQ(stats.trying, 1u);
+  EXPECT_EQ(stats.delivered, 1u);
+  EXPECT_EQ(stats.failed, 1u);
+  EXPECT_EQ(tracker.get_latency().get_count(), 2u);
+  phone.drain_listeners();
+  std::lock_guard<std::mutex> lock(events_mutex);
+  EXPECT_EQ(events.size(), 2u);
+  EXPECT_EQ(events[0]["mr"], 255);
+  EXPECT_EQ(events[0]["delivered"], true);
+  EXPECT_EQ(events[1]["delivered"], false);
+}
+
+FIXTURE(deferred_work_runs_on_time) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  std::mutex mutex;
+  std::vector<int> ran;
+  auto note = [&mutex, &ran](int which) {
+    return [&mutex, &ran, which]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      ran.push_back(which);
+    };
+  };
+  auto start = std::chrono::steady_clock::now();
+  phone.defer(note(60), 60);
+  auto cancelled = phone.defer(note(30), 30);
+  phone.defer(note(0));
+  phone.defer(note(10), 10);
+  EXPECT_TRUE(phone.cancel_deferred(cancelled));
+  EXPECT_FALSE(phone.cancel_deferred(cancelled));
+  EXPECT_TRUE(eventually([&mutex, &ran]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ran.size() == 3;
+  }));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(60));
+  phone.stop();
+  phone.join();
+  EXPECT_EQ(ran[0], 0);
+  EXPECT_EQ(ran[1], 10);
+  EXPECT_EQ(ran[2], 60);
+}
+
+FIXTURE(scripts_wait_without_threads) {
+  phone::modem_sim_t sim;
+  int next_mr = 0;
+  sim.on_body("+CMGS=", [&next_mr](
+      phone::modem_sim_t &sim, const std::string &cmd, const std::string &) {
+    if (cmd.find("bad") != std::string::npos) {
+      return std::string { "+CMS ERROR: 500" };
+    }
+    sim.send("+CMGS: " + std::to_string(next_mr++));
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+
+  // Many at once, each waiting for its own report.
+  std::vector<std::shared_ptr<send_and_confirm_t>> scripts;
+  for (int i = 0; i < 100; ++i) {
+    scripts.push_back(std::make_shared<send_and_confirm_t>("+1555000" + std::to_string(i), 2000));
+    phone::script_t::start(phone, scripts.back());
+  }
+  auto refused = std::make_shared<send_and_confirm_t>("bad", 2000);
+  phone::script_t::start(phone, refused);
+  // Reports for scripts not yet waiting go unheard, so keep sending.
+  EXPECT_TRUE(eventually([&sim, &scripts]() {
+    bool all = true;
+    for (const auto &script: scripts) {
+      if (script->mr >= 0 && !script->confirmed) {
+        sim.send("+CDS: 6," + std::to_string(script->mr.load()) + ",\"" + script->number + "\",145");
+      }
+      all = all && script->is_done();
+    }
+    return all;
+  }));
+  for (size_t i = 0; i < scripts.size(); ++i) {
+    EXPECT_TRUE(scripts[i]->confirmed);
+    EXPECT_EQ(scripts[i]->mr, static_cast<int>(i));
+  }
+  EXPECT_TRUE(eventually([&refused]() { return refused->is_done(); }));
+  EXPECT_EQ(refused->mr, -1);
+  EXPECT_EQ(sim.count("+CMGS="), 101u);
+
+  // A wait for a line which never comes times out.
+  auto lonely = std::make_shared<send_and_confirm_t>("+15559999999", 100);
+  auto start = std::chrono::steady_clock::now();
+  phone::script_t::start(phone, lonely);
+  EXPECT_TRUE(eventually([&lonely]() { return lonely->is_done(); }));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+  phone.stop();
+  phone.join();
+  EXPECT_FALSE(lonely->confirmed);
+}
+
+FIXTURE(delivery_tracker_wraps_and_expires) {
+  phone::modem_sim_t sim;
+  phone::phone_t phone(sim.port().c_str());
+  phone::delivery_tracker_t tracker(phone, 300, 60000);
+  auto start = std::chrono::steady_clock::now();
+
+  // A full cycle of references to one recipient, then the first again.
+  for (int mr = 0; mr < 256; ++mr) {
+    tracker.track("+15551230001", mr, start);
+  }
+  tracker.track("+15551230001", 0, start + std::chrono::seconds(30));
+  tracker.track("+15551230002", 0, start + std::chrono::seconds(30));
+  auto stats = tracker.get_stats();
+  EXPECT_EQ(stats.outstanding, 257u);
+  EXPECT_EQ(stats.replaced, 1u);
+
+  // Past the capacity, the oldest go.
+  for (int mr = 0; mr < 50; ++mr) {
+    tracker.track("+15551230003", mr, start + std::chrono::seconds(30));
+  }
+  stats = tracker.get_stats();
+  EXPECT_EQ(stats.outstanding, 300u);
+  EXPECT_EQ(stats.expired, 7u);
+
+  EXPECT_EQ(tracker.expire(start + std::chrono::seconds(61)), 248u);
+  EXPECT_EQ(tracker.get_stats().outstanding, 52u);
+  EXPECT_TRUE(tracker.report(
+      "+CDS: 6,0,\"+15551230001\",145,\"26/10/19,10:00:00+00\",\"26/10/19,10:00:01+00\",0"));
+  EXPECT_TRUE(tracker.report("+CDS: 6,49,,,\"26/10/19,10:00:00+00\",\"26/10/19,10:00:01+00\",0"));
+  EXPECT_EQ(tracker.get_stats().outstanding, 50u);
+}
+
+FIXTURE(dtmf_packs_tones) {
+  phone::dtmf_queue_t::options_t options;
+  auto lines = phone::dtmf_queue_t::pack("12345", "1", options);
+  EXPECT_EQ(lines.size(), 1u);
+  EXPECT_EQ(lines[0].first, "AT+VTD=1;+VTS=1;+VTS=2;+VTS=3;+VTS=4;+VTS=5");
+  EXPECT_EQ(lines[0].second, 5u);
+
+  options.max_tones = 4;
+  options.max_line = 16;
+  lines = phone::dtmf_queue_t::pack("123456", "", options);
+  EXPECT_EQ(lines.size(), 2u);
+  EXPECT_EQ(lines[0].first, "AT+VTS=\"1234\"");
+  EXPECT_EQ(lines[1].first, "AT+VTS=\"56\"");
+  EXPECT_EQ(lines[1].second, 2u);
+}
+
+FIXTURE(dtmf_queue_plays_into_call) {
+  phone::modem_sim_t sim;
+  sim.on("+VTS=", [](phone::modem_sim_t &, const std::string &) {
+    // The modem answers once the tone has played.
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return std::string { "OK" };
+  });
+  sim.on("+VTS=9", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "+CME ERROR: 3" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  std::vector<std::string> errors;
+  phone.on(phone::phone_t::event_t::error, [&errors](const json_t::object_t &data) {
+    errors.push_back(data.at("what").as<json_t::string_t>());
+  });
+  phone.listen();
+  phone::dtmf_queue_t::options_t options;
+  options.pause_ms = 50;
+  phone::call_monitor_t monitor(phone, phone::call_monitor_t::default_ring_timeout_ms, options);
+
+  auto start = std::chrono::steady_clock::now();
+  monitor.send_dtmf("123,#0");
+  EXPECT_TRUE(monitor.get_dtmf().wait_idle(2000));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50));
+  auto lines = sim.received();
+  EXPECT_EQ(lines.size(), 2u);
+  EXPECT_EQ(lines[0], "AT+VTD=1;+VTS=1;+VTS=2;+VTS=3");
+  EXPECT_EQ(lines[1], "AT+VTS=#;+VTS=0");
+  auto stats = monitor.get_dtmf().get_stats();
+  EXPECT_EQ(stats.tones, 5u);
+  EXPECT_EQ(stats.pauses, 1u);
+  EXPECT_EQ(stats.commands, 2u);
+  EXPECT_EQ(phone.get_latencies().get("dtmf").get_count(), 5u);
+
+  // A gap of our own costs a command per tone.
+  options.gap_ms = 10;
+  monitor.get_dtmf().set_options(options);
+  monitor.send_dtmf("45");
+  EXPECT_TRUE(monitor.get_dtmf().wait_idle(2000));
+  EXPECT_EQ(sim.received().size(), 4u);
+  EXPECT_EQ(sim.received()[3], "AT+VTS=5");
+
+  // A refusal drops the rest, the refused tone included.
+  monitor.send_dtmf("9,123");
+  EXPECT_TRUE(monitor.get_dtmf().wait_idle(2000));
+  EXPECT_EQ(monitor.get_dtmf().get_stats().dropped, 5u);
+  EXPECT_TRUE(eventually([&phone, &errors]() {
+    phone.drain_listeners();
+    return errors.size() == 1;
+  }));
+  EXPECT_EQ(phone.get_latencies().get("dtmf").get_count(), 7u);
+}
+
+FIXTURE(ussd_shares_one_round_trip) {
+  phone::modem_sim_t sim;
+  std::vector<std::thread> network;
+  sim.on("+CUSD=1,\"*100#\"", [&network](phone::modem_sim_t &sim, const std::string &) {
+    // The network answers a while after the modem says OK.
+    network.emplace_back([&sim]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      sim.send("+CUSD: 0,\"Balance: 5.00\",15");
+    });
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  phone::ussd_t ussd(phone);
+
+  std::vector<std::thread> pollers;
+  std::vector<std::string> answers(4);
+  for (size_t i = 0; i < answers.size(); ++i) {
+    pollers.emplace_back([&ussd, &answers, i]() {
+      answers[i] = ussd.query("*100#").text;
+    });
+  }
+  for (auto &poller: pollers) {
+    poller.join();
+  }
+  EXPECT_EQ(ussd.query("*100#").text, "Balance: 5.00");
+  for (auto &thread: network) {
+    thread.join();
+  }
+  for (const auto &answer: answers) {
+    EXPECT_EQ(answer, "Balance: 5.00");
+  }
+  EXPECT_EQ(sim.count("+CUSD=1"), 1u);
+  auto stats = ussd.get_stats();
+  EXPECT_EQ(stats.requests, 5u);
+  EXPECT_EQ(stats.sessions, 1u);
+  EXPECT_EQ(stats.shared + stats.cached, 4u);
+
+  ussd.invalidate();
+  EXPECT_EQ(ussd.query("*100#").text, "Balance: 5.00");
+  for (auto &thread: network) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  EXPECT_EQ(sim.count("+CUSD=1"), 2u);
+}
+
+FIXTURE(ussd_walks_menus) {
+  phone::modem_sim_t sim;
+  sim.on("+CUSD=1,\"*111#\"", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CUSD: 1,\"1 Bundles\n2 Balance\",15");
+    return std::string { "OK" };
+  });
+  sim.on("+CUSD=1,\"1\"", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CUSD: 1,\"1 Daily\n2 Weekly\",15");
+    return std::string { "OK" };
+  });
+  sim.on("+CUSD=1,\"2\"", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CUSD: 0,\"Weekly bundle on\",15");
+    return std::string { "OK" };
+  });
+  sim.on("+CUSD=1,\"*123#\"", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CUSD: 1,\"04110438\",72");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone.listen();
+  phone::ussd_t ussd(phone);
+
+  auto reply = ussd.session("*111#", { "1", "2" });
+  EXPECT_EQ(reply.status, 0);
+  EXPECT_EQ(reply.text, "Weekly bundle on");
+  EXPECT_EQ(sim.count("+CUSD=1"), 3u);
+  EXPECT_EQ(sim.count("+CUSD=2"), 0u);
+
+  // A menu left open is closed, and UCS2 decoded.
+  reply = ussd.query("*123#");
+  EXPECT_TRUE(reply.more());
+  EXPECT_EQ(reply.text, "\xd0\x91\xd0\xb8");
+  EXPECT_EQ(sim.count("+CUSD=2"), 1u);
+
+  // Menus run over several lines.
+  EXPECT_EQ(ussd.session("*111#", { "1" }).text, "1 Daily\n2 Weekly");
+  EXPECT_EQ(sim.count("+CUSD=2"), 2u);
+
+  bool refused = false;
+  sim.on("+CUSD=1,\"*9#\"", [](phone::modem_sim_t &, const std::string &) {
+    return std::string { "+CME ERROR: 100" };
+  });
+  try {
+    ussd.query("*9#");
+  } catch (const std::runtime_error &) {
+    refused = true;
+  }
+  EXPECT_TRUE(refused);
+  EXPECT_EQ(ussd.get_stats().failures, 1u);
+}
+
+FIXTURE(signal_history_fed_by_state_cache) {
+  phone::modem_sim_t sim;
+  sim.on("+CSQ", [](phone::modem_sim_t &sim, const std::string &) {
+    sim.send("+CSQ: 20,0");
+    return std::string { "OK" };
+  });
+  phone::phone_t phone(sim.port().c_str());
+  phone::signal_history_t history;
+  history.attach(phone);
+  phone.listen();
+
+  // Unchanged samples count too.
+  EXPECT_TRUE(phone.command("AT+CSQ").ok());
+  EXPECT_TRUE(phone.command("AT+CSQ").ok());
+  sim.send("+CREG: 1,\"00A1\",\"0001B2C3\",7");
+  EXPECT_TRUE(eventually([&history]() { return history.get_stats().rows == 3; }));
+
+  std::vector<phone::signal_history_t::sample_t> samples;
+  history.samples(0, phone::signal_history_t::now_us(), samples);
+  EXPECT_EQ(samples.size(), 3u);
+  EXPECT_EQ(samples[1].get(phone::signal_history_t::metric_t::rssi), 20);
+  EXPECT_EQ(samples[2].get(phone::signal_history_t::metric_t::cell_id), 0x1B2C3);
+  EXPECT_EQ(samples[2].get(phone::signal_history_t::metric_t::registration), 1);
+}
@@ -1,29 +1,812 @@
 #include <raspi-phone-tools/phone.h>
+#include <raspi-phone-tools/at.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <linux/futex.h>
+#include <linux/serial.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 namespace phone {
-  using callback_t = std::function<void(json_t::object_t)>;
-  phone_t::phone_t(const char *portname) : device(util::make_fd_tty(portname)), run(true) {}
-  phone_t::~phone_t() {}
+  // How long the listening thread waits for input before checking 'run'.
+  static const int listen_poll_ms = 100;
+
+  // What the listening thread's buffers are sized for up front, so it
+  // doesn't have to grow them.
+  static const size_t rx_reserve_bytes = 4096;
+
+  // Microseconds since 'start'.
+  static uint64_t elapsed_us(phone_t::time_point_t start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+
+  // USSD text may run over several lines within its quotes.  Return where
+  // the line starting at 'start' ends, outside quotes, or npos if it hasn't
+  // all arrived yet.  A quote which stays open for too long is taken to be
+  // a stray, and the line ends at the first line break after all.
+  static size_t quoted_line_end(const std::string &rx, size_t start) {
+    static const size_t max_quoted = 2048;
+    bool quoted = false;
+    for (size_t i = start; i < rx.size(); ++i) {
+      if (rx[i] == '"') {
+        quoted = !quoted;
+      } else if ((rx[i] == '\r' || rx[i] == '\n') && !quoted) {
+        return i;
+      }
+    }
+    if (rx.size() - start > max_quoted) {
+      return rx.find_first_of("\r\n", start);
+    }
+    return std::string::npos;
+  }
+
+  constexpr int phone_t::default_timeout_ms;
+  constexpr int phone_t::dial_timeout_ms;
+  constexpr size_t phone_t::max_dial_traces;
+  constexpr size_t phone_t::max_late;
+  constexpr size_t phone_t::event_count;
+  constexpr size_t phone_t::default_listener_threads;
+  constexpr size_t phone_t::urc_ring_slots;
+  constexpr size_t phone_t::urc_line_bytes;
+
+  // How many low bits of a listener id hold its event.
+  static const int listener_event_bits = 4;
+
+  namespace {
+    // Milliseconds since the epoch, as journal records are stamped.
+    int64_t now_ms() {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Sleep until woken, so long as 'word' holds 'value'.
+    void futex_wait(std::atomic<int> &word, int value) {
+      syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+    }
+
+    // Wake whoever sleeps on 'word'.
+    void futex_wake(std::atomic<int> &word) {
+      syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    // A typed listener's callback, kept alive by the list holding it.
+    using typed_ptr_t = std::shared_ptr<const std::function<void(const void *)>>;
+
+    // The job queued for a typed listener: its own copy of the event,
+    // which the executor keeps inline.
+    template <typename event_struct_t>
+    struct typed_job_t {
+      void operator()() const {
+        (*callback)(&event);
+      }
+
+      typed_ptr_t callback;
+      event_struct_t event;
+    };
+
+    // What dispatch() needs to know about the struct for an event, when it
+    // doesn't know its type.
+    struct event_ops_t {
+      json_t::object_t (*to_json)(const void *event);
+      executor_t::job_t (*job)(typed_ptr_t callback, const void *event);
+      std::shared_ptr<const void> (*from_json)(const json_t::object_t &data);
+    };
+
+    template <typename event_struct_t>
+    const event_ops_t *ops_of() {
+      static_assert(executor_t::job_t::fits_inline<typed_job_t<event_struct_t>>::value,
+          "queueing the event for a typed listener would allocate");
+      static const event_ops_t ops {
+        [](const void *event) {
+          return static_cast<const event_struct_t *>(event)->to_json();
+        },
+        [](typed_ptr_t callback, const void *event) -> executor_t::job_t {
+          return typed_job_t<event_struct_t> {
+            std::move(callback), *static_cast<const event_struct_t *>(event)
+          };
+        },
+        [](const json_t::object_t &data) -> std::shared_ptr<const void> {
+          return std::make_shared<event_struct_t>(event_struct_t::from_json(data));
+        }
+      };
+      return &ops;
+    }
+
+    // The struct for the event, or null if it has none.
+    const event_ops_t *ops_for(phone_t::event_t event) {
+      using event_t = phone_t::event_t;
+      switch (event) {
+        case event_t::reply: return ops_of<line_received_t>();
+        case event_t::error: return ops_of<phone_error_t>();
+        case event_t::sms: return ops_of<sms_received_t>();
+        case event_t::call: return ops_of<call_changed_t>();
+        case event_t::missedcall: return ops_of<missed_call_t>();
+        case event_t::delivery: return ops_of<delivery_t>();
+        case event_t::registration: return ops_of<registration_changed_t>();
+        case event_t::signal: return ops_of<signal_changed_t>();
+        case event_t::onchar: break;
+      }
+      return nullptr;
+    }
+  }
+
+  // The command currently waiting on the modem.
+  struct phone_t::pending_t {
+    pending_t(const std::string &cmd, const std::string *body, const line_callback_t &on_line)
+        : echo(cmd),
+          prefixes(at::response_prefixes(cmd)),
+          dial(at::starts_with(cmd, "ATD") || at::starts_with(cmd, "ATA")),
+          on_line(on_line),
+          body(body),
+          prompted(false),
+          done(false),
+          expires(time_point_t::max()),
+          marked(false) {
+      result.echoed = false;
+    }
+
+    // What is left of a command which timed out, to swallow the rest of
+    // its response, and that of the 'marker' command sent after it, when
+    // they come.  Lines go nowhere, and a prompt for a body is cancelled.
+    // Given up on at 'expires', in case the modem answers neither.
+    pending_t(const pending_t &timed_out, const std::string &marker, time_point_t expires)
+        : echo(timed_out.echo),
+          prefixes(timed_out.prefixes),
+          dial(timed_out.dial),
+          on_line(no_lines),
+          body(nullptr),
+          prompted(timed_out.prompted || !timed_out.body),
+          done(false),
+          expires(expires),
+          marker(marker),
+          marker_prefix(at::response_prefix(marker)),
+          marked(false) {
+      result.echoed = timed_out.result.echoed;
+    }
+
+    // True iff. the line is part of this command's response rather than
+    // something the modem sent on its own.
+    bool claims(const std::string &line) const {
+      if (line == echo) {
+        return true;
+      }
+      if (at::is_call_progress(line)) {
+        return dial;
+      }
+      if (at::is_final(line)) {
+        return true;
+      }
+      if (line[0] == '+' || line[0] == '^') {
+        auto name = at::line_name(line);
+        for (const auto &prefix: prefixes) {
+          if (name == prefix) {
+            return true;
+          }
+        }
+      }
+      return !at::is_unsolicited(line);
+    }
+
+    const std::string echo;
+    const std::vector<std::string> prefixes;
+    const bool dial;
+    const line_callback_t &on_line;
+    const std::string *body;
+    bool prompted;
+    bool done;
+    result_t result;
+    time_point_t expires;
+
+    // For a command which timed out: the command sent after it to find
+    // where its response ends, the prefix of the marker's information
+    // line, and whether that has come.
+    const std::string marker;
+    const std::string marker_prefix;
+    bool marked;
+
+    static const line_callback_t no_lines;
+  };
+
+  const phone_t::line_callback_t phone_t::pending_t::no_lines;
+
+  phone_t::listener_options_t::listener_options_t()
+      : queued(true) {
+    // Better to lose events to a listener that is stuck than to stall the
+    // reader behind it.
+    lane.capacity = 1024;
+    lane.overflow = executor_t::overflow_t::drop;
+  }
+
+  phone_t::io_options_t::io_options_t()
+      : fifo_priority(0),
+        cpu(-1),
+        lock_memory(false) {}
+
+  phone_t::phone_t(const char *portname, size_t listener_threads)
+      : device(util::make_fd_tty(portname)),
+        run(true),
+        gate_busy(false),
+        gate_waiting { 0, 0, 0 },
+        pending(nullptr),
+        listening(false),
+        next_urc_waiter(1),
+        urc_waiter_count(0),
+        urc_ring(urc_ring_slots),
+        next_listener_id(1),
+        journal(nullptr),
+        journal_failures(0),
+        registration(registration_changed_t { -1, -1, -1, -1 }),
+        signal(signal_changed_t { 99, 99 }),
+        latencies(new histogram_table_t),
+        next_dial_seq(1),
+        active_dial(0),
+        deferred_timer(util::make_fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK))),
+        deferred_armed(time_point_t::max()),
+        executor(listener_threads) {
+    for (auto &policy: policies) {
+      policy = policy_t::queue;
+    }
+    policies[static_cast<size_t>(event_t::registration)] = policy_t::latest;
+    policies[static_cast<size_t>(event_t::signal)] = policy_t::latest;
+    policies[static_cast<size_t>(event_t::onchar)] = policy_t::count;
+    policies[static_cast<size_t>(event_t::sms)] = policy_t::never_drop;
+    policies[static_cast<size_t>(event_t::call)] = policy_t::never_drop;
+    policies[static_cast<size_t>(event_t::missedcall)] = policy_t::never_drop;
+    policies[static_cast<size_t>(event_t::delivery)] = policy_t::never_drop;
+    state.observe([this](const modem_state_t &now) { note_state(now); });
+    writer = std::thread([this]() { write_queued(); });
+  }
+
+  phone_t::~phone_t() {
+    stop();
+    join();
+    // Everything queued before it is written, then the writing thread
+    // stops; joining it is our wait.
+    write_request_t last;
+    last.part_count = 0;
+    last.state.store(0, std::memory_order_relaxed);
+    last.error = 0;
+    last.last = true;
+    write_queue.push(&last);
+    writer.join();
+  }
+
+  phone_t::listener_id_t phone_t::on(
+      event_t event, callback_t callback, const listener_options_t &options) {
+    return add_listener(event, std::move(callback), typed_callback_t {}, options);
+  }
+
+  phone_t::listener_id_t phone_t::add_listener(
+      event_t event, callback_t callback, typed_callback_t typed,
+      const listener_options_t &options) {
+    static_assert(event_count <= (1 << listener_event_bits), "too many events for a listener id");
+    auto index = static_cast<size_t>(event);
+    std::lock_guard<std::mutex> lock(listeners_mutex);
+    auto id = (next_listener_id++ << listener_event_bits) | index;
+    auto policy = policies[index];
+    if (policy == policy_t::count && typed && options.queued) {
+      throw std::invalid_argument("a typed listener has no way to take a count");
+    }
+    auto lane_options = options.lane;
+    switch (policy) {
+      case policy_t::queue:
+        break;
+      case policy_t::latest:
+      case policy_t::count:
+        lane_options.capacity = 1;
+        lane_options.overflow = executor_t::overflow_t::coalesce;
+        break;
+      case policy_t::never_drop:
+        lane_options.capacity = std::numeric_limits<size_t>::max();
+        break;
+    }
+    std::vector<listener_t> list;
+    if (listeners[index]) {
+      list = listeners[index]->listeners;
+    }
+    list.push_back(listener_t {
+      id, std::move(callback), std::move(typed),
+      options.queued ? executor.make_lane(lane_options) : nullptr,
+      policy,
+      policy == policy_t::count ? std::make_shared<std::atomic<uint64_t>>(0) : nullptr,
+      options.filter
+    });
+    publish_listeners(index, std::move(list));
+    return id;
+  }
+
+  void phone_t::publish_listeners(size_t index, std::vector<listener_t> list) {
+    auto published = std::make_shared<listener_list_t>();
+    std::vector<const filter_t *> filters;
+    for (size_t i = 0; i < list.size(); ++i) {
+      if (list[i].filter.empty()) {
+        published->unfiltered.push_back(i);
+      } else {
+        published->filtered.push_back(i);
+        filters.push_back(&list[i].filter);
+      }
+    }
+    published->filters = filter_set_t(filters);
+    published->listeners = std::move(list);
+    listeners[index] = published;
+  }
+
+  bool phone_t::off(listener_id_t id) {
+    auto index = static_cast<size_t>(id & ((1 << listener_event_bits) - 1));
+    if (index >= event_count) {
+      return false;
+    }
+    executor_t::lane_ptr_t lane;
+    {
+      std::lock_guard<std::mutex> lock(listeners_mutex);
+      if (!listeners[index]) {
+        return false;
+      }
+      std::vector<listener_t> list;
+      bool found = false;
+      for (const auto &listener: listeners[index]->listeners) {
+        if (listener.id != id) {
+          list.push_back(listener);
+        } else {
+          found = true;
+          lane = listener.lane;
+        }
+      }
+      if (!found) {
+        return false;
+      }
+      publish_listeners(index, std::move(list));
+    }
+    if (lane) {
+      executor.close(lane);
+    }
+    return true;
+  }
 
-  void phone_t::on(event_t event, callback_t callback) {
-    listeners.push_back(std::pair<event_t, callback_t>(event, callback));
+  void phone_t::set_policy(event_t event, policy_t policy) {
+    std::lock_guard<std::mutex> lock(listeners_mutex);
+    policies[static_cast<size_t>(event)] = policy;
+  }
+
+  phone_t::policy_t phone_t::get_policy(event_t event) {
+    std::lock_guard<std::mutex> lock(listeners_mutex);
+    return policies[static_cast<size_t>(event)];
+  }
+
+  json_t::object_t phone_t::listener_report() {
+    static const char *event_names[event_count] = {
+      "reply", "onchar", "error", "sms", "call", "missedcall", "delivery", "registration", "signal"
+    };
+    static const char *policy_names[] = { "queue", "latest", "count", "never_drop" };
+    std::vector<std::shared_ptr<const listener_list_t>> lists;
+    {
+      std::lock_guard<std::mutex> lock(listeners_mutex);
+      lists.assign(listeners, listeners + event_count);
+    }
+    json_t::object_t report;
+    for (size_t index = 0; index < event_count; ++index) {
+      if (!lists[index]) {
+        continue;
+      }
+      for (const auto &listener: lists[index]->listeners) {
+        json_t::object_t entry {
+          { "event", std::string { event_names[index] } },
+          { "policy", std::string { policy_names[static_cast<size_t>(listener.policy)] } },
+          { "queued", static_cast<bool>(listener.lane) }
+        };
+        if (listener.lane) {
+          auto stats = executor.get_stats(listener.lane);
+          entry["depth"] = static_cast<double>(stats.depth);
+          entry["max_depth"] = static_cast<double>(stats.max_depth);
+          entry["runs"] = static_cast<double>(stats.runs);
+          entry["failures"] = static_cast<double>(stats.failures);
+          entry["dropped"] = static_cast<double>(stats.dropped);
+          entry["coalesced"] = static_cast<double>(stats.coalesced);
+          entry["blocked"] = static_cast<double>(stats.blocked);
+          entry["deferred"] = static_cast<double>(stats.deferred);
+          entry["mean_us"] = stats.runs ? static_cast<double>(stats.total_us) / static_cast<double>(stats.runs) : 0.0;
+          entry["max_us"] = static_cast<double>(stats.max_us);
+        }
+        report[std::to_string(listener.id)] = entry;
+      }
+    }
+    return report;
+  }
+
+  void phone_t::drain_listeners() {
+    executor.drain();
+  }
+
+  void phone_t::set_journal(journal_t *journal) {
+    this->journal = journal;
+  }
+
+  uint64_t phone_t::get_journal_failures() const {
+    return journal_failures;
+  }
+
+  void phone_t::on_urc(urc_handler_t handler) {
+    urc_handlers.push_back(std::move(handler));
+  }
+
+  void phone_t::on_dial(dial_handler_t handler) {
+    dial_handlers.push_back(std::move(handler));
+  }
+
+  void phone_t::emit(event_t event, const json_t::object_t &data) {
+    dispatch(event, nullptr, &data);
+  }
+
+  void phone_t::dispatch(event_t event, const void *typed, const json_t::object_t *json) {
+    auto *ops = ops_for(event);
+    json_t::object_t built_json;
+    if (auto *journal = this->journal.load()) {
+      auto start = std::chrono::steady_clock::now();
+      if (!json) {
+        built_json = ops->to_json(typed);
+        json = &built_json;
+      }
+      try {
+        journal->append(static_cast<int>(event), now_ms(), *json);
+      } catch (const std::exception &) {
+        ++journal_failures;
+      }
+      latencies->get("journal").record(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()));
+    }
+
+    std::shared_ptr<const listener_list_t> list;
+    {
+      std::lock_guard<std::mutex> lock(listeners_mutex);
+      list = listeners[static_cast<size_t>(event)];
+    }
+    if (!list) {
+      return;
+    }
+
+    // Filters look at the JSON, so if any listener has one, it's needed
+    // up front.  Then only the listeners without a filter, and those whose
+    // filter the event passes, are looked at, in order.
+    std::vector<size_t> chosen;
+    bool filtering = list->filters.size() > 0;
+    if (filtering) {
+      if (!json) {
+        built_json = ops->to_json(typed);
+        json = &built_json;
+      }
+      std::vector<uint32_t> passed;
+      list->filters.match(*json, passed);
+      for (auto &filter: passed) {
+        filter = static_cast<uint32_t>(list->filtered[filter]);
+      }
+      chosen.reserve(passed.size() + list->unfiltered.size());
+      std::merge(
+          passed.begin(), passed.end(), list->unfiltered.begin(), list->unfiltered.end(),
+          std::back_inserter(chosen));
+    }
+
+    // Whichever form the event didn't come in is made on first need, as is
+    // the copy of the JSON queued listeners share.  Queued typed listeners
+    // each get their own copy of the struct, inline in the job, so nothing
+    // is allocated for them.  The copies live as long as the last listener
+    // needs them, as does the list holding the callbacks.
+    std::shared_ptr<const json_t::object_t> shared_json;
+    std::shared_ptr<const void> shared_typed;
+    auto count = filtering ? chosen.size() : list->listeners.size();
+    for (size_t k = 0; k < count; ++k) {
+      auto i = filtering ? chosen[k] : k;
+      const auto &listener = list->listeners[i];
+      if (listener.typed) {
+        if (!typed) {
+          if (!ops) {
+            continue;
+          }
+          shared_typed = ops->from_json(*json);
+          typed = shared_typed.get();
+        }
+        if (!listener.lane) {
+          listener.typed(typed);
+          continue;
+        }
+        executor.post(listener.lane, ops->job(typed_ptr_t(list, &listener.typed), typed));
+        continue;
+      }
+      if (!json) {
+        built_json = ops->to_json(typed);
+        json = &built_json;
+      }
+      if (!listener.lane) {
+        listener.callback(*json);
+        continue;
+      }
+      if (!shared_json) {
+        shared_json = std::make_shared<json_t::object_t>(*json);
+      }
+      if (listener.arrived) {
+        // Whichever post survives the merging reports them all.
+        listener.arrived->fetch_add(1);
+        executor.post(listener.lane, [list, i, shared_json]() {
+          const auto &listener = list->listeners[i];
+          auto data = *shared_json;
+          data["count"] = static_cast<double>(listener.arrived->exchange(0));
+          listener.callback(data);
+        });
+        continue;
+      }
+      executor.post(listener.lane, [list, i, shared_json]() { list->listeners[i].callback(*shared_json); });
+    }
+  }
+
+  void phone_t::note_state(const modem_state_t &now) {
+    if (now.registration != registration.registration || now.lac != registration.lac ||
+        now.cell_id != registration.cell_id || now.act != registration.act) {
+      registration = registration_changed_t { now.registration, now.lac, now.cell_id, now.act };
+      emit(registration);
+    }
+    if (now.rssi != signal.rssi || now.ber != signal.ber) {
+      signal = signal_changed_t { now.rssi, now.ber };
+      emit(signal);
+    }
+  }
+
+  void phone_t::set_io_options(const io_options_t &options) {
+    io_options = options;
+  }
+
+  json_t::object_t phone_t::io_report() {
+    json_t::object_t report {
+      { "fifo_priority", io_options.fifo_priority },
+      { "cpu", io_options.cpu },
+      { "lock_memory", io_options.lock_memory },
+      { "jitter", latencies->get("io:wakeup-jitter").report() }
+    };
+    {
+      std::lock_guard<std::mutex> lock(io_mutex);
+      report["status"] = io_status;
+    }
+    // Real serial ports count what they had to drop; a pseudo-terminal
+    // doesn't.
+    struct serial_icounter_struct counts;
+    if (ioctl(device, TIOCGICOUNT, &counts) == 0) {
+      report["overruns"] = counts.overrun;
+      report["buffer_overruns"] = counts.buf_overrun;
+    }
+    return report;
+  }
+
+  void phone_t::apply_io_options() {
+    auto outcome = [](int error) {
+      return error ? std::string { std::strerror(error) } : std::string { "ok" };
+    };
+    json_t::object_t status;
+    if (io_options.lock_memory) {
+      status["lock_memory"] = outcome(mlockall(MCL_CURRENT | MCL_FUTURE) == 0 ? 0 : errno);
+    }
+    if (io_options.cpu >= 0) {
+      if (io_options.cpu >= CPU_SETSIZE) {
+        status["cpu"] = outcome(EINVAL);
+      } else {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(io_options.cpu, &cpus);
+        status["cpu"] = outcome(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus));
+      }
+    }
+    if (io_options.fifo_priority > 0) {
+      struct sched_param param;
+      param.sched_priority = io_options.fifo_priority;
+      status["fifo_priority"] = outcome(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param));
+    }
+    std::lock_guard<std::mutex> lock(io_mutex);
+    io_status = std::move(status);
   }
 
   void phone_t::listen() {
-    int dev = device;
+    listening = true;
+
+    tasks.push_back(std::thread([this]() {
+      apply_io_options();
+      bool hand_off = io_options.fifo_priority > 0 || io_options.cpu >= 0 || io_options.lock_memory;
+      auto &jitter = latencies->get("io:wakeup-jitter");
+      std::string line;
+      line.reserve(rx_reserve_bytes);
+      rx.reserve(rx_reserve_bytes);
+      try {
+        while (run.load()) {
+          if (next_line(line, listen_poll_ms, &jitter)) {
+            auto received = std::chrono::steady_clock::now();
+            if (hand_off) {
+              queue_urc(line, received, true);
+            } else if (!claim_line(line)) {
+              queue_urc(line, received);
+            }
+          }
+        }
+      } catch (const std::exception &ex) {
+        emit(phone_error_t { ex.what() });
+      }
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      listening = false;
+      pending_cv.notify_all();
+    }));
+
+    tasks.push_back(std::thread([this]() { dispatch_urcs(); }));
+    tasks.push_back(std::thread([this]() { work_deferred(); }));
+  }
+
+  void phone_t::stop() {
+    run = false;
+    // Wake the worker to see it.
+    std::lock_guard<std::mutex> lock(deferred_mutex);
+    deferred_armed = time_point_t::max();
+    arm_deferred(std::chrono::steady_clock::now());
+  }
 
-    tasks.push_back(std::thread([&dev](std::atomic<bool> &run) {
-      while (run.load()) {
-        char buff[2];
-        util::read_at_most(dev, buff, 1);
-        buff[1] = '\0';
-        std::cout << "BUFF: `" << buff << "`" << std::endl;
+  phone_t::timer_id_t phone_t::defer(std::function<void()> work, int delay_ms) {
+    auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+    std::lock_guard<std::mutex> lock(deferred_mutex);
+    auto id = deferred.schedule(due, std::move(work));
+    arm_deferred(deferred.next_due());
+    return id;
+  }
+
+  bool phone_t::cancel_deferred(timer_id_t id) {
+    // The timer may go off for nothing; the worker just sets it again.
+    std::lock_guard<std::mutex> lock(deferred_mutex);
+    return deferred.cancel(id);
+  }
+
+  void phone_t::arm_deferred(time_point_t when) {
+    if (when >= deferred_armed) {
+      return;
+    }
+    deferred_armed = when;
+    // The steady clock is CLOCK_MONOTONIC; a zero time would disarm it.
+    auto ns = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(
+        when.time_since_epoch()).count());
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 0;
+    spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+    spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+    util::throw_if_lt0(timerfd_settime(deferred_timer, TFD_TIMER_ABSTIME, &spec, nullptr));
+  }
+
+  void phone_t::work_deferred() {
+    std::vector<timing_wheel_t::callback_t> due;
+    for (;;) {
+      util::wait_readable(deferred_timer, -1);
+      uint64_t expirations;
+      if (::read(deferred_timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        util::throw_system_error();
+      }
+      {
+        std::lock_guard<std::mutex> lock(deferred_mutex);
+        deferred_armed = time_point_t::max();
+        if (!run.load()) {
+          return;
+        }
+        // Everything due in the same millisecond comes out in one go.
+        deferred.advance(std::chrono::steady_clock::now(), due);
+        arm_deferred(deferred.next_due());
       }
-    }, std::ref(run)));
+      for (auto &work: due) {
+        try {
+          work();
+        } catch (const std::exception &ex) {
+          emit(phone_error_t { ex.what() });
+        }
+        work = nullptr;
+      }
+      due.clear();
+    }
   }
 
   void phone_t::write(const std::string &msg) {
-    util::write_exactly(device, msg.c_str(), msg.size());
+    write_parts(msg.data(), msg.size());
+  }
+
+  void phone_t::write_parts(const char *data, size_t size, const char *more, size_t more_size) {
+    write_request_t request;
+    request.parts[0].iov_base = const_cast<char *>(data);
+    request.parts[0].iov_len = size;
+    request.parts[1].iov_base = const_cast<char *>(more);
+    request.parts[1].iov_len = more_size;
+    request.part_count = more_size ? 2 : 1;
+    request.state.store(0, std::memory_order_relaxed);
+    request.error = 0;
+    request.last = false;
+    write_queue.push(&request);
+
+    // The write will likely take a while at serial speeds, so don't spin
+    // long before sleeping.
+    for (int spins = 0; spins < 64 && request.state.load(std::memory_order_acquire) == 0; ++spins) {}
+    for (;;) {
+      int state = 0;
+      if (!request.state.compare_exchange_strong(state, 2, std::memory_order_acq_rel) && state == 1) {
+        break;
+      }
+      futex_wait(request.state, 2);
+    }
+    if (request.error) {
+      util::throw_system_error(request.error);
+    }
+  }
+
+  void phone_t::write_queued() {
+    static const int max_batch = 32;
+    write_request_t *batch[max_batch];
+    struct iovec parts[max_batch * 2];
+    for (bool stopping = false; !stopping;) {
+      int count = 0;
+      int part_count = 0;
+      while (count < max_batch && !stopping) {
+        auto node = write_queue.pop();
+        if (!node) {
+          break;
+        }
+        auto request = static_cast<write_request_t *>(node);
+        batch[count++] = request;
+        stopping = request->last;
+        for (int i = 0; i < request->part_count; ++i) {
+          if (request->parts[i].iov_len) {
+            parts[part_count++] = request->parts[i];
+          }
+        }
+      }
+      if (count == 0) {
+        if (write_queue.busy()) {
+          // A push is under way; it won't be long.
+          std::this_thread::yield();
+        } else {
+          write_queue.wait(listen_poll_ms);
+        }
+        continue;
+      }
+
+      int error = 0;
+      int at = 0;
+      while (at < part_count) {
+        auto written = ::writev(device, parts + at, part_count - at);
+        if (written < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          error = errno;
+          break;
+        }
+        // Step over what went, which may end partway through a part.
+        auto left = static_cast<size_t>(written);
+        while (at < part_count && left >= parts[at].iov_len) {
+          left -= parts[at++].iov_len;
+        }
+        if (left) {
+          parts[at].iov_base = static_cast<char *>(parts[at].iov_base) + left;
+          parts[at].iov_len -= left;
+        }
+      }
+
+      // Once its state is 1, a request may be gone, so that comes last.
+      for (int i = 0; i < count; ++i) {
+        auto request = batch[i];
+        request->error = error;
+        if (request->state.exchange(1, std::memory_order_acq_rel) == 2) {
+          futex_wake(request->state);
+        }
+      }
+    }
   }
 
   std::string phone_t::read(size_t count) {
@@ -50,32 +833,550 @@ namespace phone {
     return buff[0];
   }
 
-  int phone_t::repl() {
-    std::string buffer;
-    std::cin >> buffer;
+  bool phone_t::next_line(std::string &line, int timeout_ms, histogram_t *jitter) {
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(timeout_ms);
+
+    for (;;) {
+      // Take the first non-empty line out of what we have buffered.
+      size_t start = rx.find_first_not_of("\r\n");
+      if (start == std::string::npos) {
+        rx.clear();
+      } else {
+        if (rx.compare(start, 2, "> ") == 0) {
+          line = ">";
+          rx.erase(0, start + 2);
+          return true;
+        }
+        size_t end = rx.find_first_of("\r\n", start);
+        if (end != std::string::npos && rx.compare(start, 6, "+CUSD:") == 0) {
+          end = quoted_line_end(rx, start);
+        }
+        if (end != std::string::npos) {
+          line.assign(rx, start, end - start);
+          rx.erase(0, end + 1);
+          if (line.find('\r') != std::string::npos) {
+            line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+          }
+          return true;
+        }
+        rx.erase(0, start);
+      }
 
-    if (buffer == "q" || buffer == "quit") {
-      return 0;
+      auto now = std::chrono::steady_clock::now();
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+      if (left <= 0) {
+        return false;
+      }
+      if (!util::wait_readable(device, static_cast<int>(left))) {
+        if (jitter) {
+          auto late = std::chrono::steady_clock::now() - (now + std::chrono::milliseconds(left));
+          jitter->record(static_cast<uint64_t>(std::max<int64_t>(0,
+              std::chrono::duration_cast<std::chrono::microseconds>(late).count())));
+        }
+        return false;
+      }
+
+      char buff[256];
+      auto actl = util::read_at_most(device, buff, sizeof(buff));
+      if (!actl) {
+        util::throw_system_error(ENODATA);
+      }
+      rx.append(buff, actl);
+    }
+  }
+
+  bool phone_t::claim_line(const std::string &line) {
+    state.update(line);
+    trace_dial(line);
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      if (!late.empty() && claim_late(line)) {
+        return true;
+      }
+      if (pending && !pending->done && pending->claims(line)) {
+        if (at::is_final(line)) {
+          pending->result.status = at::is_error(line)
+              ? status_t::error : status_t::ok;
+          pending->result.final = line;
+          pending->done = true;
+          pending_cv.notify_all();
+        } else if (line == pending->echo) {
+          pending->result.echoed = true;
+        } else if (line == ">" && pending->body && !pending->prompted) {
+          pending->prompted = true;
+          write_parts(pending->body->data(), pending->body->size(), "\x1a", 1);
+        } else if (pending->on_line) {
+          pending->on_line(line);
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool phone_t::claim_late(const std::string &line) {
+    auto now = std::chrono::steady_clock::now();
+    while (!late.empty() && late.front()->expires <= now) {
+      late.pop_front();
+    }
+    if (late.empty()) {
+      return false;
+    }
+    auto &stale = *late.front();
+    // The echo of the command now pending means the modem has moved on.
+    if (pending && line == pending->echo && line != stale.echo && line != stale.marker) {
+      late.clear();
+      return false;
+    }
+    // Without echo, a final result may be the command's or the marker's,
+    // but the marker's information line can only be its own.
+    if (!stale.marked && at::line_name(line) == stale.marker_prefix) {
+      stale.marked = true;
+      return true;
+    }
+    if (line != stale.marker && !stale.claims(line)) {
+      return false;
+    }
+    if (at::is_final(line)) {
+      // The marker's result, after its line or after the command's own
+      // result (if it failed without one), puts us back in step.
+      if (stale.marked || stale.done) {
+        late.pop_front();
+      } else {
+        stale.done = true;
+      }
+    } else if (line == ">" && !stale.prompted) {
+      // Esc, rather than Ctrl-Z, so the modem sends nothing.
+      stale.prompted = true;
+      write_parts("\x1b", 1);
+    }
+    return true;
+  }
+
+  void phone_t::handle_urc(const std::string &line, time_point_t received) {
+    for (auto &handler: urc_handlers) {
+      handler(line);
+    }
+    if (urc_waiter_count.load()) {
+      wake_urc_waiters(line);
+    }
+    if (line.size() <= decltype(line_received_t::line)::max_size) {
+      emit(line_received_t { line });
     } else {
-      if (buffer.substr(0, 2) != "AT") {
-        std::cout << "All commands must start with `AT`" << std::endl;
-        return repl();
+      // Too long to go inline; JSON listeners get all of it, typed
+      // listeners what fits.
+      emit(event_t::reply, json_t::object_t {{ "line", line }});
+    }
+    if (at::line_name(line) == "+CMTI") {
+      // +CMTI: <mem>,<index>
+      auto params = at::split_params(line);
+      if (params.size() >= 2) {
+        emit(sms_received_t { params[0], at::to_int(params[1]) });
+      }
+    }
+    // Only known names get a histogram of their own, so stray text can't
+    // use up the table.
+    latencies->record(
+        at::is_unsolicited(line) ? "urc:" + at::line_name(line) : "urc:other",
+        elapsed_us(received));
+  }
+
+  void phone_t::wake_urc_waiters(const std::string &line) {
+    std::lock_guard<std::mutex> lock(urc_waiters_mutex);
+    for (auto iter = urc_waiters.begin(); iter != urc_waiters.end(); ) {
+      if (at::starts_with(line, iter->second.prefix)) {
+        auto done = std::move(iter->second.done);
+        cancel_deferred(iter->second.timeout);
+        defer([done, line]() { done(line); });
+        iter = urc_waiters.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+    urc_waiter_count = urc_waiters.size();
+  }
+
+  void phone_t::await_urc(
+      const std::string &prefix, std::function<void(const std::string &)> done, int timeout_ms) {
+    std::lock_guard<std::mutex> lock(urc_waiters_mutex);
+    auto id = next_urc_waiter++;
+    auto timeout = defer([this, id]() {
+      std::function<void(const std::string &)> done;
+      {
+        std::lock_guard<std::mutex> lock(urc_waiters_mutex);
+        auto iter = urc_waiters.find(id);
+        if (iter == urc_waiters.end()) {
+          return;
+        }
+        done = std::move(iter->second.done);
+        urc_waiters.erase(iter);
+        urc_waiter_count = urc_waiters.size();
+      }
+      done(std::string {});
+    }, timeout_ms);
+    urc_waiters.emplace(id, urc_waiter_t { prefix, std::move(done), timeout });
+    urc_waiter_count = urc_waiters.size();
+  }
+
+  void phone_t::queue_urc(const std::string &line, time_point_t received, bool unclaimed) {
+    auto slot = urc_ring.claim();
+    if (!slot) {
+      // The dispatcher is behind.  The device buffers what we don't read,
+      // so back off until there's room rather than lose lines.
+      auto start = std::chrono::steady_clock::now();
+      do {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        slot = urc_ring.claim();
+      } while (!slot);
+      latencies->record("urc:ring-full", elapsed_us(start));
+    }
+    slot->line.assign(line);
+    slot->received = received;
+    slot->unclaimed = unclaimed;
+    urc_ring.publish();
+  }
+
+  void phone_t::dispatch_urcs() {
+    for (;;) {
+      auto slot = urc_ring.peek();
+      if (!slot) {
+        // The listening thread has stopped, and everything it queued has
+        // been seen to.
+        if (!listening) {
+          if (!urc_ring.peek()) {
+            return;
+          }
+          continue;
+        }
+        urc_ring.wait(listen_poll_ms);
+        continue;
+      }
+      if (!slot->unclaimed || !claim_line(slot->line)) {
+        handle_urc(slot->line, slot->received);
+      }
+      urc_ring.release();
+    }
+  }
+
+  void phone_t::enter_gate(priority_t priority) {
+    auto level = static_cast<size_t>(priority);
+    std::unique_lock<std::mutex> lock(gate_mutex);
+    ++gate_waiting[level];
+    gate_cv.wait(lock, [this, level]() {
+      if (gate_busy) {
+        return false;
+      }
+      for (size_t higher = level + 1; higher < 3; ++higher) {
+        if (gate_waiting[higher]) {
+          return false;
+        }
+      }
+      return true;
+    });
+    --gate_waiting[level];
+    gate_busy = true;
+  }
+
+  void phone_t::leave_gate() {
+    std::lock_guard<std::mutex> lock(gate_mutex);
+    gate_busy = false;
+    gate_cv.notify_all();
+  }
+
+  phone_t::result_t phone_t::command(
+      const std::string &cmd, const line_callback_t &on_line,
+      int timeout_ms, priority_t priority) {
+    return execute(cmd, nullptr, on_line, timeout_ms, priority);
+  }
+
+  phone_t::result_t phone_t::command_with_body(
+      const std::string &cmd, const std::string &body,
+      const line_callback_t &on_line, int timeout_ms, priority_t priority) {
+    if (body.find_first_of("\x1a\x1b") != std::string::npos) {
+      throw std::invalid_argument("command body contains Ctrl-Z or Esc");
+    }
+    return execute(cmd, &body, on_line, timeout_ms, priority);
+  }
+
+  void phone_t::command_async(
+      const std::string &cmd, done_t done,
+      const line_callback_t &on_line, int timeout_ms, priority_t priority) {
+    defer([this, cmd, done, on_line, timeout_ms, priority]() {
+      done(execute(cmd, nullptr, on_line, timeout_ms, priority));
+    });
+  }
+
+  void phone_t::command_with_body_async(
+      const std::string &cmd, const std::string &body, done_t done,
+      const line_callback_t &on_line, int timeout_ms, priority_t priority) {
+    // Turned away now, rather than on the worker, where nobody would hear.
+    if (body.find_first_of("\x1a\x1b") != std::string::npos) {
+      throw std::invalid_argument("command body contains Ctrl-Z or Esc");
+    }
+    defer([this, cmd, body, done, on_line, timeout_ms, priority]() {
+      done(execute(cmd, &body, on_line, timeout_ms, priority));
+    });
+  }
+
+  phone_t::result_t phone_t::execute(
+      const std::string &cmd, const std::string *body,
+      const line_callback_t &on_line, int timeout_ms, priority_t priority,
+      const std::function<void()> *on_sending) {
+    static const char *const queue_names[] = { "queue:bulk", "queue:normal", "queue:urgent" };
+    auto asked = std::chrono::steady_clock::now();
+    enter_gate(priority);
+    latencies->record(queue_names[static_cast<size_t>(priority)], elapsed_us(asked));
+    struct leaver_t {
+      ~leaver_t() { phone->leave_gate(); }
+      phone_t *phone;
+    } leaver { this };
+
+    pending_t req(cmd, body, on_line);
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      pending = &req;
+    }
+
+    if (on_sending) {
+      (*on_sending)();
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(timeout_ms);
+    write_parts(cmd.data(), cmd.size(), "\r", 1);
+    auto written = std::chrono::steady_clock::now();
+
+    if (listening) {
+      std::unique_lock<std::mutex> lock(pending_mutex);
+      pending_cv.wait_until(lock, deadline, [this, &req]() {
+        return req.done || !listening;
+      });
+      pending = nullptr;
+      if (!req.done) {
+        note_late(req, timeout_ms);
       }
+    } else {
+      std::string line;
+      while (!req.done) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0 || !next_line(line, static_cast<int>(left))) {
+          break;
+        }
+        auto received = std::chrono::steady_clock::now();
+        if (!claim_line(line)) {
+          handle_urc(line, received);
+        }
+      }
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      pending = nullptr;
+      if (!req.done) {
+        note_late(req, timeout_ms);
+      }
+    }
 
-      buffer += '\n';
-      write(buffer);
-      read_to_nl();
-      std::cout << read_to_nl() << std::endl;
-      return repl();
+    auto finished = std::chrono::steady_clock::now();
+    latencies->record(at::command_name(cmd), static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(finished - written).count()));
+    if (!req.done) {
+      return result_t { status_t::timeout, std::string {}, written, finished, req.result.echoed };
+    }
+    req.result.written = written;
+    req.result.finished = finished;
+    return req.result;
+  }
+
+  void phone_t::note_late(const pending_t &req, int timeout_ms) {
+    // The marker goes out before the gate opens for the next command.  Its
+    // information line is one the modem never sends on its own, and which
+    // the command can't have sent.
+    bool asked_csq = std::find(req.prefixes.begin(), req.prefixes.end(), "+CSQ") != req.prefixes.end();
+    std::string marker = asked_csq ? "AT+CMEE?" : "AT+CSQ";
+    write_parts(marker.data(), marker.size(), "\r", 1);
+
+    // Give it as long again to finish as it had to start with, and no less
+    // than a command gets by default.
+    if (late.size() >= max_late) {
+      late.pop_front();
+    }
+    late.emplace_back(new pending_t(req, marker, std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(std::max(timeout_ms, default_timeout_ms))));
+  }
+
+  phone_t::result_t phone_t::dial(const std::string &number) {
+    auto requested = std::chrono::steady_clock::now();
+    uint64_t seq;
+    {
+      std::lock_guard<std::mutex> lock(dial_mutex);
+      if (dials.size() >= max_dial_traces) {
+        dials.pop_front();
+      }
+      seq = next_dial_seq++;
+      dials.push_back(dial_trace_t {});
+      auto &trace = dials.back();
+      trace.seq = seq;
+      trace.number = number;
+      trace.requested = requested;
+
+      // Trust the cache; if it doesn't know, let the modem decide.
+      auto cached = state.get();
+      if (cached.known() && !cached.registered()) {
+        trace.ended = requested;
+        trace.final = "not registered";
+        return result_t { status_t::error, trace.final, requested, requested, false };
+      }
+    }
+
+    // Other dials may queue, and push this one's trace out, while we wait
+    // our turn; so we go by its number, not where it was.
+    std::function<void()> on_sending = [this, seq, &number]() {
+      {
+        std::lock_guard<std::mutex> lock(dial_mutex);
+        active_dial = seq;
+      }
+      for (auto &handler: dial_handlers) {
+        handler(number, nullptr);
+      }
+    };
+    auto result = execute(
+        "ATD" + number + ";", nullptr, line_callback_t {}, dial_timeout_ms,
+        priority_t::urgent, &on_sending);
+    for (auto &handler: dial_handlers) {
+      handler(number, &result);
     }
 
+    std::lock_guard<std::mutex> lock(dial_mutex);
+    auto *trace = find_dial(seq);
+    if (!trace) {
+      return result;
+    }
+    trace->written = result.written;
+    if (result.ok()) {
+      trace->acknowledged = result.finished;
+    } else if (trace->ended == time_point_t {}) {
+      trace->ended = result.finished;
+      trace->final = result.final.empty() ? "timeout" : result.final;
+    }
+    return result;
+  }
+
+  void phone_t::trace_dial(const std::string &line) {
+    enum { none, alerting, connected, ended } stage = none;
+    auto name = at::line_name(line);
+    if (name == "+CLCC") {
+      // +CLCC: <id>,<dir>,<stat>,...; we only care about our own calls.
+      auto params = at::split_params(line);
+      if (params.size() > 2 && at::to_int(params[1]) == 0) {
+        int stat = at::to_int(params[2]);
+        stage = (stat == 3) ? alerting : (stat == 0) ? connected : none;
+      }
+    } else if (name == "^CONF" || name == "MO RING") {
+      stage = alerting;
+    } else if (name == "^CONN" || name == "+COLP" || name == "MO CONNECTED") {
+      stage = connected;
+    } else if (name == "^CEND" || (at::is_call_progress(line) && !at::starts_with(line, "CONNECT"))) {
+      stage = ended;
+    }
+    if (stage == none) {
+      return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(dial_mutex);
+    auto *found = find_dial(active_dial);
+    if (!found || found->ended != time_point_t {}) {
+      return;
+    }
+    auto &trace = *found;
+    if (stage == alerting && trace.alerting == time_point_t {}) {
+      trace.alerting = now;
+    } else if (stage == connected && trace.connected == time_point_t {}) {
+      trace.connected = now;
+    } else if (stage == ended) {
+      trace.ended = now;
+      trace.final = line;
+    }
+  }
+
+  phone_t::dial_trace_t *phone_t::find_dial(uint64_t seq) {
+    // The traces are numbered without gaps, so this one, if it's still
+    // kept, is at a known place.
+    if (dials.empty() || seq < dials.front().seq || seq > dials.back().seq) {
+      return nullptr;
+    }
+    return &dials[static_cast<size_t>(seq - dials.front().seq)];
+  }
+
+  json_t::array_t phone_t::dial_report() {
+    std::lock_guard<std::mutex> lock(dial_mutex);
+    json_t::array_t report;
+    for (const auto &trace: dials) {
+      auto offset = [&trace](time_point_t at) -> double {
+        if (at == time_point_t {}) {
+          return -1;
+        }
+        return static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(
+            at - trace.requested).count());
+      };
+      report.push_back(json_t::object_t {
+        { "number", trace.number },
+        { "written_us", offset(trace.written) },
+        { "acknowledged_us", offset(trace.acknowledged) },
+        { "alerting_us", offset(trace.alerting) },
+        { "connected_us", offset(trace.connected) },
+        { "ended_us", offset(trace.ended) },
+        { "final", trace.final }
+      });
+    }
+    return report;
+  }
+
+  modem_state_t phone_t::get_state() const {
+    return state.get();
+  }
+
+  void phone_t::on_state(state_cache_t::observer_t observer) {
+    state.observe(std::move(observer));
+  }
+
+  histogram_table_t &phone_t::get_latencies() {
+    return *latencies;
+  }
+
+  json_t::object_t phone_t::latency_report() const {
+    return latencies->report();
+  }
+
+  int phone_t::repl() {
+    std::string buffer;
+    while (std::cin >> buffer) {
+      if (buffer == "q" || buffer == "quit") {
+        break;
+      } else if (buffer == "stats") {
+        std::cout << json_t(latency_report()) << std::endl;
+      } else if (buffer == "io") {
+        std::cout << json_t(io_report()) << std::endl;
+      } else if (buffer.substr(0, 2) != "AT") {
+        std::cout << "All commands must start with `AT`" << std::endl;
+      } else {
+        auto result = command(buffer, [](const std::string &line) {
+          std::cout << line << std::endl;
+        });
+        std::cout << (result.status == status_t::timeout ? "TIMEOUT" : result.final) << std::endl;
+      }
+    }
     return 0;
   }
 
   // block and wait for everything to exit
   void phone_t::join() {
     for (auto it = tasks.begin(); it != tasks.end(); ++it) {
-      (*it).join();
+      if ((*it).joinable()) {
+        (*it).join();
+      }
+    }
+    if (!executor.on_worker()) {
+      executor.drain();
     }
   }
 }
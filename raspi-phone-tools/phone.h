@@ -1,13 +1,30 @@
+#pragma once
+
 #include <string>
 #include <iostream>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
 #include <raspi-phone-tools/util.h>
+#include <raspi-phone-tools/event-filter.h>
+#include <raspi-phone-tools/events.h>
+#include <raspi-phone-tools/executor.h>
+#include <raspi-phone-tools/histogram.h>
+#include <raspi-phone-tools/journal.h>
+#include <raspi-phone-tools/mpsc-queue.h>
+#include <raspi-phone-tools/spsc-ring.h>
+#include <raspi-phone-tools/state-cache.h>
+#include <raspi-phone-tools/timing-wheel.h>
 #include <vector>
 #include <utility>
 #include <functional>
 #include <json/json.h>
+#include <sys/uio.h>
 
 namespace phone {
   class phone_t {
@@ -18,23 +35,679 @@ namespace phone {
         error,
         sms,
         call,
-        missedcall
+        missedcall,
+        delivery,
+        registration,
+        signal
+      };
+
+      // What becomes of an event while a queued listener is behind.
+      // 'queue' keeps each one, up to the listener's lane options; 'latest'
+      // keeps only the newest waiting, which suits status; 'count' does
+      // too, and adds "count", how many it stands for, to a JSON
+      // listener's copy, which suits bursts (a struct has nowhere to put
+      // one, so it's not for queued typed listeners); 'never_drop' keeps
+      // each one whatever the lane options say, which suits messages and
+      // calls.
+      enum class policy_t {
+        queue,
+        latest,
+        count,
+        never_drop
+      };
+
+      // How a command ended.
+      enum class status_t {
+        ok,
+        error,
+        timeout
+      };
+
+      // Commands waiting for the modem go in order of priority, and in
+      // order of arrival within a priority.  Long jobs such as a phonebook
+      // import run at bulk, so anything else slips in between their
+      // commands; dial() runs at urgent.
+      enum class priority_t {
+        bulk,
+        normal,
+        urgent
+      };
+
+      using time_point_t = std::chrono::steady_clock::time_point;
+
+      // The outcome of a command: how it ended and the final result line the
+      // modem sent to end it ("OK", "+CME ERROR: 22", "NO CARRIER", ...),
+      // with when the command was written and when it finished.  'echoed'
+      // is true iff. the modem echoed the command back, which tells us
+      // whether ATE0 is in effect.
+      struct result_t {
+        status_t status;
+        std::string final;
+        time_point_t written;
+        time_point_t finished;
+        bool echoed;
+        bool ok() const { return status == status_t::ok; }
       };
 
+      // The stages of an outgoing call, on the steady clock; each is zero
+      // until the call reaches it.  'final' holds how the call failed, if it
+      // did.
+      struct dial_trace_t {
+        // Numbers the dials in the order they were asked for, from 1.
+        uint64_t seq;
+        std::string number;
+        time_point_t requested;
+        time_point_t written;
+        time_point_t acknowledged;
+        time_point_t alerting;
+        time_point_t connected;
+        time_point_t ended;
+        std::string final;
+      };
+
+      // Called with each information line of a command's response, on the
+      // thread which sorts the modem's lines out: the caller's own while
+      // listen() isn't running; the listening thread, which reads the
+      // device, while it is; or, with any io option set (see
+      // set_io_options()), the dispatching thread.  It must not issue
+      // commands.
+      using line_callback_t = std::function<void(const std::string &)>;
+
+      // Called with each line the modem sends on its own.  While listen() is
+      // running, that's on the thread it starts to dispatch them, which the
+      // thread reading the device hands them to; otherwise, it's on the
+      // thread reading the device.  Like a line callback, it must not issue
+      // commands; use defer() for that.
+      using urc_handler_t = std::function<void(const std::string &)>;
+
+      // Called as dial() places a call: with a null result just before ATD
+      // is written, and again with the modem's answer to it.  Both run on
+      // the thread that called dial(), the first while it holds the turn to
+      // write, so it must not issue commands; use defer() for that.
+      using dial_handler_t = std::function<void(const std::string &number, const result_t *result)>;
+
+      // How long command() waits for a final result code by default.
+      static constexpr int default_timeout_ms = 5000;
+
+      // How long dial() waits for ATD to be answered.  Modems with
+      // connected-line reporting (AT+COLP=1) hold the OK until the far end
+      // picks up.
+      static constexpr int dial_timeout_ms = 60000;
+
+      // How many dial traces dial_report() keeps.
+      static constexpr size_t max_dial_traces = 32;
+
       util::fd_t device;
       std::atomic<bool> run;
       std::vector<std::thread> tasks;
-      phone_t(const char *portname);
-      using callback_t = std::function<void(json_t::object_t)>;
-      std::vector<std::pair<event_t, callback_t>> listeners;
-      void on(event_t event, callback_t callback);
+      // How many threads run listeners by default.
+      static constexpr size_t default_listener_threads = 2;
+
+      // How listen() runs the thread reading the device, which must keep up
+      // with the modem on a busy machine.  Any part which can't be had, for
+      // want of privileges or otherwise, is left out, and io_report() says
+      // why.
+      struct io_options_t {
+        io_options_t();
+
+        // Run under SCHED_FIFO at this priority, 1 to 99, rather than the
+        // normal scheduler; 0 for the normal scheduler.
+        int fifo_priority;
+
+        // Keep to this CPU, or -1 for any.
+        int cpu;
+
+        // Lock all of the process's memory, now and to come, into RAM, so
+        // the thread never waits on a page fault.
+        bool lock_memory;
+      };
+
+      phone_t(const char *portname, size_t listener_threads = default_listener_threads);
+
+      // Called with an event's data, which it must copy to keep.
+      using callback_t = std::function<void(const json_t::object_t &)>;
+
+      // Identifies a listener, for off().
+      using listener_id_t = uint64_t;
+
+      // How a listener is run.  By default each listener gets a lane of its
+      // own on the phone's executor, so it sees events in order but a slow
+      // one never holds up the thread reading the device, nor the other
+      // listeners.  What happens to events which arrive while its lane is
+      // full is up to 'lane.overflow'; by default, after 1024 they are
+      // dropped.  The event's policy has the last word, though; see
+      // set_policy().  'lane.max_per_s' caps how often the listener runs,
+      // with events waiting, or merging per the policy, meanwhile.
+      struct listener_options_t {
+        listener_options_t();
+
+        // False to run the listener on whichever thread emits, as soon as
+        // it does.  Only for listeners which are quick and never block.
+        bool queued;
+
+        executor_t::lane_options_t lane;
+
+        // The events the listener wants; by default, all of them.  Checked
+        // on the emitting thread, along with every other listener's for the
+        // event in one pass, so a listener never runs or queues for an
+        // event it doesn't want.
+        filter_t filter;
+      };
+
+      // Register a listener for the event and return its handle.
+      listener_id_t on(
+          event_t event, callback_t callback,
+          const listener_options_t &options = listener_options_t());
+
+      // Register a listener for the event a struct from events.h stands
+      // for, as in on<missed_call_t>(...).  It gets the struct as emitted,
+      // and no JSON is built on its account; see emit() for what it costs.
+      template <typename event_struct_t>
+      listener_id_t on(
+          std::function<void(const event_struct_t &)> callback,
+          const listener_options_t &options = listener_options_t()) {
+        return add_listener(
+            event_traits_t<event_struct_t>::event, callback_t {},
+            [callback](const void *event) { callback(*static_cast<const event_struct_t *>(event)); },
+            options);
+      }
+
+      // Unregister a listener, and return false if it wasn't registered.
+      // Events queued for it are dropped, and unless called from a
+      // listener, this waits for it to finish any it's running.
+      bool off(listener_id_t id);
+
+      // Set the policy for the event's listeners registered from now on.
+      // By default, status (registration, signal) is 'latest', onchar is
+      // 'count', messages and calls (sms, call, missedcall, delivery) are
+      // 'never_drop', and the rest are 'queue'.  Registering a queued typed
+      // listener under 'count' throws std::invalid_argument.
+      void set_policy(event_t event, policy_t policy);
+      policy_t get_policy(event_t event);
+
+      // Each listener's policy, queue depth, drops, merges, rate-limit
+      // waits and run time, by id.
+      json_t::object_t listener_report();
+
+      // Wait until every queued listener has caught up.  Must not be
+      // called from a listener.
+      void drain_listeners();
+
+      // Write every event to the journal from now on, with its event_t as
+      // the record's event, or stop if it's null.  The journal must outlive
+      // the phone or be unset first.  An event the journal can't take
+      // still goes to listeners, and is counted by get_journal_failures().
+      void set_journal(journal_t *journal);
+      uint64_t get_journal_failures() const;
+
+      // Use these options for the thread listen() starts.  With any of them
+      // set, the thread only reads lines and hands them to the dispatching
+      // thread, which works out which belong to commands, so nothing it
+      // does touches the heap once its buffers have grown to fit.  Line
+      // callbacks, state observers and the registration and signal events
+      // then run on the dispatching thread too.  Call before listen().
+      void set_io_options(const io_options_t &options);
+
+      // The options asked for, what became of each ("ok" or why not), the
+      // reading thread's wakeup jitter, which is how late it woke after
+      // waiting for input and not getting any, in microseconds, and the
+      // serial driver's overrun counts, if it keeps them.
+      json_t::object_t io_report();
+
       void listen();
+
+      // Write the bytes to the device, whole, and return once they're
+      // written.  Safe to call from any number of threads at once: each
+      // call's bytes go out together, never interleaved with another's.
+      // The bytes go to the writing thread by way of a lock-free queue, so
+      // handing them over never takes a lock or allocates.
       void write(const std::string &msg);
       std::string read(size_t count);
       std::string read_to_nl();
       char read_char();
+
+      // Send one command line (without the trailing carriage return) and
+      // block until its final result code arrives or 'timeout_ms' passes.
+      // Information lines are streamed to 'on_line' as they arrive, so a
+      // long response is never held in memory.  Unsolicited lines which
+      // arrive in the meantime are handled as usual.  Commands from
+      // different threads are serialized, highest priority first.  If
+      // listen() is running, the listening thread does the reading;
+      // otherwise, the caller does.
+      result_t command(
+          const std::string &cmd,
+          const line_callback_t &on_line = line_callback_t {},
+          int timeout_ms = default_timeout_ms,
+          priority_t priority = priority_t::normal);
+
+      // As command(), for commands which prompt for a body with "> ", such
+      // as AT+CMGS: when the prompt comes, 'body' is sent, ended by Ctrl-Z.
+      // The body must not itself contain Ctrl-Z or Esc.
+      result_t command_with_body(
+          const std::string &cmd,
+          const std::string &body,
+          const line_callback_t &on_line = line_callback_t {},
+          int timeout_ms = default_timeout_ms,
+          priority_t priority = priority_t::normal);
+
+      // Called on the worker thread with the outcome of a command run by
+      // command_async().
+      using done_t = std::function<void(const result_t &)>;
+
+      // As command() and command_with_body(), but return at once: the
+      // command is run on the worker thread, which calls 'done' with the
+      // outcome, so nothing waits on it meanwhile.  The worker runs one
+      // piece of work at a time, so deferred work due while the command is
+      // out waits for it.  The worker is started by listen().
+      void command_async(
+          const std::string &cmd, done_t done,
+          const line_callback_t &on_line = line_callback_t {},
+          int timeout_ms = default_timeout_ms,
+          priority_t priority = priority_t::normal);
+      void command_with_body_async(
+          const std::string &cmd, const std::string &body, done_t done,
+          const line_callback_t &on_line = line_callback_t {},
+          int timeout_ms = default_timeout_ms,
+          priority_t priority = priority_t::normal);
+
+      // Call 'done' on the worker thread with the next unsolicited line
+      // which starts with 'prefix', or with an empty string if none comes
+      // within 'timeout_ms'.  Only lines read after the call count.
+      void await_urc(
+          const std::string &prefix, std::function<void(const std::string &)> done,
+          int timeout_ms = default_timeout_ms);
+
+      // Start a voice call to the number as fast as we can: the command goes
+      // ahead of anything queued, and registration is checked against the
+      // state cache rather than by asking the modem.  If the cache knows we
+      // aren't registered, this fails without dialing.  Returns once the
+      // modem has answered ATD; alerting and connection are timestamped in
+      // the trace as the modem reports them (+CLCC, +COLP, ^CONF/^CONN,
+      // MO RING/MO CONNECTED).  Dial handlers (see on_dial()) are told as
+      // ATD goes out and when the modem answers it.
+      result_t dial(const std::string &number);
+
+      // The traces of the most recent dials, oldest first, with the time
+      // from the request to each stage in microseconds (-1 if the stage
+      // wasn't reached).
+      json_t::array_t dial_report();
+
+      // The network state as last reported by the modem.
+      modem_state_t get_state() const;
+
+      // Register an observer to see the state each time the modem reports
+      // it (+CREG, +CSQ, +COPS).  It runs on the same thread as line
+      // callbacks (see line_callback_t), and so do the registration and
+      // signal events emitted from it and any inline listeners to those:
+      // the reading thread without io options, the dispatching thread with
+      // them.  Like an unsolicited-line handler, it must not issue commands.
+      void on_state(state_cache_t::observer_t observer);
+
+      // Latency histograms, always on.  Keys are:
+      //    "+CPBR", "D", ...: from writing a command to its final result
+      //      code, by command_name();
+      //    "queue:bulk", "queue:normal", "queue:urgent": from asking to
+      //      send a command to being allowed to; and
+      //    "urc:RING", ...: from reading an unsolicited line to having run
+      //      every handler for it and queued it for every listener;
+      //    "urc:ring-full": how long the listening thread waited for the
+      //      dispatching thread to catch up, when it had to; and
+      //    "journal": how long writing an event to the journal took.
+      // Other subsystems record their own keys here too.
+      histogram_table_t &get_latencies();
+
+      // Percentiles for every histogram with anything in it.
+      json_t::object_t latency_report() const;
+
+      // Register a handler to see every unsolicited line.  Handlers run in
+      // the order they were added, before the line is emitted as a reply
+      // event, and must outlive the phone's listening thread.
+      void on_urc(urc_handler_t handler);
+
+      // Register a handler to see every call dial() places, in the order
+      // they were added.  Like on_urc(), add them before anything dials.
+      void on_dial(dial_handler_t handler);
+
+      using timer_id_t = timing_wheel_t::timer_id_t;
+
+      // Run 'work' on the phone's worker thread once 'delay_ms' has passed,
+      // to the millisecond, and return an id for cancel_deferred().  Unlike
+      // line callbacks and unsolicited-line handlers, deferred work may
+      // issue commands.  The worker is started by listen().
+      timer_id_t defer(std::function<void()> work, int delay_ms = 0);
+
+      // Drop deferred work which hasn't started, and return true iff. it
+      // hadn't.
+      bool cancel_deferred(timer_id_t id);
+
+      // Call each listener registered for the event, or queue the event for
+      // it, with a reference to the one copy of the data.  Costs the same
+      // however many listeners other events have.
+      void emit(event_t event, const json_t::object_t &data);
+
+      // Emit an event as a struct from events.h.  Typed listeners get it as
+      // it is; its JSON is built once, and only if a JSON listener wants it.
+      // Neither inline nor queued typed listeners cost an allocation:
+      // each queued one gets its own copy of the struct, kept inline in
+      // the job for its lane, and the lane's queue only grows to the most
+      // it has held.  (A lane with a rate limit may allocate as it waits.)
+      template <typename event_struct_t>
+      void emit(const event_struct_t &event) {
+        dispatch(event_traits_t<event_struct_t>::event, &event, nullptr);
+      }
+
+      // Read commands from standard input and run them, printing their
+      // responses, until "q", "quit" or the end of the input.  "stats" and
+      // "io" print latency_report() and io_report().
       int repl();
+
+      // Ask the listening thread to exit.
+      void stop();
+
       void join();
       ~phone_t();
+
+    private:
+      struct pending_t;
+
+      static constexpr size_t event_count = 9;
+
+      // Called with a pointer to the struct of a typed listener's event.
+      using typed_callback_t = std::function<void(const void *)>;
+
+      // One or the other of 'callback' and 'typed' is set.
+      struct listener_t {
+        listener_id_t id;
+        callback_t callback;
+        typed_callback_t typed;
+
+        // Null if the listener runs on the emitting thread.
+        executor_t::lane_ptr_t lane;
+
+        policy_t policy;
+
+        // Under 'count', how many events have arrived since the listener
+        // last ran.
+        std::shared_ptr<std::atomic<uint64_t>> arrived;
+
+        // Empty if it takes every event.
+        filter_t filter;
+      };
+
+      struct listener_list_t {
+        std::vector<listener_t> listeners;
+
+        // The filters of those listeners which have one, compiled together,
+        // and by filter, the listener it belongs to.  The rest of the
+        // listeners take every event.  Both in order, so emit() can run the
+        // ones an event passes without looking at the others.
+        filter_set_t filters;
+        std::vector<size_t> filtered;
+        std::vector<size_t> unfiltered;
+      };
+
+      // Make a list of the listeners, compiling their filters, and put it
+      // in place of the event's list.  Called with 'listeners_mutex' held.
+      void publish_listeners(size_t index, std::vector<listener_t> list);
+
+      // The guts of both kinds of on().
+      listener_id_t add_listener(
+          event_t event, callback_t callback, typed_callback_t typed,
+          const listener_options_t &options);
+
+      // The guts of both kinds of emit(): exactly one of 'typed', the
+      // event's struct, and 'json' is given, and the other is made from it
+      // if a listener needs it.
+      void dispatch(event_t event, const void *typed, const json_t::object_t *json);
+
+      // Emit a registration or signal event if the state says it has
+      // changed.  Runs as a state observer, on whichever thread claims lines.
+      void note_state(const modem_state_t &now);
+
+      // The guts of command() and command_with_body(); 'body' is null for a
+      // command which doesn't take one.  'on_sending', if not null, is
+      // called once the command has its turn, just before it's written.
+      result_t execute(
+          const std::string &cmd, const std::string *body,
+          const line_callback_t &on_line, int timeout_ms, priority_t priority,
+          const std::function<void()> *on_sending = nullptr);
+
+      // The body of the worker thread which runs deferred work.
+      void work_deferred();
+
+      // Set 'deferred_timer' for 'when', unless it's already set sooner.
+      // Called with 'deferred_mutex' held.
+      void arm_deferred(time_point_t when);
+
+      // Wait up to 'timeout_ms' for a complete, non-empty line from the
+      // device and return true, or return false if none came in time.  A
+      // body prompt, which has no line ending, comes back as ">".  If
+      // given, 'jitter' gets how late the wait for input woke when none
+      // came.
+      bool next_line(std::string &line, int timeout_ms, histogram_t *jitter = nullptr);
+
+      // Apply the io options to the calling thread, noting what became of
+      // each in 'io_status'.
+      void apply_io_options();
+
+      // Feed the line to the state cache and dial trace, and hand it to the
+      // pending command if it belongs to it.  Return false if it doesn't,
+      // for the caller to treat as unsolicited.
+      bool claim_line(const std::string &line);
+
+      // Swallow the line if it belongs to a command which timed out before
+      // it was done.  Call with 'pending_mutex' held.
+      bool claim_late(const std::string &line);
+
+      // Keep what is left of a command which timed out, and send a marker
+      // command after it, so the rest of its response doesn't go to the
+      // next.  Call with 'pending_mutex' held.
+      void note_late(const pending_t &req, int timeout_ms);
+
+      // Handle a line the modem sent on its own.  'received' is when it was
+      // read from the device.
+      void handle_urc(const std::string &line, time_point_t received);
+
+      // Pass an unsolicited line from the listening thread to the
+      // dispatching thread, waiting if it's behind.  If 'unclaimed', the
+      // dispatching thread offers it to the pending command first.
+      void queue_urc(const std::string &line, time_point_t received, bool unclaimed = false);
+
+      // The body of the thread which dispatches unsolicited lines.
+      void dispatch_urcs();
+
+      // Note the stage of the call in progress, if the line reports one.
+      void trace_dial(const std::string &line);
+
+      // The trace of the given dial, or null if it's been dropped.  Call
+      // with 'dial_mutex' held.
+      dial_trace_t *find_dial(uint64_t seq);
+
+      // Bytes on their way to the device.  Lives on the stack of the thread
+      // which asked for the write until the writing thread is done with it.
+      struct write_request_t : mpsc_node_t {
+        struct iovec parts[2];
+        int part_count;
+
+        // 0 until written, and 1 after; 2 while the asking thread sleeps on
+        // it, so the writing thread knows to wake it.
+        std::atomic<int> state;
+
+        // The errno the write failed with, or 0.
+        int error;
+
+        // True for the request with nothing to write which the destructor
+        // sends to see the writing thread off.
+        bool last;
+      };
+
+      // Write the one or two runs of bytes as one, by way of the writing
+      // thread.
+      void write_parts(const char *data, size_t size, const char *more = nullptr, size_t more_size = 0);
+
+      // The body of the thread which writes to the device.  Takes whatever
+      // has queued up and writes it with one system call, until it has
+      // seen to the last request.
+      void write_queued();
+
+      // Wait for our turn to send a command, and give it up again.
+      void enter_gate(priority_t priority);
+      void leave_gate();
+
+      // A call to await_urc() still waiting.
+      struct urc_waiter_t {
+        std::string prefix;
+        std::function<void(const std::string &)> done;
+
+        // The deferred work which times it out.
+        timer_id_t timeout;
+      };
+
+      // Hand the line to the await_urc() calls waiting for it.
+      void wake_urc_waiters(const std::string &line);
+
+      // Bytes read from the device but not yet split into lines.
+      std::string rx;
+
+      // Admits one command at a time, highest priority first.
+      std::mutex gate_mutex;
+      std::condition_variable gate_cv;
+      bool gate_busy;
+      size_t gate_waiting[3];
+
+      // Guards 'pending' and signals 'pending_cv' when it completes.
+      std::mutex pending_mutex;
+      std::condition_variable pending_cv;
+      pending_t *pending;
+
+      // How many timed-out commands 'late' keeps track of.
+      static constexpr size_t max_late = 4;
+
+      // Commands which timed out and whose response may still come, oldest
+      // first.  Guarded by 'pending_mutex'.
+      std::deque<std::unique_ptr<pending_t>> late;
+
+      // Writes waiting for the writing thread.
+      mpsc_queue_t write_queue;
+      std::thread writer;
+
+      // True while the thread started by listen() is reading the device.
+      std::atomic<bool> listening;
+
+      io_options_t io_options;
+
+      // By option, "ok" or why it couldn't be applied; guarded by
+      // 'io_mutex'.
+      std::mutex io_mutex;
+      json_t::object_t io_status;
+
+      std::vector<urc_handler_t> urc_handlers;
+      std::vector<dial_handler_t> dial_handlers;
+
+      // The await_urc() calls waiting, by number.  The count lets the
+      // dispatching thread skip the lock when there are none.
+      std::mutex urc_waiters_mutex;
+      std::map<uint64_t, urc_waiter_t> urc_waiters;
+      uint64_t next_urc_waiter;
+      std::atomic<size_t> urc_waiter_count;
+
+      // Unsolicited lines on their way from the listening thread to the
+      // dispatching thread.  Each slot keeps its line's buffer, so lines up
+      // to 'urc_line_bytes' long don't allocate.
+      struct urc_slot_t {
+        urc_slot_t() : unclaimed(false) { line.reserve(urc_line_bytes); }
+        std::string line;
+        time_point_t received;
+        bool unclaimed;
+      };
+
+      static constexpr size_t urc_ring_slots = 256;
+      static constexpr size_t urc_line_bytes = 128;
+      spsc_ring_t<urc_slot_t> urc_ring;
+
+      // The listeners for each event, indexed by event_t.  A list is never
+      // changed once published, only replaced, so emit() holds the lock just
+      // long enough to take a reference to it.  The low bits of a listener's
+      // id are its event, so off() knows where to look.
+      std::mutex listeners_mutex;
+      std::shared_ptr<const listener_list_t> listeners[event_count];
+      policy_t policies[event_count];
+      listener_id_t next_listener_id;
+
+      std::atomic<journal_t *> journal;
+      std::atomic<uint64_t> journal_failures;
+
+      // The registration and signal as last emitted.  Only touched by the
+      // state cache's observer.
+      registration_changed_t registration;
+      signal_changed_t signal;
+
+      // Fed every line the modem sends.
+      state_cache_t state;
+
+      // Fixed-size, so allocated once, off to the side.
+      std::unique_ptr<histogram_table_t> latencies;
+
+      // The most recent dials, by sequence number, any of which may still be
+      // waiting its turn or in progress.
+      std::mutex dial_mutex;
+      std::deque<dial_trace_t> dials;
+      uint64_t next_dial_seq;
+
+      // The dial whose ATD went out last, which the modem's call progress
+      // lines are about, or 0 if none has yet.
+      uint64_t active_dial;
+
+      // Work waiting for the worker thread, on a wheel with a millisecond
+      // tick, and a timerfd the worker sleeps on, set for when the wheel
+      // next has work due, and when.
+      std::mutex deferred_mutex;
+      timing_wheel_t deferred;
+      util::fd_t deferred_timer;
+      time_point_t deferred_armed;
+
+      // Runs queued listeners.  Last, so it finishes their work while
+      // everything else is still here.
+      executor_t executor;
+  };
+
+  template <>
+  struct event_traits_t<line_received_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::reply;
+  };
+
+  template <>
+  struct event_traits_t<phone_error_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::error;
+  };
+
+  template <>
+  struct event_traits_t<sms_received_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::sms;
+  };
+
+  template <>
+  struct event_traits_t<call_changed_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::call;
+  };
+
+  template <>
+  struct event_traits_t<missed_call_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::missedcall;
+  };
+
+  template <>
+  struct event_traits_t<delivery_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::delivery;
+  };
+
+  template <>
+  struct event_traits_t<registration_changed_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::registration;
+  };
+
+  template <>
+  struct event_traits_t<signal_changed_t> {
+    static constexpr phone_t::event_t event = phone_t::event_t::signal;
   };
 }
@@ -0,0 +1,237 @@
+#include <raspi-phone-tools/phonebook.h>
+#include <raspi-phone-tools/at.h>
+#include <raspi-phone-tools/charset.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace phone {
+  contact_sink_t::~contact_sink_t() {}
+
+  contact_source_t::~contact_source_t() {}
+
+  json_contact_sink_t::json_contact_sink_t(std::ostream &strm)
+      : strm(strm) {}
+
+  void json_contact_sink_t::put(const contact_t &contact) {
+    strm << json_t(json_t::object_t {
+      { "id", contact.index },
+      { "number", contact.number },
+      { "type", contact.type },
+      { "name", contact.name }
+    }) << '\n';
+  }
+
+  vector_contact_source_t::vector_contact_source_t(
+      const std::vector<contact_t> &contacts)
+      : contacts(contacts), csr(0) {}
+
+  bool vector_contact_source_t::next(contact_t &contact) {
+    if (csr >= contacts.size()) {
+      return false;
+    }
+    contact = contacts[csr++];
+    return true;
+  }
+
+  phonebook_t::options_t::options_t()
+      : storage("SM"),
+        first_chunk(10),
+        min_chunk(1),
+        max_chunk(50),
+        target_ms(300),
+        timeout_ms(10000),
+        max_line(256) {}
+
+  phonebook_t::phonebook_t(phone_t &phone, const options_t &options)
+      : phone(phone),
+        options(options),
+        info(phonebook_info_t { 0, -1, 0, 0 }),
+        is_open(false),
+        ucs2(false),
+        stats(stats_t { 0, 0, 0, 0, 0 }) {}
+
+  phonebook_info_t phonebook_t::open() {
+    if (!options.storage.empty()) {
+      auto result = phone.command("AT+CPBS=" + at::quote(options.storage));
+      if (!result.ok()) {
+        throw std::runtime_error("cannot select phonebook storage: " + result.final);
+      }
+    }
+
+    ucs2 = false;
+    phone.command("AT+CSCS?", [this](const std::string &line) {
+      auto params = at::split_params(line);
+      ucs2 = !params.empty() && params[0] == "UCS2";
+    });
+
+    // +CPBR: (1-250),40,18
+    bool found = false;
+    auto result = phone.command("AT+CPBR=?", [this, &found](const std::string &line) {
+      auto params = at::split_params(line);
+      if (params.empty()) {
+        return;
+      }
+      auto range = params[0];
+      range.erase(std::remove(range.begin(), range.end(), '('), range.end());
+      auto dash = range.find('-');
+      info.first = at::to_int(range.substr(0, dash));
+      info.last = (dash == std::string::npos) ? info.first : at::to_int(range.substr(dash + 1));
+      info.number_length = params.size() > 1 ? at::to_int(params[1], 0) : 0;
+      info.name_length = params.size() > 2 ? at::to_int(params[2], 0) : 0;
+      found = info.first >= 0 && info.last >= info.first;
+    });
+    if (!result.ok() || !found) {
+      throw std::runtime_error("cannot read phonebook size: " + result.final);
+    }
+    is_open = true;
+    return info;
+  }
+
+  bool phonebook_t::decode(const std::string &line, contact_t &contact) const {
+    if (!at::starts_with(line, "+CPBR:")) {
+      return false;
+    }
+    auto params = at::split_params(line);
+    if (params.size() < 4) {
+      return false;
+    }
+    contact.index = at::to_int(params[0]);
+    contact.number = std::move(params[1]);
+    contact.type = at::to_int(params[2], 129);
+    contact.name = std::move(params[3]);
+    if (ucs2) {
+      try {
+        contact.name = charset::ucs2_hex_to_utf8(contact.name);
+      } catch (const std::invalid_argument &) {
+        // Some modems send plain text for names they could store as GSM
+        // characters.  Keep the name as it came.
+      }
+    }
+    return contact.index >= 0;
+  }
+
+  size_t phonebook_t::import(contact_sink_t &sink) {
+    if (!is_open) {
+      open();
+    }
+    auto start = std::chrono::steady_clock::now();
+    stats = stats_t { 0, 0, 0, 0, 0 };
+
+    int chunk = std::max(options.min_chunk, std::min(options.first_chunk, options.max_chunk));
+    int next = info.first;
+    while (next <= info.last) {
+      int end = std::min(info.last, next + chunk - 1);
+
+      // If the range has to be retried, the entries we already passed on
+      // must not go to the sink twice.
+      int delivered = next - 1;
+      contact_t contact;
+      auto began = std::chrono::steady_clock::now();
+      auto result = phone.command(
+          "AT+CPBR=" + std::to_string(next) + "," + std::to_string(end),
+          [this, &sink, &contact, &delivered](const std::string &line) {
+            if (decode(line, contact) && contact.index > delivered) {
+              sink.put(contact);
+              delivered = contact.index;
+              ++stats.entries;
+            }
+          },
+          options.timeout_ms,
+          phone_t::priority_t::bulk);
+      auto took = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - began).count();
+      ++stats.commands;
+
+      // "not found" just means the range holds no entries.
+      bool empty = at::error_code(result.final) == 22 ||
+          result.final == "+CME ERROR: not found";
+      if (!result.ok() && !empty) {
+        if (chunk <= options.min_chunk) {
+          throw std::runtime_error(
+              "cannot read phonebook at index " + std::to_string(delivered + 1) +
+              ": " + (result.final.empty() ? "timeout" : result.final));
+        }
+        chunk = std::max(options.min_chunk, chunk / 2);
+        next = delivered + 1;
+        ++stats.retries;
+        continue;
+      }
+
+      if (took > options.target_ms) {
+        chunk = std::max(options.min_chunk, chunk / 2);
+      } else if (took * 2 < options.target_ms) {
+        chunk = std::min(options.max_chunk, chunk * 2);
+      }
+      next = end + 1;
+    }  // while
+
+    stats.last_chunk = chunk;
+    stats.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return stats.entries;
+  }
+
+  std::string phonebook_t::encode(const contact_t &contact) const {
+    int type = contact.type > 0
+        ? contact.type
+        : (!contact.number.empty() && contact.number[0] == '+') ? 145 : 129;
+    return "+CPBW=" + std::to_string(contact.index) + "," +
+        at::quote(contact.number) + "," + std::to_string(type) + "," +
+        at::quote(ucs2 ? charset::utf8_to_ucs2_hex(contact.name) : contact.name);
+  }
+
+  void phonebook_t::flush(std::string &line) {
+    if (line.empty()) {
+      return;
+    }
+    auto result = phone.command(
+        "AT" + line, phone_t::line_callback_t {}, options.timeout_ms, phone_t::priority_t::bulk);
+    ++stats.commands;
+    line.clear();
+    if (!result.ok()) {
+      throw std::runtime_error(
+          "cannot write phonebook: " + (result.final.empty() ? "timeout" : result.final));
+    }
+  }
+
+  size_t phonebook_t::store(contact_source_t &source) {
+    if (!is_open) {
+      open();
+    }
+    auto start = std::chrono::steady_clock::now();
+    stats = stats_t { 0, 0, 0, 0, 0 };
+
+    std::string line;
+    contact_t contact;
+    while (source.next(contact)) {
+      auto cmd = encode(contact);
+      // "AT", the line so far, a separating semicolon, and this command.
+      if (!line.empty() && 2 + line.size() + 1 + cmd.size() > options.max_line) {
+        flush(line);
+      }
+      if (!line.empty()) {
+        line += ';';
+      }
+      line += cmd;
+      ++stats.entries;
+    }  // while
+    flush(line);
+
+    stats.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return stats.entries;
+  }
+
+  void phonebook_t::erase(int index) {
+    auto result = phone.command("AT+CPBW=" + std::to_string(index));
+    if (!result.ok()) {
+      throw std::runtime_error("cannot erase phonebook entry: " + result.final);
+    }
+  }
+
+  const phonebook_t::stats_t &phonebook_t::get_stats() const {
+    return stats;
+  }
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // One entry in the SIM phonebook, as read by AT+CPBR.  The name is UTF-8,
+  // whatever character set the modem used to send it.
+  struct contact_t {
+    int index;
+    std::string number;
+    int type;
+    std::string name;
+  };
+
+  // Receives contacts one at a time as they are decoded, so that the
+  // phonebook never has to be held in memory all at once.
+  class contact_sink_t {
+    public:
+      virtual ~contact_sink_t();
+
+      // Take one contact.  Called on whichever thread reads the device, so
+      // it must not issue commands to the phone.
+      virtual void put(const contact_t &contact) = 0;
+  };
+
+  // Supplies contacts one at a time to be written to the SIM.
+  class contact_source_t {
+    public:
+      virtual ~contact_source_t();
+
+      // Fill in the next contact and return true, or return false if there
+      // are no more.
+      virtual bool next(contact_t &contact) = 0;
+  };
+
+  // A sink which writes each contact to a stream as a JSON object on a line
+  // of its own, in the shape of the web app's contact model.
+  class json_contact_sink_t final : public contact_sink_t {
+    public:
+      explicit json_contact_sink_t(std::ostream &strm);
+      void put(const contact_t &contact) override;
+
+    private:
+      std::ostream &strm;
+  };
+
+  // A source which walks a vector of contacts.
+  class vector_contact_source_t final : public contact_source_t {
+    public:
+      explicit vector_contact_source_t(const std::vector<contact_t> &contacts);
+      bool next(contact_t &contact) override;
+
+    private:
+      const std::vector<contact_t> &contacts;
+      size_t csr;
+  };
+
+  // The shape of a phonebook storage, as reported by AT+CPBR=?.
+  struct phonebook_info_t {
+    int first;
+    int last;
+    int number_length;
+    int name_length;
+  };
+
+  // Reads and writes the SIM phonebook through a phone_t.
+  //
+  // Reading uses AT+CPBR over ranges of indices.  The size of each range
+  // adapts to the modem: it doubles while ranges come back quickly, halves
+  // when one is slow, and a range which fails or times out is retried at
+  // half the size.  Entries are decoded and handed to the sink as each line
+  // arrives.
+  //
+  // Reads and writes go at bulk priority, so other commands (a dial, say)
+  // get in between ranges rather than waiting for the whole phonebook.
+  //
+  // Writing packs as many AT+CPBW commands onto each command line as will
+  // fit, separated by semicolons, so a batch costs one round trip rather
+  // than one per entry.
+  class phonebook_t final {
+    public:
+      // Tuning knobs.  The defaults suit a SIM on a UART at 115200 baud.
+      struct options_t {
+        options_t();
+
+        // The phonebook storage to select with AT+CPBS; empty to leave the
+        // modem's choice alone.
+        std::string storage;
+
+        // The number of entries to ask for in the first range, and the
+        // bounds the size may move between.
+        int first_chunk;
+        int min_chunk;
+        int max_chunk;
+
+        // A range which takes longer than this halves the chunk size; one
+        // which takes less than half of it doubles the size.
+        int target_ms;
+
+        // How long to wait for any one range or batch.
+        int timeout_ms;
+
+        // The longest command line the modem will take.
+        size_t max_line;
+      };
+
+      // What the last import() or store() did.
+      struct stats_t {
+        size_t entries;
+        size_t commands;
+        size_t retries;
+        int last_chunk;
+        long elapsed_ms;
+      };
+
+      explicit phonebook_t(phone_t &phone, const options_t &options = options_t());
+
+      // Select the storage and character set and report the storage's shape.
+      // Throws std::runtime_error if the modem refuses.
+      phonebook_info_t open();
+
+      // Stream every entry to the sink and return how many there were.
+      size_t import(contact_sink_t &sink);
+
+      // Write every contact from the source to the SIM at its index, and
+      // return how many were written.
+      size_t store(contact_source_t &source);
+
+      // Clear the entry at the index.
+      void erase(int index);
+
+      const stats_t &get_stats() const;
+
+    private:
+      // Decode one +CPBR line into a contact.  Return false if it isn't one.
+      bool decode(const std::string &line, contact_t &contact) const;
+
+      // The AT+CPBW command (without "AT") which writes the contact.
+      std::string encode(const contact_t &contact) const;
+
+      // Send a batch of AT+CPBW commands as one command line.
+      void flush(std::string &line);
+
+      phone_t &phone;
+      options_t options;
+      phonebook_info_t info;
+      bool is_open;
+      bool ucs2;
+      stats_t stats;
+  };
+}
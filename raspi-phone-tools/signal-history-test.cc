@@ -0,0 +1,104 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/signal-history.h>
+#include <cstdint>
+#include <vector>
+
+namespace {
+  using history_t = phone::signal_history_t;
+
+  // On the hour, so buckets line up with the samples.
+  const int64_t start_us = 1699999200LL * 1000 * 1000;
+
+  history_t::sample_t make_sample(int64_t at_us, int rssi, int cell_id) {
+    history_t::sample_t sample;
+    sample.at_us = at_us;
+    sample.values[static_cast<size_t>(history_t::metric_t::rssi)] = rssi;
+    sample.values[static_cast<size_t>(history_t::metric_t::ber)] = 99;
+    sample.values[static_cast<size_t>(history_t::metric_t::registration)] = 1;
+    sample.values[static_cast<size_t>(history_t::metric_t::lac)] = 0xA1;
+    sample.values[static_cast<size_t>(history_t::metric_t::cell_id)] = cell_id;
+    sample.values[static_cast<size_t>(history_t::metric_t::act)] = 7;
+    return sample;
+  }
+}
+
+FIXTURE(signal_history_round_trips) {
+  history_t history;
+  for (int i = 0; i < 1000; ++i) {
+    history.append(make_sample(start_us + i * 1000000LL + (i % 7), (i * 37) % 32, i < 500 ? 0x1B2C3 : -1));
+  }
+  std::vector<history_t::sample_t> out;
+  EXPECT_EQ(history.samples(start_us + 100 * 1000000LL, start_us + 899 * 1000000LL + 6, out), 800u);
+  EXPECT_EQ(out.front().at_us, start_us + 100 * 1000000LL + 2);
+  EXPECT_EQ(out.front().get(history_t::metric_t::rssi), (100 * 37) % 32);
+  EXPECT_EQ(out[399].get(history_t::metric_t::cell_id), 0x1B2C3);
+  EXPECT_EQ(out[400].get(history_t::metric_t::cell_id), -1);
+  EXPECT_EQ(out.back().at_us, start_us + 899 * 1000000LL + 899 % 7);
+  EXPECT_EQ(out.back().get(history_t::metric_t::act), 7);
+
+  // Out of order samples are recorded as of the last.
+  history.append(make_sample(start_us, 5, 1));
+  out.clear();
+  EXPECT_EQ(history.samples(start_us + 999 * 1000000LL, start_us + 2000 * 1000000LL, out), 2u);
+  EXPECT_EQ(out[1].at_us, out[0].at_us);
+}
+
+FIXTURE(signal_history_is_compact) {
+  history_t history;
+  for (int i = 0; i < 10000; ++i) {
+    history.append(make_sample(start_us + i * 1000000LL, 20, 0x1B2C3));
+  }
+  auto stats = history.get_stats();
+  EXPECT_EQ(stats.rows, 10000u);
+  EXPECT_EQ(stats.minute_buckets, 0u);
+  EXPECT_LT(stats.raw_bytes / stats.rows, 12u);
+}
+
+FIXTURE(signal_history_rolls_up) {
+  history_t::options_t options;
+  options.raw_bytes = 8192;
+  options.block_rows = 64;
+  options.minute_buckets = 60;
+  options.hour_buckets = 10;
+  history_t history(options);
+  EXPECT_EQ(history.memory_bytes(), 8192 + 70 * sizeof(history_t::bucket_t));
+
+  // Five hours at one sample every ten seconds; the signal climbs by one
+  // each minute.
+  int64_t sum = 0;
+  for (int i = 0; i < 5 * 360; ++i) {
+    int rssi = (i / 6) % 32;
+    sum += rssi;
+    history.append(make_sample(start_us + i * 10000000LL, rssi, 0x1B2C3));
+  }
+  auto stats = history.get_stats();
+  EXPECT_LE(stats.raw_bytes, options.raw_bytes);
+  EXPECT_EQ(stats.minute_buckets, 60u);
+  EXPECT_GT(stats.hour_buckets, 0u);
+  EXPECT_EQ(stats.dropped, 0u);
+
+  // Every sample is counted once, whichever tier it's in now.
+  auto summary = history.summarize(history_t::metric_t::rssi, start_us, start_us + 5 * 3600 * 1000000LL);
+  EXPECT_EQ(summary.count, 1800u);
+  EXPECT_EQ(summary.min, 0);
+  EXPECT_EQ(summary.max, 31);
+  EXPECT_EQ(summary.avg, static_cast<double>(sum) / 1800);
+
+  // Unknown values stay out of the buckets.
+  EXPECT_EQ(history.summarize(history_t::metric_t::ber, start_us, start_us + 5 * 3600 * 1000000LL).count, 0u);
+
+  std::vector<history_t::bucket_t> minutes;
+  history.rollups(history_t::resolution_t::minute, start_us, start_us + 5 * 3600 * 1000000LL, minutes);
+  EXPECT_EQ(minutes.size(), 60u);
+  EXPECT_EQ(minutes[0].count[0], 6u);
+  EXPECT_EQ(minutes[0].min[0], minutes[0].max[0]);
+  EXPECT_EQ(minutes[1].start_us - minutes[0].start_us, 60 * 1000000LL);
+
+  // Past the hours, the oldest go.
+  for (int i = 5 * 360; i < 20 * 360; ++i) {
+    history.append(make_sample(start_us + i * 10000000LL, 10, 0x1B2C3));
+  }
+  stats = history.get_stats();
+  EXPECT_EQ(stats.hour_buckets, 10u);
+  EXPECT_GT(stats.dropped, 0u);
+}
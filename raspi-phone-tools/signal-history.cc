@@ -0,0 +1,373 @@
+#include <raspi-phone-tools/signal-history.h>
+#include <raspi-phone-tools/phone.h>
+
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
+#include <limits>
+
+namespace phone {
+  constexpr size_t signal_history_t::metric_count;
+
+  namespace {
+    const int64_t minute_us = 60LL * 1000 * 1000;
+    const int64_t hour_us = 60 * minute_us;
+
+    uint64_t zigzag(int64_t value) {
+      return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    int64_t unzigzag(uint64_t value) {
+      return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    void put_varint(std::string &out, int64_t value) {
+      auto bits = zigzag(value);
+      while (bits >= 0x80) {
+        out += static_cast<char>((bits & 0x7F) | 0x80);
+        bits >>= 7;
+      }
+      out += static_cast<char>(bits);
+    }
+
+    int64_t get_varint(const std::string &in, size_t &csr) {
+      uint64_t bits = 0;
+      for (unsigned shift = 0;; shift += 7) {
+        auto byte = static_cast<unsigned char>(in[csr++]);
+        bits |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+          break;
+        }
+      }
+      return unzigzag(bits);
+    }
+
+    // True iff. the value means the modem didn't know.
+    bool is_unknown(size_t metric, int32_t value) {
+      return (metric <= 1) ? value == 99 : value < 0;
+    }
+
+    int64_t floor_to(int64_t at_us, int64_t width_us) {
+      auto rem = at_us % width_us;
+      return at_us - (rem < 0 ? rem + width_us : rem);
+    }
+  }
+
+  double signal_history_t::bucket_t::avg(metric_t metric) const {
+    auto i = static_cast<size_t>(metric);
+    return count[i] ? static_cast<double>(sum[i]) / count[i] : 0;
+  }
+
+  signal_history_t::options_t::options_t()
+      : raw_bytes(256 * 1024),
+        block_rows(256),
+        minute_buckets(7 * 24 * 60),
+        hour_buckets(90 * 24) {}
+
+  size_t signal_history_t::block_t::bytes() const {
+    size_t result = sizeof(block_t) + times.capacity();
+    for (const auto &column: columns) {
+      result += column.capacity();
+    }
+    return result;
+  }
+
+  signal_history_t::signal_history_t(const options_t &options)
+      : options(options),
+        raw_bytes(0),
+        rows(0),
+        dropped(0) {
+    minutes.buckets.resize(std::max<size_t>(1, options.minute_buckets));
+    minutes.head = minutes.size = 0;
+    hours.buckets.resize(std::max<size_t>(1, options.hour_buckets));
+    hours.head = hours.size = 0;
+  }
+
+  void signal_history_t::attach(phone_t &phone) {
+    phone.on_state([this](const modem_state_t &state) {
+      append(state);
+    });
+  }
+
+  void signal_history_t::append(const modem_state_t &state, int64_t at_us) {
+    sample_t sample;
+    sample.at_us = at_us;
+    sample.values[static_cast<size_t>(metric_t::rssi)] = state.rssi;
+    sample.values[static_cast<size_t>(metric_t::ber)] = state.ber;
+    sample.values[static_cast<size_t>(metric_t::registration)] = state.registration;
+    sample.values[static_cast<size_t>(metric_t::lac)] = state.lac;
+    sample.values[static_cast<size_t>(metric_t::cell_id)] = state.cell_id;
+    sample.values[static_cast<size_t>(metric_t::act)] = state.act;
+    append(sample);
+  }
+
+  void signal_history_t::append(const sample_t &sample) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (blocks.empty() || blocks.back().rows >= options.block_rows) {
+      if (!blocks.empty()) {
+        // A full block won't grow again; give back its slack.
+        auto &full = blocks.back();
+        raw_bytes -= full.bytes();
+        full.times.shrink_to_fit();
+        for (auto &column: full.columns) {
+          column.shrink_to_fit();
+        }
+        raw_bytes += full.bytes();
+      }
+      blocks.emplace_back();
+      auto &fresh = blocks.back();
+      fresh.base_us = blocks.size() > 1 ? blocks[blocks.size() - 2].last_us : sample.at_us;
+      fresh.first_us = fresh.last_us = fresh.base_us;
+      fresh.rows = 0;
+      std::fill(fresh.last, fresh.last + metric_count, 0);
+      fresh.summary = bucket_t {};
+      raw_bytes += fresh.bytes();
+    }
+
+    auto &block = blocks.back();
+    auto before = block.bytes();
+    auto at_us = std::max(sample.at_us, block.last_us);
+    if (!block.rows) {
+      block.first_us = at_us;
+    }
+    put_varint(block.times, at_us - block.last_us);
+    block.last_us = at_us;
+    for (size_t i = 0; i < metric_count; ++i) {
+      put_varint(block.columns[i], static_cast<int64_t>(sample.values[i]) - block.last[i]);
+      block.last[i] = sample.values[i];
+    }
+    fold(block.summary, sample);
+    ++block.rows;
+    ++rows;
+    raw_bytes += block.bytes() - before;
+
+    while (raw_bytes > options.raw_bytes && blocks.size() > 1) {
+      roll_up_block();
+    }
+  }
+
+  template <typename func_t>
+  void signal_history_t::decode(const block_t &block, func_t f) {
+    size_t times_csr = 0;
+    size_t csrs[metric_count] = {};
+    sample_t sample;
+    int64_t at_us = block.base_us;
+    int32_t values[metric_count] = {};
+    for (size_t row = 0; row < block.rows; ++row) {
+      at_us += get_varint(block.times, times_csr);
+      for (size_t i = 0; i < metric_count; ++i) {
+        values[i] = static_cast<int32_t>(values[i] + get_varint(block.columns[i], csrs[i]));
+        sample.values[i] = values[i];
+      }
+      sample.at_us = at_us;
+      if (!f(sample)) {
+        return;
+      }
+    }
+  }
+
+  void signal_history_t::roll_up_block() {
+    auto &oldest = blocks.front();
+    decode(oldest, [this](const sample_t &sample) {
+      add_to_minutes(sample);
+      return true;
+    });
+    raw_bytes -= oldest.bytes();
+    blocks.pop_front();
+  }
+
+  void signal_history_t::add_to_minutes(const sample_t &sample) {
+    auto start_us = floor_to(sample.at_us, minute_us);
+    auto *bucket = minutes.back();
+    if (!bucket || bucket->start_us != start_us) {
+      if (minutes.size == minutes.buckets.size()) {
+        add_to_hours(minutes.at(0));
+        pop(minutes);
+      }
+      bucket = &push(minutes, start_us, minute_us);
+    }
+    fold(*bucket, sample);
+  }
+
+  void signal_history_t::fold(bucket_t &bucket, const sample_t &sample) {
+    for (size_t i = 0; i < metric_count; ++i) {
+      auto value = sample.values[i];
+      if (is_unknown(i, value)) {
+        continue;
+      }
+      bucket.min[i] = bucket.count[i] ? std::min(bucket.min[i], value) : value;
+      bucket.max[i] = bucket.count[i] ? std::max(bucket.max[i], value) : value;
+      bucket.sum[i] += value;
+      ++bucket.count[i];
+    }
+  }
+
+  void signal_history_t::add_to_hours(const bucket_t &minute) {
+    auto start_us = floor_to(minute.start_us, hour_us);
+    auto *bucket = hours.back();
+    if (!bucket || bucket->start_us != start_us) {
+      if (hours.size == hours.buckets.size()) {
+        pop(hours);
+        ++dropped;
+      }
+      bucket = &push(hours, start_us, hour_us);
+    }
+    for (size_t i = 0; i < metric_count; ++i) {
+      if (!minute.count[i]) {
+        continue;
+      }
+      bucket->min[i] = bucket->count[i] ? std::min(bucket->min[i], minute.min[i]) : minute.min[i];
+      bucket->max[i] = bucket->count[i] ? std::max(bucket->max[i], minute.max[i]) : minute.max[i];
+      bucket->sum[i] += minute.sum[i];
+      bucket->count[i] += minute.count[i];
+    }
+  }
+
+  signal_history_t::bucket_t &signal_history_t::push(ring_t &ring, int64_t start_us, int64_t width_us) {
+    auto &bucket = ring.at(ring.size++);
+    bucket = bucket_t {};
+    bucket.start_us = start_us;
+    bucket.width_us = width_us;
+    return bucket;
+  }
+
+  size_t signal_history_t::ring_t::find(int64_t from_us) const {
+    // The ring is in time order, so bisect.
+    size_t lo = 0, hi = size;
+    while (lo < hi) {
+      auto mid = (lo + hi) / 2;
+      if (at(mid).start_us < from_us) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  void signal_history_t::pop(ring_t &ring) {
+    ring.head = (ring.head + 1) % ring.buckets.size();
+    --ring.size;
+  }
+
+  size_t signal_history_t::samples(int64_t from_us, int64_t to_us, std::vector<sample_t> &out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return collect_samples(from_us, to_us, out);
+  }
+
+  size_t signal_history_t::rollups(
+      resolution_t resolution, int64_t from_us, int64_t to_us,
+      std::vector<bucket_t> &out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return collect_rollups(resolution, from_us, to_us, out);
+  }
+
+  size_t signal_history_t::collect_samples(
+      int64_t from_us, int64_t to_us, std::vector<sample_t> &out) const {
+    auto first = std::lower_bound(blocks.begin(), blocks.end(), from_us,
+        [](const block_t &block, int64_t at_us) { return block.last_us < at_us; });
+    size_t result = 0;
+    for (auto it = first; it != blocks.end() && it->first_us <= to_us; ++it) {
+      decode(*it, [&](const sample_t &sample) {
+        if (sample.at_us > to_us) {
+          return false;
+        }
+        if (sample.at_us >= from_us) {
+          out.push_back(sample);
+          ++result;
+        }
+        return true;
+      });
+    }
+    return result;
+  }
+
+  size_t signal_history_t::collect_rollups(
+      resolution_t resolution, int64_t from_us, int64_t to_us,
+      std::vector<bucket_t> &out) const {
+    const auto &ring = resolution == resolution_t::minute ? minutes : hours;
+    size_t result = 0;
+    for (auto i = ring.find(from_us); i < ring.size && ring.at(i).start_us <= to_us; ++i) {
+      out.push_back(ring.at(i));
+      ++result;
+    }
+    return result;
+  }
+
+  signal_history_t::summary_t signal_history_t::summarize(
+      metric_t metric, int64_t from_us, int64_t to_us) const {
+    auto m = static_cast<size_t>(metric);
+    summary_t result { 0, std::numeric_limits<int32_t>::max(), std::numeric_limits<int32_t>::min(), 0 };
+    int64_t sum = 0;
+    auto add_bucket = [&](const bucket_t &bucket) {
+      if (!bucket.count[m]) {
+        return;
+      }
+      result.count += bucket.count[m];
+      result.min = std::min(result.min, bucket.min[m]);
+      result.max = std::max(result.max, bucket.max[m]);
+      sum += bucket.sum[m];
+    };
+    // All under one lock, so nothing moves from one tier to the next
+    // meanwhile.
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto *ring: { &hours, &minutes }) {
+      for (auto i = ring->find(from_us); i < ring->size && ring->at(i).start_us <= to_us; ++i) {
+        add_bucket(ring->at(i));
+      }
+    }
+    auto first = std::lower_bound(blocks.begin(), blocks.end(), from_us,
+        [](const block_t &block, int64_t at_us) { return block.last_us < at_us; });
+    for (auto it = first; it != blocks.end() && it->first_us <= to_us; ++it) {
+      if (it->rows && from_us <= it->first_us && it->last_us <= to_us) {
+        add_bucket(it->summary);
+        continue;
+      }
+      decode(*it, [&](const sample_t &sample) {
+        if (sample.at_us > to_us) {
+          return false;
+        }
+        auto value = sample.values[m];
+        if (sample.at_us >= from_us && !is_unknown(m, value)) {
+          ++result.count;
+          result.min = std::min(result.min, value);
+          result.max = std::max(result.max, value);
+          sum += value;
+        }
+        return true;
+      });
+    }
+    if (!result.count) {
+      return summary_t { 0, 0, 0, 0 };
+    }
+    result.avg = static_cast<double>(sum) / static_cast<double>(result.count);
+    return result;
+  }
+
+  signal_history_t::stats_t signal_history_t::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats_t { rows, blocks.size(), raw_bytes, minutes.size, hours.size, dropped };
+  }
+
+  size_t signal_history_t::memory_bytes() const {
+    return options.raw_bytes +
+        (minutes.buckets.size() + hours.buckets.size()) * sizeof(bucket_t);
+  }
+
+  const char *signal_history_t::to_string(metric_t metric) {
+    switch (metric) {
+      case metric_t::rssi: return "rssi";
+      case metric_t::ber: return "ber";
+      case metric_t::registration: return "registration";
+      case metric_t::lac: return "lac";
+      case metric_t::cell_id: return "cell_id";
+      case metric_t::act: return "act";
+    }
+    return "";
+  }
+
+  int64_t signal_history_t::now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+}
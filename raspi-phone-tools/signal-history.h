@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <raspi-phone-tools/state-cache.h>
+
+namespace phone {
+  class phone_t;
+
+  // Weeks of signal and cell history in a fixed amount of memory, for
+  // coverage analysis.
+  //
+  // Samples of the modem state go into blocks, column by column: the
+  // timestamps in one column and each metric in its own, every value stored
+  // as the varint of its zigzagged difference from the one before.  A
+  // steady signal costs a byte or two per sample.  Blocks are ordered by
+  // time, so a range query finds its first block by binary search and
+  // decodes only what it returns.
+  //
+  // When the raw blocks outgrow their budget, the oldest is rolled up into
+  // per-minute buckets holding the min, max, sum and count of each metric;
+  // when the minute buckets run out, the oldest are rolled up into hours,
+  // and when those run out, the oldest hours are dropped.  The buckets are
+  // allocated up front, so memory use never goes past memory_bytes().
+  //
+  // Unknown values (99 for rssi and ber, -1 for the rest) are kept in the
+  // raw samples but left out of the buckets.  Thread-safe.
+  class signal_history_t final {
+    public:
+      // The columns.
+      enum class metric_t {
+        rssi,
+        ber,
+        registration,
+        lac,
+        cell_id,
+        act
+      };
+
+      static constexpr size_t metric_count = 6;
+
+      // The resolutions samples are rolled up to.
+      enum class resolution_t {
+        minute,
+        hour
+      };
+
+      // One row: microseconds since the epoch, and the metrics, indexed by
+      // metric_t.
+      struct sample_t {
+        int64_t at_us;
+        int32_t values[metric_count];
+        int32_t get(metric_t metric) const { return values[static_cast<size_t>(metric)]; }
+      };
+
+      // A rolled-up stretch of time.
+      struct bucket_t {
+        int64_t start_us;
+        int64_t width_us;
+        uint32_t count[metric_count];
+        int32_t min[metric_count];
+        int32_t max[metric_count];
+        int64_t sum[metric_count];
+
+        // The mean of the metric over the bucket, or 0 if it was never
+        // known.
+        double avg(metric_t metric) const;
+      };
+
+      // A metric over a range, across raw samples and buckets alike.
+      struct summary_t {
+        uint64_t count;
+        int32_t min;
+        int32_t max;
+        double avg;
+      };
+
+      struct options_t {
+        options_t();
+
+        // The most the raw blocks may take.
+        size_t raw_bytes;
+
+        // How many samples go in a block.
+        size_t block_rows;
+
+        // How many buckets of each resolution to keep.
+        size_t minute_buckets;
+        size_t hour_buckets;
+      };
+
+      struct stats_t {
+        uint64_t rows;
+        size_t blocks;
+        size_t raw_bytes;
+        size_t minute_buckets;
+        size_t hour_buckets;
+
+        // Hours that fell off the end.
+        uint64_t dropped;
+      };
+
+      explicit signal_history_t(const options_t &options = options_t());
+
+      // Record every state the phone's cache takes in from now on.  The
+      // history must outlive the phone's listening thread.
+      void attach(phone_t &phone);
+
+      // Record a sample.  One which claims to be older than the last is
+      // recorded as of the last, so the blocks stay in order.
+      void append(const modem_state_t &state, int64_t at_us = now_us());
+      void append(const sample_t &sample);
+
+      // Append the raw samples from 'from_us' to 'to_us', inclusive, to
+      // 'out', oldest first, and return how many there were.  Samples
+      // which have been rolled up aren't included.
+      size_t samples(int64_t from_us, int64_t to_us, std::vector<sample_t> &out) const;
+
+      // Append the buckets of the resolution which start from 'from_us' to
+      // 'to_us', inclusive, to 'out', oldest first, and return how many
+      // there were.
+      size_t rollups(
+          resolution_t resolution, int64_t from_us, int64_t to_us,
+          std::vector<bucket_t> &out) const;
+
+      // Sum up the metric over the range, from the hours, minutes and raw
+      // samples which start in it.  Blocks wholly inside the range are
+      // taken from their own summaries, so only the blocks at either end
+      // are decoded.
+      summary_t summarize(metric_t metric, int64_t from_us, int64_t to_us) const;
+
+      stats_t get_stats() const;
+
+      // The most memory the history will use, give or take a block.
+      size_t memory_bytes() const;
+
+      // The name of the metric, as used in JSON.
+      static const char *to_string(metric_t metric);
+
+      // Microseconds since the epoch, now.
+      static int64_t now_us();
+
+    private:
+      struct block_t {
+        // Where the first row's time is a difference from.
+        int64_t base_us;
+
+        int64_t first_us;
+        int64_t last_us;
+        size_t rows;
+
+        // The last row's values, which the next row's are differences
+        // from.
+        int32_t last[metric_count];
+
+        std::string times;
+        std::string columns[metric_count];
+
+        // The block rolled up, so a query spanning all of it needn't decode
+        // it.
+        bucket_t summary;
+
+        size_t bytes() const;
+      };
+
+      // A fixed ring of buckets, oldest first.
+      struct ring_t {
+        std::vector<bucket_t> buckets;
+        size_t head;
+        size_t size;
+
+        bucket_t &at(size_t i) { return buckets[(head + i) % buckets.size()]; }
+        const bucket_t &at(size_t i) const { return buckets[(head + i) % buckets.size()]; }
+        bucket_t *back() { return size ? &at(size - 1) : nullptr; }
+
+        // The index of the first bucket starting at or after the time.
+        size_t find(int64_t from_us) const;
+      };
+
+      // Call 'f' with each row of the block, oldest first, until it returns
+      // false.
+      template <typename func_t>
+      static void decode(const block_t &block, func_t f);
+
+      // samples() and rollups(), for a caller holding the lock.
+      size_t collect_samples(int64_t from_us, int64_t to_us, std::vector<sample_t> &out) const;
+      size_t collect_rollups(
+          resolution_t resolution, int64_t from_us, int64_t to_us,
+          std::vector<bucket_t> &out) const;
+
+      // Roll the oldest block up into the minute buckets.
+      void roll_up_block();
+
+      // Fold a sample's known values into the bucket.
+      static void fold(bucket_t &bucket, const sample_t &sample);
+
+      // Fold a sample into the newest minute bucket, starting a new one if
+      // it's past it.
+      void add_to_minutes(const sample_t &sample);
+
+      // Fold a bucket into the newest hour bucket, starting a new one if it
+      // is past it.
+      void add_to_hours(const bucket_t &bucket);
+
+      // Start an empty bucket at the end of the ring, which mustn't be
+      // full, and return it.
+      static bucket_t &push(ring_t &ring, int64_t start_us, int64_t width_us);
+
+      // Drop the oldest bucket in the ring.
+      static void pop(ring_t &ring);
+
+      const options_t options;
+      mutable std::mutex mutex;
+      std::deque<block_t> blocks;
+      size_t raw_bytes;
+      ring_t minutes;
+      ring_t hours;
+      uint64_t rows;
+      uint64_t dropped;
+  };
+}
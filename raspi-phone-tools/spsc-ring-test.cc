@@ -0,0 +1,66 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/spsc-ring.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+FIXTURE(spsc_ring_wraps_in_order) {
+  phone::spsc_ring_t<std::string> ring(5);
+  EXPECT_EQ(ring.capacity(), 8u);
+  EXPECT_TRUE(ring.peek() == nullptr);
+  int next_in = 0, next_out = 0;
+  for (int round = 0; round < 10; ++round) {
+    // Fill it up, then take back all but a few, so the indexes wrap.
+    for (auto slot = ring.claim(); slot; slot = ring.claim()) {
+      *slot = std::to_string(next_in++);
+      ring.publish();
+    }
+    for (int i = 0; i < 5; ++i) {
+      auto slot = ring.peek();
+      EXPECT_TRUE(slot != nullptr);
+      EXPECT_EQ(*slot, std::to_string(next_out++));
+      ring.release();
+    }
+  }
+  EXPECT_EQ(next_in - next_out, 8 - 5);
+  while (auto slot = ring.peek()) {
+    EXPECT_EQ(*slot, std::to_string(next_out++));
+    ring.release();
+  }
+  EXPECT_EQ(next_out, next_in);
+}
+
+FIXTURE(spsc_ring_across_threads) {
+  phone::spsc_ring_t<uint64_t> ring(64);
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(ring.wait(20));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+  static const uint64_t count = 200000;
+  std::thread producer([&ring]() {
+    for (uint64_t i = 0; i < count; ++i) {
+      uint64_t *slot;
+      while (!(slot = ring.claim())) {
+        std::this_thread::yield();
+      }
+      *slot = i;
+      ring.publish();
+      // Now and then, let the consumer fall asleep.
+      if (i % 10000 == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  });
+  uint64_t expected = 0;
+  bool ordered = true;
+  while (expected < count && ring.wait(1000)) {
+    auto slot = ring.peek();
+    ordered = ordered && *slot == expected;
+    ++expected;
+    ring.release();
+  }
+  producer.join();
+  EXPECT_EQ(expected, count);
+  EXPECT_TRUE(ordered);
+  EXPECT_GT(ring.get_wakes(), 0u);
+}
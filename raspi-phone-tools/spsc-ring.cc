@@ -0,0 +1,47 @@
+#include <raspi-phone-tools/spsc-ring.h>
+
+#include <sys/eventfd.h>
+
+namespace phone {
+  wakeup_t::wakeup_t()
+      : fd(util::make_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))),
+        parked(false),
+        wakes(0) {}
+
+  void wakeup_t::prepare() {
+    parked.store(true, std::memory_order_relaxed);
+    // Order the store above before the sleeper's last look for work; the
+    // waker's fence orders its work before its look at 'parked'.  One of
+    // the two sees the other.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  bool wakeup_t::wait(int timeout_ms) {
+    bool woken = util::wait_readable(fd, timeout_ms);
+    if (woken) {
+      uint64_t count;
+      if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        util::throw_system_error();
+      }
+    }
+    parked.store(false, std::memory_order_relaxed);
+    return woken;
+  }
+
+  void wakeup_t::cancel() {
+    parked.store(false, std::memory_order_relaxed);
+  }
+
+  void wakeup_t::notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.load(std::memory_order_relaxed) && parked.exchange(false)) {
+      wakes.fetch_add(1, std::memory_order_relaxed);
+      uint64_t one = 1;
+      util::write_exactly(fd, &one, sizeof(one));
+    }
+  }
+
+  uint64_t wakeup_t::get_wakes() const {
+    return wakes.load(std::memory_order_relaxed);
+  }
+}
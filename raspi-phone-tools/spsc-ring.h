@@ -0,0 +1,176 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <raspi-phone-tools/util.h>
+
+namespace phone {
+  // The size of a cache line, near enough, on the Pi and elsewhere.
+  constexpr size_t cache_line_bytes = 64;
+
+  // Lets one thread sleep until another has something for it, at the cost
+  // of a system call only when it actually is asleep.  The sleeper calls
+  // prepare(), checks once more for work, then calls wait() or cancel();
+  // the waker calls notify() after making work visible.  Built on an
+  // eventfd.
+  class wakeup_t final {
+    public:
+      wakeup_t();
+
+      // Announce that we're about to sleep.
+      void prepare();
+
+      // Sleep until notified or 'timeout_ms' passes, and return true iff.
+      // notified.  A notification which raced with cancel() may end the next
+      // wait early.
+      bool wait(int timeout_ms);
+
+      // Don't sleep after all.
+      void cancel();
+
+      // Wake the sleeper, if there is one.
+      void notify();
+
+      // How many times notify() had to make a system call.
+      uint64_t get_wakes() const;
+
+      // Sleep until 'ready()' holds or 'timeout_ms' passes, and return
+      // whether it holds.  A notification which raced with cancel() can end
+      // a wait early with nothing ready, so go round until the time's up.
+      template <typename ready_t>
+      bool wait_until(ready_t ready, int timeout_ms) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        for (;;) {
+          if (ready()) {
+            return true;
+          }
+          prepare();
+          if (ready()) {
+            cancel();
+            return true;
+          }
+          auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+              deadline - std::chrono::steady_clock::now()).count();
+          if (left <= 0) {
+            cancel();
+            return false;
+          }
+          wait(static_cast<int>((left + 999) / 1000));
+        }
+      }
+
+    private:
+      util::fd_t fd;
+      std::atomic<bool> parked;
+      std::atomic<uint64_t> wakes;
+  };
+
+  // A bounded, lock-free queue from exactly one producer thread to exactly
+  // one consumer thread, in a ring of slots allocated up front.  Slots are
+  // filled and read in place, so a slot holding a string or a buffer keeps
+  // its capacity from one trip round the ring to the next.
+  //
+  // Each side owns one index and keeps a cached copy of the other's, so in
+  // the common case a push or a pop touches only its own cache line.  The
+  // indexes are padded apart so the two threads don't fight over a line.
+  // A consumer with nothing to do can wait() for the producer without
+  // spinning.
+  template <typename slot_t>
+  class spsc_ring_t final {
+    public:
+      // Round the capacity up to a power of two, at least 2.
+      explicit spsc_ring_t(size_t min_capacity)
+          : slots(round_up(min_capacity)),
+            mask(slots.size() - 1),
+            head(0),
+            cached_tail(0),
+            tail(0),
+            cached_head(0) {}
+
+      spsc_ring_t(const spsc_ring_t &) = delete;
+      spsc_ring_t &operator=(const spsc_ring_t &) = delete;
+
+      // Producer: the slot to fill next, or null if the ring is full.  Call
+      // publish() once it's filled.
+      slot_t *claim() {
+        auto at = head.load(std::memory_order_relaxed);
+        if (at - cached_tail > mask) {
+          cached_tail = tail.load(std::memory_order_acquire);
+          if (at - cached_tail > mask) {
+            return nullptr;
+          }
+        }
+        return &slots[at & mask];
+      }
+
+      // Producer: hand the claimed slot to the consumer, waking it if it
+      // waits.
+      void publish() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        wakeup.notify();
+      }
+
+      // Consumer: the oldest filled slot, or null if the ring is empty.
+      // Call release() when done with it.
+      slot_t *peek() {
+        auto at = tail.load(std::memory_order_relaxed);
+        if (at == cached_head) {
+          cached_head = head.load(std::memory_order_acquire);
+          if (at == cached_head) {
+            return nullptr;
+          }
+        }
+        return &slots[at & mask];
+      }
+
+      // Consumer: give the slot from peek() back to the producer.
+      void release() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+
+      // Consumer: wait up to 'timeout_ms' for a slot to be published, and
+      // return true iff. the ring isn't empty.
+      bool wait(int timeout_ms) {
+        return wakeup.wait_until([this]() { return peek() != nullptr; }, timeout_ms);
+      }
+
+      size_t capacity() const {
+        return slots.size();
+      }
+
+      // How many times the consumer had to be woken.
+      uint64_t get_wakes() const {
+        return wakeup.get_wakes();
+      }
+
+    private:
+      static size_t round_up(size_t min_capacity) {
+        size_t capacity = 2;
+        while (capacity < min_capacity) {
+          capacity *= 2;
+        }
+        return capacity;
+      }
+
+      std::vector<slot_t> slots;
+      const size_t mask;
+      char pad0[cache_line_bytes];
+
+      // The producer's: the next slot to fill, and the consumer's index as
+      // last seen.
+      std::atomic<size_t> head;
+      size_t cached_tail;
+      char pad1[cache_line_bytes];
+
+      // The consumer's: the next slot to read, and the producer's index as
+      // last seen.
+      std::atomic<size_t> tail;
+      size_t cached_head;
+      char pad2[cache_line_bytes];
+
+      wakeup_t wakeup;
+  };
+}
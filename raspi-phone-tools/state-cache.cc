@@ -0,0 +1,139 @@
+#include <raspi-phone-tools/state-cache.h>
+#include <raspi-phone-tools/at.h>
+
+#include <cstdlib>
+#include <vector>
+
+namespace phone {
+  namespace {
+    int from_hex(const std::string &field) {
+      if (field.empty()) {
+        return -1;
+      }
+      char *end = nullptr;
+      long value = std::strtol(field.c_str(), &end, 16);
+      return (*end == '\0') ? static_cast<int>(value) : -1;
+    }
+  }
+
+  state_cache_t::state_cache_t() {
+    state.registration = -1;
+    state.lac = -1;
+    state.cell_id = -1;
+    state.act = -1;
+    state.rssi = 99;
+    state.ber = 99;
+  }
+
+  modem_state_t state_cache_t::get() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state;
+  }
+
+  void state_cache_t::observe(observer_t observer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    observers.push_back(std::move(observer));
+  }
+
+  bool state_cache_t::update(const std::string &line) {
+    bool taken = false;
+    bool changed = fold(line, taken);
+    if (taken) {
+      std::vector<observer_t> now_observers;
+      modem_state_t snapshot;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (observers.empty()) {
+          return changed;
+        }
+        now_observers = observers;
+        snapshot = state;
+      }
+      for (const auto &observer: now_observers) {
+        observer(snapshot);
+      }
+    }
+    return changed;
+  }
+
+  bool state_cache_t::fold(const std::string &line, bool &taken) {
+    if (line.empty() || line[0] != '+') {
+      return false;
+    }
+    auto name = at::line_name(line);
+    if (name == "+CREG") {
+      taken = true;
+      return update_registration(line);
+    }
+    if (name == "+CSQ") {
+      auto params = at::split_params(line);
+      if (params.size() < 2) {
+        return false;
+      }
+      int rssi = at::to_int(params[0], 99), ber = at::to_int(params[1], 99);
+      taken = true;
+      std::lock_guard<std::mutex> lock(mutex);
+      state.signal_at = std::chrono::steady_clock::now();
+      bool changed = rssi != state.rssi || ber != state.ber;
+      state.rssi = rssi;
+      state.ber = ber;
+      return changed;
+    }
+    if (name == "+COPS") {
+      auto params = at::split_params(line);
+      // The answer to AT+COPS=? starts with a parenthesized list; not ours.
+      if (params.size() < 3 || (!params[0].empty() && params[0][0] == '(')) {
+        return false;
+      }
+      taken = true;
+      std::lock_guard<std::mutex> lock(mutex);
+      bool changed = state.operator_name != params[2];
+      state.operator_name = params[2];
+      return changed;
+    }
+    return false;
+  }
+
+  bool state_cache_t::update_registration(const std::string &line) {
+    auto params = at::split_params(line);
+    if (params.empty()) {
+      return false;
+    }
+
+    // The answer to a query puts the reporting mode <n> first; the
+    // unsolicited form starts with <stat>.  Tell them apart by whether the
+    // second field is the quoted location area code.
+    size_t colon = line.find(':');
+    size_t comma = line.find(',', colon);
+    bool second_quoted = comma != std::string::npos &&
+        line.find_first_not_of(' ', comma + 1) != std::string::npos &&
+        line[line.find_first_not_of(' ', comma + 1)] == '"';
+    bool solicited = params.size() == 2 || (params.size() >= 3 && !second_quoted);
+    size_t stat = solicited ? 1 : 0;
+    if (stat >= params.size()) {
+      return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    bool changed = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    int registration = at::to_int(params[stat]);
+    if (registration != state.registration) {
+      state.registration = registration;
+      state.registration_at = now;
+      changed = true;
+    }
+    if (params.size() > stat + 2) {
+      int lac = from_hex(params[stat + 1]), cell_id = from_hex(params[stat + 2]);
+      int act = params.size() > stat + 3 ? at::to_int(params[stat + 3]) : state.act;
+      if (lac != state.lac || cell_id != state.cell_id || act != state.act) {
+        state.lac = lac;
+        state.cell_id = cell_id;
+        state.act = act;
+        state.cell_at = now;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+}
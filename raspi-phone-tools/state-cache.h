@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace phone {
+  // What we last heard about the modem's attachment to the network.  Fields
+  // are -1 (or empty) until the modem has told us.
+  struct modem_state_t {
+    using time_point_t = std::chrono::steady_clock::time_point;
+
+    // <stat> from +CREG: 0 not registered, 1 home, 2 searching, 3 denied,
+    // 4 unknown, 5 roaming.
+    int registration;
+
+    // The serving cell, from +CREG with location reporting (AT+CREG=2), and
+    // its access technology.
+    int lac;
+    int cell_id;
+    int act;
+
+    // <rssi> and <ber> from +CSQ, 99 meaning not known.
+    int rssi;
+    int ber;
+
+    // The operator name from +COPS?.
+    std::string operator_name;
+
+    // When each group of fields last changed; zero if never.
+    time_point_t registration_at;
+    time_point_t cell_at;
+    time_point_t signal_at;
+
+    // True iff. we know the modem is registered, at home or roaming.
+    bool registered() const { return registration == 1 || registration == 5; }
+
+    // True iff. the modem has told us its registration at all.
+    bool known() const { return registration >= 0; }
+  };
+
+  // A cache of the modem's network state, kept up to date from the lines
+  // the modem sends anyway (+CREG URCs) and the answers to any queries
+  // someone else made (+CREG?, +CSQ, +COPS?).  Reading it never costs a
+  // round trip.  Thread-safe.
+  class state_cache_t final {
+    public:
+      // Called with the new state each time the cache takes in a line,
+      // whether or not it changed anything, so samples of an unchanged
+      // signal count too.
+      using observer_t = std::function<void(const modem_state_t &)>;
+
+      state_cache_t();
+
+      // Look at a line from the modem and fold it into the cache if it's one
+      // we know.  Return true iff. it changed something.
+      bool update(const std::string &line);
+
+      // A copy of the current state.
+      modem_state_t get() const;
+
+      // Register an observer.  Observers run on the thread calling
+      // update(), in the order they were added, without the cache locked.
+      void observe(observer_t observer);
+
+    private:
+      // update(), less telling the observers; 'taken' is set iff. the line
+      // was one we know.
+      bool fold(const std::string &line, bool &taken);
+
+      // Fold in +CREG, in either the unsolicited form or the answer to a
+      // query, which has the reporting mode in front.  Voice calls need
+      // circuit-switched registration, so +CGREG and +CEREG are left out.
+      bool update_registration(const std::string &line);
+
+      mutable std::mutex mutex;
+      modem_state_t state;
+      std::vector<observer_t> observers;
+  };
+}
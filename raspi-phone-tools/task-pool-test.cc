@@ -0,0 +1,134 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/task-pool.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+FIXTURE(task_pool_runs_everything) {
+  phone::task_pool_t::options_t options;
+  options.threads = 4;
+  phone::task_pool_t pool(options);
+  EXPECT_EQ(pool.size(), 4u);
+  EXPECT_EQ(pool.current_worker(), -1);
+  std::atomic<int> ran(0);
+  std::atomic<bool> on_worker(true);
+  // From outside, with and without a worker in mind, and from the tasks
+  // themselves, which fan out further.
+  for (int i = 0; i < 1000; ++i) {
+    pool.submit([&pool, &ran, &on_worker]() {
+      auto worker = pool.current_worker();
+      if (worker < 0 || worker >= 4) {
+        on_worker = false;
+      }
+      for (int j = 0; j < 10; ++j) {
+        pool.submit([&ran]() { ++ran; });
+      }
+      ++ran;
+    }, i % 2 ? i : -1);
+  }
+  pool.submit([]() { throw std::runtime_error("oops"); });
+  pool.drain();
+  EXPECT_EQ(ran, 11000);
+  EXPECT_TRUE(on_worker);
+  auto stats = pool.get_stats();
+  EXPECT_EQ(stats.submitted, 11001u);
+  EXPECT_EQ(stats.ran, 11001u);
+  EXPECT_EQ(stats.failures, 1u);
+}
+
+FIXTURE(task_pool_forks_and_joins) {
+  phone::task_pool_t::options_t options;
+  options.threads = 3;
+  phone::task_pool_t pool(options);
+  std::atomic<uint64_t> sum(0);
+  pool.parallel_for(0, 100000, 1000, [&sum](size_t low, size_t high) {
+    uint64_t part = 0;
+    for (auto i = low; i < high; ++i) {
+      part += i;
+    }
+    sum += part;
+  });
+  EXPECT_EQ(sum.load(), uint64_t(100000) * 99999 / 2);
+
+  // Nested, from within tasks, which wait by working.
+  std::atomic<int> cells(0);
+  pool.parallel_for(0, 20, 1, [&pool, &cells](size_t, size_t) {
+    pool.parallel_for(0, 50, 5, [&cells](size_t low, size_t high) {
+      cells += static_cast<int>(high - low);
+    });
+  });
+  EXPECT_EQ(cells, 1000);
+
+  // The first failure comes back to the waiter, after the rest are done.
+  phone::task_pool_t::group_t group(pool);
+  std::atomic<int> finished(0);
+  for (int i = 0; i < 50; ++i) {
+    group.run([&finished, i]() {
+      ++finished;
+      if (i == 25) {
+        throw std::runtime_error("no");
+      }
+    });
+  }
+  bool threw = false;
+  try {
+    group.wait();
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  EXPECT_TRUE(threw);
+  EXPECT_EQ(finished, 50);
+  group.run([&finished]() { ++finished; });
+  group.wait();
+  EXPECT_EQ(finished, 51);
+}
+
+FIXTURE(task_pool_stands_in_for_blocked_workers) {
+  // With one worker, a task blocked waiting for another task's work would
+  // wait forever, were its place not handed on.
+  phone::task_pool_t::options_t options;
+  options.threads = 1;
+  phone::task_pool_t pool(options);
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool ready = false, woke = false;
+  pool.submit([&]() {
+    pool.submit([&]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready = true;
+      cv.notify_all();
+    });
+    phone::task_pool_t::blocking_t blocking(pool);
+    EXPECT_EQ(pool.current_worker(), -1);
+    std::unique_lock<std::mutex> lock(mutex);
+    woke = cv.wait_for(lock, std::chrono::seconds(5), [&ready]() { return ready; });
+  });
+  pool.drain();
+  EXPECT_TRUE(woke);
+  auto stats = pool.get_stats();
+  EXPECT_EQ(stats.blocking_sections, 1u);
+  EXPECT_EQ(stats.stand_ins, 1u);
+
+  // Next time, the thread which blocked before stands in, once it's had a
+  // moment to finish up and wait for a place.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ready = woke = false;
+  pool.submit([&]() {
+    pool.submit([&]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready = true;
+      cv.notify_all();
+    });
+    phone::task_pool_t::blocking_t blocking(pool);
+    std::unique_lock<std::mutex> lock(mutex);
+    woke = cv.wait_for(lock, std::chrono::seconds(5), [&ready]() { return ready; });
+  });
+  pool.drain();
+  EXPECT_TRUE(woke);
+  EXPECT_EQ(pool.get_stats().stand_ins, 1u);
+}
@@ -0,0 +1,601 @@
+#include <raspi-phone-tools/task-pool.h>
+
+#include <algorithm>
+#include <chrono>
+#include <pthread.h>
+#include <sched.h>
+
+namespace phone {
+  namespace {
+    // A Chase-Lev deque of pointers, as corrected for weak memory models
+    // by Lê, Pop, Cohen and Zappa Nardelli.  Its owner pushes and pops at
+    // the bottom without contention; anyone may steal from the top, racing
+    // the owner only for the last item.  Grows as needed; arrays it has
+    // outgrown are kept until it goes, as a thief may still be reading one.
+    template <typename item_t>
+    class work_deque_t final {
+      public:
+        work_deque_t()
+            : top(0),
+              bottom(0),
+              array(new array_t(initial_capacity)) {}
+
+        ~work_deque_t() {
+          delete array.load(std::memory_order_relaxed);
+        }
+
+        work_deque_t(const work_deque_t &) = delete;
+        work_deque_t &operator=(const work_deque_t &) = delete;
+
+        // Owner only.
+        void push(item_t *item) {
+          auto b = bottom.load(std::memory_order_relaxed);
+          auto t = top.load(std::memory_order_acquire);
+          auto a = array.load(std::memory_order_relaxed);
+          if (b - t > static_cast<int64_t>(a->mask)) {
+            a = grow(a, t, b);
+          }
+          a->put(b, item);
+          bottom.store(b + 1, std::memory_order_release);
+        }
+
+        // Owner only: the newest item, or null.
+        item_t *pop() {
+          auto b = bottom.load(std::memory_order_relaxed) - 1;
+          auto a = array.load(std::memory_order_relaxed);
+          bottom.store(b, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          auto t = top.load(std::memory_order_relaxed);
+          if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+          }
+          auto item = a->get(b);
+          if (t == b) {
+            // The last one, which a thief may be after too.
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+              item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+          }
+          return item;
+        }
+
+        // Anyone: the oldest item, or null if there's none or another
+        // thread got it first.
+        item_t *steal() {
+          auto t = top.load(std::memory_order_acquire);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          auto b = bottom.load(std::memory_order_acquire);
+          if (t >= b) {
+            return nullptr;
+          }
+          auto item = array.load(std::memory_order_acquire)->get(t);
+          if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+          }
+          return item;
+        }
+
+        // Whether it looked empty just now.
+        bool empty() const {
+          return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+        }
+
+      private:
+        static constexpr size_t initial_capacity = 256;
+
+        struct array_t {
+          explicit array_t(size_t capacity)
+              : mask(capacity - 1),
+                items(new std::atomic<item_t *>[capacity]) {}
+
+          item_t *get(int64_t at) const {
+            return items[static_cast<size_t>(at) & mask].load(std::memory_order_relaxed);
+          }
+
+          void put(int64_t at, item_t *item) {
+            items[static_cast<size_t>(at) & mask].store(item, std::memory_order_relaxed);
+          }
+
+          const size_t mask;
+          std::unique_ptr<std::atomic<item_t *>[]> items;
+        };
+
+        array_t *grow(array_t *old, int64_t t, int64_t b) {
+          auto bigger = new array_t((old->mask + 1) * 2);
+          for (auto at = t; at < b; ++at) {
+            bigger->put(at, old->get(at));
+          }
+          retired.emplace_back(old);
+          array.store(bigger, std::memory_order_release);
+          return bigger;
+        }
+
+        std::atomic<int64_t> top;
+        char pad[64];
+        std::atomic<int64_t> bottom;
+        std::atomic<array_t *> array;
+        std::vector<std::unique_ptr<array_t>> retired;
+    };
+
+    template <typename item_t>
+    constexpr size_t work_deque_t<item_t>::initial_capacity;
+
+    // Where the calling thread stands: the pool it works for, if any, and
+    // its place there, or -1 while it has none.
+    struct place_t {
+      const task_pool_t *pool;
+      int slot;
+      uint32_t random;
+
+      // True while this is the worker woken to look for new work.
+      bool waking;
+    };
+
+    thread_local place_t place { nullptr, -1, 0, false };
+
+    // A cheap random number for picking inboxes and victims.
+    uint32_t next_random() {
+      auto x = place.random;
+      if (x == 0) {
+        x = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&place)) | 1;
+      }
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      place.random = x;
+      return x;
+    }
+  }
+
+  struct task_pool_t::task_node_t {
+    task_t task;
+  };
+
+  // Counted apart for each place, so workers don't fight over one line.
+  struct task_pool_t::counters_t {
+    counters_t()
+        : submitted(0),
+          finished(0),
+          failures(0),
+          stolen(0) {}
+
+    std::atomic<uint64_t> submitted;
+    std::atomic<uint64_t> finished;
+    std::atomic<uint64_t> failures;
+    std::atomic<uint64_t> stolen;
+  };
+
+  struct task_pool_t::slot_t {
+    slot_t()
+        : inbox_head(0),
+          inbox_size(0) {}
+
+    work_deque_t<task_node_t> deque;
+
+    // Tasks from outside the pool.
+    std::mutex inbox_mutex;
+    std::vector<task_node_t *> inbox;
+    size_t inbox_head;
+    std::atomic<size_t> inbox_size;
+
+    counters_t counters;
+    char pad[64];
+  };
+
+  task_pool_t::options_t::options_t()
+      : threads(0),
+        pin(false),
+        max_stand_ins(16) {}
+
+  task_pool_t::task_pool_t(const options_t &options)
+      : options(options),
+        outside(new counters_t),
+        sleepers(0),
+        waking(false),
+        wake_epoch(0),
+        idle_spares(0),
+        draining(0),
+        stopping(false),
+        sleeps(0),
+        blocking_sections(0),
+        stand_ins(0) {
+    auto count = options.threads ? options.threads : std::max<size_t>(1, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < count; ++i) {
+      slots.emplace_back(new slot_t);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < count; ++i) {
+      threads.push_back(std::thread([this, i]() { run_thread(static_cast<int>(i)); }));
+    }
+  }
+
+  task_pool_t::~task_pool_t() {
+    drain();
+    std::vector<std::thread> stopped;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      sleep_cv.notify_all();
+      spare_cv.notify_all();
+      stopped.swap(threads);
+    }
+    for (auto &thread: stopped) {
+      thread.join();
+    }
+    // Anything submitted while we stopped goes unrun.
+    for (auto &slot: slots) {
+      while (auto node = slot->deque.steal()) {
+        delete node;
+      }
+      for (auto i = slot->inbox_head; i < slot->inbox.size(); ++i) {
+        delete slot->inbox[i];
+      }
+    }
+  }
+
+  size_t task_pool_t::size() const {
+    return slots.size();
+  }
+
+  void task_pool_t::submit(task_t task, int worker) {
+    auto node = new task_node_t { std::move(task) };
+    auto count = static_cast<int>(slots.size());
+    if (place.pool == this && place.slot >= 0 && (worker < 0 || worker % count == place.slot)) {
+      auto &slot = *slots[static_cast<size_t>(place.slot)];
+      slot.counters.submitted.fetch_add(1, std::memory_order_relaxed);
+      slot.deque.push(node);
+    } else {
+      auto &slot = *slots[static_cast<size_t>(worker >= 0 ? worker % count : static_cast<int>(next_random() % slots.size()))];
+      slot.counters.submitted.fetch_add(1, std::memory_order_relaxed);
+      std::lock_guard<std::mutex> lock(slot.inbox_mutex);
+      slot.inbox.push_back(node);
+      slot.inbox_size.store(slot.inbox.size() - slot.inbox_head, std::memory_order_relaxed);
+    }
+    wake_one();
+  }
+
+  void task_pool_t::parallel_for(
+      size_t begin, size_t end, size_t grain,
+      const std::function<void(size_t, size_t)> &body) {
+    grain = std::max<size_t>(1, grain);
+    group_t group(*this);
+    // Split off the top half as a task until what's left is small enough,
+    // so thieves get the big pieces.
+    std::function<void(size_t, size_t)> split;
+    split = [&group, &split, &body, grain](size_t low, size_t high) {
+      while (high - low > grain) {
+        auto middle = low + (high - low) / 2;
+        group.run([&split, middle, high]() { split(middle, high); });
+        high = middle;
+      }
+      body(low, high);
+    };
+    try {
+      if (begin < end) {
+        split(begin, end);
+      }
+    } catch (...) {
+      // The tasks refer to what's on this stack.
+      try {
+        group.wait();
+      } catch (...) {}
+      throw;
+    }
+    group.wait();
+  }
+
+  void task_pool_t::drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    ++draining;
+    // Woken as threads go idle, but a task may finish without anyone going
+    // idle after, so look now and then as well.
+    while (pending() > 0) {
+      idle_cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    --draining;
+  }
+
+  int task_pool_t::current_worker() const {
+    return place.pool == this ? place.slot : -1;
+  }
+
+  task_pool_t::stats_t task_pool_t::get_stats() const {
+    stats_t stats { 0, 0, 0, 0, 0, 0, 0 };
+    auto add = [&stats](const counters_t &counters) {
+      stats.submitted += counters.submitted.load(std::memory_order_relaxed);
+      stats.ran += counters.finished.load(std::memory_order_relaxed);
+      stats.failures += counters.failures.load(std::memory_order_relaxed);
+      stats.stolen += counters.stolen.load(std::memory_order_relaxed);
+    };
+    for (const auto &slot: slots) {
+      add(slot->counters);
+    }
+    add(*outside);
+    stats.sleeps = sleeps.load(std::memory_order_relaxed);
+    stats.blocking_sections = blocking_sections.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.stand_ins = stand_ins;
+    return stats;
+  }
+
+  void task_pool_t::run_thread(int slot) {
+    place.pool = this;
+    place.slot = slot;
+    place.random = static_cast<uint32_t>(slot + 1) * 2654435761u;
+    if (slot >= 0) {
+      pin(slot);
+    }
+    for (;;) {
+      if (place.slot < 0 && !take_slot()) {
+        return;
+      }
+      if (auto node = find(place.slot)) {
+        if (place.waking) {
+          // Found some; if there's more, the next sleeper takes over.
+          place.waking = false;
+          waking.store(false, std::memory_order_relaxed);
+          // Pairs with the fence in wake_one(), as in sleep().
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (any_work()) {
+            wake_one();
+          }
+        }
+        run(node);
+      } else if (!sleep()) {
+        return;
+      }
+    }
+  }
+
+  bool task_pool_t::take_slot() {
+    std::unique_lock<std::mutex> lock(mutex);
+    ++idle_spares;
+    if (draining) {
+      idle_cv.notify_all();
+    }
+    spare_cv.wait(lock, [this]() { return !free_slots.empty() || stopping; });
+    --idle_spares;
+    if (free_slots.empty()) {
+      return false;
+    }
+    place.slot = free_slots.back();
+    free_slots.pop_back();
+    lock.unlock();
+    pin(place.slot);
+    return true;
+  }
+
+  task_pool_t::task_node_t *task_pool_t::find(int slot) {
+    auto &mine = *slots[static_cast<size_t>(slot)];
+    if (auto node = mine.deque.pop()) {
+      return node;
+    }
+    auto take_inbox = [](slot_t &from) -> task_node_t * {
+      if (from.inbox_size.load(std::memory_order_relaxed) == 0) {
+        return nullptr;
+      }
+      std::lock_guard<std::mutex> lock(from.inbox_mutex);
+      if (from.inbox_head == from.inbox.size()) {
+        return nullptr;
+      }
+      auto node = from.inbox[from.inbox_head++];
+      if (from.inbox_head == from.inbox.size()) {
+        from.inbox.clear();
+        from.inbox_head = 0;
+      }
+      from.inbox_size.store(from.inbox.size() - from.inbox_head, std::memory_order_relaxed);
+      return node;
+    };
+    if (auto node = take_inbox(mine)) {
+      return node;
+    }
+    // Start somewhere different each time, so thieves spread out.
+    auto count = slots.size();
+    auto start = next_random() % count;
+    for (size_t i = 0; i < count; ++i) {
+      auto &victim = *slots[(start + i) % count];
+      if (&victim == &mine) {
+        continue;
+      }
+      auto node = victim.deque.steal();
+      if (!node) {
+        node = take_inbox(victim);
+      }
+      if (node) {
+        mine.counters.stolen.fetch_add(1, std::memory_order_relaxed);
+        return node;
+      }
+    }
+    return nullptr;
+  }
+
+  void task_pool_t::run(task_node_t *node) {
+    bool failed = false;
+    try {
+      node->task();
+    } catch (...) {
+      failed = true;
+    }
+    delete node;
+    // The task may have given up its place meanwhile.
+    auto &counters = place.slot >= 0 ? slots[static_cast<size_t>(place.slot)]->counters : *outside;
+    if (failed) {
+      counters.failures.fetch_add(1, std::memory_order_relaxed);
+    }
+    counters.finished.fetch_add(1, std::memory_order_release);
+  }
+
+  bool task_pool_t::help() {
+    if (place.pool != this || place.slot < 0) {
+      return false;
+    }
+    auto node = find(place.slot);
+    if (!node) {
+      return false;
+    }
+    run(node);
+    return true;
+  }
+
+  bool task_pool_t::sleep() {
+    if (place.waking) {
+      place.waking = false;
+      waking.store(false, std::memory_order_relaxed);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    auto epoch = wake_epoch;
+    sleepers.fetch_add(1, std::memory_order_relaxed);
+    // Pairs with the fence in wake_one(): either we see the new work, or
+    // it sees us sleeping.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool carry_on = true;
+    if (!any_work()) {
+      if (stopping) {
+        carry_on = false;
+      } else {
+        note_idle();
+        sleeps.fetch_add(1, std::memory_order_relaxed);
+        sleep_cv.wait(lock, [this, epoch]() { return wake_epoch != epoch || stopping; });
+        place.waking = true;
+      }
+    }
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+    return carry_on;
+  }
+
+  void task_pool_t::wake_one() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    // One worker woken and looking is enough; it wakes the next if it
+    // finds work.
+    if (waking.exchange(true, std::memory_order_seq_cst)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ++wake_epoch;
+    sleep_cv.notify_one();
+  }
+
+  bool task_pool_t::any_work() const {
+    for (const auto &slot: slots) {
+      if (!slot->deque.empty() || slot->inbox_size.load(std::memory_order_relaxed) > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void task_pool_t::note_idle() {
+    if (draining) {
+      idle_cv.notify_all();
+    }
+  }
+
+  uint64_t task_pool_t::pending() const {
+    // Finished first: any task pending by the time we've read those was
+    // submitted before we read the submissions.
+    uint64_t finished = outside->finished.load(std::memory_order_acquire);
+    for (const auto &slot: slots) {
+      finished += slot->counters.finished.load(std::memory_order_acquire);
+    }
+    uint64_t submitted = 0;
+    for (const auto &slot: slots) {
+      submitted += slot->counters.submitted.load(std::memory_order_acquire);
+    }
+    return submitted - finished;
+  }
+
+  void task_pool_t::pin(int slot) const {
+    if (!options.pin) {
+      return;
+    }
+    auto cores = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(static_cast<unsigned>(slot) % cores, &cpus);
+    // Only a hint; if it can't be had, the worker runs wherever.
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  task_pool_t::blocking_t::blocking_t(task_pool_t &pool) {
+    if (place.pool != &pool || place.slot < 0) {
+      return;
+    }
+    pool.blocking_sections.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.stopping) {
+      return;
+    }
+    if (pool.idle_spares <= pool.free_slots.size()) {
+      if (pool.stand_ins >= pool.options.max_stand_ins) {
+        return;
+      }
+      ++pool.stand_ins;
+      pool.threads.push_back(std::thread([&pool]() { pool.run_thread(-1); }));
+    }
+    pool.free_slots.push_back(place.slot);
+    place.slot = -1;
+    pool.spare_cv.notify_one();
+  }
+
+  task_pool_t::group_t::group_t(task_pool_t &pool)
+      : pool(pool),
+        pending(1),
+        done(false) {}
+
+  task_pool_t::group_t::~group_t() {
+    try {
+      wait();
+    } catch (...) {}
+  }
+
+  void task_pool_t::group_t::run(task_t task) {
+    pending.fetch_add(1, std::memory_order_relaxed);
+    pool.submit([this, task = std::move(task)]() {
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+      finish();
+    });
+  }
+
+  void task_pool_t::group_t::wait() {
+    finish();
+    // A worker keeps working meanwhile; anyone else sleeps.
+    while (!done.load(std::memory_order_acquire)) {
+      if (!pool.help()) {
+        if (pool.current_worker() < 0) {
+          break;
+        }
+        std::this_thread::yield();
+      }
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this]() { return done.load(std::memory_order_relaxed); });
+    auto thrown = error;
+    error = nullptr;
+    pending.store(1, std::memory_order_relaxed);
+    done.store(false, std::memory_order_relaxed);
+    lock.unlock();
+    if (thrown) {
+      std::rethrow_exception(thrown);
+    }
+  }
+
+  void task_pool_t::group_t::finish() {
+    if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      std::lock_guard<std::mutex> lock(mutex);
+      done.store(true, std::memory_order_release);
+      done_cv.notify_all();
+    }
+  }
+}
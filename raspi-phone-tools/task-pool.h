@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace phone {
+  // A pool of threads for short pieces of work from all over: parsing,
+  // indexing, encoding and the like, shared out over a few small cores.
+  // Unlike executor_t, it promises no order; it's for getting through a
+  // lot of work quickly.
+  //
+  // Each worker keeps a deque of tasks.  A task submitted by a worker goes
+  // on the back of that worker's deque, and the worker takes its own work
+  // from the back, so work runs while what it touches is still in cache.
+  // A worker with nothing left steals from the front of another's deque,
+  // taking the oldest, and so likely the biggest, piece.  Tasks submitted
+  // from other threads go to the workers' inboxes, each to one picked at
+  // random unless the submitter asks for a particular worker; a worker
+  // looks in its own inbox before stealing, and in others' after.  Workers
+  // with nothing to do sleep until there's something new.
+  //
+  // A task about to block, in a system call or on a lock, should do so
+  // inside a blocking_t: the worker's place, deque and all, passes to
+  // another thread meanwhile, so the pool still has its cores busy.
+  //
+  // group_t and parallel_for() split bulk work into tasks and wait for
+  // them.  A worker which waits runs tasks meanwhile, so they nest.
+  class task_pool_t final {
+    public:
+      using task_t = std::function<void()>;
+
+      struct options_t {
+        options_t();
+
+        // The number of workers; 0 for one per core.
+        size_t threads;
+
+        // Pin each worker's place to a core, the first to the first core
+        // and so on, wrapping round if there are more workers than cores.
+        bool pin;
+
+        // The most extra threads to start to stand in for workers in
+        // blocking sections.  Once there are this many, and all are busy,
+        // a worker keeps its place while it blocks.
+        size_t max_stand_ins;
+      };
+
+      struct stats_t {
+        uint64_t submitted;
+
+        // Tasks run, and of those, how many threw.
+        uint64_t ran;
+        uint64_t failures;
+
+        // Tasks taken from another worker's deque or inbox.
+        uint64_t stolen;
+
+        // Times a worker went to sleep for want of work.
+        uint64_t sleeps;
+
+        // Blocking sections entered on a worker, and threads started to
+        // stand in for them.
+        uint64_t blocking_sections;
+        uint64_t stand_ins;
+      };
+
+      // While one is in scope on a worker, that worker's place in the pool
+      // goes to another thread, which it starts if need be.  The thread
+      // which entered it carries on as an outsider until its task returns,
+      // then waits to take over a place itself.  Does nothing elsewhere.
+      class blocking_t final {
+        public:
+          explicit blocking_t(task_pool_t &pool);
+
+          blocking_t(const blocking_t &) = delete;
+          blocking_t &operator=(const blocking_t &) = delete;
+      };
+
+      // Tasks to wait for together.
+      class group_t final {
+        public:
+          explicit group_t(task_pool_t &pool);
+
+          // Wait for the tasks, ignoring anything they threw.
+          ~group_t();
+
+          group_t(const group_t &) = delete;
+          group_t &operator=(const group_t &) = delete;
+
+          // Submit the task to the pool as one of the group's.  A task may
+          // run more in its own group.
+          void run(task_t task);
+
+          // Wait for the group's tasks to finish, then rethrow the first
+          // exception one of them threw, if any.  The group may then be
+          // used again.
+          void wait();
+
+        private:
+          // One task, or wait() on the owner's behalf, is done.
+          void finish();
+
+          task_pool_t &pool;
+
+          // The tasks not yet finished, plus one until wait() is called,
+          // so the count reaches 0 only once wait() has been.
+          std::atomic<size_t> pending;
+
+          // Set once the count reaches 0, under the mutex, so a waiter which
+          // sees it may destroy the group as soon as it holds the mutex.
+          std::atomic<bool> done;
+
+          std::mutex mutex;
+          std::condition_variable done_cv;
+          std::exception_ptr error;
+      };
+
+      // Start the workers.
+      explicit task_pool_t(const options_t &options = options_t());
+
+      // Run whatever is still waiting, then stop the threads.
+      ~task_pool_t();
+
+      task_pool_t(const task_pool_t &) = delete;
+      task_pool_t &operator=(const task_pool_t &) = delete;
+
+      // The number of workers.
+      size_t size() const;
+
+      // Queue the task.  With 'worker' at or above 0, it goes to that
+      // worker (modulo size()), though others may take it if it's busy.
+      // An exception a task throws is counted and otherwise dropped.
+      void submit(task_t task, int worker = -1);
+
+      // Call 'body' on pieces of [begin, end) of at most 'grain' each, as
+      // tasks, and return when all are done.  Rethrows the first exception
+      // one threw.
+      void parallel_for(
+          size_t begin, size_t end, size_t grain,
+          const std::function<void(size_t, size_t)> &body);
+
+      // Wait until every task submitted so far has run.  Must not be
+      // called from a task.
+      void drain();
+
+      // The worker the calling thread is, or -1 if it isn't one of this
+      // pool's workers right now.
+      int current_worker() const;
+
+      stats_t get_stats() const;
+
+    private:
+      struct task_node_t;
+      struct counters_t;
+      struct slot_t;
+
+      // The body of each thread.  It starts at the worker's place 'slot',
+      // or as a stand-in with none.
+      void run_thread(int slot);
+
+      // Wait for a place which a worker in a blocking section has given
+      // up, and take it.  False if the pool is stopping instead.
+      bool take_slot();
+
+      // Find a task for the worker at 'slot': its own newest, then the
+      // oldest in its inbox, then another's oldest.
+      task_node_t *find(int slot);
+
+      // Run the task and free it.
+      void run(task_node_t *node);
+
+      // Run one task if the calling thread is a worker and there's one to
+      // be had.  False if not.
+      bool help();
+
+      // Sleep until there might be work, and return false if the pool is
+      // stopping instead.
+      bool sleep();
+
+      // Wake a sleeping worker, if any, after new work was queued.
+      void wake_one();
+
+      // True if any deque or inbox has work.
+      bool any_work() const;
+
+      // Tell drain() that a thread is going idle, if it's waiting.
+      void note_idle();
+
+      // Submitted less finished, over all places.  Never less than the
+      // tasks truly pending, so 0 means there were none.
+      uint64_t pending() const;
+
+      void pin(int slot) const;
+
+      const options_t options;
+      std::vector<std::unique_ptr<slot_t>> slots;
+
+      // Finished by threads which had given up their place.
+      std::unique_ptr<counters_t> outside;
+
+      // Guards the rest, and the sleeping, waiting and draining.
+      mutable std::mutex mutex;
+      std::condition_variable sleep_cv;
+      std::condition_variable spare_cv;
+      std::condition_variable idle_cv;
+
+      // Workers asleep or about to be, whether one has been woken and not
+      // yet found work, and a count bumped to wake them.
+      std::atomic<size_t> sleepers;
+      std::atomic<bool> waking;
+      uint64_t wake_epoch;
+
+      // Places given up by workers in blocking sections, and the threads
+      // waiting to take one.
+      std::vector<int> free_slots;
+      size_t idle_spares;
+
+      // Threads in drain().
+      size_t draining;
+
+      std::atomic<bool> stopping;
+      std::atomic<uint64_t> sleeps;
+      std::atomic<uint64_t> blocking_sections;
+      uint64_t stand_ins;
+      std::vector<std::thread> threads;
+  };
+}
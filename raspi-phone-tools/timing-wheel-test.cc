@@ -0,0 +1,126 @@
+#include <lick/lick.h>
+#include <raspi-phone-tools/timing-wheel.h>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+  using time_point_t = phone::timing_wheel_t::time_point_t;
+  using callbacks_t = std::vector<phone::timing_wheel_t::callback_t>;
+
+  // Run the callbacks, and return how many there were.
+  size_t run(callbacks_t &expired) {
+    auto ran = expired.size();
+    for (auto &callback: expired) {
+      callback();
+    }
+    expired.clear();
+    return ran;
+  }
+}
+
+FIXTURE(timing_wheel_fires_in_order) {
+  auto origin = std::chrono::steady_clock::now();
+  phone::timing_wheel_t wheel(std::chrono::milliseconds(1), origin);
+  std::vector<int> fired;
+  auto at = [origin](int ms) { return origin + std::chrono::milliseconds(ms); };
+  wheel.schedule(at(30), [&fired]() { fired.push_back(30); });
+  wheel.schedule(at(10), [&fired]() { fired.push_back(10); });
+  auto dropped = wheel.schedule(at(20), [&fired]() { fired.push_back(20); });
+  wheel.schedule(at(10), [&fired]() { fired.push_back(11); });
+  EXPECT_EQ(wheel.size(), 4u);
+  EXPECT_TRUE(wheel.next_due() == at(10));
+  EXPECT_TRUE(wheel.cancel(dropped));
+  EXPECT_FALSE(wheel.cancel(dropped));
+  EXPECT_FALSE(wheel.cancel(phone::timing_wheel_t::no_timer));
+
+  callbacks_t expired;
+  EXPECT_EQ(wheel.advance(at(9), expired), 0u);
+  EXPECT_EQ(wheel.advance(at(10), expired), 2u);
+  run(expired);
+  EXPECT_EQ(fired.size(), 2u);
+  EXPECT_EQ(fired[0], 10);
+  EXPECT_EQ(fired[1], 11);
+  EXPECT_TRUE(wheel.next_due() == at(30));
+
+  // Rounded up to the tick, never fired early.
+  wheel.schedule(at(40) + std::chrono::microseconds(1), [&fired]() { fired.push_back(40); });
+  EXPECT_EQ(wheel.advance(at(40), expired), 1u);
+  run(expired);
+  EXPECT_EQ(wheel.advance(at(41), expired), 1u);
+  run(expired);
+  EXPECT_EQ(fired.size(), 4u);
+  EXPECT_EQ(fired[3], 40);
+  EXPECT_TRUE(wheel.empty());
+  EXPECT_TRUE(wheel.next_due() == time_point_t::max());
+
+  // Already past goes out next time.
+  wheel.schedule(origin, [&fired]() { fired.push_back(0); });
+  EXPECT_EQ(wheel.advance(at(42), expired), 1u);
+}
+
+FIXTURE(timing_wheel_cascades) {
+  // Random timers across every level and the overflow, against a multimap,
+  // with a third cancelled, advanced in uneven steps.
+  auto origin = std::chrono::steady_clock::now();
+  phone::timing_wheel_t wheel(std::chrono::milliseconds(1), origin);
+  std::mt19937_64 random(7);
+  std::multimap<uint64_t, int> expected;
+  std::vector<uint64_t> fired;
+  int64_t horizon = int64_t(1) << 26;
+  for (int i = 0; i < 20000; ++i) {
+    auto ms = static_cast<uint64_t>(random() % static_cast<uint64_t>(i % 4 == 0 ? horizon : 5000)) + 1;
+    auto id = wheel.schedule(origin + std::chrono::milliseconds(ms), [&fired, ms]() { fired.push_back(ms); });
+    if (i % 3 == 0) {
+      EXPECT_TRUE(wheel.cancel(id));
+    } else {
+      expected.emplace(ms, i);
+    }
+  }
+  EXPECT_EQ(wheel.size(), expected.size());
+
+  callbacks_t expired;
+  int64_t now = 0;
+  bool early = false;
+  while (!wheel.empty()) {
+    // Never later than the next timer, so none is skipped over.
+    auto due = wheel.next_due();
+    auto before = fired.size();
+    now = std::max(now + 1, static_cast<int64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(due - origin).count()));
+    wheel.advance(origin + std::chrono::milliseconds(now), expired);
+    run(expired);
+    for (auto i = before; i < fired.size(); ++i) {
+      early = early || fired[i] > static_cast<uint64_t>(now) || fired[i] + 1 < static_cast<uint64_t>(now);
+    }
+  }
+  EXPECT_FALSE(early);
+  EXPECT_EQ(fired.size(), expected.size());
+  size_t i = 0;
+  bool ordered = true;
+  for (const auto &entry: expected) {
+    ordered = ordered && i < fired.size() && fired[i] == entry.first;
+    ++i;
+  }
+  EXPECT_TRUE(ordered);
+}
+
+FIXTURE(timing_wheel_reuses_slots) {
+  auto origin = std::chrono::steady_clock::now();
+  phone::timing_wheel_t wheel(std::chrono::milliseconds(10), origin);
+  callbacks_t expired;
+  int fired = 0;
+  for (int round = 1; round <= 1000; ++round) {
+    auto kept = wheel.schedule(origin + std::chrono::milliseconds(round * 10), [&fired]() { ++fired; });
+    auto gone = wheel.schedule(origin + std::chrono::milliseconds(round * 10), [&fired]() { fired += 100; });
+    EXPECT_NE(kept, gone);
+    wheel.cancel(gone);
+    wheel.advance(origin + std::chrono::milliseconds(round * 10), expired);
+    run(expired);
+    // An old id doesn't reach the timer now in its place.
+    EXPECT_FALSE(wheel.cancel(kept));
+  }
+  EXPECT_EQ(fired, 1000);
+}
@@ -0,0 +1,234 @@
+#include <raspi-phone-tools/timing-wheel.h>
+
+#include <stdexcept>
+
+namespace phone {
+  constexpr timing_wheel_t::timer_id_t timing_wheel_t::no_timer;
+  constexpr int timing_wheel_t::levels;
+  constexpr int timing_wheel_t::slot_bits;
+  constexpr size_t timing_wheel_t::slots_per_level;
+  constexpr uint32_t timing_wheel_t::none;
+  constexpr size_t timing_wheel_t::overflow_slot;
+
+  // The ticks one slot of each level spans, as a shift.
+  static int level_shift(int level) {
+    return level * timing_wheel_t::slot_bits;
+  }
+
+  static const uint64_t slot_mask = timing_wheel_t::slots_per_level - 1;
+
+  // Ticks the levels cover between them.
+  static const int wheel_bits = timing_wheel_t::levels * timing_wheel_t::slot_bits;
+
+  timing_wheel_t::timing_wheel_t(duration_t tick, time_point_t origin)
+      : tick(tick),
+        origin(origin),
+        now_tick(0),
+        free_head(none),
+        count(0) {
+    if (tick <= duration_t::zero()) {
+      throw std::invalid_argument("timing wheel tick must be positive");
+    }
+    for (auto &head: heads) {
+      head = none;
+    }
+    for (auto &bits: occupied) {
+      bits = 0;
+    }
+  }
+
+  timing_wheel_t::timer_id_t timing_wheel_t::schedule(time_point_t due, callback_t callback) {
+    // Rounded up, so a timer never fires early.
+    uint64_t due_tick = 0;
+    if (due > origin) {
+      auto ticks = (due - origin + tick - duration_t(1)) / tick;
+      due_tick = static_cast<uint64_t>(ticks);
+    }
+    if (due_tick <= now_tick) {
+      due_tick = now_tick + 1;
+    }
+
+    uint32_t index;
+    if (free_head != none) {
+      index = free_head;
+      free_head = nodes[index].next;
+    } else {
+      if (nodes.size() >= none) {
+        throw std::length_error("too many timers");
+      }
+      index = static_cast<uint32_t>(nodes.size());
+      nodes.push_back(node_t { none, none, none, 1, 0, callback_t {} });
+    }
+    auto &node = nodes[index];
+    node.due = due_tick;
+    node.callback = std::move(callback);
+    link(index, slot_for(due_tick, now_tick));
+    ++count;
+    return (static_cast<uint64_t>(node.generation) << 32) | index;
+  }
+
+  bool timing_wheel_t::cancel(timer_id_t id) {
+    auto index = static_cast<uint32_t>(id);
+    if (index >= nodes.size()) {
+      return false;
+    }
+    auto &node = nodes[index];
+    if (node.slot == none || node.generation != static_cast<uint32_t>(id >> 32)) {
+      return false;
+    }
+    unlink(index);
+    release(index);
+    return true;
+  }
+
+  size_t timing_wheel_t::advance(time_point_t now, std::vector<callback_t> &expired) {
+    if (now < origin) {
+      return 0;
+    }
+    auto target = static_cast<uint64_t>((now - origin) / tick);
+    auto before = expired.size();
+    while (now_tick < target) {
+      auto next = now_tick + 1;
+
+      // Between the first level's turns, go straight to its next timer.
+      if ((next & slot_mask) != 0) {
+        auto ahead = occupied[0] & (~uint64_t(0) << (next & slot_mask));
+        next = ahead
+            ? (next & ~slot_mask) + static_cast<uint64_t>(__builtin_ctzll(ahead))
+            : (next | slot_mask) + 1;
+        if (next > target) {
+          now_tick = target;
+          break;
+        }
+      }
+
+      // Coming round, bring down the slots of the coarser levels which
+      // have come due, the coarsest first, as its timers may land in the
+      // next level's slot.
+      if ((next & slot_mask) == 0) {
+        if ((next & ((uint64_t(1) << wheel_bits) - 1)) == 0) {
+          cascade(overflow_slot, next);
+        }
+        for (int level = levels - 1; level > 0; --level) {
+          if ((next & ((uint64_t(1) << level_shift(level)) - 1)) == 0) {
+            cascade(level * slots_per_level + ((next >> level_shift(level)) & slot_mask), next);
+          }
+        }
+      }
+      expire(next, expired);
+      now_tick = next;
+    }
+    return expired.size() - before;
+  }
+
+  timing_wheel_t::time_point_t timing_wheel_t::next_due() const {
+    if (count == 0) {
+      return time_point_t::max();
+    }
+    // A level only holds timers in slots after the wheel's place in it,
+    // and the first such slot at the finest level comes first.
+    for (int level = 0; level < levels; ++level) {
+      auto place = (now_tick >> level_shift(level)) & slot_mask;
+      if (place == slot_mask) {
+        continue;
+      }
+      auto ahead = occupied[level] & (~uint64_t(0) << (place + 1));
+      if (ahead) {
+        auto turn = (now_tick >> level_shift(level + 1)) << level_shift(level + 1);
+        auto first = turn + (static_cast<uint64_t>(__builtin_ctzll(ahead)) << level_shift(level));
+        return origin + tick * static_cast<duration_t::rep>(first);
+      }
+    }
+    auto turn = ((now_tick >> wheel_bits) + 1) << wheel_bits;
+    return origin + tick * static_cast<duration_t::rep>(turn);
+  }
+
+  size_t timing_wheel_t::slot_for(uint64_t due, uint64_t at) {
+    for (int level = 0; level < levels; ++level) {
+      auto shift = level_shift(level + 1);
+      if ((due >> shift) == (at >> shift)) {
+        return level * slots_per_level + ((due >> level_shift(level)) & slot_mask);
+      }
+    }
+    return overflow_slot;
+  }
+
+  void timing_wheel_t::link(uint32_t index, size_t slot) {
+    auto &node = nodes[index];
+    node.slot = static_cast<uint32_t>(slot);
+    auto head = heads[slot];
+    if (head == none) {
+      node.prev = node.next = index;
+      heads[slot] = index;
+    } else {
+      // At the back, so timers due together fire in the order they were
+      // scheduled.
+      auto tail = nodes[head].prev;
+      node.prev = tail;
+      node.next = head;
+      nodes[tail].next = index;
+      nodes[head].prev = index;
+    }
+    if (slot < overflow_slot) {
+      occupied[slot / slots_per_level] |= uint64_t(1) << (slot & slot_mask);
+    }
+  }
+
+  void timing_wheel_t::unlink(uint32_t index) {
+    auto &node = nodes[index];
+    auto slot = node.slot;
+    if (node.next == index) {
+      heads[slot] = none;
+      if (slot < overflow_slot) {
+        occupied[slot / slots_per_level] &= ~(uint64_t(1) << (slot & slot_mask));
+      }
+    } else {
+      nodes[node.prev].next = node.next;
+      nodes[node.next].prev = node.prev;
+      if (heads[slot] == index) {
+        heads[slot] = node.next;
+      }
+    }
+  }
+
+  void timing_wheel_t::release(uint32_t index) {
+    auto &node = nodes[index];
+    node.callback = nullptr;
+    node.slot = none;
+    // Never 0, so no id is ever no_timer.
+    if (++node.generation == 0) {
+      node.generation = 1;
+    }
+    node.next = free_head;
+    free_head = index;
+    --count;
+  }
+
+  void timing_wheel_t::cascade(size_t slot, uint64_t at) {
+    auto head = heads[slot];
+    if (head == none) {
+      return;
+    }
+    heads[slot] = none;
+    if (slot < overflow_slot) {
+      occupied[slot / slots_per_level] &= ~(uint64_t(1) << (slot & slot_mask));
+    }
+    // The nodes not yet moved still link round to 'head'.
+    auto index = head;
+    do {
+      auto next = nodes[index].next;
+      link(index, slot_for(nodes[index].due, at));
+      index = next;
+    } while (index != head);
+  }
+
+  void timing_wheel_t::expire(uint64_t tick, std::vector<callback_t> &expired) {
+    auto slot = static_cast<size_t>(tick & slot_mask);
+    while (heads[slot] != none) {
+      auto index = heads[slot];
+      unlink(index);
+      expired.push_back(std::move(nodes[index].callback));
+      release(index);
+    }
+  }
+}
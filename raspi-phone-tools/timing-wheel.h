@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace phone {
+  // Timers, kept in a hashed hierarchical timing wheel, so scheduling and
+  // cancelling each cost the same however many timers there are.
+  //
+  // Time goes in ticks.  Timers due within 64 ticks sit in the first
+  // level's 64 slots, one tick each; those due later sit in coarser levels,
+  // each of whose slots spans 64 of the level below, and move down a level
+  // when the wheel comes round to them.  Timers due in the same tick fire
+  // together, so a coarser tick batches more of them.  Four levels cover
+  // 2^24 ticks; timers due later still wait in an overflow list until the
+  // wheel gets round to them.
+  //
+  // Timers live in a slab, linked into their slot's list by index, so a
+  // timer's id finds it directly and cancelling unlinks it.  Ids carry a
+  // generation, so cancelling a timer which has fired or been cancelled
+  // already is harmless.  Not thread-safe.
+  class timing_wheel_t final {
+    public:
+      using time_point_t = std::chrono::steady_clock::time_point;
+      using duration_t = std::chrono::steady_clock::duration;
+      using callback_t = std::function<void()>;
+      using timer_id_t = uint64_t;
+
+      // Never returned by schedule().
+      static constexpr timer_id_t no_timer = 0;
+
+      static constexpr int levels = 4;
+      static constexpr int slot_bits = 6;
+      static constexpr size_t slots_per_level = size_t(1) << slot_bits;
+
+      // Ticks start at 'origin'.
+      explicit timing_wheel_t(
+          duration_t tick = std::chrono::milliseconds(1),
+          time_point_t origin = std::chrono::steady_clock::now());
+
+      timing_wheel_t(const timing_wheel_t &) = delete;
+      timing_wheel_t &operator=(const timing_wheel_t &) = delete;
+
+      // Arrange for 'callback' to be handed out by the first advance() at
+      // or after 'due', rounded up to the next tick.  A time already past
+      // goes out with the next advance().
+      timer_id_t schedule(time_point_t due, callback_t callback);
+
+      // Drop the timer, and return true iff. it was still waiting.
+      bool cancel(timer_id_t id);
+
+      // Bring the wheel up to 'now' and append the callbacks of the timers
+      // which have fallen due to 'expired', earliest first.  Return how
+      // many there were.
+      size_t advance(time_point_t now, std::vector<callback_t> &expired);
+
+      // When advance() next has anything to do, which may be early if the
+      // earliest timer is in a coarse level, or time_point::max() if there
+      // are no timers.
+      time_point_t next_due() const;
+
+      size_t size() const { return count; }
+      bool empty() const { return count == 0; }
+
+    private:
+      static constexpr uint32_t none = UINT32_MAX;
+
+      // The overflow list goes after the levels' slots.
+      static constexpr size_t overflow_slot = levels * slots_per_level;
+
+      struct node_t {
+        // In the slot's circular list, or the free list.
+        uint32_t prev;
+        uint32_t next;
+
+        // Which list it's in, or 'none' if it's free.
+        uint32_t slot;
+
+        uint32_t generation;
+        uint64_t due;
+        callback_t callback;
+      };
+
+      // The slot a timer due at 'due' belongs in, with the wheel at 'at'.
+      static size_t slot_for(uint64_t due, uint64_t at);
+
+      void link(uint32_t index, size_t slot);
+      void unlink(uint32_t index);
+      void release(uint32_t index);
+
+      // Move the timers in the slot down to where they now belong, with
+      // the wheel at 'at'.
+      void cascade(size_t slot, uint64_t at);
+
+      // Fire the first level's slot for 'tick'.
+      void expire(uint64_t tick, std::vector<callback_t> &expired);
+
+      const duration_t tick;
+      const time_point_t origin;
+
+      // The last tick advance() has dealt with.
+      uint64_t now_tick;
+
+      std::vector<node_t> nodes;
+      uint32_t free_head;
+
+      // The first timer in each slot, and by level, a bit for each slot
+      // with any.
+      uint32_t heads[overflow_slot + 1];
+      uint64_t occupied[levels];
+
+      size_t count;
+  };
+}
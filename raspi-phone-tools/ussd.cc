@@ -0,0 +1,196 @@
+#include <raspi-phone-tools/ussd.h>
+#include <raspi-phone-tools/at.h>
+#include <raspi-phone-tools/charset.h>
+
+#include <cctype>
+#include <stdexcept>
+
+namespace phone {
+  // True iff. the string is non-empty and all hex digits.
+  static bool is_hex(const std::string &str) {
+    for (char c: str) {
+      if (!std::isxdigit(static_cast<unsigned char>(c))) {
+        return false;
+      }
+    }
+    return !str.empty();
+  }
+
+  ussd_t::options_t::options_t()
+      : timeout_ms(30000),
+        ttl_ms(60000),
+        packed_gsm7(false) {}
+
+  ussd_t::ussd_t(phone_t &phone, const options_t &options)
+      : phone(phone),
+        options(options),
+        stats(stats_t { 0, 0, 0, 0, 0 }) {
+    phone.on_urc([this](const std::string &line) {
+      deliver(line);
+    });
+  }
+
+  ussd_reply_t ussd_t::query(const std::string &code) {
+    return session(code, std::vector<std::string> {});
+  }
+
+  ussd_reply_t ussd_t::session(const std::string &code, const std::vector<std::string> &answers) {
+    std::vector<std::string> steps { code };
+    steps.insert(steps.end(), answers.begin(), answers.end());
+    std::string key;
+    for (const auto &step: steps) {
+      key += step + '\n';
+    }
+
+    std::shared_ptr<entry_t> entry;
+    {
+      std::unique_lock<std::mutex> lock(cache_mutex);
+      ++stats.requests;
+      auto found = cache.find(key);
+      if (found != cache.end()) {
+        entry = found->second;
+        if (!entry->done) {
+          // Someone is asking the network already; wait for their answer.
+          ++stats.shared;
+          cache_cv.wait(lock, [&entry]() { return entry->done; });
+          if (entry->failed) {
+            throw std::runtime_error(entry->error);
+          }
+          return entry->reply;
+        }
+        if (std::chrono::steady_clock::now() < entry->expires) {
+          ++stats.cached;
+          return entry->reply;
+        }
+      }
+      entry = std::make_shared<entry_t>();
+      entry->done = false;
+      entry->failed = false;
+      cache[key] = entry;
+      ++stats.sessions;
+    }
+
+    ussd_reply_t reply {};
+    std::string error;
+    try {
+      reply = run(steps);
+    } catch (const std::exception &ex) {
+      error = ex.what();
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    entry->done = true;
+    entry->failed = !error.empty();
+    entry->error = error;
+    entry->reply = reply;
+    entry->expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.ttl_ms);
+    cache_cv.notify_all();
+    if (entry->failed) {
+      ++stats.failures;
+      auto found = cache.find(key);
+      if (found != cache.end() && found->second == entry) {
+        cache.erase(found);
+      }
+      throw std::runtime_error(error);
+    }
+    return reply;
+  }
+
+  void ussd_t::invalidate() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (auto it = cache.begin(); it != cache.end();) {
+      // Sessions in flight keep their entries, so their waiters are found.
+      if (it->second->done) {
+        it = cache.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  ussd_t::stats_t ussd_t::get_stats() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return stats;
+  }
+
+  ussd_reply_t ussd_t::run(const std::vector<std::string> &steps) {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    ussd_reply_t reply {};
+    for (size_t i = 0; i < steps.size(); ++i) {
+      reply = step(steps[i]);
+      if (!reply.more()) {
+        return reply;
+      }
+    }
+    // Don't leave a menu open; the network would hold the session until it
+    // timed out.
+    phone.command("AT+CUSD=2");
+    return reply;
+  }
+
+  ussd_reply_t ussd_t::step(const std::string &text) {
+    {
+      std::lock_guard<std::mutex> lock(reply_mutex);
+      replies.clear();
+    }
+    auto encoded = options.packed_gsm7 ? charset::utf8_to_gsm7_packed_hex(text) : text;
+    auto result = phone.command(
+        "AT+CUSD=1," + at::quote(encoded) + ",15",
+        [this](const std::string &line) { deliver(line); });
+    if (!result.ok()) {
+      throw std::runtime_error(
+          "USSD refused: " + (result.final.empty() ? std::string { "timeout" } : result.final));
+    }
+
+    std::unique_lock<std::mutex> lock(reply_mutex);
+    if (!reply_cv.wait_for(lock, std::chrono::milliseconds(options.timeout_ms), [this]() {
+      return !replies.empty();
+    })) {
+      lock.unlock();
+      phone.command("AT+CUSD=2");
+      throw std::runtime_error("USSD timed out: " + text);
+    }
+    auto reply = replies.front();
+    replies.pop_front();
+    return reply;
+  }
+
+  void ussd_t::deliver(const std::string &line) {
+    if (at::line_name(line) != "+CUSD") {
+      return;
+    }
+    // +CUSD: <m>[,<str>,<dcs>]
+    auto params = at::split_params(line);
+    ussd_reply_t reply {};
+    reply.status = params.empty() ? -1 : at::to_int(params[0]);
+    reply.dcs = params.size() > 2 ? at::to_int(params[2], 15) : 15;
+    reply.text = params.size() > 1 ? decode(params[1], reply.dcs, options.packed_gsm7) : std::string {};
+    std::lock_guard<std::mutex> lock(reply_mutex);
+    replies.push_back(reply);
+    reply_cv.notify_all();
+  }
+
+  std::string ussd_t::decode(const std::string &text, int dcs, bool packed_gsm7) {
+    // The alphabet, per the cell broadcast coding groups of 3GPP TS 23.038:
+    // 0 GSM 7-bit, 1 8-bit data, 2 UCS2.
+    int alphabet = 0;
+    if ((dcs & 0xF0) == 0x10) {
+      alphabet = (dcs & 0x0F) == 1 ? 2 : 0;
+    } else if ((dcs & 0xC0) == 0x40 || (dcs & 0xF0) == 0x90) {
+      alphabet = (dcs >> 2) & 3;
+    } else if ((dcs & 0xF0) == 0xF0) {
+      alphabet = (dcs >> 2) & 1;
+    }
+    try {
+      if (alphabet == 2 && is_hex(text) && text.size() % 4 == 0) {
+        return charset::ucs2_hex_to_utf8(text);
+      }
+      if (alphabet == 0 && packed_gsm7 && is_hex(text) && text.size() % 2 == 0) {
+        return charset::gsm7_packed_hex_to_utf8(text);
+      }
+    } catch (const std::invalid_argument &) {
+      // Not what the scheme promised; take it as it came.
+    }
+    return text;
+  }
+}
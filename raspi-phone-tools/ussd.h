@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <raspi-phone-tools/phone.h>
+
+namespace phone {
+  // The network's answer to a USSD request, from +CUSD.
+  struct ussd_reply_t {
+    // 0 done, 1 the network wants an answer (a menu), 2 ended by the
+    // network, 3 answered by another client, 4 not supported, 5 timed out.
+    int status;
+
+    // The text, decoded to UTF-8.
+    std::string text;
+
+    // The data coding scheme it came in.
+    int dcs;
+
+    bool more() const { return status == 1; }
+  };
+
+  // Runs USSD sessions (balance checks like *100#, bundle menus) one at a
+  // time, since the network allows only one per subscriber, and caches
+  // their answers.
+  //
+  // Each request or menu path is cached by what was sent, for 'ttl_ms'.
+  // A caller asking for something already in flight waits for that
+  // session's answer rather than starting another, so any number of
+  // pollers cost one round trip per TTL.  Failures aren't cached.
+  //
+  // Replies are decoded according to their data coding scheme: UCS2 hex
+  // (dcs 72 and friends) and, for modems which send it, GSM 7-bit packed
+  // into hex.  Anything else is taken as text in the modem's character
+  // set.  The answer arrives as an unsolicited +CUSD, so the phone must be
+  // listening.
+  class ussd_t final {
+    public:
+      struct options_t {
+        options_t();
+
+        // How long to wait for the network to answer each step.
+        int timeout_ms;
+
+        // How long an answer stays fresh.
+        long ttl_ms;
+
+        // True if the modem sends and expects GSM 7-bit text packed into
+        // hex, as some do in the "GSM" character set.
+        bool packed_gsm7;
+      };
+
+      struct stats_t {
+        // Calls to query() and session().
+        size_t requests;
+
+        // Answered from the cache, or by waiting for someone else's
+        // session.
+        size_t cached;
+        size_t shared;
+
+        // Sessions run, and of those, how many failed.
+        size_t sessions;
+        size_t failures;
+      };
+
+      // The engine must outlive the phone's listening thread.
+      explicit ussd_t(phone_t &phone, const options_t &options = options_t());
+
+      // Send the code and return the network's answer, from the cache if
+      // it is fresh.  A menu left open by the answer is closed.  Throws
+      // std::runtime_error if the modem refuses or the network doesn't
+      // answer.
+      ussd_reply_t query(const std::string &code);
+
+      // Send the code, then answer each menu the network puts up with the
+      // next of 'answers', and return the last reply.  Stops early if the
+      // network ends the session.  Cached like query(), by the whole path.
+      ussd_reply_t session(const std::string &code, const std::vector<std::string> &answers);
+
+      // Forget every cached answer.
+      void invalidate();
+
+      stats_t get_stats();
+
+      // Decode the text of a +CUSD according to its data coding scheme.
+      static std::string decode(const std::string &text, int dcs, bool packed_gsm7);
+
+    private:
+      // One cached or in-flight answer.
+      struct entry_t {
+        bool done;
+        bool failed;
+        std::string error;
+        ussd_reply_t reply;
+        std::chrono::steady_clock::time_point expires;
+      };
+
+      // Run the session on the network, one at a time.
+      ussd_reply_t run(const std::vector<std::string> &steps);
+
+      // Send one step and wait for the network's reply.
+      ussd_reply_t step(const std::string &text);
+
+      // Take in a +CUSD line, whether it came as a response or on its own.
+      void deliver(const std::string &line);
+
+      phone_t &phone;
+      const options_t options;
+
+      // Guards the cache and stats; 'cache_cv' is signalled when a session
+      // finishes.
+      std::mutex cache_mutex;
+      std::condition_variable cache_cv;
+      std::map<std::string, std::shared_ptr<entry_t>> cache;
+      stats_t stats;
+
+      // Held for the whole of a session.
+      std::mutex session_mutex;
+
+      // Replies waiting to be picked up by step().
+      std::mutex reply_mutex;
+      std::condition_variable reply_cv;
+      std::deque<ussd_reply_t> replies;
+  };
+}
@@ -1,6 +1,9 @@
 #include <lick/lick.h>
 #include <raspi-phone-tools/util.h>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <thread>
 
 FIXTURE(canonicalize_path) {
   std::string path1 = util::canonicalize("/tmp/ok/../ok/..");
@@ -67,6 +70,17 @@ FIXTURE(fd_t_unlink) {
   EXPECT_FALSE(util::exists(file1.path()));
 }
 
+FIXTURE(fd_t_move_leaves_donor_closed) {
+  auto file1 = util::open_unique("/tmp");
+  util::fd_t file2;
+  file2 = std::move(file1);
+  EXPECT_FALSE(file1.is_open());
+  EXPECT_TRUE(file2.is_open());
+  util::fd_t file3(std::move(file2));
+  EXPECT_FALSE(file2.is_open());
+  file3.unlink();
+}
+
 FIXTURE(write_and_read_exactly) {
   auto file1 = util::open_unique("/tmp");
   const char tmp[] = "The brown fox jumped over the fence";
@@ -86,3 +100,189 @@ FIXTURE(write_dev_null_no_except) {
   const int len = strlen(tmp);
   util::write_exactly(file1, tmp, len);
 }
+
+FIXTURE(mmap_reads_and_writes) {
+  auto file1 = util::open_unique("/tmp");
+  const char tmp[] = "The brown fox jumped over the fence";
+  const size_t len = strlen(tmp);
+  util::write_exactly(file1, tmp, len);
+
+  util::mmap_t reader(file1);
+  EXPECT_TRUE(reader.is_mapped());
+  EXPECT_EQ(reader.size(), len);
+  EXPECT_EQ(std::string(reader.data(), reader.size()), std::string(tmp));
+  reader.advise(util::map_advice_t::sequential);
+
+  // Writes through one mapping show in the file and in the other mapping.
+  util::mmap_t writer(file1, util::map_access_t::read_write);
+  std::memcpy(writer.data() + 4, "green", 5);
+  writer.sync(4, 5);
+  EXPECT_EQ(std::string(reader.data(), 9), std::string("The green"));
+  char tmpread[10];
+  util::throw_if_lt0(pread(file1, tmpread, 9, 0));
+  EXPECT_EQ(std::string(tmpread, 9), std::string("The green"));
+
+  util::mmap_t moved(std::move(writer));
+  EXPECT_FALSE(writer.is_mapped());
+  EXPECT_TRUE(writer.data() == nullptr);
+  EXPECT_TRUE(moved.is_mapped());
+  writer = std::move(moved);
+  EXPECT_FALSE(moved.is_mapped());
+  EXPECT_EQ(writer.size(), len);
+  writer.reset();
+  EXPECT_FALSE(writer.is_mapped());
+  file1.unlink();
+}
+
+FIXTURE(mmap_grows_with_the_file) {
+  auto file1 = util::open_unique("/tmp");
+  util::mmap_t log(file1, util::map_access_t::read_write);
+  EXPECT_FALSE(log.is_mapped());
+  EXPECT_EQ(log.size(), 0u);
+
+  // Append a page at a time, as an append-only file would.
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  for (size_t i = 0; i < 64; ++i) {
+    log.resize((i + 1) * page);
+    std::memset(log.data() + i * page, static_cast<int>('a' + i % 26), page);
+  }
+  log.sync(0, 0, false);
+  struct stat st;
+  util::throw_if_lt0(fstat(file1, &st));
+  EXPECT_EQ(static_cast<size_t>(st.st_size), 64 * page);
+  bool kept = true;
+  for (size_t i = 0; i < 64; ++i) {
+    kept = kept && log.data()[i * page] == static_cast<char>('a' + i % 26) &&
+        log.data()[i * page + page - 1] == static_cast<char>('a' + i % 26);
+  }
+  EXPECT_TRUE(kept);
+
+  // A reader can follow only as far as the file goes.
+  util::mmap_t reader(file1, util::map_access_t::read_only, page);
+  reader.resize(64 * page);
+  EXPECT_EQ(reader.data()[63 * page], static_cast<char>('a' + 63 % 26));
+  bool threw = false;
+  try {
+    reader.resize(65 * page);
+  } catch (const std::system_error &ex) {
+    threw = ex.code().value() == EINVAL;
+  }
+  EXPECT_TRUE(threw);
+  EXPECT_EQ(reader.size(), 64 * page);
+
+  // From an offset, which must be on a page.
+  util::mmap_t tail(file1, util::map_access_t::read_only, 0, static_cast<off_t>(62 * page));
+  EXPECT_EQ(tail.size(), 2 * page);
+  EXPECT_EQ(tail.data()[page], static_cast<char>('a' + 63 % 26));
+  file1.unlink();
+
+  // Mapped past the end from the first, a writer extends the file before
+  // it writes; a reader can't.
+  auto file2 = util::open_unique("/tmp");
+  util::mmap_t ahead(file2, util::map_access_t::read_write, 4 * page);
+  ahead.data()[4 * page - 1] = 'z';
+  util::throw_if_lt0(fstat(file2, &st));
+  EXPECT_EQ(static_cast<size_t>(st.st_size), 4 * page);
+  threw = false;
+  try {
+    util::mmap_t beyond(file2, util::map_access_t::read_only, 8 * page);
+  } catch (const std::system_error &ex) {
+    threw = ex.code().value() == EINVAL;
+  }
+  EXPECT_TRUE(threw);
+  file2.unlink();
+}
+
+FIXTURE(transfer_between_files) {
+  auto file1 = util::open_unique("/tmp");
+  auto file2 = util::open_unique("/tmp");
+  std::string data;
+  for (int i = 0; data.size() < 300000; ++i) {
+    data += std::to_string(i) + ',';
+  }
+  util::write_exactly(file1, data.data(), data.size());
+  EXPECT_TRUE(util::pick_transfer_method(file2, file1) == util::transfer_method_t::copy_file_range);
+
+  // From an offset, the input's own position stays put.
+  off_t offset = 1000;
+  util::transfer_exactly(file2, file1, data.size() - 2000, &offset);
+  EXPECT_EQ(offset, static_cast<off_t>(data.size() - 1000));
+  EXPECT_EQ(lseek(file1, 0, SEEK_CUR), static_cast<off_t>(data.size()));
+  std::string copy(data.size() - 2000, '\0');
+  EXPECT_EQ(pread(file2, &copy[0], copy.size(), 0), static_cast<ssize_t>(copy.size()));
+  EXPECT_TRUE(copy == data.substr(1000, data.size() - 2000));
+
+  // From the input's position, which moves on, until it runs out.
+  lseek(file1, static_cast<off_t>(data.size() - 10), SEEK_SET);
+  EXPECT_EQ(util::transfer_at_most(file2, file1, 100), 10u);
+  EXPECT_EQ(util::transfer_at_most(file2, file1, 100), 0u);
+  lseek(file1, static_cast<off_t>(data.size() - 10), SEEK_SET);
+  bool threw = false;
+  try {
+    util::transfer_exactly(file2, file1, 11);
+  } catch (const std::system_error &ex) {
+    threw = ex.code().value() == ENODATA;
+  }
+  EXPECT_TRUE(threw);
+  file1.unlink();
+  file2.unlink();
+}
+
+FIXTURE(transfer_from_procfs) {
+  // Regular files as far as stat() goes, but copy_file_range() gives
+  // nothing from them.
+  std::string data(4096, '\0');
+  auto proc = util::open("/proc/version");
+  data.resize(util::read_at_most(proc, &data[0], data.size()));
+  EXPECT_GT(data.size(), 0u);
+  auto file = util::open_unique("/tmp");
+  off_t offset = 0;
+  EXPECT_EQ(util::transfer_at_most(file, proc, data.size(), &offset), data.size());
+  util::transfer_exactly(file, util::open("/proc/version"), data.size());
+  std::string copy(data.size() * 2, '\0');
+  EXPECT_EQ(pread(file, &copy[0], copy.size(), 0), static_cast<ssize_t>(copy.size()));
+  EXPECT_TRUE(copy == data + data);
+  file.unlink();
+}
+
+FIXTURE(transfer_through_pipes_and_sockets) {
+  // A file into a pipe, the pipe into a socket, and the socket into
+  // another file, each on its own thread, as the pipe and socket fill up.
+  auto file1 = util::open_unique("/tmp");
+  auto file2 = util::open_unique("/tmp");
+  std::string data;
+  for (int i = 0; data.size() < 500000; ++i) {
+    data += std::to_string(i * 7) + ';';
+  }
+  util::write_exactly(file1, data.data(), data.size());
+  int pipe_fds[2], socket_fds[2];
+  util::throw_if_lt0(pipe(pipe_fds));
+  util::throw_if_lt0(socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds));
+  auto pipe_out = util::make_fd(pipe_fds[0]), pipe_in = util::make_fd(pipe_fds[1]);
+  auto socket1 = util::make_fd(socket_fds[0]), socket2 = util::make_fd(socket_fds[1]);
+  EXPECT_TRUE(util::pick_transfer_method(pipe_in, file1) == util::transfer_method_t::splice);
+  EXPECT_TRUE(util::pick_transfer_method(socket1, pipe_out) == util::transfer_method_t::splice);
+  EXPECT_TRUE(util::pick_transfer_method(socket1, file1) == util::transfer_method_t::sendfile);
+  EXPECT_TRUE(util::pick_transfer_method(file2, socket2) == util::transfer_method_t::read_write);
+
+  off_t offset = 0;
+  std::thread filling([&]() {
+    util::transfer_exactly(pipe_in, file1, data.size(), &offset);
+  });
+  std::thread forwarding([&]() {
+    util::transfer_exactly(socket1, pipe_out, data.size());
+  });
+  util::transfer_exactly(file2, socket2, data.size());
+  filling.join();
+  forwarding.join();
+  EXPECT_EQ(offset, static_cast<off_t>(data.size()));
+  std::string copy(data.size(), '\0');
+  EXPECT_EQ(pread(file2, &copy[0], copy.size(), 0), static_cast<ssize_t>(copy.size()));
+  EXPECT_TRUE(copy == data);
+
+  // The other end gone, there's nothing more to read.
+  socket1.reset();
+  EXPECT_EQ(util::transfer_at_most(file2, socket2, 100), 0u);
+  file1.unlink();
+  file2.unlink();
+}
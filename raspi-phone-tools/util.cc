@@ -1,7 +1,14 @@
 #include <raspi-phone-tools/util.h>
 
+#include <algorithm>
+#include <chrono>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
 namespace util {
 
+constexpr int fd_t::closed_handle;
+
 fd_t::fd_t(const fd_t &that) {
   handle = that.is_open()
       ? throw_if_lt0(dup(that.handle))
@@ -66,6 +73,115 @@ fd_t &fd_t::reset() noexcept {
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// The protection bits for mapping with the given access.
+static int map_prot(map_access_t access) {
+  return access == map_access_t::read_write ? PROT_READ | PROT_WRITE : PROT_READ;
+}
+
+// Make sure the file goes as far as 'end', so a mapping that far won't
+// fault: extend it if we may write it, otherwise throw EINVAL.
+static void reach(int fd, map_access_t access, off_t end) {
+  struct stat st;
+  throw_if_lt0(fstat(fd, &st));
+  if (st.st_size < end) {
+    if (access == map_access_t::read_only) {
+      throw_system_error(EINVAL);
+    }
+    auto error = posix_fallocate(fd, st.st_size, end - st.st_size);
+    if (error != 0) {
+      throw_system_error(error);
+    }
+  }
+}
+
+mmap_t::mmap_t(const fd_t &that_fd, map_access_t access, size_t size, off_t offset)
+    : fd(that_fd), access(access), offset(offset), base(nullptr), length(0) {
+  if (size == 0) {
+    struct stat st;
+    throw_if_lt0(fstat(fd, &st));
+    if (st.st_size > offset) {
+      size = static_cast<size_t>(st.st_size - offset);
+    }
+  } else {
+    reach(fd, access, offset + static_cast<off_t>(size));
+  }
+  if (size > 0) {
+    auto *mapped = mmap(nullptr, size, map_prot(access), MAP_SHARED, fd, offset);
+    if (mapped == MAP_FAILED) {
+      throw_system_error();
+    }
+    base = static_cast<char *>(mapped);
+    length = size;
+  }
+}
+
+void mmap_t::resize(size_t new_size) {
+  if (new_size == length) {
+    return;
+  }
+  // Touching a page past the end of the file faults.
+  reach(fd, access, offset + static_cast<off_t>(new_size));
+  if (new_size == 0) {
+    munmap(base, length);
+    base = nullptr;
+    length = 0;
+    return;
+  }
+  auto *mapped = base
+      ? mremap(base, length, new_size, MREMAP_MAYMOVE)
+      : mmap(nullptr, new_size, map_prot(access), MAP_SHARED, fd, offset);
+  if (mapped == MAP_FAILED) {
+    throw_system_error();
+  }
+  base = static_cast<char *>(mapped);
+  length = new_size;
+}
+
+void mmap_t::sync(size_t offset, size_t size, bool wait) {
+  auto range = page_range(offset, size);
+  if (range.second > 0) {
+    throw_if_lt0(msync(range.first, range.second, wait ? MS_SYNC : MS_ASYNC));
+  }
+}
+
+void mmap_t::advise(map_advice_t advice, size_t offset, size_t size) {
+  auto range = page_range(offset, size);
+  if (range.second == 0) {
+    return;
+  }
+  int flag = MADV_NORMAL;
+  switch (advice) {
+    case map_advice_t::normal: flag = MADV_NORMAL; break;
+    case map_advice_t::sequential: flag = MADV_SEQUENTIAL; break;
+    case map_advice_t::random: flag = MADV_RANDOM; break;
+    case map_advice_t::will_need: flag = MADV_WILLNEED; break;
+    case map_advice_t::dont_need: flag = MADV_DONTNEED; break;
+  }
+  throw_if_lt0(madvise(range.first, range.second, flag));
+}
+
+mmap_t &mmap_t::reset() noexcept {
+  if (base) {
+    munmap(base, length);
+  }
+  base = nullptr;
+  length = 0;
+  offset = 0;
+  fd.reset();
+  return *this;
+}
+
+std::pair<char *, size_t> mmap_t::page_range(size_t offset, size_t size) const {
+  // The region starts on a page, so its pages are the file's.
+  static const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  offset = std::min(offset, length);
+  auto end = size == 0 ? length : std::min(length, offset + size);
+  auto from = offset / page * page;
+  return std::make_pair(base + from, end - from);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 std::string canonicalize(const std::string &path) {
   char tmp[PATH_MAX];
   realpath(path.c_str(), tmp);
@@ -158,6 +274,22 @@ fd_t open_unique(const std::string &prefix) {
   return make_fd(mkstemp(const_cast<char *>(temp.c_str())));
 }
 
+transfer_method_t pick_transfer_method(int out_fd, int in_fd) {
+  struct stat in_st, out_st;
+  throw_if_lt0(fstat(in_fd, &in_st));
+  throw_if_lt0(fstat(out_fd, &out_st));
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+    return transfer_method_t::copy_file_range;
+  }
+  if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+    return transfer_method_t::splice;
+  }
+  if (S_ISREG(in_st.st_mode) || S_ISBLK(in_st.st_mode)) {
+    return transfer_method_t::sendfile;
+  }
+  return transfer_method_t::read_write;
+}
+
 void read_exactly(int fd, void *data, size_t size) {
   // Make a cursor pointing at the start of the buffer.
   auto *csr = static_cast<char *>(data);
@@ -242,10 +374,167 @@ std::string standardize_string(char *c_str) {
   return result;
 }
 
+// Move at most 'size' bytes the given way, once.  Return the number moved,
+// or -1 with errno set, as the system calls do.
+static ssize_t transfer_once(
+    transfer_method_t method, int out_fd, int in_fd, size_t size, off_t *offset) {
+  switch (method) {
+    case transfer_method_t::copy_file_range: {
+      #ifdef SYS_copy_file_range
+        loff_t from = offset ? *offset : 0;
+        auto moved = static_cast<ssize_t>(syscall(
+            SYS_copy_file_range, in_fd, offset ? &from : nullptr, out_fd, nullptr, size, 0u));
+        if (moved > 0 && offset) {
+          *offset = static_cast<off_t>(from);
+        }
+        return moved;
+      #else
+        errno = ENOSYS;
+        return -1;
+      #endif
+    }
+    case transfer_method_t::splice: {
+      loff_t from = offset ? *offset : 0;
+      auto moved = splice(in_fd, offset ? &from : nullptr, out_fd, nullptr, size, SPLICE_F_MOVE);
+      if (moved > 0 && offset) {
+        *offset = static_cast<off_t>(from);
+      }
+      return moved;
+    }
+    case transfer_method_t::sendfile: {
+      return sendfile(out_fd, in_fd, offset, size);
+    }
+    case transfer_method_t::read_write: {
+      break;
+    }
+  }  // switch
+  char buffer[64 << 10];
+  auto want = std::min(size, sizeof(buffer));
+  auto got = offset ? pread(in_fd, buffer, want, *offset) : read(in_fd, buffer, want);
+  if (got <= 0) {
+    return got;
+  }
+  // What we've read is gone from the input, so it all goes out, signals or
+  // no, or we throw.
+  auto *csr = buffer;
+  auto left = static_cast<size_t>(got);
+  while (left) {
+    auto actl = write(out_fd, csr, left);
+    if (actl < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_system_error();
+    }
+    if (!actl) {
+      throw_system_error(ENOSPC);
+    }
+    csr += actl;
+    left -= static_cast<size_t>(actl);
+  }  // while
+  if (offset) {
+    *offset += got;
+  }
+  return got;
+}
+
+// If the way we tried was turned down with the given error, which doesn't
+// say anything's wrong with the transfer as such, change 'method' to the
+// next way to try and return true; otherwise, return false.
+static bool fall_back(transfer_method_t &method, int error) {
+  if (method == transfer_method_t::read_write) {
+    return false;
+  }
+  // EBADF too, as copy_file_range() won't write a file opened to append.
+  // If the descriptor really is bad, read_write says so.
+  if (error != EINVAL && error != ENOSYS && error != EXDEV &&
+      error != EOPNOTSUPP && error != ENOTSUP && error != EBADF) {
+    return false;
+  }
+  method = method == transfer_method_t::copy_file_range
+      ? transfer_method_t::sendfile
+      : transfer_method_t::read_write;
+  return true;
+}
+
+// If the way we tried moved nothing on the first go, change 'method' to the
+// next way to try and return true; otherwise, return false.  Files in procfs
+// and sysfs, and some pairs of filesystems, give copy_file_range() nothing
+// though they have more to give, so we can't take it for the end of the
+// input until a plainer way agrees.
+static bool fall_back_on_nothing(transfer_method_t &method, bool first) {
+  return first && fall_back(method, ENOSYS);
+}
+
+size_t transfer_at_most(int out_fd, int in_fd, size_t size, off_t *offset) {
+  auto method = pick_transfer_method(out_fd, in_fd);
+  for (;;) {
+    auto moved = transfer_once(method, out_fd, in_fd, size, offset);
+    if (moved >= 0) {
+      if (!moved && size && fall_back_on_nothing(method, true)) {
+        continue;
+      }
+      return static_cast<size_t>(moved);
+    }
+    if (errno != EINTR && !fall_back(method, errno)) {
+      throw_system_error();
+    }
+  }  // for
+}
+
+void transfer_exactly(int out_fd, int in_fd, size_t size, off_t *offset) {
+  auto method = pick_transfer_method(out_fd, in_fd);
+  bool first = true;
+  // Loop while we still have bytes left to move.
+  while (size) {
+    auto moved = transfer_once(method, out_fd, in_fd, size, offset);
+    if (moved < 0) {
+      // Interrupted, or this way won't do; go again.
+      if (errno != EINTR && !fall_back(method, errno)) {
+        throw_system_error();
+      }
+      continue;
+    }
+    // Nothing moved means the input has run out, unless this way is no
+    // good for these files.
+    if (!moved) {
+      if (fall_back_on_nothing(method, first)) {
+        continue;
+      }
+      throw_system_error(ENODATA);
+    }
+    first = false;
+    size -= static_cast<size_t>(moved);
+  }  // while
+}
+
 void unlink(const std::string &path) {
   throw_if_lt0(::unlink(path.c_str()));
 }
 
+bool wait_readable(int fd, int timeout_ms) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  for (;;) {
+    auto start = std::chrono::steady_clock::now();
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret >= 0) {
+      return ret > 0;
+    }
+    if (errno != EINTR) {
+      throw_system_error();
+    }
+    // Interrupted.  Take the time we spent off the timeout and go again.
+    if (timeout_ms > 0) {
+      auto spent = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start).count();
+      timeout_ms = std::max(0, timeout_ms - static_cast<int>(spent));
+    }
+  }  // for
+}
+
 void write_exactly(int fd, const void *data, size_t size) {
   // Make a cursor pointing at the start of the buffer.
   auto *csr = static_cast<const char *>(data);
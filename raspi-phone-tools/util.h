@@ -15,7 +15,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <termios.h>
 
 #ifndef PATH_MAX
@@ -141,6 +143,148 @@ enum class if_exists_t {
 
 };  // if_exists_t
 
+// Used by mmap_t, below.  This determines what you can do with the mapped
+// bytes.
+enum class map_access_t {
+
+  // Map the file for reading only.  Writing to the mapping faults.
+  read_only,
+
+  // Map the file for reading and writing.  The mapping is shared, so writes
+  // reach the file, and other processes mapping it see them.
+  read_write
+
+};  // map_access_t
+
+// Used by mmap_t::advise(), below.  This tells the kernel how the mapped
+// bytes are about to be used, so it can read ahead, or not, accordingly.
+enum class map_advice_t {
+
+  // No particular pattern.
+  normal,
+
+  // Front to back, so read ahead aggressively and drop pages once passed.
+  sequential,
+
+  // Here and there, so don't bother reading ahead.
+  random,
+
+  // Soon, so start reading them in now.
+  will_need,
+
+  // Not for a while, so the pages may be dropped.
+  dont_need
+
+};  // map_advice_t
+
+// Used by pick_transfer_method(), below.  These are the ways of moving bytes
+// from one file descriptor to another, fastest first.
+enum class transfer_method_t {
+
+  // copy_file_range(), from a regular file to a regular file.  The kernel
+  // copies, or on some filesystems just shares, the blocks.
+  copy_file_range,
+
+  // splice(), when either side is a pipe.  Pages move rather than copy.
+  splice,
+
+  // sendfile(), from a regular file to anything, a socket say.
+  sendfile,
+
+  // read() into a buffer and write() out of it, for anything else.
+  read_write
+
+};  // transfer_method_t
+
+// An RAII wrapper around a region of a file mapped into memory.  The region
+// starts at an offset into the file and runs for a given size; reading and
+// writing the region reads and writes the file without a system call or a
+// copy.  Holds a duplicate of the file descriptor, so the region can grow
+// along with an append-only file.  Move-only.
+class mmap_t final {
+public:
+
+  // Default-construct as unmapped.
+  mmap_t() noexcept;
+
+  // Map 'size' bytes of the file, starting 'offset' bytes in, which must be
+  // a multiple of the page size.  A size of 0 maps the file from the offset
+  // to its end, if anything; an empty region can still grow.  A size past
+  // the end of the file is handled as resize() handles it: a read-write
+  // mapping extends the file, and a read-only one throws EINVAL.  If the
+  // mapping fails, this throws a system error.
+  explicit mmap_t(
+      const fd_t &fd,
+      map_access_t access = map_access_t::read_only,
+      size_t size = 0,
+      off_t offset = 0);
+
+  // Move-construct, leaving the donor unmapped.
+  mmap_t(mmap_t &&that) noexcept;
+
+  mmap_t(const mmap_t &) = delete;
+
+  // Unmap, if mapped.
+  ~mmap_t();
+
+  // Move-assign, leaving the donor unmapped.
+  mmap_t &operator=(mmap_t &&that) noexcept;
+
+  mmap_t &operator=(const mmap_t &) = delete;
+
+  // The start of the region, or null if it's empty.
+  char *data() noexcept;
+  const char *data() const noexcept;
+
+  // The size of the region.
+  size_t size() const noexcept;
+
+  // Return true iff. the region is non-empty.
+  bool is_mapped() const noexcept;
+
+  map_access_t get_access() const noexcept;
+
+  // Make the region 'new_size' bytes.  A read-write mapping extends the file
+  // first if it's too short, reserving the disk space so a full disk can't
+  // fault a later write; a read-only mapping can only grow as far as the
+  // file already goes, and throws EINVAL past that.  Shrinking leaves the
+  // file as it is.  The region may move, so pointers into it are invalid
+  // after.
+  void resize(size_t new_size);
+
+  // Write the changed pages among 'size' bytes of the region from 'offset'
+  // back to the file; a size of 0 runs to the end of the region.  With
+  // 'wait', return once they're on disk; otherwise just schedule them.
+  void sync(size_t offset = 0, size_t size = 0, bool wait = true);
+
+  // Tell the kernel how 'size' bytes of the region from 'offset' are about
+  // to be used; a size of 0 runs to the end of the region.
+  void advise(map_advice_t advice, size_t offset = 0, size_t size = 0);
+
+  // If mapped, unmap and let go of the file; otherwise, do nothing.  Either
+  // way, return a reference to the mmap_t instance.
+  mmap_t &reset() noexcept;
+
+private:
+
+  // The range of pages covering 'size' bytes from 'offset', clipped to the
+  // region, with 0 meaning to its end.
+  std::pair<char *, size_t> page_range(size_t offset, size_t size) const;
+
+  // Our own handle on the file, for growing.
+  fd_t fd;
+
+  map_access_t access;
+
+  // Where the region starts in the file.
+  off_t offset;
+
+  // The region, or null and 0 if it's empty.
+  char *base;
+  size_t length;
+
+};  // mmap_t
+
 // Expand all symbolic links, resolve references to '.' and '..', and drop
 // extra path separators, returning the absolute path in canonical form.
 std::string canonicalize(const std::string &path);
@@ -173,6 +317,11 @@ fd_t open(
 // user only.
 fd_t open_unique(const std::string &prefix = std::string {});
 
+// Return the fastest way to move bytes from 'in_fd' to 'out_fd', going by
+// what kinds of file they are.  The transfer functions, below, fall back to
+// the next way on their own if the kernel turns this one down.
+transfer_method_t pick_transfer_method(int out_fd, int in_fd);
+
 // Read at most 'size' bytes and store them in the buffer pointed at by 'data'.
 // Return the number of bytes actually read.  If the read fails, this throws a
 // system error.
@@ -195,9 +344,28 @@ std::vector<std::string> split_path(
 // and canonicalize_file_name().
 std::string standardize_string(char *c_str);
 
+// Move at most 'size' bytes from 'in_fd' to 'out_fd' within the kernel,
+// without copying them through a buffer of ours if there's a way to.  If
+// 'offset' is non-null, read from there, advancing it, and leave the
+// input's file position alone; otherwise read from, and advance, the file
+// position.  Return the number of bytes actually moved, 0 at the end of
+// the input.  A call interrupted by a signal is restarted.  If the transfer
+// fails, this throws a system error.
+size_t transfer_at_most(int out_fd, int in_fd, size_t size, off_t *offset = nullptr);
+
+// Move exactly 'size' bytes as transfer_at_most() does, going round as many
+// times as it takes.  If the input runs out first, throw ENODATA; if the
+// output won't take any more, throw ENOSPC.
+void transfer_exactly(int out_fd, int in_fd, size_t size, off_t *offset = nullptr);
+
 // Unlinks the file from the file system.
 void unlink(const std::string &path);
 
+// Wait up to 'timeout_ms' milliseconds for the file descriptor to become
+// readable.  Return true iff. it did.  A negative timeout waits forever.  If
+// the wait is interrupted by a signal, it is restarted with the time left.
+bool wait_readable(int fd, int timeout_ms);
+
 // Write at most 'size' bytes from the buffer pointed at by 'data'.
 // Return the number of bytes actually written.  If the write fails, this
 // throws a system error.
@@ -234,7 +402,7 @@ inline fd_t::fd_t() noexcept
     : handle(closed_handle) {}
 
 inline fd_t::fd_t(fd_t &&that) noexcept
-    : handle(std::exchange(that.handle, -closed_handle)) {}
+    : handle(std::exchange(that.handle, closed_handle)) {}
 
 inline fd_t::~fd_t() {
   reset();
@@ -289,6 +457,50 @@ inline if_not_exists_t::if_not_exists_t(mode_t new_mode) noexcept
 
 ///////////////////////////////////////////////////////////////////////////////
 
+inline mmap_t::mmap_t() noexcept
+    : access(map_access_t::read_only), offset(0), base(nullptr), length(0) {}
+
+inline mmap_t::mmap_t(mmap_t &&that) noexcept
+    : fd(std::move(that.fd)),
+      access(that.access),
+      offset(std::exchange(that.offset, 0)),
+      base(std::exchange(that.base, nullptr)),
+      length(std::exchange(that.length, 0)) {}
+
+inline mmap_t::~mmap_t() {
+  reset();
+}
+
+inline mmap_t &mmap_t::operator=(mmap_t &&that) noexcept {
+  if (this != &that) {
+    this->~mmap_t();
+    new (this) mmap_t(std::move(that));
+  }
+  return *this;
+}
+
+inline char *mmap_t::data() noexcept {
+  return base;
+}
+
+inline const char *mmap_t::data() const noexcept {
+  return base;
+}
+
+inline size_t mmap_t::size() const noexcept {
+  return length;
+}
+
+inline bool mmap_t::is_mapped() const noexcept {
+  return base != nullptr;
+}
+
+inline map_access_t mmap_t::get_access() const noexcept {
+  return access;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 inline size_t read_at_most(int fd, void *data, size_t size) {
   return static_cast<size_t>(throw_if_lt0(read(fd, data, size)));
 }